@@ -721,6 +721,371 @@ static char *make_union_type_enum_name (GskbFormat *format,
   return rv;
 }
 
+/* --- fixed-length runs ---
+ *
+ * In a non-extensible struct, each run of members that pack to
+ * a fixed number of bytes is handled as a unit:  every member in the
+ * run is at a constant offset, so no running total is threaded
+ * through the calls (and the fundamental types' functions are inline,
+ * so each such member compiles to a memcpy or byte-swap),
+ * and the validator checks the length once per run.
+ */
+
+/* runs longer than this are packed member-by-member,
+   instead of into a buffer on the stack */
+#define MAX_PACKED_RUN_LENGTH   512
+
+/* Find the end of the run of fixed-length members starting at 'start'. */
+static guint
+find_fixed_run_end (GskbFormat *format,
+                    guint       start,
+                    guint      *run_length_out)
+{
+  guint run_length = 0;
+  guint i;
+  for (i = start; i < format->v_struct.n_members; i++)
+    {
+      guint fixed_length = format->v_struct.members[i].format->any.fixed_length;
+      if (fixed_length == 0)
+        break;
+      run_length += fixed_length;
+    }
+  *run_length_out = run_length;
+  return i;
+}
+
+static gboolean
+has_variable_length_member (GskbFormat *format)
+{
+  guint i;
+  for (i = 0; i < format->v_struct.n_members; i++)
+    if (format->v_struct.members[i].format->any.fixed_length == 0)
+      return TRUE;
+  return FALSE;
+}
+
+/* Whether every string of bytes of the right length
+   is a valid packed instance of this fixed-length format. */
+static gboolean
+is_unconstrained_fixed (GskbFormat *format)
+{
+  guint i;
+  switch (format->type)
+    {
+    case GSKB_FORMAT_TYPE_INT:
+      return format->v_int.int_type != GSKB_FORMAT_INT_BIT;
+    case GSKB_FORMAT_TYPE_FLOAT:
+      return TRUE;
+    case GSKB_FORMAT_TYPE_FIXED_ARRAY:
+      return is_unconstrained_fixed (format->v_fixed_array.element_format);
+    case GSKB_FORMAT_TYPE_STRUCT:
+      for (i = 0; i < format->v_struct.n_members; i++)
+        if (!is_unconstrained_fixed (format->v_struct.members[i].format))
+          return FALSE;
+      return TRUE;
+    case GSKB_FORMAT_TYPE_ALIAS:
+      return is_unconstrained_fixed (format->v_alias.format);
+    default:
+      return FALSE;
+    }
+}
+
+/* Whether an array of this format packs, on a little-endian machine,
+   to exactly the bytes of the C array. */
+static gboolean
+has_native_layout (GskbFormat *format)
+{
+  while (format->type == GSKB_FORMAT_TYPE_ALIAS)
+    format = format->v_alias.format;
+  return (format->type == GSKB_FORMAT_TYPE_INT
+       || format->type == GSKB_FORMAT_TYPE_FLOAT)
+      && format->any.fixed_length != 0;
+}
+
+/* Print 'base + offset' into buf:  offset is counted from 'base + rv'
+   once a variable-length member has been passed, from 'base' before. */
+static const char *
+offset_expr (char       *buf,
+             const char *base,
+             gboolean    after_variable,
+             guint       offset)
+{
+  if (after_variable && offset != 0)
+    g_snprintf (buf, 64, "%s + rv + %u", base, offset);
+  else if (after_variable)
+    g_snprintf (buf, 64, "%s + rv", base);
+  else if (offset != 0)
+    g_snprintf (buf, 64, "%s + %u", base, offset);
+  else
+    g_snprintf (buf, 64, "%s", base);
+  return buf;
+}
+
+/* Bring 'rv' up-to-date before a variable-length member. */
+static void
+flush_fixed_offset (GskBuffer *output,
+                    gboolean  *after_variable_inout,
+                    guint     *offset_inout)
+{
+  if (!*after_variable_inout)
+    gsk_buffer_printf (output, "  rv = %u;\n", *offset_inout);
+  else if (*offset_inout != 0)
+    gsk_buffer_printf (output, "  rv += %u;\n", *offset_inout);
+  *after_variable_inout = TRUE;
+  *offset_inout = 0;
+}
+
+static void
+emit_fixed_offset_return (GskBuffer *output,
+                          gboolean   after_variable,
+                          guint      offset)
+{
+  if (!after_variable)
+    gsk_buffer_printf (output, "  return %u;\n", offset);
+  else if (offset != 0)
+    gsk_buffer_printf (output, "  return rv + %u;\n", offset);
+  else
+    gsk_buffer_printf (output, "  return rv;\n");
+}
+
+/* --- arrays of fixed-length elements ---
+ *
+ * These need one bounds check for the whole array,
+ * and then the elements are at a constant stride.
+ * Arrays of fixed-width numbers are a single memcpy
+ * on little-endian machines;  elsewhere the per-element
+ * loop is simple enough for the compiler to vectorize the byte-swapping.
+ */
+
+/* Elements which are fixed-length structs (or fixed arrays)
+   are flattened into the loop body:  each member that is a number
+   is packed or unpacked by an inline function at a constant offset
+   within the element, instead of through a call per element
+   which the compiler cannot vectorize across. */
+#define MAX_INLINED_ELEMENT_MEMBERS     32
+
+static gboolean
+is_flattenable (GskbFormat *format)
+{
+  return (format->type == GSKB_FORMAT_TYPE_STRUCT
+          && !format->v_struct.is_extensible)
+      || (format->type == GSKB_FORMAT_TYPE_FIXED_ARRAY
+          && format->any.fixed_length != 0);
+}
+
+/* the number of members that flattening FORMAT produces */
+static guint
+count_flattened_members (GskbFormat *format)
+{
+  guint i, rv = 0;
+  switch (format->type)
+    {
+    case GSKB_FORMAT_TYPE_STRUCT:
+      if (format->v_struct.is_extensible)
+        return 1;
+      for (i = 0; i < format->v_struct.n_members; i++)
+        rv += count_flattened_members (format->v_struct.members[i].format);
+      return rv;
+    case GSKB_FORMAT_TYPE_FIXED_ARRAY:
+      if (format->any.fixed_length == 0)
+        return 1;
+      return format->v_fixed_array.length
+           * count_flattened_members (format->v_fixed_array.element_format);
+    default:
+      return 1;
+    }
+}
+
+static gboolean
+can_flatten_elements (GskbFormat *sub)
+{
+  return sub->type == GSKB_FORMAT_TYPE_STRUCT
+      && is_flattenable (sub)
+      && count_flattened_members (sub) <= MAX_INLINED_ELEMENT_MEMBERS;
+}
+
+/* Print the statements for the members of the value at 'path',
+   which is packed at 'elt + offset'.  With 'is_pack' the value
+   is packed into 'elt', otherwise it is unpacked from 'elt'. */
+static void
+emit_flattened_members (GskbFormat *format,
+                        const char *path,
+                        guint       offset,
+                        gboolean    is_pack,
+                        gboolean    with_mempool,
+                        GskBuffer  *output)
+{
+  guint i, n;
+  if (format->type == GSKB_FORMAT_TYPE_STRUCT)
+    n = format->v_struct.n_members;
+  else
+    n = format->v_fixed_array.length;
+  for (i = 0; i < n; i++)
+    {
+      GskbFormat *sub;
+      char *sub_path;
+      if (format->type == GSKB_FORMAT_TYPE_STRUCT)
+        {
+          sub = format->v_struct.members[i].format;
+          sub_path = g_strdup_printf ("%s.%s", path, format->v_struct.members[i].name);
+        }
+      else
+        {
+          sub = format->v_fixed_array.element_format;
+          sub_path = g_strdup_printf ("%s.data[%u]", path, i);
+        }
+      if (is_flattenable (sub))
+        emit_flattened_members (sub, sub_path, offset, is_pack, with_mempool, output);
+      else if (is_pack)
+        gsk_buffer_printf (output,
+                           "        %s_pack_slab (%s%s, elt + %u);\n",
+                           sub->any.c_func_prefix,
+                           sub->any.always_by_pointer ? "&" : "",
+                           sub_path, offset);
+      else
+        gsk_buffer_printf (output,
+                           "        %s_unpack%s (elt + %u, &%s%s);\n",
+                           sub->any.c_func_prefix,
+                           with_mempool ? "_mempool" : "",
+                           offset, sub_path,
+                           with_mempool ? ", mem_pool" : "");
+      offset += sub->any.fixed_length;
+      g_free (sub_path);
+    }
+}
+
+/* pack 'count' elements from value->data into 'base' */
+static void
+emit_pack_slab_fixed_elements (GskbFormat *sub,
+                               const char *count,
+                               const char *base,
+                               GskBuffer  *output)
+{
+  guint stride = sub->any.fixed_length;
+  gboolean native = has_native_layout (sub);
+  if (native)
+    {
+      if (stride == 1)
+        {
+          gsk_buffer_printf (output, "  memcpy (%s, value->data, %s);\n",
+                             base, count);
+          return;
+        }
+      gsk_buffer_printf (output,
+                         "#if GSKB_OPTIMIZE_LITTLE_ENDIAN\n"
+                         "  memcpy (%s, value->data, %s * %u);\n"
+                         "#else\n",
+                         base, count, stride);
+    }
+  if (can_flatten_elements (sub))
+    {
+      gsk_buffer_printf (output,
+                         "  {\n"
+                         "    guint i;\n"
+                         "    for (i = 0; i < %s; i++)\n"
+                         "      {\n"
+                         "        guint8 *elt = %s + %u * i;\n",
+                         count, base, stride);
+      emit_flattened_members (sub, "value->data[i]", 0, TRUE, FALSE, output);
+      gsk_buffer_printf (output,
+                         "      }\n"
+                         "  }\n");
+      return;
+    }
+  gsk_buffer_printf (output,
+                     "  {\n"
+                     "    guint i;\n"
+                     "    for (i = 0; i < %s; i++)\n"
+                     "      %s_pack_slab (%svalue->data[i], %s + %u * i);\n"
+                     "  }\n",
+                     count,
+                     sub->any.c_func_prefix,
+                     sub->any.always_by_pointer ? "&" : "",
+                     base, stride);
+  if (native)
+    gsk_buffer_printf (output, "#endif\n");
+}
+
+/* check the contents of 'count' elements at 'base';
+   the caller has already checked the length */
+static void
+emit_validate_fixed_elements (GskbFormat *sub,
+                              const char *count,
+                              const char *base,
+                              GskBuffer  *output)
+{
+  guint stride = sub->any.fixed_length;
+  if (is_unconstrained_fixed (sub))
+    return;
+  gsk_buffer_printf (output,
+                     "  {\n"
+                     "    guint i;\n"
+                     "    for (i = 0; i < %s; i++)\n"
+                     "      if (%s_validate_partial (%u, %s + %u * i, error) == 0)\n"
+                     "        {\n"
+                     "          gsk_g_error_add_prefix (error, \"validating element #%%u of %%u\", i, %s);\n"
+                     "          return 0;\n"
+                     "        }\n"
+                     "  }\n",
+                     count,
+                     sub->any.c_func_prefix, stride, base, stride,
+                     count);
+}
+
+/* unpack 'count' elements from 'base' into value_out->data */
+static void
+emit_unpack_fixed_elements (GskbFormat *sub,
+                            const char *count,
+                            const char *base,
+                            gboolean    with_mempool,
+                            GskBuffer  *output)
+{
+  guint stride = sub->any.fixed_length;
+  gboolean native = has_native_layout (sub);
+  if (native)
+    {
+      if (stride == 1)
+        {
+          gsk_buffer_printf (output, "  memcpy (value_out->data, %s, %s);\n",
+                             base, count);
+          return;
+        }
+      gsk_buffer_printf (output,
+                         "#if GSKB_OPTIMIZE_LITTLE_ENDIAN\n"
+                         "  memcpy (value_out->data, %s, %s * %u);\n"
+                         "#else\n",
+                         base, count, stride);
+    }
+  if (can_flatten_elements (sub))
+    {
+      gsk_buffer_printf (output,
+                         "  {\n"
+                         "    guint i;\n"
+                         "    for (i = 0; i < %s; i++)\n"
+                         "      {\n"
+                         "        const guint8 *elt = %s + %u * i;\n",
+                         count, base, stride);
+      emit_flattened_members (sub, "value_out->data[i]", 0, FALSE, with_mempool, output);
+      gsk_buffer_printf (output,
+                         "      }\n"
+                         "  }\n");
+      return;
+    }
+  gsk_buffer_printf (output,
+                     "  {\n"
+                     "    guint i;\n"
+                     "    for (i = 0; i < %s; i++)\n"
+                     "      %s_unpack%s (%s + %u * i, &value_out->data[i]%s);\n"
+                     "  }\n",
+                     count,
+                     sub->any.c_func_prefix,
+                     with_mempool ? "_mempool" : "",
+                     base, stride,
+                     with_mempool ? ", mem_pool" : "");
+  if (native)
+    gsk_buffer_printf (output, "#endif\n");
+}
+
 
 /* pack */
 #define return_value__pack       "void"
@@ -747,6 +1112,19 @@ implement__pack(GskbFormat *format,
     case GSKB_FORMAT_TYPE_FIXED_ARRAY:
       {
         GskbFormat *sub = format->v_fixed_array.element_format;
+        if (has_native_layout (sub) && sub->any.fixed_length == 1)
+          {
+            gsk_buffer_printf (output,
+                               "  append_func (%u, (const guint8 *) value->data, append_func_data);\n",
+                               format->any.fixed_length);
+            break;
+          }
+        if (has_native_layout (sub))
+          gsk_buffer_printf (output,
+                             "#if GSKB_OPTIMIZE_LITTLE_ENDIAN\n"
+                             "  append_func (%u, (const guint8 *) value->data, append_func_data);\n"
+                             "#else\n",
+                             format->any.fixed_length);
         if (format->v_fixed_array.length < 5)
           {
             for (i = 0; i < format->v_fixed_array.length; i++)
@@ -767,25 +1145,103 @@ implement__pack(GskbFormat *format,
                                sub->any.c_func_prefix,
                                sub->any.always_by_pointer ? "&" : "");
           }
+        if (has_native_layout (sub))
+          gsk_buffer_printf (output, "#endif\n");
         break;
       }
     case GSKB_FORMAT_TYPE_LENGTH_PREFIXED_ARRAY:
       {
         GskbFormat *sub = format->v_length_prefixed_array.element_format;
+        if (!has_native_layout (sub))
+          {
+            gsk_buffer_printf (output,
+                               "  guint i;\n"
+                               "  gskb_uint_pack (value->length, append_func, append_func_data);\n"
+                               "  for (i = 0; i < value->length; i++)\n"
+                               "    %s_pack (%svalue->data[i], append_func, append_func_data);\n",
+                                   sub->any.c_func_prefix,
+                                   sub->any.always_by_pointer ? "&" : "");
+            break;
+          }
         gsk_buffer_printf (output,
-                           "  guint i;\n"
-                           "  gskb_uint_pack (value->length, append_func, append_func_data);\n"
-                           "  for (i = 0; i < value->length; i++)\n"
-                           "    %s_pack (%svalue->data[i], append_func, append_func_data);\n",
-                               sub->any.c_func_prefix,
-                               sub->any.always_by_pointer ? "&" : "");
-
+                           "  gskb_uint_pack (value->length, append_func, append_func_data);\n");
+        if (sub->any.fixed_length == 1)
+          {
+            gsk_buffer_printf (output,
+                               "  append_func (value->length, (const guint8 *) value->data, append_func_data);\n");
+            break;
+          }
+        gsk_buffer_printf (output,
+                           "#if GSKB_OPTIMIZE_LITTLE_ENDIAN\n"
+                           "  append_func (value->length * %u, (const guint8 *) value->data, append_func_data);\n"
+                           "#else\n"
+                           "  {\n"
+                           "    guint i;\n"
+                           "    for (i = 0; i < value->length; i++)\n"
+                           "      %s_pack (value->data[i], append_func, append_func_data);\n"
+                           "  }\n"
+                           "#endif\n",
+                           sub->any.fixed_length,
+                           sub->any.c_func_prefix);
         break;
       }
     case GSKB_FORMAT_TYPE_STRUCT:
       {
         guint last_code = 0;
         gboolean ext = format->v_struct.is_extensible;
+        if (!ext)
+          {
+            /* pack each run of fixed-length members into
+               a buffer, and append it all at once */
+            guint n_members = format->v_struct.n_members;
+            i = 0;
+            while (i < n_members)
+              {
+                guint run_length, j, offset = 0;
+                guint run_end = find_fixed_run_end (format, i, &run_length);
+                const char *indent = (i == 0 && run_end == n_members) ? "" : "  ";
+                char buf[64];
+                if (run_end == i)
+                  run_end = i + 1;              /* variable-length member */
+                if (run_end == i + 1 || run_length > MAX_PACKED_RUN_LENGTH)
+                  {
+                    for (j = i; j < run_end; j++)
+                      {
+                        GskbFormatStructMember *member = format->v_struct.members + j;
+                        gsk_buffer_printf (output,
+                                           "  %s_pack (%svalue->%s, append_func, append_func_data);\n",
+                                           member->format->any.c_func_prefix,
+                                           member->format->any.always_by_pointer?"&":"",
+                                           member->name);
+                      }
+                    i = run_end;
+                    continue;
+                  }
+                if (indent[0])
+                  gsk_buffer_printf (output, "  {\n");
+                gsk_buffer_printf (output, "%s  guint8 packed[%u];\n",
+                                   indent, run_length);
+                for (j = i; j < run_end; j++)
+                  {
+                    GskbFormatStructMember *member = format->v_struct.members + j;
+                    gsk_buffer_printf (output,
+                                       "%s  %s_pack_slab (%svalue->%s, %s);\n",
+                                       indent,
+                                       member->format->any.c_func_prefix,
+                                       member->format->any.always_by_pointer?"&":"",
+                                       member->name,
+                                       offset_expr (buf, "packed", FALSE, offset));
+                    offset += member->format->any.fixed_length;
+                  }
+                gsk_buffer_printf (output,
+                                   "%s  append_func (%u, packed, append_func_data);\n",
+                                   indent, run_length);
+                if (indent[0])
+                  gsk_buffer_printf (output, "  }\n");
+                i = run_end;
+              }
+            break;
+          }
         if (ext)
           {
             gsk_buffer_printf (output,
@@ -821,15 +1277,6 @@ implement__pack(GskbFormat *format,
                                member->format->any.c_func_prefix, member->format->any.always_by_pointer?"&":"", member->name);
                 last_code = member->code;
               }
-            else
-              {
-                gsk_buffer_printf (output,
-                                   "%s  %s_pack (%svalue->%s, append_func, append_func_data);\n",
-                                   ext ? "    " : "",
-                                   member->format->any.c_func_prefix,
-                                   member->format->any.always_by_pointer?"&":"",
-                                   member->name);
-              }
           }
         if (format->v_struct.is_extensible)
           gsk_buffer_printf (output,
@@ -974,9 +1421,8 @@ implement__get_packed_size(GskbFormat *format,
           {
             gsk_buffer_printf (output,
                                "  guint i;\n"
-                               "  for (i = 0; i < %u; i++)\n"
+                               "  for (i = 0; i < value->length; i++)\n"
                                "    rv += %s_get_packed_size (%svalue->data[i]);\n",
-                                 format->v_fixed_array.length,
                                  sub->any.c_func_prefix,
                                  sub->any.always_by_pointer ? "&" : "");
           }
@@ -985,10 +1431,10 @@ implement__get_packed_size(GskbFormat *format,
       }
     case GSKB_FORMAT_TYPE_STRUCT:
       {
-        gsk_buffer_printf (output, "  guint rv = 0;\n");
         if (format->v_struct.is_extensible)
           {
             gsk_buffer_printf (output,
+                               "  guint rv = 0;\n"
                                "  {\n"
                                "    guint i = 0;\n"
                                "    for (i = 0; i < value->unknown_members.length; i++)\n"
@@ -1015,9 +1461,16 @@ implement__get_packed_size(GskbFormat *format,
           }
         else
           {
+            /* the fixed-length members are summed in advance */
+            guint fixed_part = 0;
+            for (i = 0; i < format->v_struct.n_members; i++)
+              fixed_part += format->v_struct.members[i].format->any.fixed_length;
+            gsk_buffer_printf (output, "  guint rv = %u;\n", fixed_part);
             for (i = 0; i < format->v_struct.n_members; i++)
               {
                 GskbFormatStructMember *member = format->v_struct.members + i;
+                if (member->format->any.fixed_length != 0)
+                  continue;
                 gsk_buffer_printf (output,
                                    "  rv += %s_get_packed_size (%svalue->%s);\n",
                                    member->format->any.c_func_prefix,
@@ -1106,6 +1559,14 @@ implement__pack_slab      (GskbFormat *format,
     case GSKB_FORMAT_TYPE_FIXED_ARRAY:
       {
         GskbFormat *sub = format->v_fixed_array.element_format;
+        if (sub->any.fixed_length != 0)
+          {
+            char count[32];
+            g_snprintf (count, sizeof (count), "%u", format->v_fixed_array.length);
+            emit_pack_slab_fixed_elements (sub, count, "out", output);
+            gsk_buffer_printf (output, "  return %u;\n", format->any.fixed_length);
+            break;
+          }
         if (format->v_fixed_array.length < 5)
           {
             gsk_buffer_printf (output, "  guint rv = 0;\n");
@@ -1133,25 +1594,29 @@ implement__pack_slab      (GskbFormat *format,
         GskbFormat *sub = format->v_length_prefixed_array.element_format;
         gsk_buffer_printf (output,
                            "  guint rv = gskb_uint_pack_slab (value->length, out);\n");
-      {
+        if (sub->any.fixed_length != 0)
+          {
+            emit_pack_slab_fixed_elements (sub, "value->length", "out + rv", output);
+            gsk_buffer_printf (output, "  return rv + value->length * %u;\n",
+                               sub->any.fixed_length);
+            break;
+          }
         gsk_buffer_printf (output,
                            "  guint i;\n"
-                           "  for (i = 0; i < %u; i++)\n"
+                           "  for (i = 0; i < value->length; i++)\n"
                            "    rv += %s_pack_slab (%svalue->data[i], out + rv);\n",
-                             format->v_fixed_array.length,
                              sub->any.c_func_prefix,
                              sub->any.always_by_pointer ? "&" : "");
-      }
         gsk_buffer_printf (output, "  return rv;\n");
         break;
       }
     case GSKB_FORMAT_TYPE_STRUCT:
       {
-        gsk_buffer_printf (output, "  guint rv = 0;\n");
         if (format->v_struct.is_extensible)
           {
             guint last_code = 0;
             gsk_buffer_printf (output,
+                               "  guint rv = 0;\n"
                                "  guint unknown_index = 0;\n");
             for (i = 0; i < format->v_struct.n_members; i++)
               {
@@ -1188,20 +1653,37 @@ implement__pack_slab      (GskbFormat *format,
                                "                               out + rv);\n"
                                "      unknown_index++;\n"
                                "    }\n"
-                               "  out[rv++] = 0;   /* nul terminate */\n");
+                               "  out[rv++] = 0;   /* nul terminate */\n"
+                               "  return rv;\n");
           }
         else            /* non-extensible structs */
           {
+            gboolean after_variable = FALSE;
+            guint offset = 0;
+            char buf[64];
+            if (has_variable_length_member (format))
+              gsk_buffer_printf (output, "  guint rv;\n");
             for (i = 0; i < format->v_struct.n_members; i++)
               {
                 GskbFormatStructMember *member = format->v_struct.members + i;
+                if (member->format->any.fixed_length != 0)
+                  {
+                    gsk_buffer_printf (output,
+                                       "  %s_pack_slab (%svalue->%s, %s);\n",
+                                       member->format->any.c_func_prefix,
+                                       member->format->any.always_by_pointer?"&":"", member->name,
+                                       offset_expr (buf, "out", after_variable, offset));
+                    offset += member->format->any.fixed_length;
+                    continue;
+                  }
+                flush_fixed_offset (output, &after_variable, &offset);
                 gsk_buffer_printf (output,
                                    "  rv += %s_pack_slab (%svalue->%s, out + rv);\n",
                                    member->format->any.c_func_prefix,
                                    member->format->any.always_by_pointer?"&":"", member->name);
               }
+            emit_fixed_offset_return (output, after_variable, offset);
           }
-        gsk_buffer_printf (output, "  return rv;\n");
         break;
       }
     case GSKB_FORMAT_TYPE_UNION:
@@ -1315,9 +1797,28 @@ implement__validate_partial  (GskbFormat *format,
     case GSKB_FORMAT_TYPE_FIXED_ARRAY:
       {
         GskbFormat *sub = format->v_fixed_array.element_format;
-        gsk_buffer_printf (output, "  guint rv = 0, sub_used;\n");
+        if (sub->any.fixed_length != 0)
+          {
+            char count[32];
+            if (is_unconstrained_fixed (sub))
+              {
+                gsk_buffer_printf (output,
+                                   "  return gskb_simple_fixed_length_validate_partial (\"%s\", length, %u, error);\n",
+                                   format->any.name, format->any.fixed_length);
+                break;
+              }
+            g_snprintf (count, sizeof (count), "%u", format->v_fixed_array.length);
+            gsk_buffer_printf (output,
+                               "  if (gskb_simple_fixed_length_validate_partial (\"%s\", length, %u, error) == 0)\n"
+                               "    return 0;\n",
+                               format->any.name, format->any.fixed_length);
+            emit_validate_fixed_elements (sub, count, "data", output);
+            gsk_buffer_printf (output, "  return %u;\n", format->any.fixed_length);
+            break;
+          }
         if (format->v_fixed_array.length < 5)
           {
+            gsk_buffer_printf (output, "  guint rv = 0, sub_used;\n");
             for (i = 0; i < format->v_fixed_array.length; i++)
               gsk_buffer_printf (output,
                                  "  if ((sub_used = %s_validate_partial (length - rv, data + rv, error)) == 0)\n"
@@ -1332,17 +1833,19 @@ implement__validate_partial  (GskbFormat *format,
         else
           {
             gsk_buffer_printf (output,
-                               "  guint i, rv = 0;\n"
+                               "  guint i, rv = 0, sub_used;\n"
                                "  for (i = 0; i < %u; i++)\n"
-                               "    if ((sub_used = %s_validate_partial (length - rv, out + rv, error)) == 0)\n"
-                               "      {\n"
-                                 "      gsk_g_error_add_prefix (error, \"validating element #%%u of %%u\", i, %u);\n"
-                                 "      return 0;\n"
-                                 "    }\n"
-                                 "  rv += sub_used;\n",
-                                 format->v_fixed_array.length,
-                                 sub->any.c_func_prefix,
-                                 format->v_fixed_array.length);
+                               "    {\n"
+                               "      if ((sub_used = %s_validate_partial (length - rv, data + rv, error)) == 0)\n"
+                               "        {\n"
+                               "          gsk_g_error_add_prefix (error, \"validating element #%%u of %%u\", i, %u);\n"
+                               "          return 0;\n"
+                               "        }\n"
+                               "      rv += sub_used;\n"
+                               "    }\n",
+                               format->v_fixed_array.length,
+                               sub->any.c_func_prefix,
+                               format->v_fixed_array.length);
           }
         gsk_buffer_printf (output, "  return rv;\n");
         break;
@@ -1350,19 +1853,39 @@ implement__validate_partial  (GskbFormat *format,
     case GSKB_FORMAT_TYPE_LENGTH_PREFIXED_ARRAY:
       {
         GskbFormat *sub = format->v_length_prefixed_array.element_format;
+        if (sub->any.fixed_length != 0)
+          gsk_buffer_printf (output, "  guint rv;\n");
+        else
+          gsk_buffer_printf (output, "  guint rv, sub_used, i;\n");
         gsk_buffer_printf (output,
-                           "  guint rv, sub_used, i;\n"
                            "  guint32 n;\n"
-                           "  if ((sub_used=gskb_uint_validate_unpack (length, data, &n, error)) == 0)\n"
+                           "  if ((rv = gskb_uint_validate_unpack (length, data, &n, error)) == 0)\n"
                            "    {\n"
                            "      gsk_g_error_add_prefix (error, \"parsing length-prefix\");\n"
                            "      return 0;\n"
-                           "    }\n"
-                           "  rv = sub_used;\n");
+                           "    }\n");
+        if (sub->any.fixed_length != 0)
+          {
+            /* one check for all the elements (written to avoid overflow) */
+            gsk_buffer_printf (output,
+                               "  if ((length - rv) / %u < n)\n"
+                               "    {\n"
+                               "      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_TOO_SHORT,\n"
+                               "                   \"too short validating %%s (expected %%u elements of %%u bytes, got %%u bytes)\",\n"
+                               "                   \"%s\", n, %u, length - rv);\n"
+                               "      return 0;\n"
+                               "    }\n",
+                               sub->any.fixed_length,
+                               format->any.name, sub->any.fixed_length);
+            emit_validate_fixed_elements (sub, "n", "data + rv", output);
+            gsk_buffer_printf (output, "  return rv + n * %u;\n",
+                               sub->any.fixed_length);
+            break;
+          }
         gsk_buffer_printf (output,
                            "  for (i = 0; i < n; i++)\n"
                            "    {\n"
-                           "      if (!%s_validate_partial (length - rv, out + rv, &sub_used, error))\n"
+                           "      if ((sub_used = %s_validate_partial (length - rv, data + rv, error)) == 0)\n"
                            "        {\n"
                            "          gsk_g_error_add_prefix (error, \"validating element #%%u of %%u\", i, n);\n"
                            "          return 0;\n"
@@ -1375,11 +1898,11 @@ implement__validate_partial  (GskbFormat *format,
       }
     case GSKB_FORMAT_TYPE_STRUCT:
       {
-        gsk_buffer_printf (output, "  guint rv = 0;\n"
-                                   "  guint sub_used;\n");
         if (format->v_struct.is_extensible)
           {
             gsk_buffer_printf (output,
+                               "  guint rv = 0;\n"
+                               "  guint sub_used;\n"
                                "  guint32 code, last_code = 0, sub_len;\n"
                                "  for (;;)\n"
                                "    {\n"
@@ -1444,9 +1967,53 @@ implement__validate_partial  (GskbFormat *format,
           }
         else
           {
-            for (i = 0; i < format->v_struct.n_members; i++)
+            /* check the length once per run of fixed-length members;
+               then only members like 'bit' and enums need a look */
+            gboolean after_variable = FALSE;
+            guint offset = 0;
+            char buf[64];
+            if (has_variable_length_member (format))
+              gsk_buffer_printf (output, "  guint rv;\n"
+                                         "  guint sub_used;\n");
+            i = 0;
+            while (i < format->v_struct.n_members)
               {
                 GskbFormatStructMember *member = format->v_struct.members + i;
+                guint run_length, j;
+                guint run_end = find_fixed_run_end (format, i, &run_length);
+                if (run_end > i)
+                  {
+                    /* note: offset is always 0 at the start of a run */
+                    if (after_variable)
+                      gsk_buffer_printf (output,
+                                         "  if (gskb_simple_fixed_length_validate_partial (\"%s.%s\", length - rv, %u, error) == 0)\n"
+                                         "    return 0;\n",
+                                         format->any.name, member->name, run_length);
+                    else
+                      gsk_buffer_printf (output,
+                                         "  if (gskb_simple_fixed_length_validate_partial (\"%s\", length, %u, error) == 0)\n"
+                                         "    return 0;\n",
+                                         format->any.name, run_length);
+                    for (j = i; j < run_end; j++)
+                      {
+                        member = format->v_struct.members + j;
+                        if (!is_unconstrained_fixed (member->format))
+                          gsk_buffer_printf (output,
+                                             "  if (%s_validate_partial (%u, %s, error) == 0)\n"
+                                             "    {\n"
+                                             "      gsk_g_error_add_prefix (error, \"validating member '%%s' of %%s\", \"%s\", \"%s\");\n"
+                                             "      return 0;\n"
+                                             "    }\n",
+                                             member->format->any.c_func_prefix,
+                                             member->format->any.fixed_length,
+                                             offset_expr (buf, "data", after_variable, offset),
+                                             member->name, format->any.name);
+                        offset += member->format->any.fixed_length;
+                      }
+                    i = run_end;
+                    continue;
+                  }
+                flush_fixed_offset (output, &after_variable, &offset);
                 gsk_buffer_printf (output,
                                    "  if ((sub_used = %s_validate_partial (length - rv, data + rv, error)) == 0)\n"
                                    "    {\n"
@@ -1456,8 +2023,9 @@ implement__validate_partial  (GskbFormat *format,
                                    "  rv += sub_used;\n",
                                    member->format->any.c_func_prefix,
                                    member->name, format->any.name);
+                i++;
               }
-            gsk_buffer_printf (output, "  return rv;\n");
+            emit_fixed_offset_return (output, after_variable, offset);
           }
         break;
       }
@@ -1657,9 +2225,17 @@ implement_unpack_functions         (GskbFormat *format,
     case GSKB_FORMAT_TYPE_FIXED_ARRAY:
       {
         GskbFormat *sub = format->v_fixed_array.element_format;
-        gsk_buffer_printf (output, "  guint rv = 0;\n");
+        if (sub->any.fixed_length != 0)
+          {
+            char count[32];
+            g_snprintf (count, sizeof (count), "%u", format->v_fixed_array.length);
+            emit_unpack_fixed_elements (sub, count, "in", with_mempool, output);
+            gsk_buffer_printf (output, "  return %u;\n", format->any.fixed_length);
+            break;
+          }
         if (format->v_fixed_array.length < 5)
           {
+            gsk_buffer_printf (output, "  guint rv = 0;\n");
             for (i = 0; i < format->v_fixed_array.length; i++)
               gsk_buffer_printf (output,
                                  "  rv += %s_unpack%s (in + rv, &value_out->data[%u]%s);\n",
@@ -1668,7 +2244,7 @@ implement_unpack_functions         (GskbFormat *format,
         else
           {
             gsk_buffer_printf (output,
-                               "  guint i;\n"
+                               "  guint i, rv = 0;\n"
                                "  for (i = 0; i < %u; i++)\n"
                                "    rv += %s_unpack%s (in + rv, &value_out->data[i]%s);\n",
                                format->v_fixed_array.length,
@@ -1681,25 +2257,39 @@ implement_unpack_functions         (GskbFormat *format,
       {
         GskbFormat *sub = format->v_length_prefixed_array.element_format;
         gsk_buffer_printf (output,
-                           "  guint rv, i;\n"
+                           "  guint rv%s;\n"
                            "  guint32 n;\n"
                            "  rv = gskb_uint_unpack (in, &n);\n"
-                           "  value_out->length = n;\n"
-                           "  value_out->data = g_new (%s, n);\n",
-                           sub->any.c_type_name);
+                           "  value_out->length = n;\n",
+                           sub->any.fixed_length != 0 ? "" : ", i");
+        if (with_mempool)
+          gsk_buffer_printf (output,
+                             "  value_out->data = gsk_mem_pool_alloc (mem_pool, sizeof (%s) * n);\n",
+                             sub->any.c_type_name);
+        else
+          gsk_buffer_printf (output,
+                             "  value_out->data = g_new (%s, n);\n",
+                             sub->any.c_type_name);
+        if (sub->any.fixed_length != 0)
+          {
+            emit_unpack_fixed_elements (sub, "n", "in + rv", with_mempool, output);
+            gsk_buffer_printf (output, "  return rv + n * %u;\n",
+                               sub->any.fixed_length);
+            break;
+          }
         gsk_buffer_printf (output,
                            "  for (i = 0; i < n; i++)\n"
-                           "    rv += %s_unpack%s (in + rv, value_out->data[i]%s);\n",
+                           "    rv += %s_unpack%s (in + rv, &value_out->data[i]%s);\n",
                            sub->any.c_func_prefix, mempool_suffix, mempool_last_arg);
         gsk_buffer_printf (output, "  return rv;\n");
         break;
       }
     case GSKB_FORMAT_TYPE_STRUCT:
       {
-        gsk_buffer_printf (output, "  guint rv = 0;\n");
         if (format->v_struct.is_extensible)
           {
             gsk_buffer_printf (output,
+                               "  guint rv = 0;\n"
                                "  GArray *unknown_members = NULL;\n"
                                "  guint sub_used;\n"
                                "  guint32 code, sub_len;\n"
@@ -1774,15 +2364,31 @@ implement_unpack_functions         (GskbFormat *format,
           }
         else
           {
+            gboolean after_variable = FALSE;
+            guint offset = 0;
+            char buf[64];
+            if (has_variable_length_member (format))
+              gsk_buffer_printf (output, "  guint rv;\n");
             for (i = 0; i < format->v_struct.n_members; i++)
               {
                 GskbFormatStructMember *member = format->v_struct.members + i;
+                if (member->format->any.fixed_length != 0)
+                  {
+                    gsk_buffer_printf (output,
+                                       "  %s_unpack%s (%s, &value_out->%s%s);\n",
+                                       member->format->any.c_func_prefix, mempool_suffix,
+                                       offset_expr (buf, "in", after_variable, offset),
+                                       member->name, mempool_last_arg);
+                    offset += member->format->any.fixed_length;
+                    continue;
+                  }
+                flush_fixed_offset (output, &after_variable, &offset);
                 gsk_buffer_printf (output,
                                    "  rv += %s_unpack%s (in + rv, &value_out->%s%s);\n",
                                    member->format->any.c_func_prefix, mempool_suffix,
                                    member->name, mempool_last_arg);
               }
-            gsk_buffer_printf (output, "  return rv;\n");
+            emit_fixed_offset_return (output, after_variable, offset);
           }
         break;
       }
@@ -1919,7 +2525,7 @@ implement__destruct (GskbFormat *format,
           {
             for (i = 0; i < format->v_fixed_array.length; i++)
               gsk_buffer_printf (output,
-                                 "  rv += %s_destruct (&value->data[%u]);\n",
+                                 "  %s_destruct (&value->data[%u]);\n",
                                  sub->any.c_func_prefix, i);
           }
         else
@@ -1927,11 +2533,10 @@ implement__destruct (GskbFormat *format,
             gsk_buffer_printf (output,
                                "  guint i;\n"
                                "  for (i = 0; i < %u; i++)\n"
-                               "    rv += %s_destruct (&value->data[i]);\n",
+                               "    %s_destruct (&value->data[i]);\n",
                                format->v_fixed_array.length,
                                sub->any.c_func_prefix);
           }
-        gsk_buffer_printf (output, "  return rv;\n");
         break;
       }
     case GSKB_FORMAT_TYPE_LENGTH_PREFIXED_ARRAY:
@@ -1941,7 +2546,7 @@ implement__destruct (GskbFormat *format,
           gsk_buffer_printf (output,
                              "  guint i;\n"
                              "  for (i = 0; i < value->length; i++)\n"
-                             "    %s_destruct (value->data[i]);\n",
+                             "    %s_destruct (&value->data[i]);\n",
                              sub->any.c_func_prefix);
         gsk_buffer_printf (output, "  g_free (value->data);\n");
         break;
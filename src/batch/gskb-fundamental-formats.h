@@ -168,6 +168,8 @@ GSKB_FOREACH_FUNDAMENTAL_TYPE(DECLARE_UNPACK);
 #define gskb_long_unpack_mempool(data, value_out, mem_pool)   gskb_long_unpack(data, value_out)
 #define gskb_ulong_unpack_mempool(data, value_out, mem_pool)  gskb_ulong_unpack(data, value_out)
 #define gskb_bit_unpack_mempool(data, value_out, mem_pool)    gskb_bit_unpack(data, value_out)
+#define gskb_float32_unpack_mempool(data, value_out, mem_pool) gskb_float32_unpack(data, value_out)
+#define gskb_float64_unpack_mempool(data, value_out, mem_pool) gskb_float64_unpack(data, value_out)
 G_INLINE_FUNC guint gskb_string_unpack_mempool(const guint8 *data,
                                                gskb_string  *value_out,
                                                GskMemPool   *mem_pool);
@@ -334,6 +334,123 @@ test_extensible_struct (void)
 }
 
 
+static void
+test_mixed_struct (void)
+{
+  Test_Bar bar = { 0x1234, -5, "hello", 1, -1234567890123LL,
+                   {1,42,17,100,3,9,1,3,1}, 300 };
+  Test_Bar copy;
+  GByteArray *ba = g_byte_array_new ();
+  guint packed_size, i;
+  guint8 *packed_slab;
+  GError *error = NULL;
+
+  /* 2+4 + 6 + 1+8+31 + 2 */
+  packed_size = test_bar_get_packed_size (&bar);
+  g_assert (packed_size == 54);
+  packed_slab = g_malloc (packed_size);
+  g_assert (test_bar_pack_slab (&bar, packed_slab) == packed_size);
+  test_bar_pack (&bar, byte_array_append, ba);
+  g_assert (ba->len == packed_size);
+  g_assert (memcmp (ba->data, packed_slab, packed_size) == 0);
+
+  /* the int at the end is not length-checked by gskb_int_validate_partial */
+  g_assert (test_bar_validate_partial (packed_size, packed_slab, NULL) == packed_size);
+  for (i = 0; i < packed_size - 2; i++)
+    {
+      g_assert (test_bar_validate_partial (i, packed_slab, &error) == 0);
+      g_clear_error (&error);
+    }
+
+  g_assert (test_bar_unpack (packed_slab, &copy) == packed_size);
+  g_assert (copy.a == bar.a);
+  g_assert (copy.b == bar.b);
+  g_assert (strcmp (copy.c, "hello") == 0);
+  g_assert (copy.d == 1);
+  g_assert (copy.e == bar.e);
+  g_assert (copy.f.d == 100);
+  g_assert (copy.f.i == 1);
+  g_assert (copy.g == 300);
+  test_bar_destruct (&copy);
+
+  /* a bad 'bit' inside a run is still caught */
+  packed_slab[12] = 2;
+  g_assert (test_bar_validate_partial (packed_size, packed_slab, &error) == 0);
+  g_clear_error (&error);
+
+  g_free (packed_slab);
+  g_byte_array_free (ba, TRUE);
+}
+
+static void
+test_arrays (void)
+{
+  Test_Vec vecs[3] = { { {{1,-2,3}}, 1, 2.5f },
+                       { {{4,5,-6}}, 0, -1.0f },
+                       { {{7,8,9}},  1, 0.0f } };
+  gskb_uint64 ids[4] = { 1, 2, G_GUINT64_CONSTANT (0x1122334455667788), 4 };
+  gskb_bit bits[2] = { 1, 0 };
+  gskb_string names[2] = { "a", "bcd" };
+  Test_Arrays arrays = { {{1,2,3,4,5}}, {3, vecs}, {4, ids}, {2, bits}, {2, names} };
+  Test_Arrays copy;
+  GByteArray *ba = g_byte_array_new ();
+  guint packed_size, i;
+  guint8 *packed_slab;
+  GError *error = NULL;
+
+  g_assert (test_vec_format->any.fixed_length == 11);
+  g_assert (test_vec_get_packed_size () == 11);
+
+  /* 20 + 1+33 + 1+32 + 1+2 + 1+2+4 */
+  packed_size = test_arrays_get_packed_size (&arrays);
+  g_assert (packed_size == 97);
+  packed_slab = g_malloc (packed_size);
+  g_assert (test_arrays_pack_slab (&arrays, packed_slab) == packed_size);
+  test_arrays_pack (&arrays, byte_array_append, ba);
+  g_assert (ba->len == packed_size);
+  g_assert (memcmp (ba->data, packed_slab, packed_size) == 0);
+
+  /* elements are little-endian, back-to-back */
+  g_assert (packed_slab[21 + 11 + 4] == 0xfa);      /* vecs[1].xyz[2] == -6 */
+  g_assert (packed_slab[21 + 11 + 5] == 0xff);
+  g_assert (packed_slab[55 + 16] == 0x88);          /* ids[2] */
+  g_assert (packed_slab[55 + 23] == 0x11);
+
+  g_assert (test_arrays_validate_partial (packed_size, packed_slab, NULL) == packed_size);
+  for (i = 0; i < packed_size; i++)
+    {
+      g_assert (test_arrays_validate_partial (i, packed_slab, &error) == 0);
+      g_clear_error (&error);
+    }
+
+  g_assert (test_arrays_unpack (packed_slab, &copy) == packed_size);
+  g_assert (copy.ints.data[4] == 5);
+  g_assert (copy.vecs.length == 3);
+  g_assert (copy.vecs.data[1].xyz.data[2] == -6);
+  g_assert (copy.vecs.data[0].w == 2.5f);
+  g_assert (copy.vecs.data[2].flag == 1);
+  g_assert (copy.ids.length == 4);
+  g_assert (copy.ids.data[2] == ids[2]);
+  g_assert (copy.bits.length == 2);
+  g_assert (copy.bits.data[0] == 1 && copy.bits.data[1] == 0);
+  g_assert (copy.names.length == 2);
+  g_assert (strcmp (copy.names.data[1], "bcd") == 0);
+  test_arrays_destruct (&copy);
+
+  /* bad 'bit's in an element struct and in a bit[] */
+  packed_slab[21 + 11 + 6] = 2;
+  g_assert (test_arrays_validate_partial (packed_size, packed_slab, &error) == 0);
+  g_clear_error (&error);
+  packed_slab[21 + 11 + 6] = 0;
+  packed_slab[89] = 2;
+  g_assert (test_arrays_validate_partial (packed_size, packed_slab, &error) == 0);
+  g_clear_error (&error);
+
+  g_free (packed_slab);
+  g_byte_array_free (ba, TRUE);
+}
+
+
 static struct {
   const char *test_name;
   GVoidFunc test;
@@ -345,6 +462,8 @@ static struct {
   { "string pack/unpack", test_string },
   { "fixed-length integer struct", test_fixed_length_struct },
   { "extensible structs", test_extensible_struct },
+  { "struct with fixed-length runs", test_mixed_struct },
+  { "arrays of fixed-length elements", test_arrays },
 };
 
 
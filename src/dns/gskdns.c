@@ -58,6 +58,9 @@
 /* Maximum number of dotted components in a domain name we can handle. */
 #define MAX_COMPONENTS			128
 
+/* Protocol-limited number of characters in a domain name. */
+#define MAX_NAME_LENGTH			255
+
 /* Protocol-limited number of characters in a component of a domain name. */
 #define MAX_COMPONENT_LENGTH		63
 
@@ -212,6 +215,7 @@ gsk_dns_message_free (GskDnsMessage *gsk_dns_message)
 {
   g_string_chunk_free (gsk_dns_message->str_pool);
   g_mem_chunk_destroy (gsk_dns_message->qr_pool);
+  g_free (gsk_dns_message->record_block);
 
   G_LOCK (gsk_dns_message_chunk);
   g_mem_chunk_free (gsk_dns_message_chunk, gsk_dns_message);
@@ -421,6 +425,14 @@ parse_char_string (GskBufferIterator *iterator,
   return g_string_chunk_insert (message->str_pool, buf);
 }
 
+/* Whether a question or record was laid out in the record_block
+   of a message parsed by gsk_dns_message_parse_data(). */
+#define IN_RECORD_BLOCK(dns_message, ptr)				\
+    ( (dns_message)->record_block != NULL				\
+   && (const guint8 *) (ptr) >= (const guint8 *) (dns_message)->record_block \
+   && (const guint8 *) (ptr) < (const guint8 *) (dns_message)->record_block \
+                               + (dns_message)->record_block_size )
+
 /* Duplicate a string, either from the stringpool of a message,
    or off the heap. */
 #define ALLOCATOR_STRDUP(dns_message, str)				\
@@ -898,7 +910,8 @@ gsk_dns_rr_free        (GskDnsResourceRecord *record)
       /* XXX: maybe deleting is viable, but more importantly
 	      deal with things which *need* dynamic allocation */
       /* XXX: g_mem_chunk_free only needed for --disable-mem-pool support (see glib) */
-      g_mem_chunk_free (record->allocator->qr_pool, record);
+      if (!IN_RECORD_BLOCK (record->allocator, record))
+        g_mem_chunk_free (record->allocator->qr_pool, record);
       return;
     }
 
@@ -1104,7 +1117,8 @@ gsk_dns_question_free(GskDnsQuestion           *question)
   if (question->allocator != NULL)
     {
       /* XXX: g_mem_chunk_free only needed for --disable-mem-pool support (see glib) */
-      g_mem_chunk_free (question->allocator->qr_pool, question);
+      if (!IN_RECORD_BLOCK (question->allocator, question))
+        g_mem_chunk_free (question->allocator->qr_pool, question);
     }
   else
     {
@@ -1462,6 +1476,428 @@ GskDnsMessage *gsk_dns_message_parse_buffer  (GskBuffer    *buffer)
   return rv;
 }
 
+/* --- parsing a message from contiguous memory --- */
+
+/* A whole packet, which is how both GskDnsServer and GskDnsClient
+ * receive messages, needn't be copied into a GskBuffer and read a byte
+ * at a time:  compression pointers are followed directly in the packet,
+ * names are interned in the message's string pool, and the questions
+ * and resource-records are laid out in one array, the message's
+ * record_block.  The GSList's point into that array.
+ */
+
+/* Number of decompressed name-suffixes remembered while parsing a packet. */
+#define SUFFIX_CACHE_SIZE		16
+
+#define SLICE_UINT16(p)		(((guint16)(p)[0] << 8) | ((guint16)(p)[1]))
+#define SLICE_UINT32(p)		(((guint32)(p)[0] << 24) | ((guint32)(p)[1] << 16) \
+				 | ((guint32)(p)[2] << 8) | ((guint32)(p)[3]))
+
+typedef struct _SliceParser SliceParser;
+struct _SliceParser
+{
+  const guint8  *data;
+  guint          length;
+  guint          at;
+  GskDnsMessage *message;
+
+  /* direct-mapped, from the target of a compression pointer
+     to the (interned) name suffix found there;
+     0 is never a valid target, since it is in the header. */
+  guint          suffix_offsets[SUFFIX_CACHE_SIZE];
+  const char    *suffixes[SUFFIX_CACHE_SIZE];
+};
+
+/* RFC 1035, 4.1.4 */
+static char *
+slice_parse_name (SliceParser *parser)
+{
+  const guint8 *data = parser->data;
+  char name[MAX_NAME_LENGTH + 1];
+  guint len = 0;
+  guint at = parser->at;
+  guint resume_at = 0;
+  guint limit = at;
+  const char *suffix = NULL;
+  guint ptr_targets[MAX_COMPONENTS];
+  guint ptr_name_offsets[MAX_COMPONENTS];
+  guint n_ptrs = 0;
+  guint i;
+  char *rv;
+
+  for (;;)
+    {
+      guint piece_len;
+      if (at >= parser->length)
+	{
+	  PARSE_FAIL ("domain name ran past the end of the packet");
+	  return NULL;
+	}
+      piece_len = data[at];
+      if ((piece_len >> 6) == 3)
+	{
+	  guint target, slot;
+	  if (at + 1 >= parser->length)
+	    {
+	      PARSE_FAIL ("truncated compression pointer");
+	      return NULL;
+	    }
+	  target = ((piece_len & 0x3f) << 8) | data[at + 1];
+	  if (n_ptrs == 0)
+	    resume_at = at + 2;
+
+	  /* Only allow pointers to earlier data than we have
+	     looked at so far, which rules out loops;
+	     and never into the 12-byte header (which would also
+	     match the empty slots of the suffix cache). */
+	  if (target < 12 || target >= limit || n_ptrs == MAX_COMPONENTS)
+	    {
+	      PARSE_FAIL ("bad compression pointer");
+	      return NULL;
+	    }
+	  slot = target % SUFFIX_CACHE_SIZE;
+	  if (parser->suffix_offsets[slot] == target)
+	    {
+	      suffix = parser->suffixes[slot];
+	      break;
+	    }
+	  ptr_targets[n_ptrs] = target;
+	  ptr_name_offsets[n_ptrs] = len;
+	  n_ptrs++;
+	  limit = target;
+	  at = target;
+	}
+      else if ((piece_len >> 6) != 0)
+	{
+	  /* Not allowed ``reserved for future use'' (rfc1035) */
+	  PARSE_FAIL ("bad bit sequence at start of string");
+	  return NULL;
+	}
+      else if (piece_len == 0)
+	{
+	  if (n_ptrs == 0)
+	    resume_at = at + 1;
+	  break;
+	}
+      else
+	{
+	  if (at + 1 + piece_len > parser->length)
+	    {
+	      PARSE_FAIL ("data shorter than header byte indicated");
+	      return NULL;
+	    }
+	  if (len + 1 + piece_len > MAX_NAME_LENGTH)
+	    {
+	      PARSE_FAIL ("domain name too long");
+	      return NULL;
+	    }
+	  if (len > 0)
+	    name[len++] = '.';
+	  memcpy (name + len, data + at + 1, piece_len);
+	  len += piece_len;
+	  at += 1 + piece_len;
+	}
+    }
+
+  if (suffix != NULL && suffix[0] != 0)
+    {
+      guint suffix_len = strlen (suffix);
+      if (len + 1 + suffix_len > MAX_NAME_LENGTH)
+	{
+	  PARSE_FAIL ("domain name too long");
+	  return NULL;
+	}
+      if (len > 0)
+	name[len++] = '.';
+      memcpy (name + len, suffix, suffix_len);
+      len += suffix_len;
+    }
+  name[len] = 0;
+  rv = g_string_chunk_insert_const (parser->message->str_pool, name);
+
+  /* Remember the suffixes we had to decompress the hard way. */
+  for (i = 0; i < n_ptrs; i++)
+    {
+      guint name_offset = ptr_name_offsets[i];
+      guint slot = ptr_targets[i] % SUFFIX_CACHE_SIZE;
+      if (name_offset > 0 && name_offset < len)
+	name_offset++;		/* skip the `.' */
+      parser->suffix_offsets[slot] = ptr_targets[i];
+      parser->suffixes[slot] = rv + name_offset;
+    }
+
+  parser->at = resume_at;
+  return rv;
+}
+
+/* A single length-prefixed <character-string>, which must end by END. */
+static char *
+slice_parse_char_string (SliceParser *parser,
+			 guint        end)
+{
+  guint len;
+  char *buf;
+  if (parser->at >= end)
+    return NULL;
+  len = parser->data[parser->at];
+  if (parser->at + 1 + len > end)
+    return NULL;
+  buf = alloca (len + 1);
+  memcpy (buf, parser->data + parser->at + 1, len);
+  buf[len] = 0;
+  parser->at += 1 + len;
+  return g_string_chunk_insert (parser->message->str_pool, buf);
+}
+
+/* resource records (RR's) (RFC 1035, 4.1.3) */
+static gboolean
+slice_parse_resource_record (SliceParser          *parser,
+			     GskDnsResourceRecord *rr)
+{
+  const guint8 *header;
+  guint rdlength;
+  guint rdata_end;
+  char *owner;
+
+  owner = slice_parse_name (parser);
+  if (owner == NULL)
+    return FALSE;
+  if (parser->at + 10 > parser->length)
+    return FALSE;
+  header = parser->data + parser->at;
+  rdlength = SLICE_UINT16 (header + 8);
+  parser->at += 10;
+  rdata_end = parser->at + rdlength;
+  if (rdata_end > parser->length)
+    return FALSE;
+
+  memset (rr, 0, sizeof (GskDnsResourceRecord));
+  rr->type = SLICE_UINT16 (header);
+  rr->record_class = SLICE_UINT16 (header + 2);
+  rr->time_to_live = SLICE_UINT32 (header + 4);
+  rr->owner = owner;
+  rr->allocator = parser->message;
+
+  switch (rr->type)
+    {
+    case GSK_DNS_RR_HOST_ADDRESS:
+    case GSK_DNS_RR_HOST_ADDRESS_IPV6:
+      {
+	guint addr_len = rr->type == GSK_DNS_RR_HOST_ADDRESS ? 4 : 16;
+	if (rr->record_class != GSK_DNS_CLASS_INTERNET)
+	  {
+	    g_warning ("class != INTERNET not supported yet, sorry");
+	    return FALSE;
+	  }
+	if (rdlength != addr_len)
+	  {
+	    g_warning ("only %u byte internet addresses are supported", addr_len);
+	    return FALSE;
+	  }
+	if (rr->type == GSK_DNS_RR_HOST_ADDRESS)
+	  memcpy (rr->rdata.a.ip_address, parser->data + parser->at, 4);
+	else
+	  memcpy (rr->rdata.aaaa.address, parser->data + parser->at, 16);
+	break;
+      }
+
+    case GSK_DNS_RR_NAME_SERVER:
+    case GSK_DNS_RR_CANONICAL_NAME:
+    case GSK_DNS_RR_POINTER:
+      rr->rdata.domain_name = slice_parse_name (parser);
+      if (rr->rdata.domain_name == NULL)
+	return FALSE;
+      break;
+
+    case GSK_DNS_RR_MAIL_EXCHANGE:
+      if (rdlength < 2)
+	return FALSE;
+      rr->rdata.mx.preference_value = SLICE_UINT16 (parser->data + parser->at);
+      parser->at += 2;
+      rr->rdata.mx.mail_exchange_host_name = slice_parse_name (parser);
+      if (rr->rdata.mx.mail_exchange_host_name == NULL)
+	return FALSE;
+      break;
+
+    case GSK_DNS_RR_HOST_INFO:
+      rr->rdata.hinfo.cpu = slice_parse_char_string (parser, rdata_end);
+      if (rr->rdata.hinfo.cpu == NULL)
+	return FALSE;
+      rr->rdata.hinfo.os = slice_parse_char_string (parser, rdata_end);
+      if (rr->rdata.hinfo.os == NULL)
+	return FALSE;
+      break;
+
+    case GSK_DNS_RR_START_OF_AUTHORITY:
+      {
+	const guint8 *intervals;
+	rr->rdata.soa.mname = slice_parse_name (parser);
+	if (rr->rdata.soa.mname == NULL)
+	  return FALSE;
+	rr->rdata.soa.rname = slice_parse_name (parser);
+	if (rr->rdata.soa.rname == NULL)
+	  return FALSE;
+	if (parser->at + 20 > rdata_end)
+	  return FALSE;
+	intervals = parser->data + parser->at;
+	rr->rdata.soa.serial = SLICE_UINT32 (intervals);
+	rr->rdata.soa.refresh_time = SLICE_UINT32 (intervals + 4);
+	rr->rdata.soa.retry_time = SLICE_UINT32 (intervals + 8);
+	rr->rdata.soa.expire_time = SLICE_UINT32 (intervals + 12);
+	rr->rdata.soa.minimum_time = SLICE_UINT32 (intervals + 16);
+	parser->at += 20;
+	break;
+      }
+
+    case GSK_DNS_RR_TEXT:
+      {
+	/* the <character-string>s are concatenated */
+	char *buf = alloca (rdlength + 1);
+	guint out_len = 0;
+	while (parser->at < rdata_end)
+	  {
+	    guint len = parser->data[parser->at];
+	    if (parser->at + 1 + len > rdata_end)
+	      return FALSE;
+	    memcpy (buf + out_len, parser->data + parser->at + 1, len);
+	    out_len += len;
+	    parser->at += 1 + len;
+	  }
+	buf[out_len] = 0;
+	rr->rdata.txt = g_string_chunk_insert (parser->message->str_pool, buf);
+	break;
+      }
+
+    case GSK_DNS_RR_WELL_KNOWN_SERVICE:
+    case GSK_DNS_RR_ZONE_TRANSFER:
+    case GSK_DNS_RR_ZONE_MAILB:
+      g_warning ("XXX: unimplemented");
+      return FALSE;
+
+    case GSK_DNS_RR_WILDCARD:
+      break;
+
+    default:
+      g_warning ("HMM.  Don't know how to deal with RTYPE==%d", rr->type);
+      return FALSE;
+    }
+
+  if (parser->at > rdata_end)
+    {
+      PARSE_FAIL ("resource-record data longer than its rdlength");
+      return FALSE;
+    }
+  parser->at = rdata_end;
+  return TRUE;
+}
+
+static GskDnsMessage *
+gsk_dns_parse_data_internal (const guint8 *data,
+			     guint         length,
+			     guint        *num_bytes_parsed)
+{
+  guint question_count;
+  guint answer_count;
+  guint auth_count;
+  guint addl_count;
+  guint rr_count;
+  guint i;
+  guint flags;
+  GskDnsMessage *message;
+  GskDnsResourceRecord *rrs;
+  GskDnsQuestion *questions;
+  SliceParser parser;
+
+  if (length < 12)
+    return NULL;
+  question_count = SLICE_UINT16 (data + 4);
+  answer_count   = SLICE_UINT16 (data + 6);
+  auth_count     = SLICE_UINT16 (data + 8);
+  addl_count     = SLICE_UINT16 (data + 10);
+  rr_count = answer_count + auth_count + addl_count;
+
+  /* Each question takes at least 5 bytes, and each record 11:
+     don't allocate for more than the packet could hold. */
+  if (12 + 5 * question_count + 11 * rr_count > length)
+    {
+      PARSE_FAIL ("section counts too large for the message");
+      return NULL;
+    }
+
+  message = gsk_dns_message_alloc ();
+  flags = SLICE_UINT16 (data + 2);
+  message->id                  =  SLICE_UINT16 (data);
+  message->is_query            = (flags & (1<<15)) ? 0 : 1;
+  message->is_authoritative    = (flags & (1<<10)) ? 1 : 0;
+  message->is_truncated        = (flags & (1<<9))  ? 1 : 0;
+  message->recursion_desired   = (flags & (1<<8))  ? 1 : 0;
+  message->recursion_available = (flags & (1<<7))  ? 1 : 0;
+  message->error_code          = (flags & 0x000f) >> 0;
+
+  /* records first, so that both arrays are suitably aligned */
+  message->record_block_size = rr_count * sizeof (GskDnsResourceRecord)
+			     + question_count * sizeof (GskDnsQuestion);
+  if (message->record_block_size > 0)
+    message->record_block = g_malloc (message->record_block_size);
+  rrs = message->record_block;
+  questions = (GskDnsQuestion *) (rrs + rr_count);
+
+  memset (&parser, 0, sizeof (parser));
+  parser.data = data;
+  parser.length = length;
+  parser.at = 12;
+  parser.message = message;
+
+  /* question section (RFC 1035, 4.1.2) */
+  for (i = 0; i < question_count; i++)
+    {
+      char *name = slice_parse_name (&parser);
+      if (name == NULL || parser.at + 4 > length)
+	{
+	  PARSE_FAIL ("question section");
+	  goto fail;
+	}
+      questions[i].query_name = name;
+      questions[i].query_type = SLICE_UINT16 (data + parser.at);
+      questions[i].query_class = SLICE_UINT16 (data + parser.at + 2);
+      questions[i].allocator = message;
+      parser.at += 4;
+    }
+
+  /* the other three sections are the same: a list of resource-records */
+  for (i = 0; i < rr_count; i++)
+    if (!slice_parse_resource_record (&parser, rrs + i))
+      {
+	PARSE_FAIL (i < answer_count ? "answer"
+		    : i < answer_count + auth_count ? "authority"
+		    : "additional");
+	goto fail;
+      }
+
+  /* build the lists back-to-front, so they needn't be reversed */
+  for (i = question_count; i-- > 0; )
+    message->questions = g_slist_prepend (message->questions, questions + i);
+  for (i = rr_count; i-- > 0; )
+    {
+      GSList **list_out;
+      if (i < answer_count)
+	list_out = &message->answers;
+      else if (i < answer_count + auth_count)
+	list_out = &message->authority;
+      else
+	list_out = &message->additional;
+      *list_out = g_slist_prepend (*list_out, rrs + i);
+    }
+
+  if (num_bytes_parsed != NULL)
+    *num_bytes_parsed = parser.at;
+  return message;
+
+fail:
+  gsk_dns_message_unref (message);
+  return NULL;
+}
+
 /**
  * gsk_dns_message_parse_data:
  * @data: binary data to parse into a DNS message.
@@ -1469,7 +1905,10 @@ GskDnsMessage *gsk_dns_message_parse_buffer  (GskBuffer    *buffer)
  * @bytes_used_out: number of bytes of @data actually used to make the
  *   returned message, or NULL if you don't care.
  *
- * Parse a GskDnsMessage from a buffer.
+ * Parse a GskDnsMessage from a contiguous block of memory,
+ * typically the contents of a packet.
+ * All the message's questions and resource-records are stored in
+ * a single array owned by the message, rather than allocated one by one.
  *
  * returns: the new DNS message, or NULL if a parse error occurs.
  */
@@ -1477,34 +1916,80 @@ GskDnsMessage *gsk_dns_message_parse_data    (const guint8 *data,
 				              guint         length,
 				              guint        *bytes_used_out)
 {
-  GskBuffer buffer;
-  GskDnsMessage *message;
-  guint len;
-  gsk_buffer_construct (&buffer);
-  gsk_buffer_append_foreign (&buffer, data, length, NULL, NULL);
-  message = gsk_dns_parse_buffer_internal (&buffer, &len);
-  gsk_buffer_destruct (&buffer);
-  if (message == NULL)
-    return NULL;
-  if (bytes_used_out != NULL)
-    *bytes_used_out = len;
-  return message;
+  return gsk_dns_parse_data_internal (data, length, bytes_used_out);
 }
 
 /* --- writing binary messages --- */
+
+/* Number of slots in the table of names already written, for compression.
+   Once it is three-quarters full, later names are not entered,
+   so they are merely compressed less well. */
+#define COMPRESS_TABLE_SIZE		64
+
+typedef struct _CompressEntry CompressEntry;
+struct _CompressEntry
+{
+  const char *suffix;		/* NULL for an empty slot */
+  guint       hash;
+  guint       offset;
+};
+
 typedef struct _SerializeInfo SerializeInfo;
 struct _SerializeInfo
 {
   gboolean    compress;
-  GHashTable *str_to_offset;
+  guint       n_compress_entries;
+  CompressEntry compress_table[COMPRESS_TABLE_SIZE];
   GskBuffer  *buffer;
   gint        init_buffer_size;
 };
 
+static inline guint
+hash_suffix (const char *str)
+{
+  guint rv = 5381;
+  while (*str)
+    rv = rv * 33 + (guint8) *str++;
+  return rv;
+}
+
+/* Find the offset where SUFFIX was written, or 0. */
+static guint
+compress_table_lookup (SerializeInfo *ser_info,
+		       const char    *suffix,
+		       guint          hash)
+{
+  guint i = hash % COMPRESS_TABLE_SIZE;
+  while (ser_info->compress_table[i].suffix != NULL)
+    {
+      CompressEntry *entry = ser_info->compress_table + i;
+      if (entry->hash == hash && strcmp (entry->suffix, suffix) == 0)
+	return entry->offset;
+      i = (i + 1) % COMPRESS_TABLE_SIZE;
+    }
+  return 0;
+}
+
+static void
+compress_table_insert (SerializeInfo *ser_info,
+		       const char    *suffix,
+		       guint          hash,
+		       guint          offset)
+{
+  guint i = hash % COMPRESS_TABLE_SIZE;
+  if (ser_info->n_compress_entries >= COMPRESS_TABLE_SIZE * 3 / 4)
+    return;
+  while (ser_info->compress_table[i].suffix != NULL)
+    i = (i + 1) % COMPRESS_TABLE_SIZE;
+  ser_info->compress_table[i].suffix = suffix;
+  ser_info->compress_table[i].hash = hash;
+  ser_info->compress_table[i].offset = offset;
+  ser_info->n_compress_entries++;
+}
+
 static void compress_string (SerializeInfo *ser_info,
 			     const char    *str)
 {
-  GHashTable *offsets = ser_info->str_to_offset;
   const char *at = str;
   const char *component = at;
   guint offset = 0;
@@ -1514,15 +1999,17 @@ static void compress_string (SerializeInfo *ser_info,
       const char *end_component;
       guint len;
       guint buf_offset;
-      offset = GPOINTER_TO_UINT (g_hash_table_lookup (offsets, component));
-      if (offset != 0)
-	break;
-
-      buf_offset = ser_info->buffer->size - ser_info->init_buffer_size;
-      if (buf_offset <= MAX_OFFSET)
-	g_hash_table_insert (ser_info->str_to_offset,
-			     (gpointer) component,
-			     GUINT_TO_POINTER (buf_offset));
+      if (ser_info->compress)
+	{
+	  guint hash = hash_suffix (component);
+	  offset = compress_table_lookup (ser_info, component, hash);
+	  if (offset != 0)
+	    break;
+
+	  buf_offset = ser_info->buffer->size - ser_info->init_buffer_size;
+	  if (buf_offset <= MAX_OFFSET)
+	    compress_table_insert (ser_info, component, hash, buf_offset);
+	}
 
       end_component = strchr (component, '.');
       if (end_component != NULL)
@@ -1656,6 +2143,7 @@ write_rr_to_buffer (gpointer    list_data,
     case GSK_DNS_RR_HOST_INFO:
       data[4] = SAFE_STRLEN (rr->rdata.hinfo.cpu)
 	      + SAFE_STRLEN (rr->rdata.hinfo.os) + 2;
+      data[4] = GUINT16_TO_BE (data[4]);
       gsk_buffer_append (buffer, data, 10);
       append_char_string (buffer, rr->rdata.hinfo.cpu);
       append_char_string (buffer, rr->rdata.hinfo.os);
@@ -1697,7 +2185,7 @@ write_rr_to_buffer (gpointer    list_data,
 	  int_buf[2] = GUINT32_TO_BE (rr->rdata.soa.retry_time);
 	  int_buf[3] = GUINT32_TO_BE (rr->rdata.soa.expire_time);
 	  int_buf[4] = GUINT32_TO_BE (rr->rdata.soa.minimum_time);
-	  gsk_buffer_append (buffer, int_buf, sizeof (int_buf));
+	  gsk_buffer_append (&tmp_buffer, int_buf, sizeof (int_buf));
 	}
 
 	data[4] = tmp_buffer.size;
@@ -1713,7 +2201,9 @@ write_rr_to_buffer (gpointer    list_data,
     case GSK_DNS_RR_TEXT:
       {
 	char *text = rr->rdata.txt;
-	int remaining = strlen (text);
+	int remaining = SAFE_STRLEN (text);
+	data[4] = GUINT16_TO_BE (remaining + (remaining + 254) / 255);
+	gsk_buffer_append (buffer, data, 10);
 	while (remaining > 0)
 	  {
 	    int to_write = MIN (remaining, 255);
@@ -1770,11 +2260,10 @@ gsk_dns_message_write_buffer  (GskDnsMessage *message,
   SerializeInfo ser_info;
 
   ser_info.compress = compress;
-  ser_info.buffer = buffer;
+  ser_info.n_compress_entries = 0;
   if (compress)
-    ser_info.str_to_offset = g_hash_table_new (g_str_hash, g_str_equal);
-  else
-    ser_info.str_to_offset = NULL;
+    memset (ser_info.compress_table, 0, sizeof (ser_info.compress_table));
+  ser_info.buffer = buffer;
   ser_info.init_buffer_size = buffer->size;
 
   {
@@ -1799,9 +2288,6 @@ gsk_dns_message_write_buffer  (GskDnsMessage *message,
   g_slist_foreach (message->answers, write_rr_to_buffer, &ser_info);
   g_slist_foreach (message->authority, write_rr_to_buffer, &ser_info);
   g_slist_foreach (message->additional, write_rr_to_buffer, &ser_info);
-
-  if (ser_info.str_to_offset != NULL)
-    g_hash_table_destroy (ser_info.str_to_offset);
 }
 
 /**
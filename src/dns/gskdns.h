@@ -390,6 +390,8 @@ struct _GskDnsMessage
   GMemChunk    *qr_pool;  /* for GskDnsQuestion and GskDnsResourceRecord */
   GStringChunk *str_pool; /* for all strings */
   GHashTable   *offset_to_str;   /* for decompressing only */
+  gpointer      record_block;    /* RRs and questions of a parsed packet */
+  guint         record_block_size;
 };
 
 /* --- binary dns messages --- */
@@ -74,9 +74,13 @@ typedef enum
 
 /* A single entry (a ResourceRecord) in the cache.
    
-   This is in two lists:
-     - a per-owner list of resource-records
-     - a LRU list to discard old entries. */
+   This is in a per-owner list of resource-records,
+   and, unless it is locked, in its shard's expiry wheel
+   and in the CLOCK ring used to discard entries when
+   the shard is full.
+
+   The record's strings are stored right after the structure,
+   and the whole thing is usually carved from one of the shard's slabs. */
 typedef struct _RRList RRList;
 struct _RRList
 {
@@ -99,35 +103,83 @@ struct _RRList
   guint is_negative : 1;
 
   /* Indicates that this record has been abandoned since it was locked.
-     It has been removed from all the lists and trees,
+     It has been removed from all the lists,
      but it still affects the estimated size of the cache.
      It will be freed as soon as its lock_count reaches 0. */
   guint is_deprecated : 1;
 
+  /* CLOCK's reference bit: set whenever the record is used,
+     and cleared when the hand passes over it. */
+  guint is_referenced : 1;
+
+  /* Whether the record came from g_malloc() instead of a slab. */
+  guint is_heap : 1;
+
+  /* Which of the cache's shards the record belongs to. */
+  guint shard_index : 12;
+
   RRList *owner_next;
   RRList *owner_prev;
-  RRList *lru_next;
-  RRList *lru_prev;
+
+  /* wheel_pprev points to whichever pointer points to this entry:
+     either the wheel bucket or the previous entry's wheel_next. */
+  RRList *wheel_next;
+  RRList **wheel_pprev;
+
+  /* the CLOCK ring is circular */
+  RRList *clock_next;
+  RRList *clock_prev;
 };
 
-/* predicate to determine if the given rr_list is in the lru_list.
+/* predicate to determine if the given rr_list is in the CLOCK ring.
    This is equivalent to whether the rr_list
-   is in the by_expire_time tree. */
-#define RR_LIST_IS_IN_LRU_LIST(rr_list)   ((rr_list)->lock_count == 0 \
+   is in the expiry wheel. */
+#define RR_LIST_IS_EVICTABLE(rr_list)     ((rr_list)->lock_count == 0 \
                                         && !(rr_list)->is_from_user \
                                         && !(rr_list)->is_deprecated)
 
-struct _GskDnsRRCache
+/* Largest number of shards; limited by RRList's shard_index. */
+#define MAX_SHARDS			4096
+
+/* Number of one-second buckets in the expiry wheel.
+   Records that expire further in the future than this
+   are merely passed over once per revolution. */
+#define WHEEL_SIZE			1024
+
+/* Records are carved from slabs in size-classes
+   that are multiples of SLAB_GRANULARITY;
+   records too large for any class come from the heap.  */
+#define SLAB_GRANULARITY		32
+#define N_SLAB_CLASSES			32
+
+/* A shard's slabs start small, so that the many tiny caches
+   made by GskDnsClient stay tiny, and double up to this size.
+   Slabs are never freed, and memory freed into one size-class
+   is not reused for another, so once a shard's slabs add up
+   to its max_bytes_used, further records come from the heap:
+   that bounds the slabs even as the mix of record sizes changes. */
+#define MIN_SLAB_SIZE			(SLAB_GRANULARITY * N_SLAB_CLASSES)
+#define MAX_SLAB_SIZE			(64 * 1024)
+
+/* A cache is divided by owner into shards,
+   each with its own records, budget and (if shared) lock. */
+typedef struct _RRShard RRShard;
+struct _RRShard
 {
+  /* NULL unless the cache is shared between threads */
+  GMutex             *lock;
+
   GHashTable         *owner_to_rr_list;
 
-  /* ordered by expiry */
-  GTree              *rr_list_by_expire_time;
+  /* evictable entries by expire_time, allocated on first use */
+  RRList            **wheel;
+  /* all buckets up to this time have been swept */
+  gulong              wheel_time;
 
-  guint               ref_count;
-  gboolean            is_roundrobin;
+  /* ring of evictable entries */
+  RRList             *clock_hand;
 
-  /* current use of all objects in this cache */
+  /* current use of all objects in this shard */
   guint64             num_bytes_used;
   guint               num_records;
 
@@ -135,48 +187,218 @@ struct _GskDnsRRCache
   guint64             max_bytes_used;
   guint               max_records;
 
-  /* list of discardable rrlists (those with lock_count==0) */
-  RRList             *lru_first;		/* the most recently used */
-  RRList             *lru_last;			/* the least recently used */
+  /* slab allocation */
+  gpointer            free_lists[N_SLAB_CLASSES];
+  guint8             *slab_at;
+  guint               slab_remaining;
+  guint               next_slab_size;
+  guint64             slab_bytes;
+  GSList             *slabs;
 };
 
-static gint
-compare_rr_list_by_expire_time (const RRList *a,
-				const RRList *b)
-{
-  if (a->expire_time < b->expire_time)
-    return -1;
-  if (a->expire_time > b->expire_time)
-    return +1;
-  if (a < b)
-    return -1;
-  if (a > b)
-    return +1;
-  return 0;
+struct _GskDnsRRCache
+{
+  gint                ref_count;
+  gboolean            is_roundrobin;
+
+  guint               n_shards;
+  RRShard            *shards;
+};
+
+#define SHARD_LOCK(shard)						\
+  G_STMT_START{ if ((shard)->lock) g_mutex_lock ((shard)->lock); }G_STMT_END
+#define SHARD_UNLOCK(shard)						\
+  G_STMT_START{ if ((shard)->lock) g_mutex_unlock ((shard)->lock); }G_STMT_END
+
+/* The shard holding records owned by LC_OWNER, which must be lowercase. */
+static inline RRShard *
+get_shard (GskDnsRRCache *rr_cache,
+           const char    *lc_owner)
+{
+  if (rr_cache->n_shards == 1)
+    return rr_cache->shards;
+  return rr_cache->shards + g_str_hash (lc_owner) % rr_cache->n_shards;
+}
+#define SHARD_OF_RR_LIST(rr_cache, rr_list)	((rr_cache)->shards + (rr_list)->shard_index)
+
+/* --- slab allocation --- */
+static inline void
+push_free_list (RRShard *shard, guint slab_class, gpointer mem)
+{
+  * (gpointer *) mem = shard->free_lists[slab_class];
+  shard->free_lists[slab_class] = mem;
+}
+
+/* Allocate memory for an rr_list of *BYTE_SIZE_INOUT bytes,
+   rounding up *BYTE_SIZE_INOUT to the size actually used.
+   The rr_list's is_heap flag is set; the caller fills in the rest. */
+static RRList *
+shard_alloc (RRShard *shard,
+             guint   *byte_size_inout)
+{
+  guint slab_class = (*byte_size_inout - 1) / SLAB_GRANULARITY;
+  guint byte_size;
+  RRList *rv;
+  if (slab_class >= N_SLAB_CLASSES)
+    {
+      rv = g_malloc (*byte_size_inout);
+      rv->is_heap = 1;
+      return rv;
+    }
+
+  byte_size = (slab_class + 1) * SLAB_GRANULARITY;
+  *byte_size_inout = byte_size;
+  rv = shard->free_lists[slab_class];
+  if (rv != NULL)
+    {
+      shard->free_lists[slab_class] = * (gpointer *) rv;
+      rv->is_heap = 0;
+      return rv;
+    }
+
+  if (shard->slab_remaining < byte_size)
+    {
+      if (shard->slabs != NULL
+       && shard->slab_bytes + shard->next_slab_size > shard->max_bytes_used)
+        {
+          rv = g_malloc (byte_size);
+          rv->is_heap = 1;
+          return rv;
+        }
+
+      /* keep the tail of the old slab for a smaller class */
+      if (shard->slab_remaining >= SLAB_GRANULARITY)
+        push_free_list (shard, shard->slab_remaining / SLAB_GRANULARITY - 1,
+                        shard->slab_at);
+      shard->slab_at = g_malloc (shard->next_slab_size);
+      shard->slab_remaining = shard->next_slab_size;
+      shard->slab_bytes += shard->next_slab_size;
+      shard->slabs = g_slist_prepend (shard->slabs, shard->slab_at);
+      if (shard->next_slab_size < MAX_SLAB_SIZE)
+        shard->next_slab_size *= 2;
+    }
+  rv = (RRList *) shard->slab_at;
+  shard->slab_at += byte_size;
+  shard->slab_remaining -= byte_size;
+  rv->is_heap = 0;
+  return rv;
+}
+
+static void
+shard_free (RRShard *shard,
+            RRList  *rr_list)
+{
+  if (rr_list->is_heap)
+    g_free (rr_list);
+  else
+    push_free_list (shard, (rr_list->byte_size - 1) / SLAB_GRANULARITY, rr_list);
+}
+
+/* --- the expiry wheel --- */
+static void
+wheel_insert (RRShard *shard,
+              RRList  *rr_list)
+{
+  gulong when = rr_list->expire_time;
+  RRList **bucket;
+  if (shard->wheel == NULL)
+    shard->wheel = g_new0 (RRList *, WHEEL_SIZE);
+
+  /* a time which has already been swept would not be
+     looked at again for an entire revolution */
+  if (when <= shard->wheel_time)
+    when = shard->wheel_time + 1;
+  bucket = shard->wheel + when % WHEEL_SIZE;
+  rr_list->wheel_next = *bucket;
+  if (*bucket != NULL)
+    (*bucket)->wheel_pprev = &rr_list->wheel_next;
+  rr_list->wheel_pprev = bucket;
+  *bucket = rr_list;
+}
+
+static void
+wheel_remove (RRList *rr_list)
+{
+  *rr_list->wheel_pprev = rr_list->wheel_next;
+  if (rr_list->wheel_next != NULL)
+    rr_list->wheel_next->wheel_pprev = rr_list->wheel_pprev;
+  rr_list->wheel_next = NULL;
+  rr_list->wheel_pprev = NULL;
+}
+
+/* --- the CLOCK ring --- */
+
+/* New entries go just behind the hand,
+   so they are the last ones it reaches. */
+static void
+clock_insert (RRShard *shard,
+              RRList  *rr_list)
+{
+  RRList *hand = shard->clock_hand;
+  if (hand == NULL)
+    {
+      rr_list->clock_next = rr_list->clock_prev = rr_list;
+      shard->clock_hand = rr_list;
+    }
+  else
+    {
+      rr_list->clock_next = hand;
+      rr_list->clock_prev = hand->clock_prev;
+      hand->clock_prev->clock_next = rr_list;
+      hand->clock_prev = rr_list;
+    }
+}
+
+static void
+clock_remove (RRShard *shard,
+              RRList  *rr_list)
+{
+  if (rr_list->clock_next == rr_list)
+    {
+      g_assert (shard->clock_hand == rr_list);
+      shard->clock_hand = NULL;
+    }
+  else
+    {
+      rr_list->clock_prev->clock_next = rr_list->clock_next;
+      rr_list->clock_next->clock_prev = rr_list->clock_prev;
+      if (shard->clock_hand == rr_list)
+        shard->clock_hand = rr_list->clock_next;
+    }
+  rr_list->clock_next = rr_list->clock_prev = NULL;
+}
+
+static inline void
+add_evictable (RRShard *shard, RRList *rr_list)
+{
+  wheel_insert (shard, rr_list);
+  clock_insert (shard, rr_list);
+}
+
+static inline void
+remove_evictable (RRShard *shard, RRList *rr_list)
+{
+  wheel_remove (rr_list);
+  clock_remove (shard, rr_list);
 }
 
 /* Set the expiration time on an rr_list,
-   possibly updating the by-expire-time tree. */
+   possibly moving it in the expiry wheel. */
 static inline void
-set_expire_time (GskDnsRRCache *rr_cache,
+set_expire_time (RRShard       *shard,
                  RRList        *rr_list,
                  guint          expire_time)
 {
-  gboolean expirable = RR_LIST_IS_IN_LRU_LIST (rr_list);
+  gboolean expirable = RR_LIST_IS_EVICTABLE (rr_list);
   if (expirable)
-    {
-      g_assert (g_tree_lookup (rr_cache->rr_list_by_expire_time, rr_list) != NULL);
-      g_tree_remove (rr_cache->rr_list_by_expire_time, rr_list);
-    }
+    wheel_remove (rr_list);
   rr_list->expire_time = expire_time;
   if (expirable)
-    {
-      g_tree_insert (rr_cache->rr_list_by_expire_time, rr_list, rr_list);
-    }
+    wheel_insert (shard, rr_list);
 }
 
 
-/* For debugging, implement ASSERT_INVARIANTS(rr_cache),
+/* For debugging, implement ASSERT_INVARIANTS(shard),
    which does nothing if dns debugging is disabled,
    or asserts every condition possible if dns debugging enabled.
 
@@ -186,18 +408,15 @@ set_expire_time (GskDnsRRCache *rr_cache,
 #ifdef GSK_DEBUG
 typedef struct
 {
-  guint n_lru;
+  guint n_evictable;
   guint n_rr;
-  guint n_user_rr;
-  guint n_locked_nonuser;
-  GskDnsRRCache *rr_cache;
+  RRShard *shard;
 } CheckInvariantForeachInfo;
 
 static void
 check_invariant_owner_to_rr_list_foreach (gpointer key, gpointer value, gpointer data)
 {
   CheckInvariantForeachInfo *info = data;
-  GskDnsRRCache *rr_cache = info->rr_cache;
   RRList *at = value;
   g_assert (key); g_assert (value);
   g_assert (at->owner_prev == NULL);
@@ -208,60 +427,88 @@ check_invariant_owner_to_rr_list_foreach (gpointer key, gpointer value, gpointer
         g_assert (at->owner_prev->owner_next == at);
       if (at->owner_next)
         g_assert (at->owner_next->owner_prev == at);
-      if (RR_LIST_IS_IN_LRU_LIST (at))
-        info->n_lru += 1;
+      if (RR_LIST_IS_EVICTABLE (at))
+        {
+          g_assert (at->wheel_pprev != NULL && *at->wheel_pprev == at);
+          g_assert (at->clock_next != NULL);
+          info->n_evictable += 1;
+        }
+      else
+        g_assert (at->wheel_pprev == NULL && at->clock_next == NULL);
       g_assert (g_ascii_strcasecmp (at->rr.owner, (char*) key) == 0);
       info->n_rr += 1;
-      if (at->is_from_user)
-        info->n_user_rr += 1;
-      else if (at->lock_count == 0)
-        g_assert (g_tree_lookup (rr_cache->rr_list_by_expire_time, at) != NULL);
-      else
-        info->n_locked_nonuser += 1;
     }
 }
   
 static void
-assert_invariants (GskDnsRRCache *rr_cache)
+assert_invariants (RRShard *shard)
 {
   RRList *at;
-  CheckInvariantForeachInfo info = { 0, 0, 0, 0, rr_cache };
-  guint lru_count = 0;
-  for (at = rr_cache->lru_first; at; at = at->lru_next)
+  CheckInvariantForeachInfo info = { 0, 0, shard };
+  guint clock_count = 0;
+  guint wheel_count = 0;
+  guint i;
+  if (shard->clock_hand != NULL)
     {
-      g_assert (at->magic == RR_LIST_MAGIC);
-      g_assert (RR_LIST_IS_IN_LRU_LIST (at));
-      if (at->lru_prev)
+      at = shard->clock_hand;
+      do
         {
-          g_assert (at->lru_prev->lru_next == at);
-          g_assert (at != rr_cache->lru_first);
+          g_assert (at->magic == RR_LIST_MAGIC);
+          g_assert (RR_LIST_IS_EVICTABLE (at));
+          g_assert (at->clock_next->clock_prev == at);
+          clock_count++;
+          at = at->clock_next;
         }
-      else
-        g_assert (at == rr_cache->lru_first);
-      if (at->lru_next)
+      while (at != shard->clock_hand);
+    }
+  if (shard->wheel != NULL)
+    for (i = 0; i < WHEEL_SIZE; i++)
+      for (at = shard->wheel[i]; at != NULL; at = at->wheel_next)
         {
-          g_assert (at->lru_next->lru_prev == at);
-          g_assert (at != rr_cache->lru_last);
+          g_assert (RR_LIST_IS_EVICTABLE (at));
+          wheel_count++;
         }
-      else
-        g_assert (at == rr_cache->lru_last);
-      lru_count++;
-    }
-  g_hash_table_foreach (rr_cache->owner_to_rr_list,
+  g_hash_table_foreach (shard->owner_to_rr_list,
                         check_invariant_owner_to_rr_list_foreach,
                         &info);
-  g_assert (lru_count == info.n_lru);
-  g_assert (g_tree_nnodes (rr_cache->rr_list_by_expire_time) == (int)info.n_rr - (int)info.n_locked_nonuser - (int)info.n_user_rr);
+  g_assert (clock_count == info.n_evictable);
+  g_assert (wheel_count == info.n_evictable);
+  g_assert (info.n_rr <= shard->num_records);
 }
-#define ASSERT_INVARIANTS(rr_cache)				\
+#define ASSERT_INVARIANTS(shard)				\
   G_STMT_START{							\
     if (GSK_IS_DEBUGGING (DNS))					\
-      assert_invariants (rr_cache);				\
+      assert_invariants (shard);				\
   }G_STMT_END
 #else
-#define ASSERT_INVARIANTS(rr_cache)
+#define ASSERT_INVARIANTS(shard)
 #endif
 
+static GskDnsRRCache *
+gsk_dns_rr_cache_new_internal (guint64  max_bytes,
+                               guint    max_records,
+                               guint    n_shards,
+                               gboolean shared)
+{
+  GskDnsRRCache *rv = g_new (GskDnsRRCache, 1);
+  guint i;
+  rv->ref_count = 1;
+  rv->is_roundrobin = TRUE;
+  rv->n_shards = n_shards;
+  rv->shards = g_new0 (RRShard, n_shards);
+  for (i = 0; i < n_shards; i++)
+    {
+      RRShard *shard = rv->shards + i;
+      shard->lock = shared ? g_mutex_new () : NULL;
+      shard->owner_to_rr_list = g_hash_table_new (g_str_hash, g_str_equal);
+      shard->max_bytes_used = max_bytes / n_shards;
+      shard->max_records = max_records / n_shards;
+      shard->next_slab_size = MIN_SLAB_SIZE;
+      ASSERT_INVARIANTS (shard);
+    }
+  return rv;
+}
+
 /**
  * gsk_dns_rr_cache_new:
  * @max_bytes: the maximum number of bytes to use for all the resource
@@ -277,20 +524,38 @@ GskDnsRRCache *
 gsk_dns_rr_cache_new        (guint64                  max_bytes,
 			     guint                    max_records)
 {
-  GskDnsRRCache *rv = g_new (GskDnsRRCache, 1);
-  rv->owner_to_rr_list = g_hash_table_new (g_str_hash, g_str_equal);
-  rv->rr_list_by_expire_time
-    = g_tree_new ((GCompareFunc) compare_rr_list_by_expire_time);
-  rv->ref_count = 1;
-  rv->num_bytes_used = 0;
-  rv->num_records = 0;
-  rv->max_bytes_used = max_bytes;
-  rv->max_records = max_records;
-  rv->lru_first = NULL;
-  rv->lru_last = NULL;
-  rv->is_roundrobin = TRUE;
-  ASSERT_INVARIANTS (rv);
-  return rv;
+  return gsk_dns_rr_cache_new_internal (max_bytes, max_records, 1, FALSE);
+}
+
+/**
+ * gsk_dns_rr_cache_new_shared:
+ * @max_bytes: the maximum number of bytes to use for all the resource
+ * records and negative information in this pool, as for gsk_dns_rr_cache_new().
+ * @max_records: the maximum number of records in this cache.
+ * @n_shards: number of independently locked parts to divide the cache into.
+ *
+ * Create a new, empty DNS cache which may be used
+ * by several threads at once.
+ * Names are spread over the shards by hashing, and each shard
+ * gets an equal part of the limits.
+ *
+ * Records obtained from a shared cache may be discarded by another
+ * thread at any time, unless they are locked:
+ * use gsk_dns_rr_cache_lookup_one() with GSK_DNS_RR_CACHE_LOOKUP_LOCK
+ * to find and lock a record together.
+ *
+ * GLib's threads must have been initialized.
+ *
+ * returns: the new GskDnsRRCache.
+ */
+GskDnsRRCache *
+gsk_dns_rr_cache_new_shared (guint64                  max_bytes,
+			     guint                    max_records,
+			     guint                    n_shards)
+{
+  g_return_val_if_fail (n_shards > 0 && n_shards <= MAX_SHARDS, NULL);
+  g_return_val_if_fail (g_thread_supported (), NULL);
+  return gsk_dns_rr_cache_new_internal (max_bytes, max_records, n_shards, TRUE);
 }
 
 /**
@@ -307,41 +572,8 @@ gsk_dns_rr_cache_roundrobin (GskDnsRRCache *rr_cache,
   rr_cache->is_roundrobin = do_roundrobin;
 }
 
-
-static inline void
-remove_from_lru_list (GskDnsRRCache *rr_cache, RRList *at)
-{
-  if (at->lru_prev != NULL)
-    at->lru_prev->lru_next = at->lru_next;
-  else
-    {
-      g_assert (at == rr_cache->lru_first);
-      rr_cache->lru_first = at->lru_next;
-    }
-  if (at->lru_next != NULL)
-    at->lru_next->lru_prev = at->lru_prev;
-  else
-    {
-      g_assert (at == rr_cache->lru_last);
-      rr_cache->lru_last = at->lru_prev;
-    }
-  at->lru_prev = at->lru_next = NULL;
-}
-
-static inline void
-prepend_to_lru_list (GskDnsRRCache *rr_cache, RRList *at)
-{
-  at->lru_prev = NULL;
-  at->lru_next = rr_cache->lru_first;
-  if (rr_cache->lru_first != NULL)
-    rr_cache->lru_first->lru_prev = at;
-  else
-    rr_cache->lru_last = at;
-  rr_cache->lru_first = at;
-}
-
 static void
-remove_owner_to_rr_list_entry (GskDnsRRCache *rr_cache,
+remove_owner_to_rr_list_entry (RRShard       *shard,
                                const char    *owner)
 {
   char *lc_owner;
@@ -349,81 +581,174 @@ remove_owner_to_rr_list_entry (GskDnsRRCache *rr_cache,
   gpointer list;
   LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
   /* delete/remove the key */
-  if (!g_hash_table_lookup_extended (rr_cache->owner_to_rr_list,
+  if (!g_hash_table_lookup_extended (shard->owner_to_rr_list,
 				     lc_owner,
 				     &name,
 				     &list))
     g_assert_not_reached ();
-  g_hash_table_remove (rr_cache->owner_to_rr_list, lc_owner);
+  g_hash_table_remove (shard->owner_to_rr_list, lc_owner);
   g_free (name);
 }
 
 static void
-change_owner_to_rr_list_entry (GskDnsRRCache *rr_cache,
+change_owner_to_rr_list_entry (RRShard       *shard,
                                RRList        *new_head)
 {
   char *lc_owner;
   LOWER_CASE_COPY_ON_STACK (lc_owner, new_head->rr.owner);
-  g_assert (g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner) != NULL);
+  g_assert (g_hash_table_lookup (shard->owner_to_rr_list, lc_owner) != NULL);
   g_assert (new_head->magic == RR_LIST_MAGIC);
-  g_hash_table_insert (rr_cache->owner_to_rr_list, lc_owner, new_head);
+  g_hash_table_insert (shard->owner_to_rr_list, lc_owner, new_head);
 }
 
-static RRList *
-lookup_owner_to_rr_list_entry (GskDnsRRCache *rr_cache, 
-                               const char *owner)
+/* Add a new entry to the list for its (lowercased) owner. */
+static void
+link_into_owner_list (RRShard    *shard,
+                      const char *lc_owner,
+                      RRList     *at)
 {
-  char *lc_owner;
-  RRList *rv;
-  LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
-  rv = g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner);
-  if (rv != NULL)
-    g_assert (rv->magic == RR_LIST_MAGIC);
-  return rv;
+  RRList *owner_list = g_hash_table_lookup (shard->owner_to_rr_list, lc_owner);
+  if (owner_list == NULL)
+    {
+      g_hash_table_insert (shard->owner_to_rr_list,
+			   g_strdup (lc_owner),
+			   at);
+      at->owner_next = at->owner_prev = NULL;
+    }
+  else
+    {
+      /* insert this element as the second in the list,
+       * to avoid disturbing the hashtable.
+       */
+      g_assert (owner_list->owner_prev == NULL);
+      at->owner_prev = owner_list;
+      at->owner_next = owner_list->owner_next;
+      if (at->owner_next != NULL)
+	at->owner_next->owner_prev = at;
+      owner_list->owner_next = at;
+    }
+}
+
+static void
+unlink_from_owner_list (RRShard *shard,
+                        RRList  *at)
+{
+  if (at->owner_next != NULL)
+    at->owner_next->owner_prev = at->owner_prev;
+  if (at->owner_prev != NULL)
+    at->owner_prev->owner_next = at->owner_next;
+  else if (at->owner_next != NULL)
+    change_owner_to_rr_list_entry (shard, at->owner_next);
+  else
+    remove_owner_to_rr_list_entry (shard, at->rr.owner);
+  at->owner_next = at->owner_prev = NULL;
+}
+
+/* Take an entry out of the cache.  It is freed now,
+   unless it is locked, in which case it is freed
+   when it is finally unlocked. */
+static void
+discard_rr_list (RRShard     *shard,
+                 RRList      *at,
+                 RRListMagic  magic)
+{
+  unlink_from_owner_list (shard, at);
+  if (RR_LIST_IS_EVICTABLE (at))
+    remove_evictable (shard, at);
+  if (at->lock_count > 0)
+    {
+      at->is_deprecated = 1;
+      return;
+    }
+  shard->num_records--;
+  shard->num_bytes_used -= at->byte_size;
+  at->magic = magic;
+  shard_free (shard, at);
 }
 
 /* Verify that enough space is free before adding/allocating
- * a new rrcache, if possible.
+ * a new record, if possible, by running the CLOCK hand:
+ * records used since it last passed get another chance.
  */
 static void
-ensure_space (GskDnsRRCache   *rr_cache,
+ensure_space (RRShard         *shard,
 	      guint            num_records,
 	      guint            byte_size)
 {
-  while (rr_cache->lru_last != NULL
-      && (rr_cache->num_bytes_used + byte_size > rr_cache->max_bytes_used
-       || rr_cache->num_records + num_records > rr_cache->max_records))
+  while (shard->clock_hand != NULL
+      && (shard->num_bytes_used + byte_size > shard->max_bytes_used
+       || shard->num_records + num_records > shard->max_records))
     {
-      RRList *to_discard = rr_cache->lru_last;
-      remove_from_lru_list (rr_cache, to_discard);
-      if (to_discard->owner_prev == NULL)
-	{
-	  if (to_discard->owner_next == NULL)
-	    {
-              remove_owner_to_rr_list_entry (rr_cache, to_discard->rr.owner);
-	    }
-	  else
-	    {
-              change_owner_to_rr_list_entry (rr_cache, to_discard->owner_next);
-	      to_discard->owner_next->owner_prev = NULL;
-	    }
-	}
+      RRList *at = shard->clock_hand;
+      if (at->is_referenced)
+        {
+          at->is_referenced = 0;
+          shard->clock_hand = at->clock_next;
+        }
       else
-	{
-	  /* adjust pointers: the hash-table can stay the same */
-	  to_discard->owner_prev->owner_next = to_discard->owner_next;
-	  if (to_discard->owner_next != NULL)
-	    to_discard->owner_next->owner_prev = to_discard->owner_prev;
-	}
+        discard_rr_list (shard, at, RR_LIST_EXPIRED);
+    }
+}
 
-      rr_cache->num_records--;
-      rr_cache->num_bytes_used -= to_discard->byte_size;
-      g_tree_remove (rr_cache->rr_list_by_expire_time, to_discard);
+/* Discard expired records, sweeping the wheel up to CUR_TIME. */
+static void
+flush_shard (RRShard *shard,
+             gulong   cur_time)
+{
+  if (cur_time > shard->wheel_time)
+    {
+      if (shard->wheel != NULL)
+        {
+          gulong n_buckets = MIN (cur_time - shard->wheel_time, WHEEL_SIZE);
+          gulong t = shard->wheel_time;
+          while (n_buckets-- > 0)
+            {
+              RRList *at = shard->wheel[++t % WHEEL_SIZE];
+              while (at != NULL)
+                {
+                  RRList *next = at->wheel_next;
+                  if (at->expire_time <= cur_time)
+                    discard_rr_list (shard, at, RR_LIST_EXPIRED);
+                  at = next;
+                }
+            }
+        }
+      shard->wheel_time = cur_time;
+    }
+  ensure_space (shard, 0, 0);
+  ASSERT_INVARIANTS (shard);
+}
 
-      to_discard->magic = RR_LIST_EXPIRED;
+static inline void
+lock_rr_list (RRShard *shard,
+              RRList  *rr_list)
+{
+  if (RR_LIST_IS_EVICTABLE (rr_list))
+    remove_evictable (shard, rr_list);
+  ++(rr_list->lock_count);
+  rr_list->is_referenced = 1;
+}
 
-      g_free (to_discard);
+static void
+unlock_rr_list (RRShard *shard,
+                RRList  *rr_list)
+{
+  --(rr_list->lock_count);
+  if (rr_list->lock_count > 0)
+    return;
+  if (rr_list->is_deprecated)
+    {
+      shard->num_bytes_used -= rr_list->byte_size;
+      shard->num_records--;
+      rr_list->magic = RR_LIST_REPLACED;
+      shard_free (shard, rr_list);
+      return;
     }
+
+  /* back into the wheel and the CLOCK ring;
+     if we are over budget, that may discard it at once. */
+  add_evictable (shard, rr_list);
+  ensure_space (shard, 0, 0);
 }
 
 /* Return TRUE if OLD_STR is shorter than NEW_STR,
@@ -456,7 +781,7 @@ typedef enum
 } UpdateResult;
 
 static UpdateResult
-update_record (GskDnsRRCache        *rr_cache,
+update_record (RRShard              *shard,
 	       RRList               *list,
 	       const GskDnsResourceRecord *record,
 	       gboolean              is_authoritative,
@@ -545,7 +870,7 @@ update_record (GskDnsRRCache        *rr_cache,
 
       /* Update the expire_time to be longer, if needed. */
       if (list->expire_time < new_expire_time)
-	set_expire_time (rr_cache, list, new_expire_time);
+	set_expire_time (shard, list, new_expire_time);
       return UPDATE_SUCCESS;
     }
 
@@ -741,9 +1066,12 @@ flatten_rr (RRList               *out,
   out->lock_count = 0;
   out->rr.allocator = NULL;
   out->owner_next = out->owner_prev = NULL;
-  out->lru_next = out->lru_prev = NULL;
+  out->wheel_next = NULL;
+  out->wheel_pprev = NULL;
+  out->clock_next = out->clock_prev = NULL;
   out->is_negative = 0;
   out->is_deprecated = 0;
+  out->is_referenced = 0;
 }
 
 static void
@@ -766,7 +1094,11 @@ flatten_negative_rr (RRList               *out,
   out->is_from_user = 0;
   out->is_negative = 1;
   out->is_deprecated = 0;
-  out->owner_next = out->owner_prev = out->lru_next = out->lru_prev = NULL;
+  out->is_referenced = 0;
+  out->owner_next = out->owner_prev = NULL;
+  out->wheel_next = NULL;
+  out->wheel_pprev = NULL;
+  out->clock_next = out->clock_prev = NULL;
 
   out->rr.owner = str_slab;
   strcpy (str_slab, owner);
@@ -789,6 +1121,7 @@ flatten_negative_rr (RRList               *out,
  * returns:
  * A new copy of the record is returned; if you wish to guarantee that
  * the record is not deleted, you should call gsk_dns_rr_cache_lock() on it.
+ * (For a shared cache, another thread may delete it before then.)
  */
 GskDnsResourceRecord *
 gsk_dns_rr_cache_insert     (GskDnsRRCache     *rr_cache,
@@ -797,25 +1130,28 @@ gsk_dns_rr_cache_insert     (GskDnsRRCache     *rr_cache,
 			     gulong                   cur_time)
 {
   guint byte_size;
-  RRList *owner_list;
-  RRList *new_owner_list;
+  RRShard *shard;
   RRList *at;
+  RRList *next;
   char *lc_owner;
 
+  g_return_val_if_fail (record->type != GSK_DNS_RR_WILDCARD, NULL);
+
   LOWER_CASE_COPY_ON_STACK (lc_owner, record->owner);
+  shard = get_shard (rr_cache, lc_owner);
+  SHARD_LOCK (shard);
 
   byte_size = compute_byte_size (record);
-  ensure_space (rr_cache, 1, byte_size);
-
-  ASSERT_INVARIANTS (rr_cache);
+  ensure_space (shard, 1, byte_size);
 
-  g_return_val_if_fail (record->type != GSK_DNS_RR_WILDCARD, NULL);
-  owner_list = g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner);
-  new_owner_list = owner_list;
+  ASSERT_INVARIANTS (shard);
 
   /* search for collisions */
-  for (at = owner_list; at != NULL; )
+  for (at = g_hash_table_lookup (shard->owner_to_rr_list, lc_owner);
+       at != NULL;
+       at = next)
     {
+      next = at->owner_next;
       if (record->type == at->rr.type
        && record->record_class == at->rr.record_class)
 	{
@@ -825,106 +1161,39 @@ gsk_dns_rr_cache_insert     (GskDnsRRCache     *rr_cache,
 	   * the new record, or keeping them both.
 	   */
 	  UpdateResult result;
-	  result = update_record (rr_cache, at,
+	  result = update_record (shard, at,
 				  record, is_authoritative,
 				  cur_time);
 	  switch (result)
 	    {
 	    case UPDATE_SUCCESS:
+	      at->is_referenced = 1;
+	      SHARD_UNLOCK (shard);
 	      return &at->rr;
 	    case UPDATE_ADD_NEW:
-	      at = at->owner_next;
 	      break;
 	    case UPDATE_REPLACE:
 	      /* otherwise, remove `at', it is obsolete. */
-	      if (at->owner_prev == NULL)
-	        new_owner_list = at->owner_next;
-	      else
-		at->owner_prev->owner_next = at->owner_next;
-	      if (at->owner_next != NULL)
-		at->owner_next->owner_prev = at->owner_prev;
-	      if (RR_LIST_IS_IN_LRU_LIST (at))
-		remove_from_lru_list (rr_cache, at);
-              if (at->lock_count > 0)
-                {
-		  at->is_deprecated = 1;
-                  at = at->owner_next;
-                }
-              else
-		{
-		  RRList *next;
-                  g_assert (g_tree_lookup (rr_cache->rr_list_by_expire_time, at) != NULL);
-                  g_tree_remove (rr_cache->rr_list_by_expire_time, at);
-                  next = at->owner_next;
-		  at->magic = RR_LIST_REPLACED;
-		  rr_cache->num_bytes_used -= at->byte_size;
-		  rr_cache->num_records--;
-		  g_free (at);
-		  at = next;
-		}
+	      discard_rr_list (shard, at, RR_LIST_REPLACED);
 	      break;
 	    }
 	}
-      else
-	{
-	  at = at->owner_next;
-	}
-    }
-
-  if (owner_list != NULL && new_owner_list == NULL)
-    {
-      gpointer key, value;
-      if (!g_hash_table_lookup_extended (rr_cache->owner_to_rr_list,
-					 lc_owner, &key, &value))
-	g_assert_not_reached ();
-      g_hash_table_remove (rr_cache->owner_to_rr_list, key);
-      g_free (key);
-    }
-  else if (owner_list != new_owner_list)
-    {
-      g_assert (new_owner_list->magic == RR_LIST_MAGIC);
-      g_hash_table_insert (rr_cache->owner_to_rr_list,
-			   lc_owner,
-			   new_owner_list);
     }
-  g_assert (at == NULL);
 
-  at = g_malloc (byte_size);
+  at = shard_alloc (shard, &byte_size);
   flatten_rr (at, record, cur_time);
   at->is_authoritative = is_authoritative ? 1 : 0;
   at->is_from_user = 0;
   at->byte_size = byte_size;
-  rr_cache->num_bytes_used += byte_size;
-  rr_cache->num_records += 1;
+  at->shard_index = shard - rr_cache->shards;
+  shard->num_bytes_used += byte_size;
+  shard->num_records += 1;
 
-  /* add it to owner_list */
-  if (new_owner_list == NULL)
-    {
-      g_hash_table_insert (rr_cache->owner_to_rr_list,
-			   g_strdup (lc_owner),
-			   at);
-      at->owner_next = at->owner_prev = NULL;
-    }
-  else
-    {
-      /* insert this element as the second in the list,
-       * to avoid disturbing the hashtable.
-       */
-      at->owner_prev = new_owner_list;
-      at->owner_next = new_owner_list->owner_next;
-      if (at->owner_next != NULL)
-	at->owner_next->owner_prev = at;
-      new_owner_list->owner_next = at;
-      g_assert (new_owner_list->owner_prev == NULL);
-    }
+  link_into_owner_list (shard, lc_owner, at);
+  add_evictable (shard, at);
 
-  /* add it to expire tree */
-  g_tree_insert (rr_cache->rr_list_by_expire_time, at, at);
-
-  /* add it to lru list */
-  prepend_to_lru_list (rr_cache, at);
-
-  ASSERT_INVARIANTS (rr_cache);
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 
   return &at->rr;
 }
@@ -946,6 +1215,50 @@ record_matches_query (GskDnsResourceRecord    *record,
   return TRUE;
 }
 
+static inline gulong
+get_flush_time (void)
+{
+  return gsk_main_loop_default ()->current_time.tv_sec + 1;
+}
+
+/* Find the positive records for LC_OWNER (which must be lowercase),
+   optionally locking them. */
+static GSList *
+lookup_list_internal (GskDnsRRCache           *rr_cache,
+                      const char              *lc_owner,
+                      GskDnsResourceRecordType query_type,
+                      GskDnsResourceClass      query_class,
+                      gboolean                 lock_records)
+{
+  GSList *rv = NULL;
+  RRShard *shard = get_shard (rr_cache, lc_owner);
+  RRList *at;
+  SHARD_LOCK (shard);
+  flush_shard (shard, get_flush_time ());
+  for (at = g_hash_table_lookup (shard->owner_to_rr_list, lc_owner);
+       at != NULL;
+       at = at->owner_next)
+    {
+      if (!at->is_negative)
+	{
+          if (record_matches_query (&at->rr, query_type, query_class))
+	    {
+	      rv = g_slist_prepend (rv, &at->rr);
+	      if (lock_records)
+	        lock_rr_list (shard, at);
+	      else
+	        at->is_referenced = 1;
+	    }
+	  /*
+	  else if (at->rr.type == GSK_DNS_RR_CANONICAL_NAME)
+	    cname = g_slist_prepend (rv, &at->rr);
+	   */
+	}
+    }
+  SHARD_UNLOCK (shard);
+  return g_slist_reverse (rv);
+}
+
 /**
  * gsk_dns_rr_cache_lookup_list:
  * @rr_cache: a resource-record cache to query.
@@ -971,27 +1284,9 @@ gsk_dns_rr_cache_lookup_list(GskDnsRRCache           *rr_cache,
 			     GskDnsResourceRecordType query_type,
 			     GskDnsResourceClass      query_class)
 {
-  GSList *rv = NULL;
-  RRList *at;
   char *lc_owner;
-  gsk_dns_rr_cache_flush (rr_cache, gsk_main_loop_default ()->current_time.tv_sec + 1);
-
   LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
-  for (at = g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner);
-       at != NULL;
-       at = at->owner_next)
-    {
-      if (!at->is_negative)
-	{
-          if (record_matches_query (&at->rr, query_type, query_class))
-	    rv = g_slist_prepend (rv, &at->rr);
-	  /*
-	  else if (at->rr.type == GSK_DNS_RR_CANONICAL_NAME)
-	    cname = g_slist_prepend (rv, &at->rr);
-	   */
-	}
-    }
-  return g_slist_reverse (rv);
+  return lookup_list_internal (rr_cache, lc_owner, query_type, query_class, FALSE);
 }
 
 /**
@@ -1000,6 +1295,7 @@ gsk_dns_rr_cache_lookup_list(GskDnsRRCache           *rr_cache,
  * @owner: the domain name to lookup resource-records for.
  * @query_type: the type of resource-record to look up.
  * @query_class: the address namespace in which to look for the information.
+ * @flags: whether to follow CNAME records, and whether to lock the result.
  *
  * Find the first appropriate resource record of a given
  * specification.
@@ -1010,7 +1306,9 @@ gsk_dns_rr_cache_lookup_list(GskDnsRRCache           *rr_cache,
  * You may call gsk_dns_rr_cache_is_negative() to distinguish these cases.
  *
  * returns: a pointer to a #GskDnsResourceRecord.
- * You must call gsk_dns_rr_cache_lock() on it if you want to keep it around.
+ * You must call gsk_dns_rr_cache_lock() on it if you want to keep it around,
+ * unless GSK_DNS_RR_CACHE_LOOKUP_LOCK was given, in which case
+ * it is already locked.
  */
 GskDnsResourceRecord *
 gsk_dns_rr_cache_lookup_one (GskDnsRRCache           *rr_cache,
@@ -1025,19 +1323,24 @@ gsk_dns_rr_cache_lookup_one (GskDnsRRCache           *rr_cache,
   GHashTable *cname_table = NULL;
   GSList *pending_names_to_lookup;
   RRList *rv = NULL;
-  GSList *rv_list = NULL;
   gboolean roundrobin = rr_cache->is_roundrobin;
-
-  gsk_dns_rr_cache_flush (rr_cache, gsk_main_loop_default ()->current_time.tv_sec + 1);
+  gulong flush_time = get_flush_time ();
 
   LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
   pending_names_to_lookup = g_slist_prepend (NULL, lc_owner);
 
-  while (pending_names_to_lookup != NULL)
+  /* The names of CNAMEs are copied, since (if the cache is shared)
+     the records could be gone once their shard is unlocked. */
+  while (pending_names_to_lookup != NULL && rv == NULL)
     {
       const char *this_owner = pending_names_to_lookup->data;
-      pending_names_to_lookup = g_slist_remove (pending_names_to_lookup, this_owner);
-      for (at = lookup_owner_to_rr_list_entry (rr_cache, this_owner);
+      RRShard *shard = get_shard (rr_cache, this_owner);
+      guint n_found = 0;
+      pending_names_to_lookup = g_slist_delete_link (pending_names_to_lookup,
+                                                     pending_names_to_lookup);
+      SHARD_LOCK (shard);
+      flush_shard (shard, flush_time);
+      for (at = g_hash_table_lookup (shard->owner_to_rr_list, this_owner);
 	   at != NULL;
 	   at = at->owner_next)
 	{
@@ -1047,49 +1350,51 @@ gsk_dns_rr_cache_lookup_one (GskDnsRRCache           *rr_cache,
 		{
                   if (!roundrobin)
                     {
-                      g_slist_free (pending_names_to_lookup);
-                      if (cname_table != NULL)
-                        g_hash_table_destroy (cname_table);
-                      return &at->rr;
+                      rv = at;
+                      break;
                     }
-                  if (rv)
-                    rv_list = g_slist_prepend (rv_list, at);
-                  else
+
+                  /* If there is more than one thing found,
+                     choose randomly. */
+                  if (g_random_int_range (0, ++n_found) == 0)
                     rv = at;
 		}
 	      else if ((flags & GSK_DNS_RR_CACHE_LOOKUP_DEREF_CNAMES) != 0
                     && at->rr.type == GSK_DNS_RR_CANONICAL_NAME)
 		{
+		  char *name;
 		  if (cname_table == NULL)
 		    {
-		      cname_table = g_hash_table_new (g_str_hash, g_str_equal);
-		      g_hash_table_insert (cname_table, lc_owner, GUINT_TO_POINTER (1));
+		      cname_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+		                                           g_free, NULL);
+		      g_hash_table_insert (cname_table, g_strdup (lc_owner), GUINT_TO_POINTER (1));
 		    }
-		  if (g_hash_table_lookup (cname_table, at->rr.rdata.domain_name) == NULL)
+		  name = g_ascii_strdown (at->rr.rdata.domain_name, -1);
+		  if (g_hash_table_lookup (cname_table, name) == NULL)
 		    {
-		      g_hash_table_insert (cname_table, at->rr.rdata.domain_name, GUINT_TO_POINTER (1));
-		      pending_names_to_lookup = g_slist_append (pending_names_to_lookup, at->rr.rdata.domain_name);
+		      g_hash_table_insert (cname_table, name, GUINT_TO_POINTER (1));
+		      pending_names_to_lookup = g_slist_append (pending_names_to_lookup, name);
 		    }
+		  else
+		    g_free (name);
 		}
 	    }
 	}
+      if (rv != NULL)
+        {
+          if ((flags & GSK_DNS_RR_CACHE_LOOKUP_LOCK) != 0)
+            lock_rr_list (shard, rv);
+          else
+            rv->is_referenced = 1;
+        }
+      ASSERT_INVARIANTS (shard);
+      SHARD_UNLOCK (shard);
     }
   g_slist_free (pending_names_to_lookup);
   if (cname_table != NULL)
     g_hash_table_destroy (cname_table);
 
-  ASSERT_INVARIANTS (rr_cache);
-
-  /* If there was more than one thing found,
-     choose randomly. */
-  if (rv_list != NULL)
-    {
-      guint which = g_random_int_range (0, 1 + g_slist_length (rv_list));
-      if (which > 0)
-        rv = g_slist_nth_data (rv_list, which - 1);
-      g_slist_free (rv_list);
-    }
-  return &rv->rr;
+  return rv ? &rv->rr : NULL;
 }
 
 /**
@@ -1110,72 +1415,15 @@ gsk_dns_rr_cache_unlock     (GskDnsRRCache           *rr_cache,
 			     GskDnsResourceRecord    *record)
 {
   RRList *rr_list = (RRList *) record;
-  char *lc_owner;
+  RRShard *shard;
   g_return_if_fail (rr_list->magic == RR_LIST_MAGIC);
   g_return_if_fail (rr_list->lock_count > 0);
 
-  LOWER_CASE_COPY_ON_STACK (lc_owner, record->owner);
-
-  g_assert (rr_list->is_deprecated
-        ||  g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner) != NULL);
-
-  --(rr_list->lock_count);
-
-  if (rr_list->lock_count > 0)
-    return;
-
-  /* should we destroy it? */
-  if (rr_list->is_deprecated
-   || rr_cache->max_records < rr_cache->num_records
-   || rr_cache->max_bytes_used < rr_cache->num_bytes_used)
-    {
-      if (!rr_list->is_deprecated)
-        {
-          /* should have already flushed anything in the LRU list */
-          g_return_if_fail (rr_cache->lru_first == NULL);
-          g_return_if_fail (!rr_list->is_from_user);
-        }
-
-      /* yes, destroy it */
-
-      /* remove from owner list */
-      if (!rr_list->is_deprecated)
-	{
-	  if (rr_list->owner_next != NULL)
-	    rr_list->owner_next->owner_prev = rr_list->owner_prev;
-	  if (rr_list->owner_prev != NULL)
-	    rr_list->owner_prev->owner_next = rr_list->owner_next;
-	  else
-	    {
-	      if (rr_list->owner_next == NULL)
-		{
-		  gpointer key, value;
-		  if (!g_hash_table_lookup_extended (rr_cache->owner_to_rr_list,
-						     lc_owner,
-						     &key, &value))
-		    g_assert_not_reached ();
-		  g_hash_table_remove (rr_cache->owner_to_rr_list, key);
-		  g_free (key);
-		}
-	      else
-		g_hash_table_insert (rr_cache->owner_to_rr_list,
-				     lc_owner,
-				     rr_list->owner_next);
-	    }
-	}
-      rr_cache->num_bytes_used -= rr_list->byte_size;
-      rr_cache->num_records--;
-      g_free (record);
-
-      return;
-    }
-
-  g_tree_insert (rr_cache->rr_list_by_expire_time, rr_list, rr_list);
-
-  /* move rr_list to lru cache */
-  prepend_to_lru_list (rr_cache, rr_list);
-
-  ASSERT_INVARIANTS (rr_cache);
+  shard = SHARD_OF_RR_LIST (rr_cache, rr_list);
+  SHARD_LOCK (shard);
+  unlock_rr_list (shard, rr_list);
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 }
 
 /**
@@ -1193,25 +1441,14 @@ gsk_dns_rr_cache_lock       (GskDnsRRCache           *rr_cache,
 			     GskDnsResourceRecord    *record)
 {
   RRList *rr_list = (RRList *) record;
-  gboolean was_in_lru = RR_LIST_IS_IN_LRU_LIST (rr_list);
+  RRShard *shard;
   g_return_if_fail (rr_list->magic == RR_LIST_MAGIC);
-  
-  ++(rr_list->lock_count);
-
-  if (was_in_lru)
-    {
-      remove_from_lru_list (rr_cache, rr_list);
-      g_tree_remove (rr_cache->rr_list_by_expire_time, rr_list);
-    }
 
-#ifndef G_DISABLE_ASSERT
-  {
-    char *lc_owner;
-    LOWER_CASE_COPY_ON_STACK (lc_owner, record->owner);
-    g_assert (g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner) != NULL);
-  }
-#endif
-  ASSERT_INVARIANTS (rr_cache);
+  shard = SHARD_OF_RR_LIST (rr_cache, rr_list);
+  SHARD_LOCK (shard);
+  lock_rr_list (shard, rr_list);
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 }
 
 /**
@@ -1236,12 +1473,18 @@ gsk_dns_rr_cache_mark_user  (GskDnsRRCache           *rr_cache,
 			     GskDnsResourceRecord    *record)
 {
   RRList *rr_list = (RRList *) record;
+  RRShard *shard;
   g_return_if_fail (rr_list->magic == RR_LIST_MAGIC);
-  if (rr_list->is_from_user)
-    return;
-  gsk_dns_rr_cache_lock (rr_cache, record);
-  rr_list->is_from_user = 1;
-  ASSERT_INVARIANTS (rr_cache);
+
+  shard = SHARD_OF_RR_LIST (rr_cache, rr_list);
+  SHARD_LOCK (shard);
+  if (!rr_list->is_from_user)
+    {
+      lock_rr_list (shard, rr_list);
+      rr_list->is_from_user = 1;
+    }
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 }
 
 /**
@@ -1257,12 +1500,19 @@ gsk_dns_rr_cache_unmark_user  (GskDnsRRCache           *rr_cache,
 			       GskDnsResourceRecord    *record)
 {
   RRList *rr_list = (RRList *) record;
+  RRShard *shard;
   g_return_if_fail (rr_list->magic == RR_LIST_MAGIC);
-  if (!rr_list->is_from_user)
-    return;
-  g_assert (rr_list->lock_count > 0);
-  rr_list->is_from_user = 0;
-  gsk_dns_rr_cache_unlock (rr_cache, record);
+
+  shard = SHARD_OF_RR_LIST (rr_cache, rr_list);
+  SHARD_LOCK (shard);
+  if (rr_list->is_from_user)
+    {
+      g_assert (rr_list->lock_count > 0);
+      rr_list->is_from_user = 0;
+      unlock_rr_list (shard, rr_list);
+    }
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 }
 
 /**
@@ -1291,11 +1541,13 @@ gsk_dns_rr_cache_get_addr   (GskDnsRRCache           *rr_cache,
 					host,
 					GSK_DNS_RR_HOST_ADDRESS,
 					GSK_DNS_CLASS_INTERNET,
-					GSK_DNS_RR_CACHE_LOOKUP_DEREF_CNAMES);
+					GSK_DNS_RR_CACHE_LOOKUP_DEREF_CNAMES
+					| GSK_DNS_RR_CACHE_LOOKUP_LOCK);
   if (record == NULL)
     return FALSE;
 
   addr = gsk_socket_address_ipv4_new (record->rdata.a.ip_address, GSK_DNS_PORT);
+  gsk_dns_rr_cache_unlock (rr_cache, record);
   *address = GSK_SOCKET_ADDRESS_IPV4 (addr);
   return TRUE;
 }
@@ -1325,14 +1577,16 @@ gsk_dns_rr_cache_get_ns_addr(GskDnsRRCache           *rr_cache,
   GSList *record_list;
   GSList *at;
   GHashTable *circ_ref_guard = NULL;
+  gboolean rv = FALSE;
 
   LOWER_CASE_COPY_ON_STACK (host, host);
 
 retry:
-  record_list = gsk_dns_rr_cache_lookup_list (rr_cache,
-					      host,
-					      GSK_DNS_RR_NAME_SERVER,
-					      GSK_DNS_CLASS_INTERNET);
+  record_list = lookup_list_internal (rr_cache,
+				      host,
+				      GSK_DNS_RR_NAME_SERVER,
+				      GSK_DNS_CLASS_INTERNET,
+				      TRUE);
   if (record_list == NULL)
     {
       GskDnsResourceRecord *record;
@@ -1340,26 +1594,31 @@ retry:
 					    host,
 					    GSK_DNS_RR_CANONICAL_NAME,
 					    GSK_DNS_CLASS_INTERNET,
-                                            0);
+                                            GSK_DNS_RR_CACHE_LOOKUP_LOCK);
       if (record != NULL)
 	{
+	  char *alias = g_ascii_strdown (record->rdata.domain_name, -1);
+	  gsk_dns_rr_cache_unlock (rr_cache, record);
           if (circ_ref_guard == NULL)
-            circ_ref_guard = g_hash_table_new (g_str_hash, g_str_equal);
-          g_hash_table_insert (circ_ref_guard,
-                               (gpointer) host,
-                               (gpointer) host);
-	  host = record->rdata.domain_name;
-          if (g_hash_table_lookup (circ_ref_guard, host) == NULL)
-            goto retry;
+            {
+              circ_ref_guard = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+              g_hash_table_insert (circ_ref_guard, g_strdup (host), GUINT_TO_POINTER (1));
+            }
+          if (g_hash_table_lookup (circ_ref_guard, alias) == NULL)
+            {
+              g_hash_table_insert (circ_ref_guard, alias, GUINT_TO_POINTER (1));
+              host = alias;
+              goto retry;
+            }
 
           /* found circular reference... fallthrough */
+          g_free (alias);
 	}
       if (circ_ref_guard)
         g_hash_table_destroy (circ_ref_guard);
       return FALSE;
     }
-  if (circ_ref_guard)
-    g_hash_table_destroy (circ_ref_guard);
 
   for (at = record_list; at != NULL; at = at->next)
     {
@@ -1368,15 +1627,20 @@ retry:
 	*ns_name_out = record->owner;
 
       /* CAREFUL: record->owner will be deleted (maybe)
-	 if anything is added to the cache */
+	 if anything is added to the cache,
+	 or, for a shared cache, once it is unlocked. */
       if (gsk_dns_rr_cache_get_addr (rr_cache, record->rdata.domain_name, address_out))
 	{
-	  g_slist_free (record_list);
-	  return TRUE;
+	  rv = TRUE;
+	  break;
 	}
     }
+  for (at = record_list; at != NULL; at = at->next)
+    gsk_dns_rr_cache_unlock (rr_cache, at->data);
   g_slist_free (record_list);
-  return FALSE;
+  if (circ_ref_guard)
+    g_hash_table_destroy (circ_ref_guard);
+  return rv;
 }
 
 /**
@@ -1402,21 +1666,21 @@ gsk_dns_rr_cache_add_negative(GskDnsRRCache           *rr_cache,
 			      gboolean                 is_authoritative)
 {
   guint byte_size;
-  RRList *owner_list;
-  RRList *new_owner_list;
+  RRShard *shard;
   RRList *at;
   char *lc_owner;
 
   LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
-
-  owner_list = g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner);
-  new_owner_list = owner_list;
+  shard = get_shard (rr_cache, lc_owner);
+  SHARD_LOCK (shard);
 
   /* Scan for records that conflict with a negative record. */
   /* If there are any, figure out if they are more authoritative than us.
      If so, do nothing (leave the old record and scrap this one).
      If not, replace the old record with the negative one in-place. */
-  for (at = owner_list; at != NULL; at = at->owner_next)
+  for (at = g_hash_table_lookup (shard->owner_to_rr_list, lc_owner);
+       at != NULL;
+       at = at->owner_next)
     {
       gboolean conflict = FALSE;
       g_assert (at->magic == RR_LIST_MAGIC);
@@ -1426,19 +1690,9 @@ gsk_dns_rr_cache_add_negative(GskDnsRRCache           *rr_cache,
 	    {
 	      /* extend record lifetime, if applicable */
 	      if (expire_time > at->expire_time)
-                {
-                  gboolean expirable = (at->lock_count == 0
-                                     && !at->is_deprecated);
-                  if (expirable)
-                    {
-                      g_assert (g_tree_lookup (rr_cache->rr_list_by_expire_time, at) != NULL);
-                      g_tree_remove (rr_cache->rr_list_by_expire_time, at);
-                    }
-                  at->expire_time = expire_time;
-                  if (expirable)
-                    g_tree_insert (rr_cache->rr_list_by_expire_time, at, at);
-                }
-	      /* TODO: touch entry in LRU list */
+                set_expire_time (shard, at, expire_time);
+	      at->is_referenced = 1;
+	      SHARD_UNLOCK (shard);
 	      return;
 	    }
 	}
@@ -1455,59 +1709,39 @@ gsk_dns_rr_cache_add_negative(GskDnsRRCache           *rr_cache,
       if (conflict)
 	{
 	  /* The records conflict.  Update. */
-	  if (!is_authoritative || at->is_authoritative)
+	  if (is_authoritative && !at->is_authoritative)
 	    {
-	      /* If the records are of the same authority, tie goes to positive record. */
-	      /* XXX: we are not as authoritative as the record we conflict with.
-		 Trigger an error someday?  */
-	      return;
+	      /* update 'at' to be negative */
+	      at->is_negative = 1;
+	      set_expire_time (shard, at, expire_time);
+	      at->is_authoritative = 1;
+	      at->is_referenced = 1;
 	    }
 
-	  /* update 'at' to be negative */
-	  at->is_negative = 1;
-	  at->expire_time = expire_time;
-	  at->is_authoritative = is_authoritative ? 1 : 0;
-	  /* TODO: touch entry in LRU list */
-
+	  /* Otherwise, we are not as authoritative as the record we conflict with.
+	     If the records are of the same authority, tie goes to positive record.
+	     XXX: Trigger an error someday?  */
+	  SHARD_UNLOCK (shard);
 	  return;
 	}
     }
 
   /* Allocate an RRList. */
   byte_size = compute_byte_size_for_negative_record (owner);
-  ensure_space (rr_cache, 1, byte_size);
-  at = g_malloc (byte_size);
+  ensure_space (shard, 1, byte_size);
+  at = shard_alloc (shard, &byte_size);
   flatten_negative_rr (at, owner, query_type, query_class, is_authoritative, expire_time);
   at->is_from_user = 0;
+  at->byte_size = byte_size;
+  at->shard_index = shard - rr_cache->shards;
+  shard->num_bytes_used += byte_size;
+  shard->num_records += 1;
 
-  /* add it to owner_list */
-  if (owner_list == NULL)
-    {
-      g_hash_table_insert (rr_cache->owner_to_rr_list,
-			   g_strdup (lc_owner),
-			   at);
-      at->owner_prev = at->owner_next = NULL;
-    }
-  else
-    {
-      /* insert this element as the second in the list,
-       * to avoid disturbing the hashtable.
-       */
-      at->owner_prev = owner_list;
-      at->owner_next = owner_list->owner_next;
-      if (at->owner_next != NULL)
-	at->owner_next->owner_prev = at;
-      owner_list->owner_next = at;
-    }
-
-  /* add it to expire tree */
-  g_tree_insert (rr_cache->rr_list_by_expire_time, at, at);
-
-  /* add it to lru list */
-  prepend_to_lru_list (rr_cache, at);
+  link_into_owner_list (shard, lc_owner, at);
+  add_evictable (shard, at);
 
-  ASSERT_INVARIANTS (rr_cache);
-  //return &at->rr;
+  ASSERT_INVARIANTS (shard);
+  SHARD_UNLOCK (shard);
 }
 
 /**
@@ -1536,22 +1770,31 @@ gsk_dns_rr_cache_is_negative (GskDnsRRCache           *rr_cache,
 			      GskDnsResourceRecordType query_type,
 			      GskDnsResourceClass      query_class)
 {
-  RRList *owner_list;
+  RRShard *shard;
   RRList *at;
   char *lc_owner;
+  gboolean rv = FALSE;
 
   LOWER_CASE_COPY_ON_STACK (lc_owner, owner);
-  owner_list = g_hash_table_lookup (rr_cache->owner_to_rr_list, lc_owner);
-  for (at = owner_list; at != NULL; at = at->owner_next)
+  shard = get_shard (rr_cache, lc_owner);
+  SHARD_LOCK (shard);
+  for (at = g_hash_table_lookup (shard->owner_to_rr_list, lc_owner);
+       at != NULL;
+       at = at->owner_next)
     {
       if ( (at->rr.type == GSK_DNS_RR_WILDCARD
          || at->rr.type == query_type)
        &&  (at->rr.record_class == GSK_DNS_CLASS_WILDCARD
          || at->rr.record_class == query_class)
        &&  at->is_negative)
-	return TRUE;
+	{
+	  at->is_referenced = 1;
+	  rv = TRUE;
+	  break;
+	}
     }
-  return FALSE;
+  SHARD_UNLOCK (shard);
+  return rv;
 }
 
 /**
@@ -1567,18 +1810,20 @@ GskDnsRRCache *
 gsk_dns_rr_cache_ref        (GskDnsRRCache           *rr_cache)
 {
   g_return_val_if_fail (rr_cache->ref_count > 0, rr_cache);
-  ++(rr_cache->ref_count);
+  g_atomic_int_inc (&rr_cache->ref_count);
   return rr_cache;
 }
 
+/* Only records not in the slabs need freeing one by one. */
 static void
-free_name_and_rr_list (char *name, RRList *owner_list)
+free_name_and_rr_list (char *name, RRList *owner_list, RRShard *shard)
 {
   g_free (name);
   while (owner_list != NULL)
     {
       RRList *next = owner_list->owner_next;
-      g_free (owner_list);
+      if (owner_list->is_heap)
+        g_free (owner_list);
       owner_list = next;
     }
 }
@@ -1594,14 +1839,25 @@ void
 gsk_dns_rr_cache_unref      (GskDnsRRCache           *rr_cache)
 {
   g_return_if_fail (rr_cache->ref_count > 0);
-  --(rr_cache->ref_count);
-  if (rr_cache->ref_count == 0)
+  if (g_atomic_int_dec_and_test (&rr_cache->ref_count))
     {
-      g_hash_table_foreach (rr_cache->owner_to_rr_list,
-			    (GHFunc) free_name_and_rr_list,
-			    NULL);
-      g_hash_table_destroy (rr_cache->owner_to_rr_list);
-      g_tree_destroy (rr_cache->rr_list_by_expire_time);
+      guint i;
+      for (i = 0; i < rr_cache->n_shards; i++)
+        {
+          RRShard *shard = rr_cache->shards + i;
+          GSList *at;
+          g_hash_table_foreach (shard->owner_to_rr_list,
+			        (GHFunc) free_name_and_rr_list,
+			        shard);
+          g_hash_table_destroy (shard->owner_to_rr_list);
+          for (at = shard->slabs; at != NULL; at = at->next)
+            g_free (at->data);
+          g_slist_free (shard->slabs);
+          g_free (shard->wheel);
+          if (shard->lock != NULL)
+            g_mutex_free (shard->lock);
+        }
+      g_free (rr_cache->shards);
       g_free (rr_cache);
     }
 }
@@ -1618,65 +1874,14 @@ void
 gsk_dns_rr_cache_flush      (GskDnsRRCache           *rr_cache,
 			     gulong                   cur_time)
 {
-  for (;;)
+  guint i;
+  for (i = 0; i < rr_cache->n_shards; i++)
     {
-      RRList *next_to_expire;
-      next_to_expire = gsk_g_tree_min (rr_cache->rr_list_by_expire_time);
-      if (next_to_expire == NULL)
-        break;
-      if (next_to_expire->expire_time > cur_time)
-        break;
-
-      if (next_to_expire->owner_next != NULL)
-	next_to_expire->owner_next->owner_prev = next_to_expire->owner_prev;
-      if (next_to_expire->owner_prev != NULL)
-	next_to_expire->owner_prev->owner_next = next_to_expire->owner_next;
-      else
-	{
-          char *lc_owner;
-          LOWER_CASE_COPY_ON_STACK (lc_owner, next_to_expire->rr.owner);
-	  if (next_to_expire->owner_next != NULL)
-            {
-	      g_hash_table_insert (rr_cache->owner_to_rr_list,
-				   lc_owner,
-				   next_to_expire->owner_next);
-              g_assert (next_to_expire->owner_next->magic == RR_LIST_MAGIC);
-            }
-	  else
-	    {
-	      gpointer key, value;
-	      if (!g_hash_table_lookup_extended (rr_cache->owner_to_rr_list,
-						 lc_owner,
-						 &key, &value))
-		g_assert_not_reached ();
-	      g_hash_table_remove (rr_cache->owner_to_rr_list, lc_owner);
-	      g_free (key);
-	    }
-	}
-      g_tree_remove (rr_cache->rr_list_by_expire_time, next_to_expire);
-
-      /* Remove from LRU list */
-      if (next_to_expire->lru_prev == NULL)
-        {
-          g_assert (rr_cache->lru_first == next_to_expire);
-          rr_cache->lru_first = next_to_expire->lru_next;
-        }
-      else
-        next_to_expire->lru_prev->lru_next = next_to_expire->lru_next;
-      if (next_to_expire->lru_next == NULL)
-        {
-          g_assert (rr_cache->lru_last == next_to_expire);
-          rr_cache->lru_last = next_to_expire->lru_prev;
-        }
-      else
-        next_to_expire->lru_next->lru_prev = next_to_expire->lru_prev;
-
-      rr_cache->num_records--;
-      rr_cache->num_bytes_used -= next_to_expire->byte_size;
-      g_free (next_to_expire);
+      RRShard *shard = rr_cache->shards + i;
+      SHARD_LOCK (shard);
+      flush_shard (shard, cur_time);
+      SHARD_UNLOCK (shard);
     }
-  ensure_space (rr_cache, 0, 0);
-  ASSERT_INVARIANTS (rr_cache);
 }
 
 /* --- parsing a Master File --- */
@@ -40,6 +40,15 @@ GType gsk_dns_rr_cache_get_type () G_GNUC_CONST;
 
 GskDnsRRCache        *gsk_dns_rr_cache_new        (guint64                  max_bytes,
 						   guint                    max_records);
+
+/* A cache which several threads may use at once.
+ * It is divided into n_shards independently locked parts.
+ * Records must be locked (see GSK_DNS_RR_CACHE_LOOKUP_LOCK)
+ * to be used safely.
+ */
+GskDnsRRCache        *gsk_dns_rr_cache_new_shared (guint64                  max_bytes,
+						   guint                    max_records,
+						   guint                    n_shards);
 GskDnsResourceRecord *gsk_dns_rr_cache_insert     (GskDnsRRCache     *rr_cache,
 					           const GskDnsResourceRecord    *record,
 						   gboolean                 is_authoritative,
@@ -58,7 +67,10 @@ GSList               *gsk_dns_rr_cache_lookup_list(GskDnsRRCache           *rr_c
 					           GskDnsResourceClass      query_class);
 typedef enum
 {
-  GSK_DNS_RR_CACHE_LOOKUP_DEREF_CNAMES = (1<<0)
+  GSK_DNS_RR_CACHE_LOOKUP_DEREF_CNAMES = (1<<0),
+
+  /* return the record already locked */
+  GSK_DNS_RR_CACHE_LOOKUP_LOCK = (1<<1)
 } GskDnsRRCacheLookupFlags;
 GskDnsResourceRecord *gsk_dns_rr_cache_lookup_one (GskDnsRRCache           *rr_cache,
 					           const char              *owner,
@@ -1,6 +1,14 @@
 #include "gskdnsserver.h"
 #include "../gskghelpers.h"
 #include "../gskmacros.h"
+#include "../gskpacketqueuefd.h"
+
+/* A UDP server receives and answers up to this many
+   queries per system call.  Queries longer than
+   MAX_QUERY_SIZE are dropped;  without EDNS
+   they are limited to 512 bytes (RFC 1035, 4.2.1). */
+#define QUERY_BATCH_SIZE        32
+#define MAX_QUERY_SIZE          4096
 
 enum
 {
@@ -325,6 +333,13 @@ gsk_dns_server_constructor (GType                  type,
       return NULL;
     }
   io = GSK_IO (server->packet_queue);
+
+  /* unless the caller chose a batch size already */
+  if (GSK_IS_PACKET_QUEUE_FD (io)
+   && GSK_PACKET_QUEUE_FD (io)->batch == NULL)
+    gsk_packet_queue_fd_set_batch_size (GSK_PACKET_QUEUE_FD (io),
+                                        QUERY_BATCH_SIZE, MAX_QUERY_SIZE);
+
   gsk_io_trap_readable (io,
 			gsk_dns_server_handle_readable,
 			gsk_dns_server_handle_readable_shutdown,
@@ -477,6 +492,11 @@ gsk_dns_server_get_type()
  *
  * Allocate a DNS server using the optional @resolver to answer questions.
  *
+ * If @packet_queue is a #GskPacketQueueFd without a batch size,
+ * the server makes it receive and send many packets per system call
+ * (see gsk_packet_queue_fd_set_batch_size()).
+ * To turn that off, set the batch size to 1 after creating the server.
+ *
  * returns: the newly allocated DNS server.
  */
 GskDnsServer *
@@ -28,6 +28,7 @@
 #include "gskstreamfd.h"
 #include "gskstreamlistener.h"
 #include "gskstreamlistenersocket.h"
+#include "gskstreamlistenergroup.h"
 #include "gsktree.h"
 #include "gsktypes.h"
 #include "gskutils.h"
@@ -19,11 +19,10 @@
         daveb@ffem.org <Dave Benson>
 */
 
-/* Free blocks to hold around to avoid repeated mallocs... */
-#define MAX_RECYCLED		16
-
-/* Size of allocations to make. */
-#define BUF_CHUNK_SIZE		32768
+/* Free blocks to hold around to avoid repeated mallocs...
+   (see gsk_buffer_set_recycling_limits()) */
+#define DEFAULT_MAX_RECYCLED_PER_THREAD	32
+#define DEFAULT_MAX_RECYCLED_IN_DEPOT	256
 
 /* Max fragments in the iovector to writev. */
 #define MAX_FRAGMENTS_TO_WRITE	16
@@ -66,35 +65,270 @@ gsk_buffer_fragment_end (GskBufferFragment *frag)
   return frag->buf + frag->buf_start + frag->buf_length;
 }
 
+/* --- GskBufferFragment size classes --- */
+/* Native fragments come in a few sizes (these are the allocation
+ * sizes, including the GskBufferFragment header).
+ * See choose_size_class() for how a size is picked. */
+#define N_SIZE_CLASSES		4
+static const guint size_class_alloc_sizes[N_SIZE_CLASSES] =
+{
+  512, 4096, 32768, 262144
+};
+#define SIZE_CLASS_PAYLOAD(cls) \
+  (size_class_alloc_sizes[cls] - sizeof (GskBufferFragment))
+
+/* The recycling limits are counts of 32k fragments;
+   larger fragments get proportionally fewer slots. */
+static const guint size_class_limit_shifts[N_SIZE_CLASSES] =
+{
+  0, 0, 0, 3
+};
+
+static inline guint
+size_class_for_length (gsize length)
+{
+  guint cls = 0;
+  while (cls + 1 < N_SIZE_CLASSES && length > SIZE_CLASS_PAYLOAD (cls))
+    cls++;
+  return cls;
+}
+
+static inline guint
+fragment_size_class (const GskBufferFragment *frag)
+{
+  guint cls = 0;
+  while (cls + 1 < N_SIZE_CLASSES && frag->buf_max_size > SIZE_CLASS_PAYLOAD (cls))
+    cls++;
+  return cls;
+}
+
+/* Pick the size of the next fragment for 'buffer',
+ * which must hold (the start of) 'length' more bytes.
+ *
+ * 'buffer->size_class' remembers the last choice.
+ * If the buffer is accumulating data beyond one fragment,
+ * we move up a class, so that streams quickly reach
+ * big fragments; each time the buffer is emptied,
+ * we move down a class (see buffer_emptied()),
+ * so that mostly-idle buffers use small fragments.
+ */
+static inline guint
+choose_size_class (GskBuffer *buffer,
+                   gsize      length)
+{
+  guint cls = buffer->size_class;
+  if (buffer->last_frag != NULL && cls + 1 < N_SIZE_CLASSES)
+    cls++;
+  while (cls + 1 < N_SIZE_CLASSES && length > SIZE_CLASS_PAYLOAD (cls))
+    cls++;
+  buffer->size_class = cls;
+  return cls;
+}
+
+static inline void
+buffer_emptied (GskBuffer *buffer)
+{
+  if (buffer->size_class > 0)
+    buffer->size_class--;
+}
+
 /* --- GskBufferFragment recycling --- */
+/* Native fragments are recycled through two levels of caching,
+ * separately for each size class:
+ *   - each thread has a private stack of free fragments,
+ *     which requires no locking at all.
+ *   - when a thread's stack overflows, half of it is moved
+ *     as a "batch" into the global depot; when it is empty,
+ *     a whole batch is taken from the depot.
+ *
+ * The depot is a lock-free stack of batches.  Batches are
+ * pushed with compare-and-exchange, and popped by detaching
+ * the entire stack (then pushing the remainder back),
+ * which avoids the ABA problem, since no 'next' pointer
+ * is ever read from a node that is still on the shared stack.
+ *
+ * The head fragment of each batch uses 'destroy_data'
+ * as the link to the next batch and 'buf_start' for the number
+ * of fragments in the batch; the fragments within a batch
+ * are linked by 'next'.  Neither field means anything
+ * for a free native fragment.
+ */
 #if !GSK_DEBUG_BUFFER_ALLOCATIONS
-static int num_recycled = 0;
-static GskBufferFragment* recycling_stack = 0;
-G_LOCK_DEFINE_STATIC (recycling_stack);
+typedef struct _ThreadCache ThreadCache;
+struct _ThreadCache
+{
+  GskBufferFragment *frags[N_SIZE_CLASSES];
+  guint n_frags[N_SIZE_CLASSES];
+
+  /* statistics not yet added to the global totals */
+  guint n_thread_hits;
+  guint n_depot_hits;
+  guint n_misses;
+  guint n_freed;
+};
+
+static guint max_recycled_per_thread = DEFAULT_MAX_RECYCLED_PER_THREAD;
+static guint max_recycled_in_depot = DEFAULT_MAX_RECYCLED_IN_DEPOT;
+
+static inline guint
+size_class_limit (guint max, guint cls)
+{
+  guint rv = max >> size_class_limit_shifts[cls];
+  return (rv == 0 && max > 0) ? 1 : rv;
+}
 
+static GStaticPrivate thread_cache_key = G_STATIC_PRIVATE_INIT;
+
+static gpointer depot_batches[N_SIZE_CLASSES];
+static gint depot_n_fragments[N_SIZE_CLASSES];
+
+/* the stats lock is only taken when a thread
+   talks to the depot, so it is very lightly contended. */
+static GskBufferRecyclingStats global_stats;
+G_LOCK_DEFINE_STATIC (global_stats);
+
+static void
+flush_thread_stats (ThreadCache *cache)
+{
+  G_LOCK (global_stats);
+  global_stats.n_thread_hits += cache->n_thread_hits;
+  global_stats.n_depot_hits += cache->n_depot_hits;
+  global_stats.n_misses += cache->n_misses;
+  global_stats.n_freed += cache->n_freed;
+  G_UNLOCK (global_stats);
+  cache->n_thread_hits = cache->n_depot_hits = 0;
+  cache->n_misses = cache->n_freed = 0;
+}
+
+static void
+free_fragment_list (GskBufferFragment *list)
+{
+  while (list != NULL)
+    {
+      GskBufferFragment *next = list->next;
+      g_free (list);
+      list = next;
+    }
+}
+
+static void
+depot_push_batches (guint              cls,
+                    GskBufferFragment *first,
+                    GskBufferFragment *last)
+{
+  gpointer old;
+  do
+    {
+      old = g_atomic_pointer_get (&depot_batches[cls]);
+      last->destroy_data = old;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&depot_batches[cls], old, first));
+}
+
+static GskBufferFragment *
+depot_pop_batch (guint cls)
+{
+  GskBufferFragment *rv;
+  GskBufferFragment *rest;
+  do
+    {
+      rv = g_atomic_pointer_get (&depot_batches[cls]);
+      if (rv == NULL)
+        return NULL;
+    }
+  while (!g_atomic_pointer_compare_and_exchange (&depot_batches[cls], rv, NULL));
+
+  /* we own the whole stack now:  keep the first batch,
+     and give the rest back. */
+  rest = rv->destroy_data;
+  if (rest != NULL)
+    {
+      GskBufferFragment *last = rest;
+      while (last->destroy_data != NULL)
+        last = last->destroy_data;
+      depot_push_batches (cls, rest, last);
+    }
+  g_atomic_int_add (&depot_n_fragments[cls], -(gint)rv->buf_start);
+  return rv;
+}
+
+/* Give a chain of n_frags fragments to the depot,
+   or to the allocator if the depot is full. */
+static void
+release_to_depot (ThreadCache       *cache,
+                  guint              cls,
+                  GskBufferFragment *batch,
+                  guint              n_frags)
+{
+  gint old_count = g_atomic_int_exchange_and_add (&depot_n_fragments[cls],
+                                                  (gint) n_frags);
+  if ((guint) old_count + n_frags > size_class_limit (max_recycled_in_depot, cls))
+    {
+      g_atomic_int_add (&depot_n_fragments[cls], -(gint) n_frags);
+      free_fragment_list (batch);
+      cache->n_freed += n_frags;
+    }
+  else
+    {
+      batch->buf_start = n_frags;
+      depot_push_batches (cls, batch, batch);
+    }
+  flush_thread_stats (cache);
+}
+
+static void
+thread_cache_destroy (gpointer data)
+{
+  ThreadCache *cache = data;
+  guint cls;
+  for (cls = 0; cls < N_SIZE_CLASSES; cls++)
+    if (cache->frags[cls] != NULL)
+      release_to_depot (cache, cls, cache->frags[cls], cache->n_frags[cls]);
+  flush_thread_stats (cache);
+  g_free (cache);
+}
+
+static inline ThreadCache *
+get_thread_cache (void)
+{
+  ThreadCache *cache = g_static_private_get (&thread_cache_key);
+  if (G_UNLIKELY (cache == NULL))
+    {
+      cache = g_new0 (ThreadCache, 1);
+      g_static_private_set (&thread_cache_key, cache, thread_cache_destroy);
+    }
+  return cache;
+}
 #endif
 
 static GskBufferFragment *
-new_native_fragment()
+new_native_fragment (guint cls)
 {
   GskBufferFragment *frag;
 #if GSK_DEBUG_BUFFER_ALLOCATIONS
-  frag = (GskBufferFragment *) g_malloc (BUF_CHUNK_SIZE);
-  frag->buf_max_size = BUF_CHUNK_SIZE - sizeof (GskBufferFragment);
+  frag = (GskBufferFragment *) g_malloc (size_class_alloc_sizes[cls]);
+  frag->buf_max_size = SIZE_CLASS_PAYLOAD (cls);
 #else  /* optimized (?) */
-  G_LOCK (recycling_stack);
-  if (recycling_stack)
+  ThreadCache *cache = get_thread_cache ();
+  if (cache->frags[cls] != NULL)
     {
-      frag = recycling_stack;
-      recycling_stack = recycling_stack->next;
-      num_recycled--;
-      G_UNLOCK (recycling_stack);
+      frag = cache->frags[cls];
+      cache->frags[cls] = frag->next;
+      cache->n_frags[cls]--;
+      cache->n_thread_hits++;
+    }
+  else if ((frag = depot_pop_batch (cls)) != NULL)
+    {
+      cache->frags[cls] = frag->next;
+      cache->n_frags[cls] = frag->buf_start - 1;
+      cache->n_depot_hits++;
+      flush_thread_stats (cache);
     }
   else
     {
-      G_UNLOCK (recycling_stack);
-      frag = (GskBufferFragment *) g_malloc (BUF_CHUNK_SIZE);
-      frag->buf_max_size = BUF_CHUNK_SIZE - sizeof (GskBufferFragment);
+      frag = (GskBufferFragment *) g_malloc (size_class_alloc_sizes[cls]);
+      frag->buf_max_size = SIZE_CLASS_PAYLOAD (cls);
+      cache->n_misses++;
     }
 #endif	/* !GSK_DEBUG_BUFFER_ALLOCATIONS */
   frag->buf_start = frag->buf_length = 0;
@@ -134,6 +368,8 @@ new_foreign_fragment (gconstpointer        ptr,
 static void
 recycle(GskBufferFragment* frag)
 {
+  ThreadCache *cache;
+  guint cls;
   if (frag->is_foreign)
     {
       if (frag->destroy)
@@ -141,43 +377,158 @@ recycle(GskBufferFragment* frag)
       g_slice_free (GskBufferFragment, frag);
       return;
     }
-  G_LOCK (recycling_stack);
-#if defined(MAX_RECYCLED)
-  if (num_recycled >= MAX_RECYCLED)
+  cache = get_thread_cache ();
+  cls = fragment_size_class (frag);
+  if (cache->n_frags[cls] >= size_class_limit (max_recycled_per_thread, cls))
     {
-      g_free (frag);
-      G_UNLOCK (recycling_stack);
+      /* move the top half of our stack (plus this fragment)
+         into the depot, as a single batch. */
+      guint n_move = cache->n_frags[cls] / 2;
+      GskBufferFragment *last = frag;
+      guint i;
+      frag->next = cache->frags[cls];
+      for (i = 0; i < n_move; i++)
+        last = last->next;
+      cache->frags[cls] = last->next;
+      cache->n_frags[cls] -= n_move;
+      last->next = NULL;
+      release_to_depot (cache, cls, frag, n_move + 1);
       return;
     }
-#endif
-  frag->next = recycling_stack;
-  recycling_stack = frag;
-  num_recycled++;
-  G_UNLOCK (recycling_stack);
+  frag->next = cache->frags[cls];
+  cache->frags[cls] = frag;
+  cache->n_frags[cls]++;
 }
 #endif	/* !GSK_DEBUG_BUFFER_ALLOCATIONS */
 
+/* Allocate a fragment to hold (the start of) 'length' more bytes
+   at the end of 'buffer'.  The caller links it in. */
+static inline GskBufferFragment *
+new_fragment_for_append (GskBuffer *buffer,
+                         gsize      length)
+{
+  return new_native_fragment (choose_size_class (buffer, length));
+}
+
 /* --- Global public methods --- */
 /**
  * gsk_buffer_cleanup_recycling_bin:
  * 
  * Free unused buffer fragments.  (Normally some are
  * kept around to reduce strain on the global allocator.)
+ *
+ * This frees the fragments cached by the calling thread
+ * and all the fragments in the shared depot.
+ * Other threads' private caches are not affected.
  */
 void
 gsk_buffer_cleanup_recycling_bin ()
 {
 #if !GSK_DEBUG_BUFFER_ALLOCATIONS
-  G_LOCK (recycling_stack);
-  while (recycling_stack != NULL)
+  ThreadCache *cache = get_thread_cache ();
+  guint cls;
+  for (cls = 0; cls < N_SIZE_CLASSES; cls++)
     {
-      GskBufferFragment *next;
-      next = recycling_stack->next;
-      g_free (recycling_stack);
-      recycling_stack = next;
+      GskBufferFragment *batch;
+      free_fragment_list (cache->frags[cls]);
+      cache->frags[cls] = NULL;
+      cache->n_frags[cls] = 0;
+      while ((batch = depot_pop_batch (cls)) != NULL)
+        {
+          /* the batches are unlinked by depot_pop_batch() */
+          free_fragment_list (batch);
+        }
+    }
+  flush_thread_stats (cache);
+#endif
+}
+
+/**
+ * gsk_buffer_set_recycling_limits:
+ * @max_per_thread: maximum number of free fragments
+ * each thread may keep for itself.
+ * @max_in_depot: maximum number of free fragments
+ * kept in the depot shared by all threads.
+ *
+ * Configure how many unused fragments are kept around,
+ * rather than being returned to the allocator.
+ * Fragments move between a thread's cache and the depot
+ * in batches of about @max_per_thread / 2,
+ * so @max_in_depot should be at least a few times that.
+ *
+ * The limits apply separately to each fragment size;
+ * they are counts of 32k fragments: the 256k fragments
+ * get an eighth as many slots.
+ *
+ * Lowering the limits does not immediately free
+ * fragments; use gsk_buffer_cleanup_recycling_bin() for that.
+ */
+void
+gsk_buffer_set_recycling_limits (guint max_per_thread,
+                                 guint max_in_depot)
+{
+#if !GSK_DEBUG_BUFFER_ALLOCATIONS
+  max_recycled_per_thread = max_per_thread;
+  max_recycled_in_depot = max_in_depot;
+#endif
+}
+
+/**
+ * gsk_buffer_get_recycling_limits:
+ * @max_per_thread_out: location to store the per-thread limit, or NULL.
+ * @max_in_depot_out: location to store the depot limit, or NULL.
+ *
+ * Get the limits set by gsk_buffer_set_recycling_limits().
+ */
+void
+gsk_buffer_get_recycling_limits (guint *max_per_thread_out,
+                                 guint *max_in_depot_out)
+{
+#if GSK_DEBUG_BUFFER_ALLOCATIONS
+  if (max_per_thread_out)
+    *max_per_thread_out = 0;
+  if (max_in_depot_out)
+    *max_in_depot_out = 0;
+#else
+  if (max_per_thread_out)
+    *max_per_thread_out = max_recycled_per_thread;
+  if (max_in_depot_out)
+    *max_in_depot_out = max_recycled_in_depot;
+#endif
+}
+
+/**
+ * gsk_buffer_get_recycling_stats:
+ * @stats_out: the statistics to fill in.
+ *
+ * Get counters of how fragment allocations were satisfied.
+ *
+ * Each thread accumulates its counts privately
+ * and adds them to the totals whenever it
+ * uses the depot (and when it exits), so the
+ * counts are slightly out-of-date, except
+ * for those of the calling thread, which are always
+ * included.
+ */
+void
+gsk_buffer_get_recycling_stats (GskBufferRecyclingStats *stats_out)
+{
+#if GSK_DEBUG_BUFFER_ALLOCATIONS
+  memset (stats_out, 0, sizeof (GskBufferRecyclingStats));
+#else
+  guint cls;
+  flush_thread_stats (get_thread_cache ());
+  G_LOCK (global_stats);
+  *stats_out = global_stats;
+  G_UNLOCK (global_stats);
+  stats_out->n_depot_fragments = 0;
+  stats_out->n_depot_bytes = 0;
+  for (cls = 0; cls < N_SIZE_CLASSES; cls++)
+    {
+      guint n = g_atomic_int_get (&depot_n_fragments[cls]);
+      stats_out->n_depot_fragments += n;
+      stats_out->n_depot_bytes += (guint64) n * size_class_alloc_sizes[cls];
     }
-  num_recycled = 0;
-  G_UNLOCK (recycling_stack);
 #endif
 }
       
@@ -194,6 +545,7 @@ gsk_buffer_construct(GskBuffer *buffer)
 {
   buffer->first_frag = buffer->last_frag = NULL;
   buffer->size = 0;
+  buffer->size_class = 0;
 }
 
 #if defined(GSK_DEBUG) || GSK_DEBUG_BUFFER_ALLOCATIONS
@@ -231,7 +583,7 @@ gsk_buffer_append(GskBuffer    *buffer,
       guint avail;
       if (!buffer->last_frag)
 	{
-	  buffer->last_frag = buffer->first_frag = new_native_fragment ();
+	  buffer->last_frag = buffer->first_frag = new_fragment_for_append (buffer, length);
 	  avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	}
       else
@@ -239,7 +591,7 @@ gsk_buffer_append(GskBuffer    *buffer,
 	  avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	  if (avail <= 0)
 	    {
-	      buffer->last_frag->next = new_native_fragment ();
+	      buffer->last_frag->next = new_fragment_for_append (buffer, length);
 	      avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	      buffer->last_frag = buffer->last_frag->next;
 	    }
@@ -254,6 +606,81 @@ gsk_buffer_append(GskBuffer    *buffer,
   CHECK_INTEGRITY (buffer);
 }
 
+/**
+ * gsk_buffer_begin_append:
+ * @buffer: the buffer to add data to.
+ * @length_inout: the most data the caller wants to add;
+ * on return, the size of the returned area, which may be smaller,
+ * but is never 0 unless 0 was asked for.
+ *
+ * Get space at the end of the buffer, so that data
+ * can be produced directly into it (by a decoder, for example),
+ * instead of into a temporary area which is then appended.
+ *
+ * The buffer does not change until gsk_buffer_end_append() is called,
+ * and nothing else may be done to the buffer in between.
+ *
+ * returns: the writable area.
+ */
+gpointer
+gsk_buffer_begin_append (GskBuffer    *buffer,
+                         guint        *length_inout)
+{
+  GskBufferFragment *frag = buffer->last_frag;
+  guint avail;
+  CHECK_INTEGRITY (buffer);
+  if (frag == NULL || gsk_buffer_fragment_avail (frag) <= 0)
+    {
+      /* link in an empty fragment;
+         gsk_buffer_end_append() removes it if it stays empty */
+      GskBufferFragment *new_frag = new_fragment_for_append (buffer, *length_inout);
+      if (frag == NULL)
+        buffer->first_frag = new_frag;
+      else
+        frag->next = new_frag;
+      buffer->last_frag = frag = new_frag;
+    }
+  avail = gsk_buffer_fragment_avail (frag);
+  if (*length_inout > avail)
+    *length_inout = avail;
+  return gsk_buffer_fragment_end (frag);
+}
+
+/**
+ * gsk_buffer_end_append:
+ * @buffer: the buffer to add data to.
+ * @length: the number of bytes written into the area
+ * given by gsk_buffer_begin_append().
+ *
+ * Add the data written at the end of the buffer.
+ */
+void
+gsk_buffer_end_append   (GskBuffer    *buffer,
+                         guint         length)
+{
+  GskBufferFragment *frag = buffer->last_frag;
+  g_assert (frag != NULL);
+  g_assert (length <= (guint) gsk_buffer_fragment_avail (frag));
+  if (length == 0 && frag->buf_length == 0)
+    {
+      /* unused new fragment */
+      GskBufferFragment *prev = NULL;
+      if (buffer->first_frag != frag)
+        for (prev = buffer->first_frag; prev->next != frag; prev = prev->next)
+          ;
+      if (prev == NULL)
+        buffer->first_frag = NULL;
+      else
+        prev->next = NULL;
+      buffer->last_frag = prev;
+      recycle (frag);
+      return;
+    }
+  frag->buf_length += length;
+  buffer->size += length;
+  CHECK_INTEGRITY (buffer);
+}
+
 void
 gsk_buffer_append_repeated_char (GskBuffer    *buffer, 
                                  char          character,
@@ -266,7 +693,7 @@ gsk_buffer_append_repeated_char (GskBuffer    *buffer,
       guint avail;
       if (!buffer->last_frag)
 	{
-	  buffer->last_frag = buffer->first_frag = new_native_fragment ();
+	  buffer->last_frag = buffer->first_frag = new_fragment_for_append (buffer, count);
 	  avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	}
       else
@@ -274,7 +701,7 @@ gsk_buffer_append_repeated_char (GskBuffer    *buffer,
 	  avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	  if (avail <= 0)
 	    {
-	      buffer->last_frag->next = new_native_fragment ();
+	      buffer->last_frag->next = new_fragment_for_append (buffer, count);
 	      avail = gsk_buffer_fragment_avail (buffer->last_frag);
 	      buffer->last_frag = buffer->last_frag->next;
 	    }
@@ -375,7 +802,10 @@ gsk_buffer_read(GskBuffer    *buffer,
 	  max_length -= first->buf_length;
 	  buffer->first_frag = first->next;
 	  if (!buffer->first_frag)
-	    buffer->last_frag = NULL;
+	    {
+	      buffer->last_frag = NULL;
+	      buffer_emptied (buffer);
+	    }
 	  recycle (first);
 	}
       else
@@ -577,7 +1007,10 @@ gsk_buffer_discard(GskBuffer *buffer,
 	  max_discard -= first->buf_length;
 	  buffer->first_frag = first->next;
 	  if (!buffer->first_frag)
-	    buffer->last_frag = NULL;
+	    {
+	      buffer->last_frag = NULL;
+	      buffer_emptied (buffer);
+	    }
 	  recycle (first);
 	}
       else
@@ -736,6 +1169,62 @@ gsk_buffer_destruct(GskBuffer *to_destroy)
     }
   to_destroy->first_frag = to_destroy->last_frag = NULL;
   to_destroy->size = 0;
+  to_destroy->size_class = 0;
+}
+
+/**
+ * gsk_buffer_shrink:
+ * @buffer: the buffer to compact.
+ *
+ * Reduce the memory held by a buffer that is expected
+ * to be idle for a while, for example a keep-alive connection's
+ * buffers between requests.
+ *
+ * Each native fragment whose data would fit in a smaller
+ * fragment is copied into one, and the buffer forgets its
+ * recent history, so that new fragments start out small.
+ * (An empty buffer holds no fragments at all, so this
+ * only matters for buffers with leftover data.)
+ *
+ * The freed fragments go to the recycler;
+ * see gsk_buffer_cleanup_recycling_bin().
+ *
+ * returns: the number of bytes of fragment memory released.
+ */
+guint
+gsk_buffer_shrink (GskBuffer *buffer)
+{
+  GskBufferFragment **pfrag = &buffer->first_frag;
+  guint rv = 0;
+  CHECK_INTEGRITY (buffer);
+  buffer->size_class = 0;
+  while (*pfrag != NULL)
+    {
+      GskBufferFragment *frag = *pfrag;
+      if (!frag->is_foreign)
+        {
+          guint old_cls = fragment_size_class (frag);
+          guint new_cls = size_class_for_length (frag->buf_length);
+          if (new_cls < old_cls)
+            {
+              GskBufferFragment *new_frag = new_native_fragment (new_cls);
+              memcpy (new_frag->buf, gsk_buffer_fragment_start (frag),
+                      frag->buf_length);
+              new_frag->buf_length = frag->buf_length;
+              new_frag->next = frag->next;
+              *pfrag = new_frag;
+              if (buffer->last_frag == frag)
+                buffer->last_frag = new_frag;
+              rv += size_class_alloc_sizes[old_cls]
+                  - size_class_alloc_sizes[new_cls];
+              recycle (frag);
+              frag = new_frag;
+            }
+        }
+      pfrag = &frag->next;
+    }
+  CHECK_INTEGRITY (buffer);
+  return rv;
 }
 
 /**
@@ -49,9 +49,12 @@ struct _GskBuffer
 
   GskBufferFragment    *first_frag;
   GskBufferFragment    *last_frag;
+
+  /*< private >*/
+  guint8                size_class;	/* hint for new fragments' size */
 };
 
-#define GSK_BUFFER_STATIC_INIT		{ 0, NULL, NULL }
+#define GSK_BUFFER_STATIC_INIT		{ 0, NULL, NULL, 0 }
 
 
 void     gsk_buffer_construct           (GskBuffer       *buffer);
@@ -103,6 +106,13 @@ void     gsk_buffer_append_foreign      (GskBuffer    *buffer,
 					 GDestroyNotify destroy,
 					 gpointer      destroy_data);
 
+/* Producing data in place at the end of the buffer;
+ * see gsk_buffer_begin_append(). */
+gpointer gsk_buffer_begin_append        (GskBuffer    *buffer,
+                                         guint        *length_inout);
+void     gsk_buffer_end_append          (GskBuffer    *buffer,
+                                         guint         length);
+
 void     gsk_buffer_printf              (GskBuffer    *buffer,
 					 const char   *format,
 					 ...) G_GNUC_PRINTF(2,3);
@@ -144,9 +154,31 @@ int      gsk_buffer_polystr_index_of    (GskBuffer    *buffer,
  * for the allocation and deallocation of the GskBuffer itself. */
 void     gsk_buffer_destruct            (GskBuffer    *to_destroy);
 
+/* Move the buffer's data into the smallest fragments that hold it;
+ * call this on buffers that are about to be idle. */
+guint    gsk_buffer_shrink              (GskBuffer    *buffer);
+
 /* Free all unused buffer fragments. */
 void     gsk_buffer_cleanup_recycling_bin ();
 
+/* Tuning the fragment recycler. */
+typedef struct _GskBufferRecyclingStats GskBufferRecyclingStats;
+struct _GskBufferRecyclingStats
+{
+  guint64 n_thread_hits;        /* allocations from the thread's own cache */
+  guint64 n_depot_hits;         /* batches taken from the shared depot */
+  guint64 n_misses;             /* allocations that went to malloc */
+  guint64 n_freed;              /* fragments freed because the depot was full */
+  guint   n_depot_fragments;    /* fragments currently in the depot */
+  guint64 n_depot_bytes;        /* ... and their total allocation size */
+};
+
+void     gsk_buffer_set_recycling_limits (guint         max_per_thread,
+                                          guint         max_in_depot);
+void     gsk_buffer_get_recycling_limits (guint        *max_per_thread_out,
+                                          guint        *max_in_depot_out);
+void     gsk_buffer_get_recycling_stats  (GskBufferRecyclingStats *stats_out);
+
 
 /* intended for use on the stack */
 typedef struct _GskBufferIterator GskBufferIterator;
@@ -22,6 +22,7 @@
 
 #include <sys/wait.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
@@ -78,6 +79,8 @@ struct _GskSource
   guint                  timer_adjusted_while_running : 1;
   guint                  timer_is_red : 1;
   guint                  timer_in_tree : 1;
+  guint                  timer_is_coarse : 1;
+  guint                  timer_in_wheel : 1;
 
   GskMainLoop           *main_loop;
 
@@ -97,7 +100,8 @@ struct _GskSource
       GTimeVal               expire_time;
       gint64                 milli_period;
       GskMainLoopTimeoutFunc func;
-      GskSource             *left, *right, *parent;
+      GskSource             *left, *right, *parent;	/* prev/next in the wheel */
+      guint                  wheel_slot;
     } timer;
     struct
     {
@@ -154,6 +158,271 @@ struct _GskMainLoopContextList
   (main_loop)->timers, GskSource *, TIMER_GET_IS_RED, TIMER_SET_IS_RED,  \
   data.timer.parent, data.timer.left, data.timer.right, TIMER_COMPARE
 
+/* --- coarse timers:  a hierarchical timing wheel --- */
+
+/* Coarse timers are rounded up to the next tick,
+   so they never run early, but they may run up to a tick late.
+   Unlike the tree, adding, adjusting and removing a timer are O(1),
+   which matters for idle-timeouts that are re-armed on every read.
+
+   There are TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SIZE slots;
+   level N holds timers which expire within 2^(8*(N+1)) ticks.
+   Whenever level 0 wraps around, the current slot of level 1
+   is redistributed to the lower level (and so on up the levels).
+   Timers that are due are moved to the "expired" list,
+   which is then run by gsk_main_loop_run(). */
+#define TIMER_WHEEL_TICK_MILLIS		10
+#define TIMER_WHEEL_BITS		8
+#define TIMER_WHEEL_SIZE		(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK		(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS		4
+#define TIMER_WHEEL_MAX_DELTA		((G_GUINT64_CONSTANT (1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+#define TIMER_WHEEL_EXPIRED_SLOT	(TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE)
+
+#define WHEEL_PREV(source)		((source)->data.timer.left)
+#define WHEEL_NEXT(source)		((source)->data.timer.right)
+
+typedef struct _GskTimerWheel GskTimerWheel;
+struct _GskTimerWheel
+{
+  /* the next tick to process: all earlier ticks have been expired */
+  guint64    cur_tick;
+
+  guint      n_timers;
+  guint      n_per_level[TIMER_WHEEL_LEVELS];
+
+  /* one list per slot, plus the list of expired timers */
+  GskSource *slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE + 1];
+  GskSource *last_expired;
+};
+
+static inline guint64
+timeval_to_tick_floor (const GTimeVal *tv)
+{
+  guint64 ms = (guint64) tv->tv_sec * 1000 + tv->tv_usec / 1000;
+  return ms / TIMER_WHEEL_TICK_MILLIS;
+}
+
+static inline guint64
+timeval_to_tick_ceil (const GTimeVal *tv)
+{
+  guint64 ms = (guint64) tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+  return (ms + TIMER_WHEEL_TICK_MILLIS - 1) / TIMER_WHEEL_TICK_MILLIS;
+}
+
+static GskTimerWheel *
+timer_wheel_new (const GTimeVal *current_time)
+{
+  GskTimerWheel *wheel = g_new0 (GskTimerWheel, 1);
+  wheel->cur_tick = timeval_to_tick_floor (current_time);
+  return wheel;
+}
+
+static void
+timer_wheel_insert (GskTimerWheel *wheel,
+                    GskSource     *source)
+{
+  guint64 expire = timeval_to_tick_ceil (&source->data.timer.expire_time);
+  guint64 delta;
+  guint level;
+  guint slot;
+  if (expire < wheel->cur_tick)
+    expire = wheel->cur_tick;
+  delta = expire - wheel->cur_tick;
+
+  /* timers too far in the future will be rescheduled
+     when they are cascaded out of the top level. */
+  if (delta > TIMER_WHEEL_MAX_DELTA)
+    {
+      delta = TIMER_WHEEL_MAX_DELTA;
+      expire = wheel->cur_tick + delta;
+    }
+  for (level = 0; level + 1 < TIMER_WHEEL_LEVELS; level++)
+    if ((delta >> (TIMER_WHEEL_BITS * (level + 1))) == 0)
+      break;
+  slot = level * TIMER_WHEEL_SIZE
+       + ((guint) (expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+
+  source->data.timer.wheel_slot = slot;
+  WHEEL_PREV (source) = NULL;
+  WHEEL_NEXT (source) = wheel->slots[slot];
+  if (wheel->slots[slot] != NULL)
+    WHEEL_PREV (wheel->slots[slot]) = source;
+  wheel->slots[slot] = source;
+  wheel->n_per_level[level]++;
+  wheel->n_timers++;
+}
+
+static void
+timer_wheel_remove (GskTimerWheel *wheel,
+                    GskSource     *source)
+{
+  guint slot = source->data.timer.wheel_slot;
+  GskSource *prev = WHEEL_PREV (source);
+  GskSource *next = WHEEL_NEXT (source);
+  if (prev != NULL)
+    WHEEL_NEXT (prev) = next;
+  else
+    wheel->slots[slot] = next;
+  if (next != NULL)
+    WHEEL_PREV (next) = prev;
+  else if (slot == TIMER_WHEEL_EXPIRED_SLOT)
+    wheel->last_expired = prev;
+  if (slot != TIMER_WHEEL_EXPIRED_SLOT)
+    wheel->n_per_level[slot / TIMER_WHEEL_SIZE]--;
+  wheel->n_timers--;
+}
+
+/* Move the timers in the current slot of each upper level
+   down the hierarchy.  Called whenever level 0 wraps around. */
+static void
+timer_wheel_cascade (GskTimerWheel *wheel)
+{
+  guint level;
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+      guint index = (guint) (wheel->cur_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+      guint slot = level * TIMER_WHEEL_SIZE + index;
+      GskSource *at = wheel->slots[slot];
+      wheel->slots[slot] = NULL;
+      while (at != NULL)
+        {
+          GskSource *next = WHEEL_NEXT (at);
+          wheel->n_per_level[level]--;
+          wheel->n_timers--;
+          timer_wheel_insert (wheel, at);
+          at = next;
+        }
+      if (index != 0)
+        break;
+    }
+}
+
+/* Move the contents of the given level-0 slot to the end
+   of the expired list. */
+static void
+timer_wheel_expire_slot (GskTimerWheel *wheel,
+                         guint          slot)
+{
+  GskSource *at = wheel->slots[slot];
+  wheel->slots[slot] = NULL;
+  while (at != NULL)
+    {
+      GskSource *next = WHEEL_NEXT (at);
+      wheel->n_per_level[0]--;
+      at->data.timer.wheel_slot = TIMER_WHEEL_EXPIRED_SLOT;
+      WHEEL_PREV (at) = wheel->last_expired;
+      WHEEL_NEXT (at) = NULL;
+      if (wheel->last_expired != NULL)
+        WHEEL_NEXT (wheel->last_expired) = at;
+      else
+        wheel->slots[TIMER_WHEEL_EXPIRED_SLOT] = at;
+      wheel->last_expired = at;
+      at = next;
+    }
+}
+
+/* Process all ticks up to and including 'now_tick'. */
+static void
+timer_wheel_advance (GskTimerWheel *wheel,
+                     guint64        now_tick)
+{
+  while (wheel->cur_tick <= now_tick)
+    {
+      guint index = (guint) wheel->cur_tick & TIMER_WHEEL_MASK;
+      if (index == 0)
+        timer_wheel_cascade (wheel);
+      if (wheel->n_per_level[0] == 0)
+        {
+          /* Nothing can expire before the next cascade. */
+          guint64 next = (wheel->cur_tick | TIMER_WHEEL_MASK) + 1;
+          if (wheel->n_timers == 0 || next > now_tick)
+            next = now_tick + 1;
+          wheel->cur_tick = next;
+          continue;
+        }
+      if (wheel->slots[index] != NULL)
+        timer_wheel_expire_slot (wheel, index);
+      wheel->cur_tick++;
+    }
+}
+
+/* Returns the number of milliseconds until a coarse timer
+   may need to be run, or -1 if there are no coarse timers. */
+static gint
+timer_wheel_get_timeout (GskTimerWheel  *wheel,
+                         const GTimeVal *current_time)
+{
+  guint64 tick;
+  guint64 now_ms;
+  guint64 tick_ms;
+  if (wheel->slots[TIMER_WHEEL_EXPIRED_SLOT] != NULL)
+    return 0;
+  if (wheel->n_timers == 0)
+    return -1;
+  tick = wheel->cur_tick;
+  if ((tick & TIMER_WHEEL_MASK) == 0
+   && wheel->n_timers > wheel->n_per_level[0])
+    {
+      /* a cascade is due right away */
+    }
+  else if (wheel->n_per_level[0] > 0)
+    {
+      while (wheel->slots[tick & TIMER_WHEEL_MASK] == NULL
+          && (tick & TIMER_WHEEL_MASK) != TIMER_WHEEL_MASK)
+        tick++;
+      if (wheel->slots[tick & TIMER_WHEEL_MASK] == NULL)
+        tick++;
+    }
+  else
+    {
+      /* wake up in time for the next cascade */
+      tick = (tick | TIMER_WHEEL_MASK) + 1;
+    }
+  now_ms = (guint64) current_time->tv_sec * 1000 + current_time->tv_usec / 1000;
+  tick_ms = tick * TIMER_WHEEL_TICK_MILLIS;
+  if (tick_ms <= now_ms)
+    return 0;
+  return (gint) MIN (tick_ms - now_ms, G_MAXINT);
+}
+
+/* --- adding and removing timers from the tree or wheel --- */
+static inline void
+timer_insert (GskMainLoop *main_loop,
+              GskSource   *source)
+{
+  g_assert (!source->timer_in_tree && !source->timer_in_wheel);
+  if (source->timer_is_coarse)
+    {
+      if (main_loop->timer_wheel == NULL)
+        main_loop->timer_wheel = timer_wheel_new (&main_loop->current_time);
+      timer_wheel_insert (main_loop->timer_wheel, source);
+      source->timer_in_wheel = 1;
+    }
+  else
+    {
+      GskSource *unused;
+      GSK_RBTREE_INSERT (GET_MAIN_LOOP_TIMER_TREE (main_loop), source, unused);
+      source->timer_in_tree = 1;
+    }
+}
+
+static inline void
+timer_remove (GskMainLoop *main_loop,
+              GskSource   *source)
+{
+  if (source->timer_in_tree)
+    {
+      GSK_RBTREE_REMOVE (GET_MAIN_LOOP_TIMER_TREE (main_loop), source);
+      source->timer_in_tree = 0;
+    }
+  else if (source->timer_in_wheel)
+    {
+      timer_wheel_remove (main_loop->timer_wheel, source);
+      source->timer_in_wheel = 0;
+    }
+}
+
 
 static inline GIOCondition
 get_io_events (GskMainLoop *main_loop,
@@ -565,6 +834,28 @@ handle_poll_fd_set (int          fd,
   return TRUE;
 }
 
+static void
+run_timer (GskMainLoop *main_loop,
+           GskSource   *at)
+{
+  at->run_count++;
+  timer_remove (main_loop, at);
+  if (!(*at->data.timer.func) (at->user_data))
+    at->must_remove = 1;
+  at->run_count--;
+  if (at->run_count == 0 && at->must_remove)
+    gsk_source_remove (at);
+  else
+    {
+      if (at->timer_adjusted_while_running)
+        at->timer_adjusted_while_running = 0;
+      else
+        g_time_val_add_millis (&at->data.timer.expire_time, 
+                               at->data.timer.milli_period);
+      timer_insert (main_loop, at);
+    }
+}
+
 /**
  * gsk_main_loop_run:
  * @main_loop: the main loop to run.
@@ -623,6 +914,12 @@ gsk_main_loop_run          (GskMainLoop       *main_loop,
             timeout = t;
         }
     }
+  if (main_loop->timer_wheel != NULL)
+    {
+      gint t = timer_wheel_get_timeout (main_loop->timer_wheel, current_time);
+      if (t >= 0 && (timeout < 0 || t < timeout))
+        timeout = t;
+    }
 
   /* TODO: this doesn't work for reentrant main-loops. */
   events = main_loop->event_array_cache;
@@ -751,31 +1048,22 @@ retry_query:
         && at->data.timer.expire_time.tv_usec >= current_time->tv_usec))
 	break;
 
-      at->run_count++;
       g_assert (at->timer_in_tree);
-      GSK_RBTREE_REMOVE (GET_MAIN_LOOP_TIMER_TREE (main_loop), at);
-      at->timer_in_tree = 0;
-      if (!(*at->data.timer.func) (at->user_data))
-	at->must_remove = 1;
+      run_timer (main_loop, at);
       rv++;
-      at->run_count--;
-      if (at->run_count == 0 && at->must_remove)
-	gsk_source_remove (at);
-      else
-	{
-          if (at->timer_adjusted_while_running)
-	    at->timer_adjusted_while_running = 0;
-	  else
-	    g_time_val_add_millis (&at->data.timer.expire_time, 
-				   at->data.timer.milli_period);
-          g_assert (!at->timer_in_tree);
-          {
-            GskSource *unused;
-            GSK_RBTREE_INSERT (GET_MAIN_LOOP_TIMER_TREE (main_loop),
-                               at, unused);
-            at->timer_in_tree = 1;
-          }
-	}
+    }
+
+  /* expire coarse timers */
+  if (main_loop->timer_wheel != NULL)
+    {
+      GskTimerWheel *wheel = main_loop->timer_wheel;
+      timer_wheel_advance (wheel, timeval_to_tick_floor (current_time));
+      while ((at = wheel->slots[TIMER_WHEEL_EXPIRED_SLOT]) != NULL)
+        {
+          g_assert (at->timer_in_wheel);
+          run_timer (main_loop, at);
+          rv++;
+        }
     }
 
   g_return_val_if_fail (main_loop->is_running, rv);
@@ -1159,14 +1447,15 @@ gsk_main_loop_add_timer64  (GskMainLoop       *main_loop,
 			    gint64             milli_period)
 {
   GskSource *source = gsk_source_new (GSK_SOURCE_TYPE_TIMER, main_loop, timer_data, timer_destroy);
-  GskSource *unused;
   source->data.timer.expire_time = main_loop->current_time;
   g_time_val_add_millis (&source->data.timer.expire_time, millis_expire);
   source->data.timer.milli_period = milli_period;
   source->data.timer.func = timer_func;
   source->timer_adjusted_while_running = FALSE;
-  GSK_RBTREE_INSERT (GET_MAIN_LOOP_TIMER_TREE (main_loop), source, unused);
-  source->timer_in_tree = 1;
+  source->timer_is_coarse = main_loop->coarse_timers;
+  source->timer_in_tree = 0;
+  source->timer_in_wheel = 0;
+  timer_insert (main_loop, source);
   main_loop->num_sources++;
   return source;
 }
@@ -1210,14 +1499,15 @@ gsk_main_loop_add_timer_absolute (GskMainLoop       *main_loop,
 				  int                unixtime_micro)
 {
   GskSource *source = gsk_source_new (GSK_SOURCE_TYPE_TIMER, main_loop, timer_data, timer_destroy);
-  GskSource *unused;
   source->data.timer.expire_time.tv_sec = unixtime;
   source->data.timer.expire_time.tv_usec = unixtime_micro;
   source->data.timer.milli_period = -1;
   source->data.timer.func = timer_func;
   source->timer_adjusted_while_running = 0;
-  GSK_RBTREE_INSERT (GET_MAIN_LOOP_TIMER_TREE (main_loop), source, unused);
-  source->timer_in_tree = 1;
+  source->timer_is_coarse = 0;
+  source->timer_in_tree = 0;
+  source->timer_in_wheel = 0;
+  timer_insert (main_loop, source);
   main_loop->num_sources++;
   return source;
 }
@@ -1241,25 +1531,12 @@ gsk_source_adjust_timer   (GskSource         *timer_source,
 {
   GskMainLoop *main_loop = timer_source->main_loop;
   g_return_if_fail (timer_source->type == GSK_SOURCE_TYPE_TIMER);
-  if (timer_source->timer_in_tree)
-    {
-      GSK_RBTREE_REMOVE (GET_MAIN_LOOP_TIMER_TREE (main_loop), timer_source);
-      timer_source->timer_in_tree = 0;
-    }
+  timer_remove (main_loop, timer_source);
   timer_source->data.timer.expire_time = main_loop->current_time;
   g_time_val_add_millis (&timer_source->data.timer.expire_time, millis_expire);
   timer_source->data.timer.milli_period = milli_period;
   if (timer_source->run_count == 0)
-    {
-      if (!timer_source->timer_in_tree)
-        {
-          GskSource *unused;
-          GSK_RBTREE_INSERT (GET_MAIN_LOOP_TIMER_TREE (main_loop),
-                             timer_source,
-                             unused);
-          timer_source->timer_in_tree = 1;
-        }
-    }
+    timer_insert (main_loop, timer_source);
   else
     timer_source->timer_adjusted_while_running = 1;
 }
@@ -1272,6 +1549,41 @@ gsk_source_adjust_timer   (GskSource         *timer_source,
   gsk_source_adjust_timer64 (timer_source, millis_expire, milli_period);
 }
 
+/**
+ * gsk_source_set_timer_coarse:
+ * @timer_source: the timeout source returned by gsk_main_loop_add_timer() or gsk_main_loop_add_timer_absolute().
+ * @is_coarse: whether the timer may be run a little late.
+ *
+ * Coarse timers are kept in a timing wheel rather
+ * than a sorted tree, which makes adding, adjusting and removing them
+ * constant-time operations.  The price is that they are rounded up
+ * to the wheel's granularity (10 milliseconds),
+ * so that nearby timers are run together.
+ *
+ * This is appropriate for timeouts that are frequently pushed back,
+ * like idle-timeouts on connections.
+ *
+ * Timers added by gsk_main_loop_add_timer() are coarse if the main-loop
+ * was created with GSK_MAIN_LOOP_COARSE_TIMERS; otherwise they are precise.
+ */
+void
+gsk_source_set_timer_coarse (GskSource         *timer_source,
+                             gboolean           is_coarse)
+{
+  GskMainLoop *main_loop = timer_source->main_loop;
+  g_return_if_fail (timer_source->type == GSK_SOURCE_TYPE_TIMER);
+  if (!timer_source->timer_is_coarse == !is_coarse)
+    return;
+  if (timer_source->timer_in_tree || timer_source->timer_in_wheel)
+    {
+      timer_remove (main_loop, timer_source);
+      timer_source->timer_is_coarse = is_coarse ? 1 : 0;
+      timer_insert (main_loop, timer_source);
+    }
+  else
+    timer_source->timer_is_coarse = is_coarse ? 1 : 0;
+}
+
 static inline void
 gsk_main_loop_block_io (GskMainLoop *main_loop,
 			GskSource   *source)
@@ -1290,11 +1602,7 @@ gsk_main_loop_block_io (GskMainLoop *main_loop,
 	break;
 
       case GSK_SOURCE_TYPE_TIMER:
-        if (source->timer_in_tree)
-          {
-            GSK_RBTREE_REMOVE (GET_MAIN_LOOP_TIMER_TREE (main_loop), source);
-            source->timer_in_tree = 0;
-          }
+        timer_remove (main_loop, source);
 	break;
 
       case GSK_SOURCE_TYPE_IO:
@@ -1519,6 +1827,13 @@ gsk_main_loop_destroy_all_sources (GskMainLoop *main_loop)
   /* Destroy timers */
   while (main_loop->timers)
     gsk_source_remove (main_loop->timers);
+  if (main_loop->timer_wheel != NULL)
+    {
+      GskTimerWheel *wheel = main_loop->timer_wheel;
+      for (i = 0; i <= TIMER_WHEEL_EXPIRED_SLOT; i++)
+        while (wheel->slots[i] != NULL)
+          gsk_source_remove (wheel->slots[i]);
+    }
 
   /* Destroy i/o handlers */
   for (i = 0; i < main_loop->read_sources->len; i++)
@@ -1585,6 +1900,11 @@ gsk_main_loop_finalize (GObject *object)
   g_assert (main_loop->first_idle == NULL);
   g_assert (main_loop->last_idle == NULL);
   g_assert (main_loop->timers == NULL);
+  if (main_loop->timer_wheel != NULL)
+    {
+      g_assert (((GskTimerWheel *) main_loop->timer_wheel)->n_timers == 0);
+      g_free (main_loop->timer_wheel);
+    }
   g_assert (g_hash_table_size (main_loop->process_source_lists) == 0);
   g_assert (main_loop->running_source == NULL);
   CHECK_INVARIANTS (main_loop);
@@ -1605,6 +1925,7 @@ static void
 gsk_main_loop_init (GskMainLoop *main_loop)
 {
   main_loop->timers = NULL;
+  main_loop->timer_wheel = NULL;
   main_loop->read_sources = g_ptr_array_new ();
   main_loop->write_sources = g_ptr_array_new ();
   main_loop->signal_source_lists = g_ptr_array_new ();
@@ -1671,6 +1992,7 @@ GType gsk_main_loop_wait_info_get_type(void)
 #include "main-loops/gskmainloopkqueue.h"
 #include "main-loops/gskmainloopdevpoll.h"
 #include "main-loops/gskmainloopepoll.h"
+#include "main-loops/gskmainloopiouring.h"
 #include "main-loops/gskmainlooppoll.h"
 #include "main-loops/gskmainloopselect.h"
 
@@ -1694,6 +2016,10 @@ static struct
 #endif
 #if HAVE_SELECT
   { gsk_main_loop_select_get_type,   "select",  TRUE  },
+#endif
+  /* only used on request: see GSK_MAIN_LOOP_IO_URING */
+#if HAVE_IO_URING_SUPPORT
+  { gsk_main_loop_io_uring_get_type, "io_uring", TRUE },
 #endif
   { NULL, NULL, FALSE }
 };
@@ -1707,6 +2033,10 @@ gsk_main_loop_new (GskMainLoopCreateFlags create_flags)
   /* Try the GSK_MAIN_LOOP_TYPE environment variable */
   guint i = 0;
   const char *env_type = g_getenv ("GSK_MAIN_LOOP_TYPE");
+  const char *env_et = g_getenv ("GSK_MAIN_LOOP_EDGE_TRIGGERED");
+
+  if (env_et != NULL && atoi (env_et) != 0)
+    create_flags |= GSK_MAIN_LOOP_EDGE_TRIGGERED;
 
   if (env_type != NULL)
     {
@@ -1740,6 +2070,10 @@ gsk_main_loop_new (GskMainLoopCreateFlags create_flags)
 	{
 	  GskMainLoopClass *class;
 	  main_loop = g_object_new (type, NULL);
+	  if (create_flags & GSK_MAIN_LOOP_COARSE_TIMERS)
+	    main_loop->coarse_timers = 1;
+	  if (create_flags & GSK_MAIN_LOOP_EDGE_TRIGGERED)
+	    main_loop->edge_triggered = 1;
 	  class = GSK_MAIN_LOOP_GET_CLASS (main_loop);
 	  if (class->setup == NULL || (*class->setup) (main_loop))
 	    return main_loop;
@@ -1751,6 +2085,27 @@ gsk_main_loop_new (GskMainLoopCreateFlags create_flags)
 	}
     }
 
+#if HAVE_IO_URING_SUPPORT
+  /* GSK_MAIN_LOOP_IO_URING is only a preference:  if the kernel
+     does not allow io_uring, quietly use the defaults. */
+  if ((create_flags & GSK_MAIN_LOOP_IO_URING) != 0 && env_type == NULL)
+    {
+      GskMainLoop *main_loop;
+      GskMainLoopClass *class;
+      main_loop = g_object_new (gsk_main_loop_io_uring_get_type (), NULL);
+      if (create_flags & GSK_MAIN_LOOP_COARSE_TIMERS)
+        main_loop->coarse_timers = 1;
+      if (create_flags & GSK_MAIN_LOOP_EDGE_TRIGGERED)
+        main_loop->edge_triggered = 1;
+      class = GSK_MAIN_LOOP_GET_CLASS (main_loop);
+      main_loop->is_setup = 1;
+      if (class->setup == NULL || (*class->setup) (main_loop))
+        return main_loop;
+      DEBUG_POLL (("io_uring main-loop could not be set up: using the default"));
+      g_object_unref (main_loop);
+    }
+#endif
+
   /* Try autoconf-detected defaults, in our preferred order. */
   for (i = 0; main_loop_types[i].get_type_func != NULL; i++)
     {
@@ -1760,6 +2115,10 @@ gsk_main_loop_new (GskMainLoopCreateFlags create_flags)
 	  GskMainLoopClass *class;
 	  type = (*main_loop_types[i].get_type_func) ();
 	  main_loop = g_object_new (type, NULL);
+	  if (create_flags & GSK_MAIN_LOOP_COARSE_TIMERS)
+	    main_loop->coarse_timers = 1;
+	  if (create_flags & GSK_MAIN_LOOP_EDGE_TRIGGERED)
+	    main_loop->edge_triggered = 1;
 	  class = GSK_MAIN_LOOP_GET_CLASS (main_loop);
 	  main_loop->is_setup = 1;
 	  if (class->setup != NULL && !((*class->setup) (main_loop)))
@@ -128,6 +128,9 @@ struct _GskMainLoop
   /* timers */
   GskSource     *timers;
 
+  /* coarse timers (a timing wheel; NULL until needed) */
+  gpointer       timer_wheel;
+
   /* i/o handlers by file-descriptor */
   GPtrArray     *read_sources;
   GPtrArray     *write_sources;
@@ -152,6 +155,8 @@ struct _GskMainLoop
   guint          is_setup : 1;
   guint          is_running : 1;		/*< private >*/
   guint          quit : 1;			/*< public >*/
+  guint          coarse_timers : 1;		/* default for new timers */
+  guint          edge_triggered : 1;		/* see GSK_MAIN_LOOP_EDGE_TRIGGERED */
 
   gint		 exit_status;
 
@@ -191,7 +196,21 @@ typedef gboolean (*GskMainLoopIOFunc)     (int                   fd,
 /* Create a main loop with selected options. */
 typedef enum
 {
-  GSK_MAIN_LOOP_NEEDS_THREADS = (1 << 0)
+  GSK_MAIN_LOOP_NEEDS_THREADS = (1 << 0),
+
+  /* relative timers are coarse by default:  see gsk_source_set_timer_coarse() */
+  GSK_MAIN_LOOP_COARSE_TIMERS = (1 << 1),
+
+  /* register each file-descriptor with the kernel once, and
+     track read/write interest in user-space.  Only honored
+     by the epoll main-loop; others ignore it.
+     Also enabled by setting GSK_MAIN_LOOP_EDGE_TRIGGERED=1 */
+  GSK_MAIN_LOOP_EDGE_TRIGGERED = (1 << 2),
+
+  /* prefer the io_uring main-loop, if the kernel supports it;
+     otherwise the default is used, without complaint.
+     Also selected by GSK_MAIN_LOOP_TYPE=io_uring */
+  GSK_MAIN_LOOP_IO_URING = (1 << 3)
 } GskMainLoopCreateFlags;
 
 GskMainLoop     *gsk_main_loop_new       (GskMainLoopCreateFlags create_flags);
@@ -250,6 +269,8 @@ GskSource       *gsk_main_loop_add_timer_absolute
 void             gsk_source_adjust_timer    (GskSource         *timer_source,
                                              gint64             millis_expire,
                                              gint64             milli_period);
+void             gsk_source_set_timer_coarse(GskSource         *timer_source,
+                                             gboolean           is_coarse);
 void             gsk_source_remove          (GskSource         *source);
 void             gsk_main_loop_add_context  (GskMainLoop       *main_loop,
 					     GMainContext      *context);
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE             /* for recvmmsg() and sendmmsg() */
 #include <errno.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -33,6 +35,401 @@ static GObjectClass *parent_class = NULL;
    yet bigger packets. */
 #define MAX_UDP_PACKET_SIZE   ((1 << 16) - 1)
 
+/* --- batched i/o --- */
+/* With recvmmsg() and sendmmsg(), a batched queue receives
+   many packets per system call, into a ring of preallocated buffers,
+   and hands them all to the read-hook before returning to the main-loop.
+   Packets written while the read-hook runs are sent together
+   once it is done. */
+#define USE_BATCHES	(HAVE_RECVMMSG && HAVE_SENDMMSG)
+
+#if USE_BATCHES
+/* Buffers for received packets.  A buffer belongs to its packet
+   until the packet is destroyed, so the pool may outlive the queue. */
+typedef struct _BufferPool BufferPool;
+typedef struct _PacketBuffer PacketBuffer;
+struct _BufferPool
+{
+  guint ref_count;
+  gboolean has_batch;           /* cleared when the batch is freed */
+  guint buffer_size;
+  guint n_free;
+  guint max_free;
+  PacketBuffer *free_list;
+};
+struct _PacketBuffer
+{
+  BufferPool *pool;
+  PacketBuffer *next_free;
+  /* data follows */
+};
+#define PACKET_BUFFER_DATA(pb)	((char *) ((pb) + 1))
+
+struct _GskPacketQueueFdBatch
+{
+  guint n_slots;
+  BufferPool *pool;
+
+  /* incoming: slots in_next .. in_count-1 have been received
+     but not yet read. */
+  struct mmsghdr *in_msgs;
+  struct iovec *in_iov;
+  struct sockaddr_storage *in_addrs;
+  PacketBuffer **in_buffers;
+  guint in_next, in_count;
+  guint n_reads;
+  gboolean in_burst;
+
+  /* outgoing: slots out_next .. out_count-1 are waiting to be sent */
+  struct mmsghdr *out_msgs;
+  struct iovec *out_iov;
+  struct sockaddr_storage *out_addrs;
+  GskPacket **out_packets;
+  guint out_next, out_count;
+
+  /* the first error sending queued packets,
+     returned by the next write */
+  int out_errno;
+};
+
+/* The pool is referenced by its batch and by each buffer not in
+   its free-list. */
+static void
+buffer_pool_unref (BufferPool *pool)
+{
+  if (--(pool->ref_count) == 0)
+    {
+      while (pool->free_list != NULL)
+        {
+          PacketBuffer *pb = pool->free_list;
+          pool->free_list = pb->next_free;
+          g_free (pb);
+        }
+      g_free (pool);
+    }
+}
+
+static PacketBuffer *
+buffer_pool_alloc (BufferPool *pool)
+{
+  PacketBuffer *pb = pool->free_list;
+  if (pb != NULL)
+    {
+      pool->free_list = pb->next_free;
+      --(pool->n_free);
+    }
+  else
+    {
+      pb = g_malloc (sizeof (PacketBuffer) + pool->buffer_size);
+      pb->pool = pool;
+    }
+  ++(pool->ref_count);
+  return pb;
+}
+
+static void
+buffer_pool_recycle (gpointer   destroy_data,
+                     GskPacket *packet)
+{
+  PacketBuffer *pb = destroy_data;
+  BufferPool *pool = pb->pool;
+  if (pool->has_batch && pool->n_free < pool->max_free)
+    {
+      pb->next_free = pool->free_list;
+      pool->free_list = pb;
+      ++(pool->n_free);
+    }
+  else
+    g_free (pb);
+  buffer_pool_unref (pool);
+}
+
+static void
+batch_free (GskPacketQueueFdBatch *batch)
+{
+  guint i;
+  batch->pool->has_batch = FALSE;
+  for (i = 0; i < batch->n_slots; i++)
+    if (batch->in_buffers[i] != NULL)
+      buffer_pool_recycle (batch->in_buffers[i], NULL);
+  for (i = batch->out_next; i < batch->out_count; i++)
+    gsk_packet_unref (batch->out_packets[i]);
+  buffer_pool_unref (batch->pool);
+  g_free (batch->in_msgs);
+  g_free (batch->in_iov);
+  g_free (batch->in_addrs);
+  g_free (batch->in_buffers);
+  g_free (batch->out_msgs);
+  g_free (batch->out_iov);
+  g_free (batch->out_addrs);
+  g_free (batch->out_packets);
+  g_free (batch);
+}
+
+static gboolean
+batch_receive (GskPacketQueueFd *queue_fd,
+               GError          **error)
+{
+  GskPacketQueueFdBatch *batch = queue_fd->batch;
+  guint i;
+  int rv;
+
+  for (i = 0; i < batch->n_slots; i++)
+    {
+      struct msghdr *hdr = &batch->in_msgs[i].msg_hdr;
+      if (batch->in_buffers[i] == NULL)
+        {
+          batch->in_buffers[i] = buffer_pool_alloc (batch->pool);
+          batch->in_iov[i].iov_base = PACKET_BUFFER_DATA (batch->in_buffers[i]);
+          batch->in_iov[i].iov_len = batch->pool->buffer_size;
+        }
+      hdr->msg_name = &batch->in_addrs[i];
+      hdr->msg_namelen = sizeof (struct sockaddr_storage);
+      hdr->msg_iov = &batch->in_iov[i];
+      hdr->msg_iovlen = 1;
+      hdr->msg_control = NULL;
+      hdr->msg_controllen = 0;
+      hdr->msg_flags = 0;
+    }
+
+  rv = recvmmsg (queue_fd->fd, batch->in_msgs, batch->n_slots, 0, NULL);
+  if (rv < 0)
+    {
+      int e = errno;
+      if (!gsk_errno_is_ignorable (e))
+	g_set_error (error, GSK_G_ERROR_DOMAIN,
+		     gsk_error_code_from_errno (e),
+		     _("packet-queue-read failed: %s"),
+		     g_strerror (e));
+      return FALSE;
+    }
+  batch->in_next = 0;
+  batch->in_count = rv;
+  return TRUE;
+}
+
+static GskPacket *
+batch_read (GskPacketQueueFd *queue_fd,
+            gboolean          save_address,
+            GError          **error)
+{
+  GskPacketQueueFdBatch *batch = queue_fd->batch;
+  GskPacket *packet = NULL;
+
+  ++(batch->n_reads);
+  if (batch->in_next == batch->in_count
+   && !batch_receive (queue_fd, error))
+    return NULL;
+
+  while (packet == NULL && batch->in_next < batch->in_count)
+    {
+      guint i = batch->in_next++;
+      struct mmsghdr *msg = &batch->in_msgs[i];
+      PacketBuffer *pb;
+
+      /* packets too long for our buffers are lost,
+         as the queue is allowed to miss packets */
+      if (msg->msg_hdr.msg_flags & MSG_TRUNC)
+        continue;
+
+      pb = batch->in_buffers[i];
+      batch->in_buffers[i] = NULL;
+      packet = gsk_packet_new (PACKET_BUFFER_DATA (pb), msg->msg_len,
+                               buffer_pool_recycle, pb);
+      if (save_address)
+	{
+	  packet->src_address = gsk_socket_address_from_native (&batch->in_addrs[i],
+                                                                msg->msg_hdr.msg_namelen);
+	  if (packet->src_address == NULL)
+	    {
+	      g_set_error (error, GSK_G_ERROR_DOMAIN,
+			   GSK_ERROR_FOREIGN_ADDRESS,
+			   _("received packet had invalid or unknown address"));
+	      gsk_packet_unref (packet);
+	      packet = NULL;
+              break;
+	    }
+	}
+      if (queue_fd->bound_address != NULL)
+	packet->dst_address = g_object_ref (queue_fd->bound_address);
+    }
+
+  /* make sure the remaining packets are delivered,
+     even if the read-hook stops reading this cycle */
+  gsk_io_set_idle_notify_read (queue_fd, batch->in_next < batch->in_count);
+  return packet;
+}
+
+static void set_poll_write_events (GskPacketQueueFd *queue_fd,
+                                   gboolean          do_poll);
+
+/* Send as many queued packets as possible. */
+static void
+batch_flush (GskPacketQueueFd *queue_fd)
+{
+  GskPacketQueueFdBatch *batch = queue_fd->batch;
+  while (batch->out_next < batch->out_count)
+    {
+      int rv = sendmmsg (queue_fd->fd,
+                         batch->out_msgs + batch->out_next,
+                         batch->out_count - batch->out_next,
+                         0);
+      if (rv < 0)
+        {
+          int e = errno;
+          if (e == EINTR)
+            continue;
+          if (gsk_errno_is_ignorable (e))
+            break;
+
+          /* the error is for the first packet: drop it */
+          if (batch->out_errno == 0)
+            batch->out_errno = e;
+          rv = 1;
+        }
+      while (rv-- > 0)
+        gsk_packet_unref (batch->out_packets[batch->out_next++]);
+    }
+  if (batch->out_next == batch->out_count)
+    batch->out_next = batch->out_count = 0;
+  set_poll_write_events (queue_fd,
+                         queue_fd->poll_write || batch->out_count > 0);
+}
+
+/* Move the unsent packets to the start of the outgoing slots. */
+static void
+batch_compact_outgoing (GskPacketQueueFdBatch *batch)
+{
+  guint n = batch->out_count - batch->out_next;
+  guint i;
+  if (batch->out_next == 0)
+    return;
+  memmove (batch->out_packets, batch->out_packets + batch->out_next,
+           n * sizeof (GskPacket *));
+  memmove (batch->out_addrs, batch->out_addrs + batch->out_next,
+           n * sizeof (struct sockaddr_storage));
+  for (i = 0; i < n; i++)
+    {
+      struct msghdr *hdr = &batch->out_msgs[i].msg_hdr;
+      gboolean has_addr = batch->out_msgs[batch->out_next + i].msg_hdr.msg_name != NULL;
+      hdr->msg_namelen = batch->out_msgs[batch->out_next + i].msg_hdr.msg_namelen;
+      hdr->msg_name = has_addr ? &batch->out_addrs[i] : NULL;
+      batch->out_iov[i] = batch->out_iov[batch->out_next + i];
+      hdr->msg_iov = &batch->out_iov[i];
+    }
+  batch->out_next = 0;
+  batch->out_count = n;
+}
+
+static gboolean
+take_out_error (GskPacketQueueFdBatch *batch,
+                GError               **error)
+{
+  int e = batch->out_errno;
+  if (e == 0)
+    return FALSE;
+  batch->out_errno = 0;
+  g_set_error (error, GSK_G_ERROR_DOMAIN,
+               gsk_error_code_from_errno (e),
+               _("packet-queue-fd-write: %s"),
+               g_strerror (e));
+  return TRUE;
+}
+
+static gboolean
+batch_write (GskPacketQueueFd *queue_fd,
+             GskPacket        *out,
+             GError          **error)
+{
+  GskPacketQueueFdBatch *batch = queue_fd->batch;
+  struct msghdr *hdr;
+  guint i;
+
+  if (take_out_error (batch, error))
+    return FALSE;
+  if (batch->out_count == batch->n_slots)
+    {
+      batch_flush (queue_fd);
+      batch_compact_outgoing (batch);
+      if (batch->out_count == batch->n_slots)
+        return FALSE;           /* would block */
+    }
+
+  i = batch->out_count;
+  hdr = &batch->out_msgs[i].msg_hdr;
+  memset (hdr, 0, sizeof (struct msghdr));
+  if (out->dst_address != NULL)
+    {
+      hdr->msg_namelen = gsk_socket_address_sizeof_native (out->dst_address);
+      if (!gsk_socket_address_to_native (out->dst_address, &batch->out_addrs[i], error))
+	return FALSE;
+      hdr->msg_name = &batch->out_addrs[i];
+    }
+  batch->out_iov[i].iov_base = out->data;
+  batch->out_iov[i].iov_len = out->len;
+  hdr->msg_iov = &batch->out_iov[i];
+  hdr->msg_iovlen = 1;
+  batch->out_packets[i] = gsk_packet_ref (out);
+  batch->out_count++;
+
+  /* outside the read-hook, send at once, so that errors
+     are reported for the packet that caused them. */
+  if (!batch->in_burst)
+    {
+      batch_flush (queue_fd);
+      if (take_out_error (batch, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+#endif  /* USE_BATCHES */
+
+/* Notify the read-hook: for a batched queue,
+   keep notifying until the received packets are all read. */
+static void
+notify_ready_to_read (GskPacketQueueFd *packet_queue_fd)
+{
+#if USE_BATCHES
+  GskPacketQueueFdBatch *batch = packet_queue_fd->batch;
+  if (batch != NULL)
+    {
+      g_object_ref (packet_queue_fd);
+      batch->in_burst = TRUE;
+      for (;;)
+        {
+          guint n_reads = batch->n_reads;
+          gsk_io_notify_ready_to_read (GSK_IO (packet_queue_fd));
+          if (batch->n_reads == n_reads
+           || batch->in_next == batch->in_count
+           || packet_queue_fd->fd < 0)
+            break;
+        }
+      batch->in_burst = FALSE;
+      if (batch->out_count > 0 && packet_queue_fd->fd >= 0)
+        batch_flush (packet_queue_fd);
+      g_object_unref (packet_queue_fd);
+      return;
+    }
+#endif
+  gsk_io_notify_ready_to_read (GSK_IO (packet_queue_fd));
+}
+
+static void
+notify_ready_to_write (GskPacketQueueFd *packet_queue_fd)
+{
+#if USE_BATCHES
+  GskPacketQueueFdBatch *batch = packet_queue_fd->batch;
+  if (batch != NULL && batch->out_count > 0)
+    {
+      batch_flush (packet_queue_fd);
+      if (batch->out_count > 0 || !packet_queue_fd->poll_write)
+        return;
+    }
+#endif
+  gsk_io_notify_ready_to_write (GSK_IO (packet_queue_fd));
+}
+
+
 /* --- queue methods --- */
 static gboolean
 gsk_packet_queue_fd_bind (GskPacketQueue    *queue,
@@ -76,6 +473,10 @@ gsk_packet_queue_fd_read (GskPacketQueue    *queue,
   int rv;
   GskPacket *packet;
   gpointer data;
+#if USE_BATCHES
+  if (queue_fd->batch != NULL)
+    return batch_read (queue_fd, save_address, error);
+#endif
   if (save_address)
     rv = recvfrom (fd, tmp, MAX_UDP_PACKET_SIZE, 0, &addr, &addrlen);
   else
@@ -123,6 +524,10 @@ gsk_packet_queue_fd_write (GskPacketQueue    *queue,
   gpointer native_addr;
   gssize rv;
   int fd = queue_fd->fd;
+#if USE_BATCHES
+  if (queue_fd->batch != NULL)
+    return batch_write (queue_fd, out, error);
+#endif
   if (out->dst_address != NULL)
     {
       native_size = gsk_socket_address_sizeof_native (out->dst_address);
@@ -196,9 +601,9 @@ gsk_packet_queue_fd_source_dispatch (GSource    *source,
   GskPacketQueueFd *packet_queue_fd = fd_source->packet_queue_fd;
   guint events = fd_source->packet_queue_fd->poll_fd.revents;
   if ((events & (G_IO_IN|G_IO_HUP)) != 0)
-    gsk_io_notify_ready_to_read (GSK_IO (packet_queue_fd));
+    notify_ready_to_read (packet_queue_fd);
   if ((events & G_IO_OUT) == G_IO_OUT)
-    gsk_io_notify_ready_to_write (GSK_IO (packet_queue_fd));
+    notify_ready_to_write (packet_queue_fd);
   return TRUE;
 }
 
@@ -249,10 +654,9 @@ gsk_packet_queue_fd_set_poll_read   (GskIO         *io,
 }
 
 static void
-gsk_packet_queue_fd_set_poll_write  (GskIO         *io,
-			             gboolean       do_poll)
+set_poll_write_events (GskPacketQueueFd *packet_queue_fd,
+                       gboolean          do_poll)
 {
-  GskPacketQueueFd *packet_queue_fd = GSK_PACKET_QUEUE_FD (io);
   if (do_poll)
     packet_queue_fd->poll_fd.events |= G_IO_OUT;
   else
@@ -264,9 +668,9 @@ handle_io_event (int fd, GIOCondition events, gpointer data)
 {
   GskPacketQueueFd *packet_queue_fd = GSK_PACKET_QUEUE_FD (data);
   if ((events & (G_IO_IN|G_IO_HUP)) != 0)
-    gsk_io_notify_ready_to_read (GSK_IO (packet_queue_fd));
+    notify_ready_to_read (packet_queue_fd);
   if ((events & G_IO_OUT) == G_IO_OUT)
-    gsk_io_notify_ready_to_write (GSK_IO (packet_queue_fd));
+    notify_ready_to_write (packet_queue_fd);
   return TRUE;
 }
 
@@ -300,10 +704,11 @@ gsk_packet_queue_fd_set_poll_read   (GskIO         *io,
     gsk_source_remove_io_events (packet_queue_fd->source, G_IO_IN);
 }
 static void
-gsk_packet_queue_fd_set_poll_write  (GskIO         *io,
-			             gboolean       do_poll)
+set_poll_write_events (GskPacketQueueFd *packet_queue_fd,
+                       gboolean          do_poll)
 {
-  GskPacketQueueFd *packet_queue_fd = GSK_PACKET_QUEUE_FD (io);
+  if (packet_queue_fd->source == NULL)
+    return;
   if (do_poll)
     gsk_source_add_io_events (packet_queue_fd->source, G_IO_OUT);
   else
@@ -311,6 +716,20 @@ gsk_packet_queue_fd_set_poll_write  (GskIO         *io,
 }
 #endif
 
+static void
+gsk_packet_queue_fd_set_poll_write  (GskIO         *io,
+			             gboolean       do_poll)
+{
+  GskPacketQueueFd *packet_queue_fd = GSK_PACKET_QUEUE_FD (io);
+  packet_queue_fd->poll_write = do_poll;
+#if USE_BATCHES
+  /* keep polling while there are queued packets to send */
+  if (packet_queue_fd->batch != NULL && packet_queue_fd->batch->out_count > 0)
+    do_poll = TRUE;
+#endif
+  set_poll_write_events (packet_queue_fd, do_poll);
+}
+
 static gboolean
 gsk_packet_queue_fd_shutdown_read   (GskIO         *io,
 				     GError       **error)
@@ -423,6 +842,17 @@ gsk_packet_queue_fd_open (GskIO     *io,
   return TRUE;
 }
 
+static void
+gsk_packet_queue_fd_finalize (GObject *object)
+{
+#if USE_BATCHES
+  GskPacketQueueFd *packet_queue_fd = GSK_PACKET_QUEUE_FD (object);
+  if (packet_queue_fd->batch != NULL)
+    batch_free (packet_queue_fd->batch);
+#endif
+  (*parent_class->finalize) (object);
+}
+
 /* --- functions --- */
 static void
 gsk_packet_queue_fd_init (GskPacketQueueFd *packet_queue_fd)
@@ -455,6 +885,7 @@ gsk_packet_queue_fd_class_init (GskPacketQueueFdClass *class)
   io_class->close = gsk_packet_queue_fd_close;
   object_class->get_property = gsk_packet_queue_fd_get_property;
   object_class->set_property = gsk_packet_queue_fd_set_property;
+  object_class->finalize = gsk_packet_queue_fd_finalize;
   pspec = gsk_param_spec_fd ("file-descriptor",
 			     _("File Descriptor"),
 			     _("for reading and/or writing"),
@@ -604,3 +1035,71 @@ gboolean gsk_packet_queue_fd_set_broadcast (GskPacketQueueFd *packet_queue_fd,
     }
   return TRUE;
 }
+
+/**
+ * gsk_packet_queue_fd_set_batch_size:
+ * @packet_queue_fd: the packet-queue to affect.
+ * @n_packets: the number of packets to receive or send per system call,
+ * or 1 to disable batching.
+ * @max_packet_size: the longest packet to receive, or 0 for
+ * the maximum size of a UDP packet.
+ *
+ * Use recvmmsg() and sendmmsg() to transfer many packets per system call.
+ * This is worthwhile for servers which handle many packets per second.
+ *
+ * Received packets are kept in a ring of @n_packets buffers
+ * of @max_packet_size bytes, which are reused once the packets
+ * are destroyed.  Longer packets are dropped.
+ * The read-hook is run repeatedly until all the received packets are read.
+ *
+ * Packets written by the read-hook are sent together after it returns.
+ * An error sending them is returned by the next gsk_packet_queue_write().
+ *
+ * This should not be called when there are unread or unsent packets.
+ * #GskDnsServer calls this for its queue, unless a batch size
+ * has already been set.
+ *
+ * returns: whether the batch size could be set:
+ * batching is not supported on all systems.
+ */
+gboolean
+gsk_packet_queue_fd_set_batch_size (GskPacketQueueFd *packet_queue_fd,
+				    guint             n_packets,
+				    guint             max_packet_size)
+{
+#if USE_BATCHES
+  GskPacketQueueFdBatch *batch = packet_queue_fd->batch;
+  if (batch != NULL)
+    {
+      g_return_val_if_fail (!batch->in_burst, FALSE);
+      g_return_val_if_fail (batch->in_next == batch->in_count, FALSE);
+      g_return_val_if_fail (batch->out_count == 0, FALSE);
+      batch_free (batch);
+      packet_queue_fd->batch = NULL;
+    }
+  if (n_packets <= 1)
+    return TRUE;
+  if (max_packet_size == 0 || max_packet_size > MAX_UDP_PACKET_SIZE)
+    max_packet_size = MAX_UDP_PACKET_SIZE;
+
+  batch = g_new0 (GskPacketQueueFdBatch, 1);
+  batch->n_slots = n_packets;
+  batch->pool = g_new0 (BufferPool, 1);
+  batch->pool->ref_count = 1;
+  batch->pool->has_batch = TRUE;
+  batch->pool->buffer_size = max_packet_size;
+  batch->pool->max_free = n_packets * 2;
+  batch->in_msgs = g_new0 (struct mmsghdr, n_packets);
+  batch->in_iov = g_new0 (struct iovec, n_packets);
+  batch->in_addrs = g_new (struct sockaddr_storage, n_packets);
+  batch->in_buffers = g_new0 (PacketBuffer *, n_packets);
+  batch->out_msgs = g_new0 (struct mmsghdr, n_packets);
+  batch->out_iov = g_new0 (struct iovec, n_packets);
+  batch->out_addrs = g_new (struct sockaddr_storage, n_packets);
+  batch->out_packets = g_new (GskPacket *, n_packets);
+  packet_queue_fd->batch = batch;
+  return TRUE;
+#else
+  return n_packets <= 1;
+#endif
+}
@@ -8,6 +8,7 @@ G_BEGIN_DECLS
 /* --- typedefs --- */
 typedef struct _GskPacketQueueFd GskPacketQueueFd;
 typedef struct _GskPacketQueueFdClass GskPacketQueueFdClass;
+typedef struct _GskPacketQueueFdBatch GskPacketQueueFdBatch;
 /* --- type macros --- */
 GType gsk_packet_queue_fd_get_type(void) G_GNUC_CONST;
 #define GSK_TYPE_PACKET_QUEUE_FD			(gsk_packet_queue_fd_get_type ())
@@ -40,6 +41,10 @@ struct _GskPacketQueueFd
 #else
   GskSource *source;
 #endif
+
+  /*< private >*/
+  guint poll_write : 1;
+  GskPacketQueueFdBatch *batch;
 };
 
 /* --- prototypes --- */
@@ -52,6 +57,11 @@ gboolean gsk_packet_queue_fd_set_broadcast (GskPacketQueueFd *packet_queue_fd,
 					    gboolean          allow_broadcast,
 					    GError          **error);
 
+/* read and write up to n_packets packets per system call */
+gboolean gsk_packet_queue_fd_set_batch_size (GskPacketQueueFd *packet_queue_fd,
+					     guint             n_packets,
+					     guint             max_packet_size);
+
 G_END_DECLS
 
 #endif
@@ -215,6 +215,49 @@ gsk_stream_write_buffer      (GskStream        *stream,
     }
 }
 
+/**
+ * gsk_stream_sendfile:
+ * @stream: the stream to move data out of.
+ * @write_side: the stream to write the data to.
+ * @max_bytes: the maximum number of bytes to move,
+ * or 0 to just find out whether @stream can do this now.
+ * @n_written_out: place to store the number of bytes moved.
+ * @error: optional place to store a GError if something goes wrong.
+ *
+ * Some streams produce data (or some runs of data)
+ * which is really the contents of a regular file;
+ * this function lets such a stream write that data
+ * directly into @write_side using sendfile(2),
+ * instead of copying it through a #GskBuffer.
+ *
+ * This is only useful if @write_side is a #GskStreamFd.
+ * If @stream cannot do this for its next data,
+ * it returns FALSE, and the caller should use
+ * gsk_stream_read() or gsk_stream_read_buffer() instead.
+ *
+ * returns: whether the next data of @stream was (or could be)
+ * moved this way.
+ */
+gboolean
+gsk_stream_sendfile          (GskStream        *stream,
+                              GskStream        *write_side,
+                              guint             max_bytes,
+                              guint            *n_written_out,
+                              GError          **error)
+{
+  GskStreamClass *class = GSK_STREAM_GET_CLASS (stream);
+  gboolean rv;
+  *n_written_out = 0;
+  if (class->raw_sendfile == NULL || GSK_IS_DEBUGGING (STREAM_DATA))
+    return FALSE;
+  if (gsk_io_get_is_connecting (stream))
+    return FALSE;
+  g_object_ref (stream);
+  rv = (*class->raw_sendfile) (stream, write_side, max_bytes, n_written_out, error);
+  g_object_unref (stream);
+  return rv;
+}
+
 /* --- functions --- */
 static void
 gsk_stream_init (GskStream *stream)
@@ -54,6 +54,15 @@ struct _GskStreamClass
   guint      (*raw_write_buffer)(GskStream    *stream,
 				 GskBuffer     *buffer,
 				 GError       **error);
+
+  /* optional: hand the next data straight to a file-descriptor
+     stream, without copying it through a buffer.
+     See gsk_stream_sendfile(). */
+  gboolean   (*raw_sendfile)    (GskStream     *stream,
+                                 GskStream     *write_side,
+                                 guint          max_bytes,
+                                 guint         *n_written_out,
+                                 GError       **error);
 };
 
 struct _GskStream 
@@ -86,6 +95,14 @@ gsize    gsk_stream_write_buffer      (GskStream        *stream,
 		                       GskBuffer        *buffer,
 		                       GError          **error);
 
+/* move data from a stream into a GskStreamFd without copying it,
+   if the stream can (see GskStreamConnection) */
+gboolean gsk_stream_sendfile          (GskStream        *stream,
+                                       GskStream        *write_side,
+                                       guint             max_bytes,
+                                       guint            *n_written_out,
+                                       GError          **error);
+
 /* connections from the output of one stream to the input of another. */
 gboolean gsk_stream_attach            (GskStream        *input_stream,
                                        GskStream        *output_stream,
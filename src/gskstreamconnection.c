@@ -1,6 +1,12 @@
+#define _GNU_SOURCE             /* for F_SETPIPE_SZ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "gskstreamconnection.h"
+#include "gskstreamfd.h"
 #include "gskerror.h"
 #include "gskghelpers.h"
+#include "gskutils.h"
 #include "gskmacros.h"
 
 static GObjectClass *parent_class = NULL;
@@ -21,12 +27,30 @@ struct _GskStreamConnectionClass
  *   block the readable side of this connection.
  * - If a buffer overflow occurs (the number of buffered bytes greater than max_buffered),
  *   block the writable side of this connection.
+ * - If both ends are plain file-descriptors, move the data
+ *   with sendfile() or splice() instead of through the buffer:
+ *   - sendfile: the read-side (a regular file) is kept blocked;
+ *     whenever the write-side is writable, we send the next chunk of the file.
+ *   - splice: data is spliced from the read-side into a pipe,
+ *     and from the pipe to the write-side; the pipe plays the role of the buffer.
+ * - If only the write-side is a file-descriptor, the read-side
+ *   may still have runs of data which come from a regular file
+ *   (for example, an http-server sending a file as its response body).
+ *   While gsk_stream_sendfile() says that it does, we treat it
+ *   like the sendfile case above, but let the read-side do the sendfile().
  */
 
 #define DEFAULT_MAX_BUFFERED		4096
 #define DEFAULT_MAX_ATOMIC_READ		4096
 #define MAX_READ_ON_STACK		8192
 
+/* maximum number of bytes to move per sendfile() or splice() */
+#define ZERO_COPY_CHUNK_SIZE		65536
+
+/* the capacity to ask for a splice pipe to have;
+   this is also the default capacity of a pipe on linux */
+#define SPLICE_PIPE_CAPACITY		65536
+
 /* runtime-able? */
 #if 0
 #define DEBUG(args) g_message args
@@ -71,11 +95,27 @@ stream_connection_set_internal_read_block (GskStreamConnection *stream_connectio
       gsk_io_unblock_read (GSK_IO (stream_connection->read_side));
     }
 }
+static inline guint
+get_n_buffered (GskStreamConnection *stream_connection)
+{
+  return stream_connection->buffer.size + stream_connection->splice_pipe_size;
+}
+
 static inline void
 check_internal_blocks (GskStreamConnection *stream_connection)
 {
-  guint size = stream_connection->buffer.size;
-  stream_connection_set_internal_read_block (stream_connection, size > stream_connection->max_buffered);
+  guint size = get_n_buffered (stream_connection);
+  if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_SENDFILE
+   || stream_connection->read_side_sendfile)
+    {
+      /* The file is only read from the write-side's handler. */
+      stream_connection_set_internal_read_block (stream_connection, TRUE);
+      stream_connection_set_internal_write_block (stream_connection, FALSE);
+      return;
+    }
+  stream_connection_set_internal_read_block (stream_connection,
+                                             size > stream_connection->max_buffered
+                                          || stream_connection->splice_pipe_size >= stream_connection->splice_pipe_capacity);
   stream_connection_set_internal_write_block (stream_connection, size == 0);
 }
 
@@ -137,7 +177,7 @@ guint    gsk_stream_connection_get_max_buffered   (GskStreamConnection *connecti
  */
 guint    gsk_stream_connection_get_cur_buffered   (GskStreamConnection *connection)
 {
-  return connection->buffer.size;
+  return get_n_buffered (connection);
 }
 
 
@@ -188,6 +228,40 @@ handle_input_is_readable (GskIO         *io,
 
   D (io, "handle_input_is_readable");
 
+  if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_SPLICE)
+    {
+      guint max_read = stream_connection->splice_pipe_capacity - stream_connection->splice_pipe_size;
+      if (max_read > ZERO_COPY_CHUNK_SIZE)
+        max_read = ZERO_COPY_CHUNK_SIZE;
+      num_read = gsk_stream_fd_splice_to_pipe (GSK_STREAM_FD (read_side),
+                                               stream_connection->splice_pipe[1],
+                                               max_read, &error);
+      if (error != NULL)
+        {
+          handle_error (stream_connection, error);
+          return TRUE;
+        }
+      stream_connection->splice_pipe_size += num_read;
+      check_internal_blocks (stream_connection);
+      return TRUE;
+    }
+
+  if (stream_connection->try_read_side_sendfile)
+    {
+      /* Only ask:  the data is sent by handle_output_is_writable(). */
+      if (gsk_stream_sendfile (read_side, write_side, 0, &num_read, &error))
+        {
+          stream_connection->read_side_sendfile = 1;
+          check_internal_blocks (stream_connection);
+          return TRUE;
+        }
+      if (error != NULL)
+        {
+          handle_error (stream_connection, error);
+          return TRUE;
+        }
+    }
+
   /* TODO: too harsh a penalty for big atomic reads...
    * maybe we should cache a big one.
    */
@@ -265,7 +339,7 @@ handle_input_shutdown_read (GskIO     *io,
   if (stream_connection->write_side != NULL)
     {
       GError *error = NULL;
-      if (stream_connection->buffer.size == 0)
+      if (get_n_buffered (stream_connection) == 0)
 	{
 	  if (!gsk_io_write_shutdown (GSK_IO (stream_connection->write_side), &error)
 	      && error != NULL)
@@ -298,7 +372,6 @@ handle_output_is_writable (GskIO         *io,
 {
   GskStreamConnection *stream_connection = data;
   GskStream *write_side = stream_connection->write_side;
-  GskStream *read_side = stream_connection->read_side;
   GError *error = NULL;
   g_return_val_if_fail (write_side == GSK_STREAM (io), FALSE);
 
@@ -321,8 +394,57 @@ handle_output_is_writable (GskIO         *io,
 	  return TRUE;
 	}
     }
-  if (stream_connection->buffer.size == 0
-   && read_side == NULL)
+  if (stream_connection->splice_pipe_size > 0)
+    {
+      guint n_written;
+      n_written = gsk_stream_fd_splice_from_pipe (GSK_STREAM_FD (write_side),
+                                                  stream_connection->splice_pipe[0],
+                                                  stream_connection->splice_pipe_size,
+                                                  &error);
+      if (error)
+	{
+	  handle_error (stream_connection, error);
+	  return TRUE;
+	}
+      stream_connection->splice_pipe_size -= n_written;
+    }
+  if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_SENDFILE
+   && stream_connection->buffer.size == 0
+   && stream_connection->read_side != NULL)
+    {
+      /* May read-shutdown the file, which will clear read_side. */
+      gsk_stream_fd_sendfile (GSK_STREAM_FD (write_side),
+                              GSK_STREAM_FD (stream_connection->read_side),
+                              ZERO_COPY_CHUNK_SIZE,
+                              &error);
+      if (error)
+	{
+	  handle_error (stream_connection, error);
+	  return TRUE;
+	}
+    }
+  if (stream_connection->read_side_sendfile
+   && stream_connection->buffer.size == 0
+   && stream_connection->read_side != NULL)
+    {
+      guint n_written;
+      /* After each chunk, ask whether there is more file data;
+         if not, go back to reading from the read-side normally. */
+      if (!gsk_stream_sendfile (stream_connection->read_side, write_side,
+                                ZERO_COPY_CHUNK_SIZE, &n_written, &error)
+       || (error == NULL
+        && (stream_connection->read_side == NULL
+         || !gsk_stream_sendfile (stream_connection->read_side, write_side,
+                                  0, &n_written, &error))))
+        stream_connection->read_side_sendfile = 0;
+      if (error)
+	{
+	  handle_error (stream_connection, error);
+	  return TRUE;
+	}
+    }
+  if (get_n_buffered (stream_connection) == 0
+   && stream_connection->read_side == NULL)
     {
       if (!gsk_io_write_shutdown (GSK_IO (stream_connection->write_side), &error)
 	  && error != NULL)
@@ -381,6 +503,11 @@ gsk_stream_connection_finalize (GObject *object)
 {
   GskStreamConnection *connection = GSK_STREAM_CONNECTION (object);
   gsk_buffer_destruct (&connection->buffer);
+  if (connection->splice_pipe[0] >= 0)
+    {
+      close (connection->splice_pipe[0]);
+      close (connection->splice_pipe[1]);
+    }
   parent_class->finalize (object);
 }
 
@@ -390,6 +517,9 @@ gsk_stream_connection_init (GskStreamConnection *stream_connection)
   stream_connection->max_buffered = DEFAULT_MAX_BUFFERED;
   stream_connection->atomic_read_size = DEFAULT_MAX_ATOMIC_READ;
   gsk_buffer_construct (&stream_connection->buffer);
+  stream_connection->transfer_mode = GSK_STREAM_FD_TRANSFER_BUFFERED;
+  stream_connection->splice_pipe[0] = -1;
+  stream_connection->splice_pipe[1] = -1;
 }
 
 static void
@@ -424,6 +554,24 @@ GType gsk_stream_connection_get_type()
   return stream_connection_type;
 }
 
+/* Try to give a splice pipe SPLICE_PIPE_CAPACITY bytes,
+   and find out how many it really holds:  it may have less
+   once the user has many pipes (see pipe(7)). */
+static guint
+get_splice_pipe_capacity (int fd)
+{
+#ifdef F_GETPIPE_SZ
+  int capacity;
+  if (fcntl (fd, F_GETPIPE_SZ) < SPLICE_PIPE_CAPACITY)
+    fcntl (fd, F_SETPIPE_SZ, SPLICE_PIPE_CAPACITY);
+  capacity = fcntl (fd, F_GETPIPE_SZ);
+  if (capacity > 0)
+    return capacity;
+#endif
+  /* kernels without F_GETPIPE_SZ have fixed 64k pipes */
+  return SPLICE_PIPE_CAPACITY;
+}
+
 /**
  * gsk_stream_connection_new:
  * @input_stream: the input stream whose read-end will be trapped.
@@ -434,6 +582,12 @@ GType gsk_stream_connection_get_type()
  * to the write end of @output_stream,
  * returning an error if anything goes wrong.
  *
+ * If both streams are plain #GskStreamFd's,
+ * the data will be moved with sendfile() or splice()
+ * when possible, rather than being copied through a buffer.
+ * If only @output_stream is, @input_stream may still
+ * send parts of its data with gsk_stream_sendfile().
+ *
  * returns: a reference at the connection.
  * You should use eventually call g_object_unref() on the connection.
  */
@@ -480,6 +634,32 @@ gsk_stream_connection_new   (GskStream        *input_stream,
   if (GSK_STREAM_GET_CLASS (input_stream)->raw_read_buffer != NULL)
     stream_connection->use_read_buffer = 1;
 
+  stream_connection->transfer_mode = gsk_stream_fd_get_transfer_mode (input_stream, output_stream);
+  if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_SPLICE)
+    {
+      if (pipe (stream_connection->splice_pipe) < 0)
+        {
+          gsk_g_debug ("stream-attach: making splice pipe: %s", g_strerror (errno));
+          stream_connection->splice_pipe[0] = -1;
+          stream_connection->splice_pipe[1] = -1;
+          stream_connection->transfer_mode = GSK_STREAM_FD_TRANSFER_BUFFERED;
+        }
+      else
+        {
+          gsk_fd_set_nonblocking (stream_connection->splice_pipe[0]);
+          gsk_fd_set_nonblocking (stream_connection->splice_pipe[1]);
+          gsk_fd_set_close_on_exec (stream_connection->splice_pipe[0], TRUE);
+          gsk_fd_set_close_on_exec (stream_connection->splice_pipe[1], TRUE);
+          stream_connection->splice_pipe_capacity = get_splice_pipe_capacity (stream_connection->splice_pipe[1]);
+        }
+    }
+  if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_SENDFILE)
+    check_internal_blocks (stream_connection);
+  else if (stream_connection->transfer_mode == GSK_STREAM_FD_TRANSFER_BUFFERED
+        && GSK_STREAM_GET_CLASS (input_stream)->raw_sendfile != NULL
+        && GSK_IS_STREAM_FD (output_stream))
+    stream_connection->try_read_side_sendfile = 1;
+
   return stream_connection;
 }
 
@@ -50,6 +50,18 @@ struct _GskStreamConnection
      both max_buffered and atomic_read_size to be violated. */
   guint use_read_buffer : 1;
 
+  /* How data is moved from read_side to write_side:
+     a GskStreamFdTransferMode.  Anything but BUFFERED
+     bypasses 'buffer' and moves the data inside the kernel. */
+  guint transfer_mode : 2;
+
+  /* Whether the read-side may be able to write its data
+     to write_side itself, with gsk_stream_sendfile(),
+     and whether it is doing so now.  Like sendfile transfers,
+     that is driven by the write-side's handler. */
+  guint try_read_side_sendfile : 1;
+  guint read_side_sendfile : 1;
+
   /* Data which is to be transferred from read_side to write_side,
      which hasn't been processed on the write side. */
   GskBuffer buffer;
@@ -59,6 +71,13 @@ struct _GskStreamConnection
 
   /* The maximum number of bytes to read atomically from the input stream. */
   guint atomic_read_size;
+
+  /* For splice() transfers:  a pipe containing data
+     which has been read but not yet written, the number of bytes in it,
+     and the number of bytes it can hold. */
+  int splice_pipe[2];
+  guint splice_pipe_size;
+  guint splice_pipe_capacity;
 };
 
 G_END_DECLS
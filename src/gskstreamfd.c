@@ -1,3 +1,4 @@
+#define _GNU_SOURCE             /* for splice() */
 #include "config.h"
 #include <errno.h>
 #include <fcntl.h>
@@ -5,6 +6,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "gskghelpers.h"
 #include "gskutils.h"
 #include "gskstreamfd.h"
@@ -1136,3 +1140,209 @@ gboolean    gsk_stream_fd_duplex_pipe_fd (GskStream     **side_a_out,
   *side_b_fd_out = fds[1];
   return TRUE;
 }
+
+/* --- zero-copy transfers --- */
+static gboolean
+can_transfer_directly (GskStream *stream)
+{
+  GskStreamFd *stream_fd;
+
+  /* Subclasses (and any filters stacked on top of us)
+     may transform the data, so only a bare GskStreamFd qualifies. */
+  if (G_OBJECT_TYPE (stream) != GSK_TYPE_STREAM_FD)
+    return FALSE;
+  stream_fd = GSK_STREAM_FD (stream);
+  return stream_fd->fd >= 0
+      && !stream_fd->is_resolving_name
+      && !gsk_stream_get_is_connecting (stream);
+}
+
+/**
+ * gsk_stream_fd_get_transfer_mode:
+ * @read_side: the stream that data will be read from.
+ * @write_side: the stream that data will be written to.
+ *
+ * Figure out whether data can be moved from @read_side
+ * to @write_side without copying it through userspace.
+ *
+ * A regular file may be sent to a pollable file-descriptor
+ * using sendfile(2); two pollable file-descriptors may
+ * be connected by splice(2) through an intermediate pipe.
+ * Anything else (including any stream that is not exactly a GskStreamFd,
+ * such as an SSL or zlib stream) must be buffered.
+ *
+ * returns: how to transfer data between the two streams.
+ */
+GskStreamFdTransferMode
+gsk_stream_fd_get_transfer_mode (GskStream *read_side,
+                                 GskStream *write_side)
+{
+  GskStreamFd *in;
+  GskStreamFd *out;
+  if (!can_transfer_directly (read_side) || !can_transfer_directly (write_side))
+    return GSK_STREAM_FD_TRANSFER_BUFFERED;
+  in = GSK_STREAM_FD (read_side);
+  out = GSK_STREAM_FD (write_side);
+  if (!out->is_pollable)
+    return GSK_STREAM_FD_TRANSFER_BUFFERED;
+#if HAVE_SENDFILE
+  if (!in->is_pollable)
+    {
+      struct stat stat_buf;
+      if (fstat (in->fd, &stat_buf) == 0 && S_ISREG (stat_buf.st_mode))
+        return GSK_STREAM_FD_TRANSFER_SENDFILE;
+      return GSK_STREAM_FD_TRANSFER_BUFFERED;
+    }
+#endif
+#if HAVE_SPLICE
+  if (in->is_pollable)
+    return GSK_STREAM_FD_TRANSFER_SPLICE;
+#endif
+  return GSK_STREAM_FD_TRANSFER_BUFFERED;
+}
+
+/* Common error handling for the zero-copy calls,
+   which mirrors that of raw_read and raw_write. */
+static void
+handle_transfer_errno (GskStreamFd *stream_fd,
+                       int          e,
+                       const char  *op,
+                       GError     **error)
+{
+  if (e == ECONNRESET || e == EPIPE)
+    {
+      gsk_io_notify_shutdown (GSK_IO (stream_fd));
+      return;
+    }
+  g_set_error (error, GSK_G_ERROR_DOMAIN,
+	       gsk_error_code_from_errno (e),
+	       "error doing %s on fd %d: %s",
+	       op, stream_fd->fd, g_strerror (e));
+  gsk_io_notify_shutdown (GSK_IO (stream_fd));
+}
+
+/**
+ * gsk_stream_fd_sendfile:
+ * @write_side: the stream to write to; usually a socket.
+ * @read_side: the stream to read from; must be a regular file.
+ * @max_bytes: maximum number of bytes to transfer.
+ * @error: optional error return location.
+ *
+ * Copy data from the current offset of @read_side's file
+ * directly into @write_side, using sendfile(2).
+ * If the end of the file is reached, @read_side is read-shutdown.
+ *
+ * This should only be used if gsk_stream_fd_get_transfer_mode()
+ * returned GSK_STREAM_FD_TRANSFER_SENDFILE.
+ *
+ * returns: the number of bytes transferred.
+ */
+guint
+gsk_stream_fd_sendfile (GskStreamFd *write_side,
+                        GskStreamFd *read_side,
+                        guint        max_bytes,
+                        GError     **error)
+{
+#if HAVE_SENDFILE
+  ssize_t rv;
+  if (write_side->fd < 0 || read_side->fd < 0)
+    return 0;
+  rv = sendfile (write_side->fd, read_side->fd, NULL, max_bytes);
+  if (rv < 0)
+    {
+      gint e = errno;
+      if (gsk_errno_is_ignorable (e))
+	return 0;
+      handle_transfer_errno (write_side, e, "sendfile", error);
+      return 0;
+    }
+  if (rv == 0 && max_bytes > 0)
+    gsk_io_notify_read_shutdown (GSK_IO (read_side));
+  return (guint) rv;
+#else
+  g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FUNCTION_NOT_IMPLEMENTED,
+               "sendfile not available");
+  return 0;
+#endif
+}
+
+/**
+ * gsk_stream_fd_splice_to_pipe:
+ * @read_side: the stream to read from.
+ * @pipe_fd: the write end of a pipe.
+ * @max_bytes: maximum number of bytes to transfer.
+ * @error: optional error return location.
+ *
+ * Move data from @read_side into a pipe using splice(2).
+ * If @read_side reaches end-of-file, it is read-shutdown.
+ *
+ * returns: the number of bytes moved into the pipe.
+ */
+guint
+gsk_stream_fd_splice_to_pipe (GskStreamFd *read_side,
+                              int          pipe_fd,
+                              guint        max_bytes,
+                              GError     **error)
+{
+#if HAVE_SPLICE
+  ssize_t rv;
+  if (read_side->fd < 0)
+    return 0;
+  rv = splice (read_side->fd, NULL, pipe_fd, NULL, max_bytes,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv < 0)
+    {
+      gint e = errno;
+      if (gsk_errno_is_ignorable (e))
+	return 0;
+      handle_transfer_errno (read_side, e, "splice", error);
+      return 0;
+    }
+  if (rv == 0 && max_bytes > 0)
+    gsk_io_notify_read_shutdown (GSK_IO (read_side));
+  return (guint) rv;
+#else
+  g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FUNCTION_NOT_IMPLEMENTED,
+               "splice not available");
+  return 0;
+#endif
+}
+
+/**
+ * gsk_stream_fd_splice_from_pipe:
+ * @write_side: the stream to write to.
+ * @pipe_fd: the read end of a pipe.
+ * @max_bytes: maximum number of bytes to transfer.
+ * @error: optional error return location.
+ *
+ * Move data out of a pipe into @write_side using splice(2).
+ *
+ * returns: the number of bytes moved out of the pipe.
+ */
+guint
+gsk_stream_fd_splice_from_pipe (GskStreamFd *write_side,
+                                int          pipe_fd,
+                                guint        max_bytes,
+                                GError     **error)
+{
+#if HAVE_SPLICE
+  ssize_t rv;
+  if (write_side->fd < 0)
+    return 0;
+  rv = splice (pipe_fd, NULL, write_side->fd, NULL, max_bytes,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv < 0)
+    {
+      gint e = errno;
+      if (gsk_errno_is_ignorable (e))
+	return 0;
+      handle_transfer_errno (write_side, e, "splice", error);
+      return 0;
+    }
+  return (guint) rv;
+#else
+  g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FUNCTION_NOT_IMPLEMENTED,
+               "splice not available");
+  return 0;
+#endif
+}
@@ -105,6 +105,30 @@ gboolean    gsk_stream_fd_duplex_pipe_fd (GskStream     **side_a_out,
                                           int            *side_b_fd_out,
 			                  GError        **error);
 
+/* zero-copy transfers, used by GskStreamConnection */
+typedef enum
+{
+  GSK_STREAM_FD_TRANSFER_BUFFERED,
+  GSK_STREAM_FD_TRANSFER_SENDFILE,
+  GSK_STREAM_FD_TRANSFER_SPLICE
+} GskStreamFdTransferMode;
+
+GskStreamFdTransferMode
+            gsk_stream_fd_get_transfer_mode (GskStream   *read_side,
+                                             GskStream   *write_side);
+guint       gsk_stream_fd_sendfile          (GskStreamFd *write_side,
+                                             GskStreamFd *read_side,
+                                             guint        max_bytes,
+                                             GError     **error);
+guint       gsk_stream_fd_splice_to_pipe    (GskStreamFd *read_side,
+                                             int          pipe_fd,
+                                             guint        max_bytes,
+                                             GError     **error);
+guint       gsk_stream_fd_splice_from_pipe  (GskStreamFd *write_side,
+                                             int          pipe_fd,
+                                             guint        max_bytes,
+                                             GError     **error);
+
 G_END_DECLS
 
 #endif
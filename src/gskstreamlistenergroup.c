@@ -0,0 +1,429 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "gskstreamlistenergroup.h"
+#include "gskstreamlistenersocket.h"
+#include "gskerrno.h"
+#include "gskerror.h"
+#include "gskghelpers.h"
+#include "gskutils.h"
+#include "gskinit.h"
+#include "gskmacros.h"
+#include "config.h"
+
+/*
+ * strategy:
+ * - All listening sockets are created and bound by gsk_stream_listener_group_new(),
+ *   so that errors are reported synchronously.
+ * - Each worker thread wraps its socket in a GskStreamListenerSocket:
+ *   since that is created in the worker, it (and every stream it accepts)
+ *   uses the worker's gsk_main_loop_default().
+ * - With SO_REUSEPORT, each worker has its own socket and the kernel
+ *   distributes the connections.  Otherwise, each worker gets a dup()
+ *   of the same socket; the losers of the race to accept() get EAGAIN.
+ * - To stop, a byte is written to each worker's wakeup pipe.
+ */
+
+typedef struct _Worker Worker;
+struct _Worker
+{
+  GskStreamListenerGroup *group;
+  guint index;
+  GThread *thread;
+  GskMainLoop *main_loop;
+
+  /* owned by the worker's listener once it has started */
+  int listen_fd;
+
+  int wakeup_read_fd;
+  int wakeup_write_fd;
+};
+
+struct _GskStreamListenerGroup
+{
+  guint n_workers;
+  Worker *workers;
+
+  GskStreamListenerGroupSetupFunc setup;
+  gpointer setup_data;
+
+  GMutex *lock;
+  GCond *started_cond;
+  guint n_started;
+};
+
+/* --- creating the listening sockets --- */
+static int
+make_listening_fd (GskSocketAddress      *address,
+                   const struct sockaddr *addr,
+                   socklen_t              addr_len,
+                   gboolean               reuse_port,
+                   GError               **error)
+{
+  int one = 1;
+  int fd;
+  const char *op;
+  int e;
+  char *addr_str;
+
+  fd = socket (gsk_socket_address_protocol_family (address), SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      op = "socket";
+      goto failed;
+    }
+  gsk_fd_set_close_on_exec (fd, TRUE);
+  if (!GSK_IS_SOCKET_ADDRESS_LOCAL (address))
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+#ifdef SO_REUSEPORT
+  if (reuse_port
+   && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0)
+    {
+      op = "setsockopt(SO_REUSEPORT)";
+      goto failed;
+    }
+#endif
+  if (bind (fd, addr, addr_len) < 0)
+    {
+      op = "bind";
+      goto failed;
+    }
+  if (listen (fd, SOMAXCONN) < 0)
+    {
+      op = "listen";
+      goto failed;
+    }
+  gsk_fd_set_nonblocking (fd);
+  return fd;
+
+failed:
+  e = errno;
+  if (fd >= 0)
+    close (fd);
+  addr_str = gsk_socket_address_to_string (address);
+  g_set_error (error, GSK_G_ERROR_DOMAIN,
+               gsk_error_code_from_errno (e),
+               _("%s(2) failed when creating a listener group (%s): %s"),
+               op, addr_str, g_strerror (e));
+  g_free (addr_str);
+  return -1;
+}
+
+/* --- worker threads --- */
+static gboolean
+handle_wakeup (int fd, GIOCondition condition, gpointer data)
+{
+  Worker *worker = data;
+  char buf[16];
+  int rv = read (fd, buf, sizeof (buf));
+  if (rv < 0)
+    {
+      int e = errno;
+      if (gsk_errno_is_ignorable (e))
+        return TRUE;            /* spurious wakeup */
+
+      /* nothing else will stop the worker:  quit anyway */
+      g_warning ("listener group: worker %u: error reading wakeup pipe: %s",
+                 worker->index, g_strerror (e));
+    }
+  gsk_main_loop_quit (worker->main_loop);
+  return TRUE;
+}
+
+static gpointer
+worker_thread_func (gpointer data)
+{
+  Worker *worker = data;
+  GskStreamListenerGroup *group = worker->group;
+  GskMainLoop *main_loop = gsk_main_loop_default ();
+  GskStreamListener *listener;
+  GskSource *wakeup_source;
+  GError *error = NULL;
+
+  worker->main_loop = main_loop;
+  wakeup_source = gsk_main_loop_add_io (main_loop, worker->wakeup_read_fd,
+                                        G_IO_IN, handle_wakeup, worker, NULL);
+  listener = gsk_stream_listener_socket_new_from_fd (worker->listen_fd, &error);
+  if (listener == NULL)
+    {
+      g_warning ("listener group: worker %u: %s",
+                 worker->index, error ? error->message : "unknown error");
+      if (error)
+        g_error_free (error);
+    }
+  else
+    {
+      worker->listen_fd = -1;
+      (*group->setup) (listener, worker->index, group->setup_data);
+    }
+
+  g_mutex_lock (group->lock);
+  group->n_started++;
+  g_cond_signal (group->started_cond);
+  g_mutex_unlock (group->lock);
+
+  while (gsk_main_loop_should_continue (main_loop))
+    gsk_main_loop_run (main_loop, -1, NULL);
+
+  gsk_source_remove (wakeup_source);
+  if (listener != NULL)
+    g_object_unref (listener);
+  return NULL;
+}
+
+/**
+ * gsk_stream_listener_group_new:
+ * @address: the address to listen on.
+ * @n_workers: the number of threads which should accept and handle connections.
+ * @flags: whether to use SO_REUSEPORT.
+ * @setup: function that will be called in each worker thread
+ * with that worker's listener, typically to call gsk_stream_listener_handle_accept().
+ * @setup_data: data to pass to @setup.
+ * @error: optional error return location.
+ *
+ * Start @n_workers threads that each accept connections on @address
+ * in their own #GskMainLoop.  Streams accepted by a worker
+ * stay in that worker's thread, so @setup and all the handlers
+ * it installs run in the worker thread, concurrently with the others.
+ *
+ * GSK must have been initialized with thread support.
+ *
+ * returns: the new listener group, or NULL on error.
+ */
+GskStreamListenerGroup *
+gsk_stream_listener_group_new (GskSocketAddress               *address,
+                               guint                           n_workers,
+                               GskStreamListenerGroupFlags     flags,
+                               GskStreamListenerGroupSetupFunc setup,
+                               gpointer                        setup_data,
+                               GError                        **error)
+{
+  GskStreamListenerGroup *group;
+  gboolean reuse_port = FALSE;
+  guint sizeof_addr;
+  struct sockaddr *addr;
+  socklen_t bound_addr_len;
+  guint i;
+
+  g_return_val_if_fail (GSK_IS_SOCKET_ADDRESS (address), NULL);
+  g_return_val_if_fail (n_workers > 0, NULL);
+  g_return_val_if_fail (setup != NULL, NULL);
+
+  if (!gsk_init_get_support_threads ())
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_STATE,
+                   "listener groups require gsk to be initialized with thread support");
+      return NULL;
+    }
+
+#ifdef SO_REUSEPORT
+  if ((flags & GSK_STREAM_LISTENER_GROUP_REUSE_PORT) != 0
+   && (GSK_IS_SOCKET_ADDRESS_IPV4 (address) || GSK_IS_SOCKET_ADDRESS_IPV6 (address)))
+    reuse_port = TRUE;
+#endif
+
+  sizeof_addr = gsk_socket_address_sizeof_native (address);
+  addr = g_alloca (MAX (sizeof_addr, sizeof (struct sockaddr_storage)));
+  if (!gsk_socket_address_to_native (address, addr, error))
+    return NULL;
+  if (GSK_IS_SOCKET_ADDRESS_LOCAL (address))
+    _gsk_socket_address_local_maybe_delete_stale_socket (address);
+
+  group = g_new0 (GskStreamListenerGroup, 1);
+  group->n_workers = n_workers;
+  group->workers = g_new0 (Worker, n_workers);
+  group->setup = setup;
+  group->setup_data = setup_data;
+  for (i = 0; i < n_workers; i++)
+    {
+      group->workers[i].listen_fd = -1;
+      group->workers[i].wakeup_read_fd = -1;
+      group->workers[i].wakeup_write_fd = -1;
+    }
+
+  for (i = 0; i < n_workers; i++)
+    {
+      Worker *worker = group->workers + i;
+      int pipe_fds[2];
+      worker->group = group;
+      worker->index = i;
+      if (i == 0 || reuse_port)
+        {
+          worker->listen_fd = make_listening_fd (address, addr, sizeof_addr,
+                                                 reuse_port, error);
+          if (worker->listen_fd < 0)
+            goto failed;
+          if (i == 0)
+            {
+              /* If the port was chosen by the kernel,
+                 make sure everyone binds to the same one. */
+              bound_addr_len = MAX (sizeof_addr, sizeof (struct sockaddr_storage));
+              if (getsockname (worker->listen_fd, addr, &bound_addr_len) == 0)
+                sizeof_addr = bound_addr_len;
+            }
+        }
+      else
+        {
+          worker->listen_fd = dup (group->workers[0].listen_fd);
+          if (worker->listen_fd < 0)
+            {
+              gsk_errno_fd_creation_failed ();
+              g_set_error (error, GSK_G_ERROR_DOMAIN,
+                           gsk_error_code_from_errno (errno),
+                           "error duplicating listening socket: %s",
+                           g_strerror (errno));
+              goto failed;
+            }
+          gsk_fd_set_close_on_exec (worker->listen_fd, TRUE);
+        }
+
+      if (pipe (pipe_fds) < 0)
+        {
+          gsk_errno_fd_creation_failed ();
+          g_set_error (error, GSK_G_ERROR_DOMAIN,
+                       gsk_error_code_from_errno (errno),
+                       "error creating wakeup pipe: %s",
+                       g_strerror (errno));
+          goto failed;
+        }
+      worker->wakeup_read_fd = pipe_fds[0];
+      worker->wakeup_write_fd = pipe_fds[1];
+      gsk_fd_set_nonblocking (worker->wakeup_read_fd);
+      gsk_fd_set_close_on_exec (worker->wakeup_read_fd, TRUE);
+      gsk_fd_set_close_on_exec (worker->wakeup_write_fd, TRUE);
+    }
+
+  /* start the workers and wait until they are all accepting */
+  group->lock = g_mutex_new ();
+  group->started_cond = g_cond_new ();
+  for (i = 0; i < n_workers; i++)
+    {
+      Worker *worker = group->workers + i;
+      worker->thread = g_thread_create (worker_thread_func, worker, TRUE, error);
+      if (worker->thread == NULL)
+        {
+          guint j;
+          for (j = i; j < n_workers; j++)
+            {
+              close (group->workers[j].listen_fd);
+              close (group->workers[j].wakeup_read_fd);
+              close (group->workers[j].wakeup_write_fd);
+            }
+          group->n_workers = i;
+          gsk_stream_listener_group_destroy (group);
+          return NULL;
+        }
+    }
+  g_mutex_lock (group->lock);
+  while (group->n_started < n_workers)
+    g_cond_wait (group->started_cond, group->lock);
+  g_mutex_unlock (group->lock);
+
+  return group;
+
+failed:
+  for (i = 0; i < n_workers; i++)
+    {
+      Worker *worker = group->workers + i;
+      if (worker->listen_fd >= 0)
+        close (worker->listen_fd);
+      if (worker->wakeup_read_fd >= 0)
+        close (worker->wakeup_read_fd);
+      if (worker->wakeup_write_fd >= 0)
+        close (worker->wakeup_write_fd);
+    }
+  g_free (group->workers);
+  g_free (group);
+  return NULL;
+}
+
+/**
+ * gsk_stream_listener_group_get_n_workers:
+ * @group: the listener group to query.
+ *
+ * Get the number of worker threads in the group.
+ *
+ * returns: the number of workers.
+ */
+guint
+gsk_stream_listener_group_get_n_workers (GskStreamListenerGroup *group)
+{
+  return group->n_workers;
+}
+
+/**
+ * gsk_stream_listener_group_peek_main_loop:
+ * @group: the listener group to query.
+ * @worker_index: which worker's main-loop to return.
+ *
+ * Get the main-loop that a worker is running.
+ * It must only be used from that worker's thread,
+ * except to call gsk_main_loop_quit().
+ *
+ * returns: the worker's main-loop.
+ */
+GskMainLoop *
+gsk_stream_listener_group_peek_main_loop (GskStreamListenerGroup *group,
+                                          guint                   worker_index)
+{
+  g_return_val_if_fail (worker_index < group->n_workers, NULL);
+  return group->workers[worker_index].main_loop;
+}
+
+/* Tell a worker to stop.  The pipe is empty until now,
+   so the byte always fits. */
+static void
+wake_worker (Worker *worker)
+{
+  static const char byte = 0;
+  while (write (worker->wakeup_write_fd, &byte, 1) < 0)
+    {
+      if (errno != EINTR)
+        {
+          g_warning ("listener group: worker %u: error writing wakeup pipe: %s",
+                     worker->index, g_strerror (errno));
+          return;
+        }
+    }
+}
+
+/**
+ * gsk_stream_listener_group_destroy:
+ * @group: the listener group to stop.
+ *
+ * Stop all the worker threads and wait for them to exit.
+ * Connections that the workers were handling are destroyed
+ * along with the workers' main-loops.
+ *
+ * This must not be called from one of the worker threads.
+ */
+void
+gsk_stream_listener_group_destroy (GskStreamListenerGroup *group)
+{
+  guint i;
+  for (i = 0; i < group->n_workers; i++)
+    wake_worker (group->workers + i);
+  for (i = 0; i < group->n_workers; i++)
+    {
+      Worker *worker = group->workers + i;
+      g_thread_join (worker->thread);
+    }
+  for (i = 0; i < group->n_workers; i++)
+    {
+      Worker *worker = group->workers + i;
+      close (worker->wakeup_read_fd);
+      close (worker->wakeup_write_fd);
+    }
+
+  /* workers that failed to start never got their socket */
+  for (i = 0; i < group->n_workers; i++)
+    if (group->workers[i].listen_fd >= 0)
+      close (group->workers[i].listen_fd);
+
+  g_cond_free (group->started_cond);
+  g_mutex_free (group->lock);
+  g_free (group->workers);
+  g_free (group);
+}
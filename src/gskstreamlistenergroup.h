@@ -0,0 +1,46 @@
+#ifndef __GSK_STREAM_LISTENER_GROUP_H_
+#define __GSK_STREAM_LISTENER_GROUP_H_
+
+#include "gskstreamlistener.h"
+#include "gsksocketaddress.h"
+#include "gskmainloop.h"
+
+G_BEGIN_DECLS
+
+/* A listener group accepts connections on one address
+   using several threads, each with its own GskMainLoop.
+   Streams accepted by a worker are handled entirely
+   by that worker's main-loop. */
+typedef struct _GskStreamListenerGroup GskStreamListenerGroup;
+
+typedef enum
+{
+  /* Give each worker its own socket, bound with SO_REUSEPORT,
+     so that the kernel balances new connections between them.
+     Without this flag (or if SO_REUSEPORT is unavailable),
+     the workers share a single listening socket. */
+  GSK_STREAM_LISTENER_GROUP_REUSE_PORT = (1<<0)
+} GskStreamListenerGroupFlags;
+
+/* Called from each worker thread, before its main-loop starts running.
+   Typically this calls gsk_stream_listener_handle_accept(). */
+typedef void (*GskStreamListenerGroupSetupFunc) (GskStreamListener *listener,
+                                                 guint              worker_index,
+                                                 gpointer           setup_data);
+
+GskStreamListenerGroup *
+       gsk_stream_listener_group_new        (GskSocketAddress               *address,
+                                             guint                           n_workers,
+                                             GskStreamListenerGroupFlags     flags,
+                                             GskStreamListenerGroupSetupFunc setup,
+                                             gpointer                        setup_data,
+                                             GError                        **error);
+guint  gsk_stream_listener_group_get_n_workers (GskStreamListenerGroup *group);
+GskMainLoop *
+       gsk_stream_listener_group_peek_main_loop (GskStreamListenerGroup *group,
+                                                 guint                   worker_index);
+void   gsk_stream_listener_group_destroy    (GskStreamListenerGroup         *group);
+
+G_END_DECLS
+
+#endif
@@ -167,7 +167,8 @@ static void
 remove_poll (GskStreamListenerSocket *socket)
 {
   GSource *source = socket->source;
-  g_return_if_fail (source != NULL);
+  if (source == NULL)
+    return;
   socket->source = NULL;
   g_source_destroy (source);
   socket->poll_fd.fd = -1;
@@ -681,3 +682,24 @@ void    gsk_stream_listener_socket_set_backlog (GskStreamListenerSocket *lis,
 {
   listen (lis->fd, backlog);
 }
+
+/**
+ * gsk_stream_listener_socket_set_paused:
+ * @lis: the listener to pause or resume.
+ * @paused: whether to stop accepting connections.
+ *
+ * Stop or resume accepting incoming connections.
+ * While paused, new connections wait in the kernel's
+ * listen queue (see gsk_stream_listener_socket_set_backlog()).
+ */
+void
+gsk_stream_listener_socket_set_paused (GskStreamListenerSocket *lis,
+                                       gboolean                 paused)
+{
+  if (lis->fd < 0)
+    return;
+  if (paused && lis->source != NULL)
+    remove_poll (lis);
+  else if (!paused && lis->source == NULL)
+    add_poll (lis);
+}
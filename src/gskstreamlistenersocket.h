@@ -68,6 +68,8 @@ gsk_stream_listener_socket_new_bind_full(GskSocketAddress *address,
 					 GError          **error);
 void    gsk_stream_listener_socket_set_backlog (GskStreamListenerSocket *lis,
 						guint             backlog);
+void    gsk_stream_listener_socket_set_paused  (GskStreamListenerSocket *lis,
+						gboolean          paused);
 
 
 /*< private >*/
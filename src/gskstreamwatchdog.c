@@ -302,6 +302,8 @@ GskStream *gsk_stream_watchdog_new (GskStream       *underlying_stream,
                                                NULL,
                                                max_inactivity_millis,
                                                max_inactivity_millis);
+  /* touched on every read and write, so use the timing-wheel */
+  gsk_source_set_timer_coarse (watchdog->timeout, TRUE);
   if (gsk_io_get_is_readable (underlying_stream))
     gsk_io_mark_is_readable (watchdog);
   if (gsk_io_get_is_writable (underlying_stream))
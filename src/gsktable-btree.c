@@ -774,6 +774,23 @@ btree__release_build_data(GskTableFile            *file)
   unlink (fname_buf);
 }
 
+static gboolean
+btree__sync_file        (GskTableFile             *file,
+                         GError                  **error)
+{
+  BtreeFile *f = (BtreeFile *) file;
+  int fd = f->is_building ? f->info.building.writer.fd
+                          : f->info.readable.queryable.fd;
+  if (fsync (fd) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                   "error syncing btree file: %s",
+                   g_strerror (errno));
+      return FALSE;
+    }
+  return TRUE;
+}
+
 /* methods for a file which has been constructed */
 static gboolean
 btree__query_file       (GskTableFile             *file,
@@ -855,6 +872,7 @@ GskTableFileFactory *gsk_table_file_factory_new_btree (void)
         btree__get_build_state,
         btree__build_file,
         btree__release_build_data,
+        btree__sync_file,
         btree__query_file,
         btree__create_reader,
         btree__get_reader_state,
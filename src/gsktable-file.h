@@ -44,11 +44,17 @@ struct _GskTableFileQuery
                    gpointer      compare_data);
   gpointer compare_data;
 
+  /* the key itself, if keys compare equal exactly when their bytes
+     are equal (ie the table uses memcmp ordering); otherwise NULL.
+     Files may use this to rule out keys without searching. */
+  guint key_len;
+  const guint8 *key_data;
+
   gboolean found;
   GskTableBuffer value;
 };
 
-#define GSK_TABLE_FILE_QUERY_INIT  { NULL, NULL, FALSE, GSK_TABLE_BUFFER_INIT }
+#define GSK_TABLE_FILE_QUERY_INIT  { NULL, NULL, 0, NULL, FALSE, GSK_TABLE_BUFFER_INIT }
 
 G_INLINE_FUNC void    gsk_table_file_query_clear (GskTableFileQuery *query);
 
@@ -111,6 +117,11 @@ struct _GskTableFileFactory
 					 GError                  **error);
   void              (*release_build_data)(GskTableFile            *file);
 
+  /* make everything written so far durable
+     (used with GSK_TABLE_JOURNAL_SYNC, before the journal names the file) */
+  gboolean          (*sync_file)        (GskTableFile             *file,
+					 GError                  **error);
+
   /* methods for a file which has been constructed;
      some file types can be queried before they are constructed */
   gboolean          (*query_file)       (GskTableFile             *file,
@@ -141,6 +152,12 @@ struct _GskTableFileFactory
 
 /* optimized for situations where writes predominate */
 GskTableFileFactory *gsk_table_file_factory_new_flat (void);
+GskTableFileFactory *gsk_table_file_factory_new_flat_full (GskTableCompression compression,
+                                                           gint                compression_level,
+                                                           gsize               block_cache_bytes,
+                                                           GError            **error);
+void gsk_table_file_factory_flat_get_cache_stats (GskTableFileFactory *factory,
+                                                  GskTableCacheStats  *stats_out);
 
 /* optimized for situations where reads are common */
 GskTableFileFactory *gsk_table_file_factory_new_btree (void);
@@ -159,6 +176,8 @@ GskTableFileFactory *gsk_table_file_factory_new_btree (void);
   ((file)->factory->done_feeding ((file), (ready_out), (error)))
 #define gsk_table_file_build_file(file, ready_out, error) \
   ((file)->factory->build_file ((file), (ready_out), (error)))
+#define gsk_table_file_sync(file, error) \
+  ((file)->factory->sync_file ((file), (error)))
 #define gsk_table_file_query(file, query_inout, error) \
   ((file)->factory->query_file ((file), (query_inout), (error)))
 #define gsk_table_file_create_reader(file, dir, error) \
@@ -20,6 +20,7 @@
 #include "gsktable.h"
 #include "gsktable-file.h"
 #include "gsktable-helpers.h"
+#include "gsktable-lz.h"
 
 #define FTELLO          ftello          /* TODO: track the offsets ourselves */
 #define FSEEKO          fseeko
@@ -49,6 +50,7 @@ typedef struct _MmapWriter MmapWriter;
 typedef struct _FlatFileBuilder FlatFileBuilder;
 typedef struct _FlatFile FlatFile;
 typedef struct _FlatFileReader FlatFileReader;
+typedef struct _BlockCache BlockCache;
 
 typedef enum
 {
@@ -65,15 +67,52 @@ typedef enum
 
 static const char *file_extensions[N_FILES] = { "index", "firstkeys", "data" };
 
+/* The bloom filter lives in its own file, which is optional:
+   it is only written if the creator gave a max_entries hint. */
+#define BLOOM_FILE_EXTENSION    "bloom"
+#define BLOOM_MAGIC             0x4d4f4f42
+#define BLOOM_HEADER_SIZE       16
+/* each bloom file begins with (all LE int32):
+     magic
+     number of hash functions
+     log2 of the number of bits
+     reserved (0)
+ */
+#define BLOOM_MIN_LOG2_BITS     10
+#define BLOOM_MAX_LOG2_BITS     30
+#define BLOOM_MAX_N_HASHES      32
+
+/* How the data blocks are compressed.  This is recorded in the top byte
+   of the index file's header, so these values must never change.
+   Files from before there was a choice have 0 there, and use zlib. */
+typedef enum
+{
+  CODEC_ZLIB = 0,
+  CODEC_NONE = 1,
+  CODEC_LZ = 2
+} BlockCodec;
+#define N_CODECS                3
+#define CODEC_SHIFT             56
+
+/* zlib state for uncompressing, reused from block to block */
+typedef struct _Inflater Inflater;
+struct _Inflater
+{
+  gboolean inited;
+  z_stream zstream;
+};
+
 struct _FlatFactory
 {
   GskTableFileFactory base_factory;
-  guint bytes_per_chunk;
+  guint bytes_per_chunk;                /* compressed for zlib, else uncompressed */
+  BlockCodec codec;                     /* for new files */
   guint compression_level;
   guint n_recycled_builders;
   guint max_recycled_builders;
   FlatFileBuilder *recycled_builders;
-  guint max_cache_entries;
+  BlockCache *block_cache;              /* may be shared with other factories */
+  guint bloom_bits_per_key;             /* 0 to disable bloom filters */
 };
 
 
@@ -106,13 +145,16 @@ struct _FlatFileBuilder
 
   GskTableBuffer uncompressed;
   GskTableBuffer compressed;
+  GskTableBuffer block;                 /* uncompressed block, for CODEC_LZ */
 
   guint n_compressed_entries;
   guint uncompressed_data_len;
 
   MmapWriter writers[N_FILES];
  
-  z_stream compressor;
+  BlockCodec codec;
+  guint compression_level;
+  z_stream compressor;                  /* only for CODEC_ZLIB */
   GskMemPool compressor_allocator;
   guint8 *compressor_allocator_scratchpad;
   gsize compressor_allocator_scratchpad_len;
@@ -129,45 +171,133 @@ struct _CacheEntryRecord
   guint value_len;
   const guint8 *value_data;
 };
+typedef enum
+{
+  QUEUE_NONE,                           /* not in the cache */
+  QUEUE_A1IN,
+  QUEUE_AM
+} CacheQueue;
+
 struct _CacheEntry
 {
   guint n_entries;
   guint64 index;
-  CacheEntry *prev_lru, *next_lru;
+
+  /* the rest is only used by the block cache */
+  gint ref_count;
+  gsize n_bytes;
+  FlatFile *owner;
+  CacheQueue queue;
+  CacheEntry *prev_lru, *next_lru;      /* in its queue, newest first */
+  CacheEntry *prev_in_file, *next_in_file;
   CacheEntry *bin_next;
   CacheEntryRecord records[1];          /* must be last! */
 };
 
+/* the key of a block recently evicted from a1in */
+typedef struct _GhostEntry GhostEntry;
+struct _GhostEntry
+{
+  guint64 file_cache_id;
+  guint64 index;
+  GhostEntry *prev, *next;              /* newest first */
+  GhostEntry *bin_next;
+};
+
+/* A 2Q cache of uncompressed blocks, shared by all the files
+   of one or more factories, with a budget in bytes.
+
+   New blocks enter 'a1in', a FIFO of a quarter of the budget.
+   A block evicted from a1in leaves a ghost behind;  if the block is
+   wanted again while its ghost remains, it goes into 'am',
+   the LRU list of hot blocks.  So a scan only churns a1in. */
+struct _BlockCache
+{
+  GStaticMutex lock;
+  gsize max_bytes;
+  gsize n_bytes;
+  gsize a1in_max_bytes;
+  gsize a1in_bytes;
+  CacheEntry *a1in_newest, *a1in_oldest;
+  CacheEntry *am_newest, *am_oldest;
+
+  guint n_entries;
+  guint n_bins;
+  CacheEntry **bins;
+
+  guint n_ghosts;
+  guint max_ghosts;
+  guint n_ghost_bins;
+  GhostEntry **ghost_bins;
+  GhostEntry *ghost_newest, *ghost_oldest;
+
+  guint64 next_file_cache_id;
+  guint64 n_hits, n_misses, n_evictions;
+};
+
+/* in-memory copy of an index entry and its firstkey */
+typedef struct _KeyIndexEntry KeyIndexEntry;
+struct _KeyIndexEntry
+{
+  guint64 compressed_data_offset;
+  guint32 compressed_data_len;
+  guint32 firstkey_len;
+  gsize firstkey_offset;                /* in key_index_keys */
+};
+
 struct _FlatFile
 {
   GskTableFile base_file;
   gint         fds[N_FILES];
   FlatFileBuilder *builder;
+  BlockCodec codec;
 
   gboolean has_readers;         /* builder and has_readers are exclusive: they
                                    cannot be set at the same time */
   MmapReader readers[N_FILES];
 
-  guint cache_entries_len;
-  CacheEntry **cache_entries;
-  guint cache_entries_count;
-  guint max_cache_entries;
-  CacheEntry *most_recently_used, *least_recently_used;
+  /* this file's blocks in the factory's block cache */
+  guint64 cache_id;                     /* unique in the cache */
+  CacheEntry *first_cached, *last_cached;
+  Inflater inflater;                    /* for queries */
+
+  /* bloom filter of every key, mmapped from the bloom file
+     (writable while building); NULL if there is no bloom file */
+  guint8 *bloom_mmapped;
+  gsize bloom_mmapped_size;
+  guint32 bloom_bit_mask;
+  guint bloom_n_hashes;
+
+  /* the whole index and firstkeys files, loaded by the first query,
+     so that a query only has to pread() the compressed data */
+  gboolean has_key_index;
+  guint n_key_index;
+  guint key_index_alloced;
+  KeyIndexEntry *key_index;
+  GskTableBuffer key_index_keys;
 };
 
 struct _FlatFileReader
 {
   GskTableReader base_reader;
   FILE *fps[N_FILES];
+  BlockCodec codec;
+  Inflater inflater;
   guint64 chunk_file_offsets[N_FILES];
   CacheEntry *cache_entry;
   guint record_index;
   guint64 index_entry_index;
 };
 
-#define GET_LRU_LIST(file) \
-  CacheEntry *, (file)->most_recently_used, (file)->least_recently_used, \
-  prev_lru, next_lru
+#define GET_A1IN_LIST(cache) \
+  CacheEntry *, (cache)->a1in_newest, (cache)->a1in_oldest, prev_lru, next_lru
+#define GET_AM_LIST(cache) \
+  CacheEntry *, (cache)->am_newest, (cache)->am_oldest, prev_lru, next_lru
+#define GET_GHOST_LIST(cache) \
+  GhostEntry *, (cache)->ghost_newest, (cache)->ghost_oldest, prev, next
+#define GET_FILE_CACHED_LIST(file) \
+  CacheEntry *, (file)->first_cached, (file)->last_cached, \
+  prev_in_file, next_in_file
 
 typedef struct _IndexEntry IndexEntry;
 struct _IndexEntry
@@ -250,6 +380,54 @@ uint32_vli_decode (const guint8 *input,
     }
 }
 
+static gboolean
+inflater_run (Inflater     *inflater,
+              guint         in_len,
+              const guint8 *in_data,
+              guint         out_len,
+              guint8       *out_data,
+              GError      **error)
+{
+  int zrv;
+  if (!inflater->inited)
+    {
+      memset (&inflater->zstream, 0, sizeof (z_stream));
+      zrv = inflateInit (&inflater->zstream);
+      if (zrv != Z_OK)
+        {
+          g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_OUT_OF_MEMORY,
+                       "error initializing zlib decompressor (zrv=%d)", zrv);
+          return FALSE;
+        }
+      inflater->inited = TRUE;
+    }
+  else
+    inflateReset (&inflater->zstream);
+  inflater->zstream.avail_in = in_len;
+  inflater->zstream.next_in = (guint8 *) in_data;
+  inflater->zstream.avail_out = out_len;
+  inflater->zstream.next_out = out_data;
+  zrv = inflate (&inflater->zstream, Z_SYNC_FLUSH);
+  if (zrv != Z_OK || inflater->zstream.avail_out != 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+                   "error uncompressing zlib compressed data (zrv=%d)",
+                   zrv);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static inline void
+inflater_clear (Inflater *inflater)
+{
+  if (inflater->inited)
+    {
+      inflateEnd (&inflater->zstream);
+      inflater->inited = FALSE;
+    }
+}
+
 typedef struct _CacheEntryTmpRecord CacheEntryTmpRecord;
 struct _CacheEntryTmpRecord
 {
@@ -260,7 +438,9 @@ struct _CacheEntryTmpRecord
   const guint8 *value;
 };
 static CacheEntry *
-cache_entry_deserialize (guint64       index,
+cache_entry_deserialize (BlockCodec    codec,
+                         Inflater     *inflater,
+                         guint64       index,
                          guint         firstkey_len,
                          const guint8 *firstkey_data,
                          guint         compressed_data_len,
@@ -272,7 +452,6 @@ cache_entry_deserialize (guint64       index,
   CacheEntryTmpRecord *records, *to_free = NULL;
   guint8 *uncompressed_data, *to_free2 = NULL;
   guint i;
-  int zrv;
   guint8 *uc_at;
   guint data_size;
   CacheEntry *rv;
@@ -293,26 +472,46 @@ cache_entry_deserialize (guint64       index,
 #endif
 
   /* uncompress */
-  if (uncompressed_data_len < 32*1024)
-    uncompressed_data = g_alloca (uncompressed_data_len);
+  if (codec == CODEC_NONE)
+    {
+      if (compressed_data_len - used != uncompressed_data_len)
+        {
+          g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+                       "uncompressed block has wrong length");
+          return NULL;
+        }
+      uncompressed_data = (guint8 *) compressed_data + used;
+    }
   else
-    uncompressed_data = to_free2 = g_malloc (uncompressed_data_len);
-
-  z_stream uncompress_buf;
-  memset (&uncompress_buf, 0, sizeof (uncompress_buf));
-  inflateInit (&uncompress_buf);
-  uncompress_buf.avail_in = compressed_data_len - used;
-  uncompress_buf.next_in = (guint8 *) compressed_data + used;
-  uncompress_buf.avail_out = uncompressed_data_len;
-  uncompress_buf.next_out = uncompressed_data;
-  zrv = inflate (&uncompress_buf, Z_SYNC_FLUSH);
-  if (zrv != Z_OK)
     {
-      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
-                   "error uncompressing zlib compressed data (zrv=%d)",
-                   zrv);
-      g_free (to_free2);
-      return NULL;
+      if (uncompressed_data_len < 32*1024)
+        uncompressed_data = g_alloca (uncompressed_data_len);
+      else
+        uncompressed_data = to_free2 = g_malloc (uncompressed_data_len);
+
+      if (codec == CODEC_LZ)
+        {
+          if (!gsk_table_lz_decompress (compressed_data_len - used,
+                                        compressed_data + used,
+                                        uncompressed_data_len,
+                                        uncompressed_data))
+            {
+              g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+                           "error uncompressing lz compressed data");
+              g_free (to_free2);
+              return NULL;
+            }
+        }
+      else if (!inflater_run (inflater,
+                              compressed_data_len - used,
+                              compressed_data + used,
+                              uncompressed_data_len,
+                              uncompressed_data,
+                              error))
+        {
+          g_free (to_free2);
+          return NULL;
+        }
     }
 
   /* parse data */
@@ -369,6 +568,10 @@ cache_entry_deserialize (guint64       index,
   
   rv->n_entries = n_compressed_entries;
   rv->index = index;
+  rv->ref_count = 1;
+  rv->n_bytes = heap_at - (guint8 *) rv + data_size;
+  rv->owner = NULL;
+  rv->queue = QUEUE_NONE;
 
   for (i = 0; i < n_compressed_entries; i++)
     {
@@ -390,56 +593,305 @@ cache_entry_deserialize (guint64       index,
   return rv;
 }
 
-static CacheEntry *
-cache_entry_force (FlatFile  *ffile,
-                   guint64    index,
-                   IndexEntry *index_entry,
-                   guint8     *firstkey_data,
-                   GError    **error)
+/* --- the block cache --- */
+/* the cache used by default, shared by the whole process */
+#define DEFAULT_BLOCK_CACHE_BYTES       (16*1024*1024)
+static BlockCache *default_block_cache = NULL;
+G_LOCK_DEFINE_STATIC (default_block_cache);
+
+static inline guint
+block_cache_hash (guint64 file_cache_id,
+                  guint64 index)
 {
-  guint bin;
+  return (guint) file_cache_id * 0x9e3779b1U
+       + (guint) index + (guint) (index >> 32);
+}
+
+static BlockCache *
+block_cache_new (gsize max_bytes,
+                 guint bytes_per_chunk)
+{
+  BlockCache *cache = g_new0 (BlockCache, 1);
+  gsize approx_n_blocks = MAX (64, max_bytes / bytes_per_chunk);
+  g_static_mutex_init (&cache->lock);
+  cache->max_bytes = max_bytes;
+  cache->a1in_max_bytes = max_bytes / 4;
+  cache->max_ghosts = approx_n_blocks / 2;
+  cache->n_bins = g_spaced_primes_closest (approx_n_blocks);
+  cache->bins = g_new0 (CacheEntry *, cache->n_bins);
+  cache->n_ghost_bins = g_spaced_primes_closest (cache->max_ghosts);
+  cache->ghost_bins = g_new0 (GhostEntry *, cache->n_ghost_bins);
+  cache->next_file_cache_id = 1;
+  return cache;
+}
+
+static BlockCache *
+peek_default_block_cache (guint bytes_per_chunk)
+{
+  G_LOCK (default_block_cache);
+  if (default_block_cache == NULL)
+    default_block_cache = block_cache_new (DEFAULT_BLOCK_CACHE_BYTES,
+                                           bytes_per_chunk);
+  G_UNLOCK (default_block_cache);
+  return default_block_cache;
+}
+
+/* all the cache's files must have been destroyed */
+static void
+block_cache_free (BlockCache *cache)
+{
+  g_assert (cache->n_entries == 0);
+  while (cache->ghost_newest != NULL)
+    {
+      GhostEntry *ghost = cache->ghost_newest;
+      GSK_LIST_REMOVE_FIRST (GET_GHOST_LIST (cache));
+      g_slice_free (GhostEntry, ghost);
+    }
+  g_free (cache->bins);
+  g_free (cache->ghost_bins);
+  g_static_mutex_free (&cache->lock);
+  g_free (cache);
+}
+
+static guint64
+block_cache_new_file_id (BlockCache *cache)
+{
+  guint64 rv;
+  g_static_mutex_lock (&cache->lock);
+  rv = cache->next_file_cache_id++;
+  g_static_mutex_unlock (&cache->lock);
+  return rv;
+}
+
+static inline void
+cache_entry_unref (CacheEntry *entry)
+{
+  if (g_atomic_int_dec_and_test (&entry->ref_count))
+    g_free (entry);
+}
+
+/* the following functions are called with the cache locked */
+static inline CacheEntry *
+block_cache_lookup (BlockCache *cache,
+                    FlatFile   *ffile,
+                    guint64     index)
+{
+  guint bin = block_cache_hash (ffile->cache_id, index) % cache->n_bins;
   CacheEntry *entry;
-#if DEBUG_CACHE_ENTRY_FORCE
-  g_message ("cache_entry_force: index=%llu [key offset/length=%llu/%u; data offset/length=%llu/%u]", index,index_entry->firstkeys_offset,index_entry->firstkeys_len, index_entry->compressed_data_offset, index_entry->compressed_data_len);
-#endif
-  if (ffile->cache_entries_len == 0)
+  for (entry = cache->bins[bin]; entry != NULL; entry = entry->bin_next)
+    if (entry->index == index && entry->owner == ffile)
+      return entry;
+  return NULL;
+}
+
+static GhostEntry *
+block_cache_find_ghost (BlockCache *cache,
+                        guint64     file_cache_id,
+                        guint64     index)
+{
+  guint bin = block_cache_hash (file_cache_id, index) % cache->n_ghost_bins;
+  GhostEntry *ghost;
+  for (ghost = cache->ghost_bins[bin]; ghost != NULL; ghost = ghost->bin_next)
+    if (ghost->index == index && ghost->file_cache_id == file_cache_id)
+      return ghost;
+  return NULL;
+}
+
+static void
+block_cache_unlink_ghost (BlockCache *cache,
+                          GhostEntry *ghost)
+{
+  guint bin = block_cache_hash (ghost->file_cache_id, ghost->index)
+            % cache->n_ghost_bins;
+  GhostEntry **pprev;
+  for (pprev = cache->ghost_bins + bin; *pprev != ghost; pprev = &((*pprev)->bin_next))
+    ;
+  *pprev = ghost->bin_next;
+  GSK_LIST_REMOVE (GET_GHOST_LIST (cache), ghost);
+  cache->n_ghosts--;
+}
+
+static void
+block_cache_add_ghost (BlockCache *cache,
+                       guint64     file_cache_id,
+                       guint64     index)
+{
+  GhostEntry *ghost;
+  guint bin;
+  if (cache->max_ghosts == 0)
+    return;
+  if (cache->n_ghosts == cache->max_ghosts)
     {
-      ffile->cache_entries_len = g_spaced_primes_closest (ffile->max_cache_entries);
-      ffile->cache_entries = g_new0 (CacheEntry *, ffile->cache_entries_len);
+      ghost = cache->ghost_oldest;
+      block_cache_unlink_ghost (cache, ghost);
     }
-  bin = (guint) index % ffile->cache_entries_len;
-  for (entry = ffile->cache_entries[bin]; entry != NULL; entry = entry->bin_next)
-    if (entry->index == index)
+  else
+    ghost = g_slice_new (GhostEntry);
+  ghost->file_cache_id = file_cache_id;
+  ghost->index = index;
+  bin = block_cache_hash (file_cache_id, index) % cache->n_ghost_bins;
+  ghost->bin_next = cache->ghost_bins[bin];
+  cache->ghost_bins[bin] = ghost;
+  GSK_LIST_PREPEND (GET_GHOST_LIST (cache), ghost);
+  cache->n_ghosts++;
+}
+
+/* remove an entry from the cache;  the caller must
+   drop the cache's reference */
+static void
+block_cache_detach (BlockCache *cache,
+                    CacheEntry *entry)
+{
+  guint bin = block_cache_hash (entry->owner->cache_id, entry->index)
+            % cache->n_bins;
+  CacheEntry **pprev;
+  for (pprev = cache->bins + bin; *pprev != entry; pprev = &((*pprev)->bin_next))
+    ;
+  *pprev = entry->bin_next;
+  cache->n_entries--;
+
+  if (entry->queue == QUEUE_A1IN)
+    {
+      GSK_LIST_REMOVE (GET_A1IN_LIST (cache), entry);
+      cache->a1in_bytes -= entry->n_bytes;
+    }
+  else
+    GSK_LIST_REMOVE (GET_AM_LIST (cache), entry);
+  entry->queue = QUEUE_NONE;
+  GSK_LIST_REMOVE (GET_FILE_CACHED_LIST (entry->owner), entry);
+  cache->n_bytes -= entry->n_bytes;
+}
+
+static void
+block_cache_evict (BlockCache *cache)
+{
+  while (cache->n_bytes > cache->max_bytes)
+    {
+      CacheEntry *victim;
+      if (cache->a1in_oldest != NULL
+       && (cache->a1in_bytes > cache->a1in_max_bytes || cache->am_oldest == NULL))
+        {
+          victim = cache->a1in_oldest;
+          block_cache_add_ghost (cache, victim->owner->cache_id, victim->index);
+        }
+      else
+        victim = cache->am_oldest;
+      block_cache_detach (cache, victim);
+      cache->n_evictions++;
+      cache_entry_unref (victim);
+    }
+}
+
+static void
+block_cache_grow_bins (BlockCache *cache)
+{
+  guint new_n_bins = g_spaced_primes_closest (cache->n_bins * 2 + 1);
+  CacheEntry **new_bins = g_new0 (CacheEntry *, new_n_bins);
+  guint i;
+  for (i = 0; i < cache->n_bins; i++)
+    while (cache->bins[i] != NULL)
       {
-        if (entry->prev_lru != NULL)
-          {
-            GSK_LIST_REMOVE (GET_LRU_LIST (ffile), entry);
-            GSK_LIST_PREPEND (GET_LRU_LIST (ffile), entry);
-          }
-        return entry;
+        CacheEntry *entry = cache->bins[i];
+        guint bin = block_cache_hash (entry->owner->cache_id, entry->index) % new_n_bins;
+        cache->bins[i] = entry->bin_next;
+        entry->bin_next = new_bins[bin];
+        new_bins[bin] = entry;
       }
+  g_free (cache->bins);
+  cache->bins = new_bins;
+  cache->n_bins = new_n_bins;
+}
+
+/* add a new entry, with its own reference;
+   blocks bigger than a1in are never cached */
+static void
+block_cache_insert (BlockCache *cache,
+                    FlatFile   *ffile,
+                    CacheEntry *entry)
+{
+  GhostEntry *ghost;
+  guint bin;
+  if (entry->n_bytes > cache->a1in_max_bytes)
+    return;
 
-  /* possibly evict old cache entry */
-  if (ffile->cache_entries_count == ffile->max_cache_entries)
+  entry->owner = ffile;
+  g_atomic_int_inc (&entry->ref_count);
+  ghost = block_cache_find_ghost (cache, ffile->cache_id, entry->index);
+  if (ghost != NULL)
+    {
+      /* the second request in a short time:  a hot block */
+      block_cache_unlink_ghost (cache, ghost);
+      g_slice_free (GhostEntry, ghost);
+      entry->queue = QUEUE_AM;
+      GSK_LIST_PREPEND (GET_AM_LIST (cache), entry);
+    }
+  else
     {
-      CacheEntry *evicted = ffile->least_recently_used;
-      guint bin = (guint) evicted->index % ffile->cache_entries_len;
-      CacheEntry **pprev;
-      GSK_LIST_REMOVE_LAST (GET_LRU_LIST (ffile));
+      entry->queue = QUEUE_A1IN;
+      GSK_LIST_PREPEND (GET_A1IN_LIST (cache), entry);
+      cache->a1in_bytes += entry->n_bytes;
+    }
 
-      /* remove from hash-table */
-      for (pprev = ffile->cache_entries + bin;
-           *pprev != evicted;
-           pprev = &((*pprev)->bin_next))
-        ;
-      *pprev = evicted->bin_next;
+  if (cache->n_entries >= cache->n_bins * 2)
+    block_cache_grow_bins (cache);
+  bin = block_cache_hash (ffile->cache_id, entry->index) % cache->n_bins;
+  entry->bin_next = cache->bins[bin];
+  cache->bins[bin] = entry;
+  cache->n_entries++;
+  GSK_LIST_PREPEND (GET_FILE_CACHED_LIST (ffile), entry);
+  cache->n_bytes += entry->n_bytes;
+
+  block_cache_evict (cache);
+}
 
-      ffile->cache_entries_count--;
-      g_free (evicted);
+/* drop all of a file's blocks, before the file is destroyed */
+static void
+block_cache_purge_file (BlockCache *cache,
+                        FlatFile   *ffile)
+{
+  g_static_mutex_lock (&cache->lock);
+  while (ffile->first_cached != NULL)
+    {
+      CacheEntry *entry = ffile->first_cached;
+      block_cache_detach (cache, entry);
+      cache_entry_unref (entry);
     }
+  g_static_mutex_unlock (&cache->lock);
+}
 
-  /* create new entry */
+/* Get the uncompressed block, from the cache if possible.
+   The caller must cache_entry_unref() it. */
+static CacheEntry *
+cache_entry_force (FlatFile      *ffile,
+                   guint64        index,
+                   KeyIndexEntry *index_entry,
+                   const guint8  *firstkey_data,
+                   GError       **error)
+{
+  BlockCache *cache = ((FlatFactory *) ffile->base_file.factory)->block_cache;
+  CacheEntry *entry;
   guint8 *compressed_data;
+#if DEBUG_CACHE_ENTRY_FORCE
+  g_message ("cache_entry_force: index=%llu [key length=%u; data offset/length=%llu/%u]", index,index_entry->firstkey_len, index_entry->compressed_data_offset, index_entry->compressed_data_len);
+#endif
+  g_static_mutex_lock (&cache->lock);
+  entry = block_cache_lookup (cache, ffile, index);
+  if (entry != NULL)
+    {
+      cache->n_hits++;
+      if (entry->queue == QUEUE_AM && entry->prev_lru != NULL)
+        {
+          GSK_LIST_REMOVE (GET_AM_LIST (cache), entry);
+          GSK_LIST_PREPEND (GET_AM_LIST (cache), entry);
+        }
+      g_atomic_int_inc (&entry->ref_count);
+      g_static_mutex_unlock (&cache->lock);
+      return entry;
+    }
+  cache->n_misses++;
+  g_static_mutex_unlock (&cache->lock);
+
+  /* read and uncompress without the lock */
   compressed_data = g_malloc (index_entry->compressed_data_len);
   if (!do_pread (ffile, FILE_DATA,
                  index_entry->compressed_data_offset,
@@ -449,24 +901,19 @@ cache_entry_force (FlatFile  *ffile,
       g_free (compressed_data);
       return NULL;
     }
-
-  /* deserialize the cache entry */
-  entry = cache_entry_deserialize (index,
-                                   index_entry->firstkeys_len, firstkey_data,
+  entry = cache_entry_deserialize (ffile->codec, &ffile->inflater, index,
+                                   index_entry->firstkey_len, firstkey_data,
                                    index_entry->compressed_data_len,
                                    compressed_data,
                                    error);
-  if (entry == NULL)
-    {
-      g_free (compressed_data);
-      return NULL;
-    }
-  entry->bin_next = ffile->cache_entries[bin];
-  ffile->cache_entries[bin] = entry;
-  ffile->cache_entries_count++;
   g_free (compressed_data);
-  GSK_LIST_PREPEND (GET_LRU_LIST (ffile), entry);
+  if (entry == NULL)
+    return NULL;
 
+  g_static_mutex_lock (&cache->lock);
+  if (block_cache_lookup (cache, ffile, index) == NULL)
+    block_cache_insert (cache, ffile, entry);
+  g_static_mutex_unlock (&cache->lock);
   return entry;
 }
 
@@ -744,10 +1191,211 @@ mmap_writer_clear (MmapWriter *writer)
   gsk_table_buffer_clear (&writer->tmp_buf);
 }
 
+/* --- bloom filter --- */
+static inline guint64
+bloom_hash (guint         len,
+            const guint8 *data)
+{
+  /* FNV-1a, followed by a final avalanche so that
+     both halves are usable as independent hashes */
+  guint64 h = G_GUINT64_CONSTANT (14695981039346656037);
+  guint i;
+  for (i = 0; i < len; i++)
+    {
+      h ^= data[i];
+      h *= G_GUINT64_CONSTANT (1099511628211);
+    }
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+/* the i-th hash function is h1 + i * h2 */
+static inline void
+bloom_add (FlatFile     *ffile,
+           guint         key_len,
+           const guint8 *key_data)
+{
+  guint8 *bits = ffile->bloom_mmapped + BLOOM_HEADER_SIZE;
+  guint64 h = bloom_hash (key_len, key_data);
+  guint32 h1 = (guint32) h;
+  guint32 h2 = (guint32) (h >> 32) | 1;
+  guint i;
+  for (i = 0; i < ffile->bloom_n_hashes; i++)
+    {
+      guint32 bit = h1 & ffile->bloom_bit_mask;
+      bits[bit / 8] |= (1 << (bit % 8));
+      h1 += h2;
+    }
+}
+
+static inline gboolean
+bloom_test (FlatFile     *ffile,
+            guint         key_len,
+            const guint8 *key_data)
+{
+  const guint8 *bits = ffile->bloom_mmapped + BLOOM_HEADER_SIZE;
+  guint64 h = bloom_hash (key_len, key_data);
+  guint32 h1 = (guint32) h;
+  guint32 h2 = (guint32) (h >> 32) | 1;
+  guint i;
+  for (i = 0; i < ffile->bloom_n_hashes; i++)
+    {
+      guint32 bit = h1 & ffile->bloom_bit_mask;
+      if ((bits[bit / 8] & (1 << (bit % 8))) == 0)
+        return FALSE;
+      h1 += h2;
+    }
+  return TRUE;
+}
+
+static gboolean
+bloom_create (FlatFile    *ffile,
+              const char  *dir,
+              guint64      max_entries,
+              guint        bits_per_key,
+              GError     **error)
+{
+  char fname_buf[GSK_TABLE_MAX_PATH];
+  guint log2_bits = BLOOM_MIN_LOG2_BITS;
+  guint64 n_bits_wanted;
+  gsize size;
+  guint32 header[4];
+  int fd;
+
+  if (max_entries > (G_GUINT64_CONSTANT (1) << BLOOM_MAX_LOG2_BITS))
+    max_entries = G_GUINT64_CONSTANT (1) << BLOOM_MAX_LOG2_BITS;
+  n_bits_wanted = max_entries * bits_per_key;
+  while (log2_bits < BLOOM_MAX_LOG2_BITS
+      && (G_GUINT64_CONSTANT (1) << log2_bits) < n_bits_wanted)
+    log2_bits++;
+  size = BLOOM_HEADER_SIZE + (((gsize) 1 << log2_bits) / 8);
+
+  gsk_table_mk_fname (fname_buf, dir, ffile->base_file.id, BLOOM_FILE_EXTENSION);
+  fd = open (fname_buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_CREATE,
+                   "error creating %s: %s",
+                   fname_buf, g_strerror (errno));
+      return FALSE;
+    }
+  if (ftruncate (fd, size) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_TRUNCATE,
+                   "error sizing bloom file: %s",
+                   g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+  ffile->bloom_mmapped = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (ffile->bloom_mmapped == MAP_FAILED)
+    {
+      ffile->bloom_mmapped = NULL;
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_MMAP,
+                   "error mmapping bloom file: %s",
+                   g_strerror (errno));
+      return FALSE;
+    }
+  ffile->bloom_mmapped_size = size;
+  ffile->bloom_bit_mask = (guint32) (((guint64) 1 << log2_bits) - 1);
+  ffile->bloom_n_hashes = CLAMP (bits_per_key * 69 / 100, 1, BLOOM_MAX_N_HASHES);
+
+  header[0] = GUINT32_TO_LE (BLOOM_MAGIC);
+  header[1] = GUINT32_TO_LE (ffile->bloom_n_hashes);
+  header[2] = GUINT32_TO_LE (log2_bits);
+  header[3] = 0;
+  memcpy (ffile->bloom_mmapped, header, BLOOM_HEADER_SIZE);
+  return TRUE;
+}
+
+/* A missing bloom file is not an error:  the file simply
+   has no bloom filter.  Neither is a bad number of hash functions,
+   which would make every lookup slow or the filter useless:
+   the filter is ignored. */
+static gboolean
+bloom_open (FlatFile    *ffile,
+            const char  *dir,
+            gboolean     writable,
+            GError     **error)
+{
+  char fname_buf[GSK_TABLE_MAX_PATH];
+  struct stat stat_buf;
+  guint32 header[4];
+  guint log2_bits;
+  guint n_hashes;
+  int fd;
+
+  gsk_table_mk_fname (fname_buf, dir, ffile->base_file.id, BLOOM_FILE_EXTENSION);
+  fd = open (fname_buf, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_OPEN,
+                   "error opening %s: %s",
+                   fname_buf, g_strerror (errno));
+      return FALSE;
+    }
+  if (fstat (fd, &stat_buf) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_STAT,
+                   "error stating %s: %s",
+                   fname_buf, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+  if (stat_buf.st_size < BLOOM_HEADER_SIZE
+   || pread (fd, header, BLOOM_HEADER_SIZE, 0) != BLOOM_HEADER_SIZE)
+    goto corrupt;
+  log2_bits = GUINT32_FROM_LE (header[2]);
+  if (GUINT32_FROM_LE (header[0]) != BLOOM_MAGIC
+   || log2_bits < BLOOM_MIN_LOG2_BITS
+   || log2_bits > BLOOM_MAX_LOG2_BITS
+   || (guint64) stat_buf.st_size != BLOOM_HEADER_SIZE + (((guint64) 1 << log2_bits) / 8))
+    goto corrupt;
+  n_hashes = GUINT32_FROM_LE (header[1]);
+  if (n_hashes < 1 || n_hashes > BLOOM_MAX_N_HASHES)
+    {
+      close (fd);
+      return TRUE;
+    }
+
+  ffile->bloom_mmapped = mmap (NULL, stat_buf.st_size,
+                               writable ? (PROT_READ|PROT_WRITE) : PROT_READ,
+                               MAP_SHARED, fd, 0);
+  close (fd);
+  if (ffile->bloom_mmapped == MAP_FAILED)
+    {
+      ffile->bloom_mmapped = NULL;
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_MMAP,
+                   "error mmapping %s: %s",
+                   fname_buf, g_strerror (errno));
+      return FALSE;
+    }
+  ffile->bloom_mmapped_size = stat_buf.st_size;
+  ffile->bloom_bit_mask = (guint32) (((guint64) 1 << log2_bits) - 1);
+  ffile->bloom_n_hashes = n_hashes;
+  return TRUE;
+
+corrupt:
+  g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+               "bloom file %s is corrupt", fname_buf);
+  close (fd);
+  return FALSE;
+}
 
 /* --- index entry serialization --- */
 #define SIZEOF_INDEX_ENTRY 24
-#define INDEX_HEADER_SIZE   8    /* the number of records, as a LE int64 */
+#define INDEX_HEADER_SIZE   8
+/* the index file's header is a LE int64:
+     bits 0..55:  the number of records
+     bits 56..63: the BlockCodec
+ */
 /* each entry in index file is:
      8 bytes -- initial key offset
      4 bytes -- initial key length
@@ -795,6 +1443,119 @@ index_entry_deserialize (const guint8     *data_in,
 }
 
 
+/* --- in-memory copy of the index and firstkeys files --- */
+static KeyIndexEntry *
+key_index_append (FlatFile      *ffile,
+                  guint64        compressed_data_offset,
+                  guint32        compressed_data_len,
+                  guint32        firstkey_len)
+{
+  KeyIndexEntry *entry;
+  if (ffile->n_key_index == ffile->key_index_alloced)
+    {
+      ffile->key_index_alloced = ffile->key_index_alloced ? ffile->key_index_alloced * 2 : 16;
+      ffile->key_index = g_renew (KeyIndexEntry, ffile->key_index,
+                                  ffile->key_index_alloced);
+    }
+  entry = ffile->key_index + ffile->n_key_index++;
+  entry->compressed_data_offset = compressed_data_offset;
+  entry->compressed_data_len = compressed_data_len;
+  entry->firstkey_len = firstkey_len;
+  entry->firstkey_offset = ffile->key_index_keys.len;
+  return entry;
+}
+
+static gboolean
+key_index_load (FlatFile *ffile,
+                guint64   n_index_records,
+                GError  **error)
+{
+  guint8 *index_data;
+  guint8 *firstkeys;
+  guint64 firstkeys_len = 0;
+  guint i;
+
+  g_assert (!ffile->has_key_index);
+  if (n_index_records == 0)
+    {
+      ffile->has_key_index = TRUE;
+      return TRUE;
+    }
+
+  index_data = g_malloc (n_index_records * SIZEOF_INDEX_ENTRY);
+  if (!do_pread (ffile, FILE_INDEX, INDEX_HEADER_SIZE,
+                 n_index_records * SIZEOF_INDEX_ENTRY, index_data, error))
+    {
+      g_free (index_data);
+      return FALSE;
+    }
+
+  /* the firstkeys are written back-to-back, so the last index entry
+     tells us how much of the firstkeys file to read */
+  {
+    IndexEntry last;
+    index_entry_deserialize (index_data + (n_index_records - 1) * SIZEOF_INDEX_ENTRY, &last);
+    firstkeys_len = last.firstkeys_offset + last.firstkeys_len;
+  }
+  firstkeys = gsk_table_buffer_set_len (&ffile->key_index_keys, firstkeys_len);
+  if (!do_pread (ffile, FILE_FIRSTKEYS, 0, firstkeys_len, firstkeys, error))
+    {
+      gsk_table_buffer_set_len (&ffile->key_index_keys, 0);
+      g_free (index_data);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_index_records; i++)
+    {
+      IndexEntry index_entry;
+      KeyIndexEntry *entry;
+      index_entry_deserialize (index_data + i * SIZEOF_INDEX_ENTRY, &index_entry);
+      if (index_entry.firstkeys_offset + index_entry.firstkeys_len > firstkeys_len)
+        {
+          g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+                       "index entry %u refers past the end of the firstkeys file", i);
+          ffile->n_key_index = 0;
+          gsk_table_buffer_set_len (&ffile->key_index_keys, 0);
+          g_free (index_data);
+          return FALSE;
+        }
+      entry = key_index_append (ffile,
+                                index_entry.compressed_data_offset,
+                                index_entry.compressed_data_len,
+                                index_entry.firstkeys_len);
+      entry->firstkey_offset = index_entry.firstkeys_offset;
+    }
+  g_free (index_data);
+  ffile->has_key_index = TRUE;
+  return TRUE;
+}
+
+static void
+init_query_data (FlatFile *ffile)
+{
+  ffile->bloom_mmapped = NULL;
+  ffile->has_key_index = FALSE;
+  ffile->n_key_index = 0;
+  ffile->key_index_alloced = 0;
+  ffile->key_index = NULL;
+  gsk_table_buffer_init (&ffile->key_index_keys);
+  ffile->inflater.inited = FALSE;
+  ffile->cache_id = block_cache_new_file_id (((FlatFactory *) ffile->base_file.factory)->block_cache);
+  ffile->first_cached = ffile->last_cached = NULL;
+}
+
+static void
+clear_query_data (FlatFile *ffile)
+{
+  if (ffile->bloom_mmapped != NULL)
+    munmap (ffile->bloom_mmapped, ffile->bloom_mmapped_size);
+  g_free (ffile->key_index);
+  gsk_table_buffer_clear (&ffile->key_index_keys);
+  inflater_clear (&ffile->inflater);
+  block_cache_purge_file (((FlatFactory *) ffile->base_file.factory)->block_cache, ffile);
+}
+
+
 static voidpf my_mem_pool_alloc (voidpf opaque, uInt items, uInt size)
 {
   FlatFileBuilder *builder = opaque;
@@ -807,7 +1568,6 @@ static void my_mem_pool_free (voidpf opaque, voidpf address)
 
 static inline void
 reinit_compressor (FlatFileBuilder *builder,
-                   guint            compression_level,
                    gboolean         preowned_mempool)
 {
   if (preowned_mempool)
@@ -823,65 +1583,101 @@ reinit_compressor (FlatFileBuilder *builder,
   gsk_mem_pool_construct_with_scratch_buf (&builder->compressor_allocator,
                                            builder->compressor_allocator_scratchpad,
                                            builder->compressor_allocator_scratchpad_len);
-  memset (&builder->compressor, 0, sizeof (z_stream));
-  builder->compressor.zalloc = my_mem_pool_alloc;
-  builder->compressor.zfree = my_mem_pool_free;
-  builder->compressor.opaque = builder;
-  deflateInit (&builder->compressor, compression_level);
+  if (builder->codec == CODEC_ZLIB)
+    {
+      memset (&builder->compressor, 0, sizeof (z_stream));
+      builder->compressor.zalloc = my_mem_pool_alloc;
+      builder->compressor.zfree = my_mem_pool_free;
+      builder->compressor.opaque = builder;
+      deflateInit (&builder->compressor, builder->compression_level);
+    }
   builder->n_compressed_entries = 0;
   builder->uncompressed_data_len = 0;
   builder->has_last_key = FALSE;
   gsk_table_buffer_set_len (&builder->compressed, 0);
+  gsk_table_buffer_set_len (&builder->block, 0);
 }
 
+/* tables with merge threads create and finish files concurrently */
+G_LOCK_DEFINE_STATIC (recycled_builders);
+
 static FlatFileBuilder *
-flat_file_builder_new (FlatFactory *factory)
+flat_file_builder_new (FlatFactory *factory,
+                       BlockCodec   codec)
 {
-  if (factory->recycled_builders)
+  FlatFileBuilder *builder;
+  G_LOCK (recycled_builders);
+  builder = factory->recycled_builders;
+  if (builder != NULL)
     {
-      FlatFileBuilder *builder = factory->recycled_builders;
       factory->recycled_builders = builder->next_recycled_builder;
       factory->n_recycled_builders--;
+    }
+  G_UNLOCK (recycled_builders);
+  if (builder != NULL)
+    {
       g_assert (builder->n_compressed_entries == 0
              && builder->uncompressed_data_len == 0);
+
+      /* a file being reopened may use an older codec */
+      if (builder->codec != codec)
+        {
+          builder->codec = codec;
+          reinit_compressor (builder, TRUE);
+        }
       return builder;
     }
   else
     {
-      FlatFileBuilder *builder = g_slice_new (FlatFileBuilder);
+      builder = g_slice_new (FlatFileBuilder);
       gsk_table_buffer_init (&builder->input);
       gsk_table_buffer_init (&builder->first_key);
       gsk_table_buffer_init (&builder->last_key);
       gsk_table_buffer_init (&builder->compressed);
       gsk_table_buffer_init (&builder->uncompressed);
+      gsk_table_buffer_init (&builder->block);
+      builder->codec = codec;
+      builder->compression_level = factory->compression_level;
       builder->compressor_allocator_scratchpad_len = 1024;
       builder->compressor_allocator_scratchpad = g_malloc (builder->compressor_allocator_scratchpad_len);
-      reinit_compressor (builder, factory->compression_level, FALSE);
+      reinit_compressor (builder, FALSE);
       return builder;
     }
 }
 
+static void
+builder_free (FlatFileBuilder *builder)
+{
+  gsk_table_buffer_clear (&builder->input);
+  gsk_table_buffer_clear (&builder->first_key);
+  gsk_table_buffer_clear (&builder->last_key);
+  gsk_table_buffer_clear (&builder->compressed);
+  gsk_table_buffer_clear (&builder->uncompressed);
+  gsk_table_buffer_clear (&builder->block);
+  gsk_mem_pool_destruct (&builder->compressor_allocator);
+  g_free (builder->compressor_allocator_scratchpad);
+  g_slice_free (FlatFileBuilder, builder);
+}
+
 static void
 builder_recycle (FlatFactory *ffactory,
                  FlatFileBuilder *builder)
 {
-  if (ffactory->n_recycled_builders == ffactory->max_recycled_builders)
-    {
-      gsk_table_buffer_clear (&builder->input);
-      gsk_table_buffer_clear (&builder->first_key);
-      gsk_table_buffer_clear (&builder->last_key);
-      gsk_table_buffer_clear (&builder->compressed);
-      gsk_table_buffer_clear (&builder->uncompressed);
-      gsk_mem_pool_destruct (&builder->compressor_allocator);
-      g_free (builder->compressor_allocator_scratchpad);
-      g_slice_free (FlatFileBuilder, builder);
-    }
+  gboolean keep;
+  G_LOCK (recycled_builders);
+  keep = ffactory->n_recycled_builders < ffactory->max_recycled_builders;
+  if (keep)
+    ffactory->n_recycled_builders++;
+  G_UNLOCK (recycled_builders);
+  if (!keep)
+    builder_free (builder);
   else
     {
-      reinit_compressor (builder, ffactory->compression_level, TRUE);
+      reinit_compressor (builder, TRUE);
+      G_LOCK (recycled_builders);
       builder->next_recycled_builder = ffactory->recycled_builders;
       ffactory->recycled_builders = builder;
-      ffactory->n_recycled_builders++;
+      G_UNLOCK (recycled_builders);
     }
 }
 
@@ -940,6 +1736,39 @@ open_3_files (FlatFile                 *file,
   return TRUE;
 }
 
+static gboolean
+read_index_header (FlatFile  *ffile,
+                   guint64   *n_entries_out,
+                   GError   **error)
+{
+  guint64 header_le, header;
+  int prv = pread (ffile->fds[FILE_INDEX], &header_le, 8, 0);
+  if (prv < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_PREAD,
+                   "error reading nrecords from index file: %s",
+                   g_strerror (errno));
+      return FALSE;
+    }
+  if (prv < 8)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_PREAD,
+                   "premature eof reading nrecords from index file");
+      return FALSE;
+    }
+  header = GUINT64_FROM_LE (header_le);
+  if ((header >> CODEC_SHIFT) >= N_CODECS)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_CORRUPT,
+                   "unknown compression codec %u in index file",
+                   (guint) (header >> CODEC_SHIFT));
+      return FALSE;
+    }
+  ffile->codec = header >> CODEC_SHIFT;
+  *n_entries_out = header & ((G_GUINT64_CONSTANT (1) << CODEC_SHIFT) - 1);
+  return TRUE;
+}
+
 static GskTableFile *
 flat__create_file      (GskTableFileFactory      *factory,
                         const char               *dir,
@@ -959,7 +1788,8 @@ flat__create_file      (GskTableFileFactory      *factory,
       g_slice_free (FlatFile, rv);
       return NULL;
     }
-  rv->builder = flat_file_builder_new (ffactory);
+  rv->codec = ffactory->codec;
+  rv->builder = flat_file_builder_new (ffactory, rv->codec);
   for (f = 0; f < N_FILES; f++)
     {
       if (!mmap_writer_init_at (&rv->builder->writers[f], rv->fds[f], 0, error))
@@ -975,11 +1805,11 @@ flat__create_file      (GskTableFileFactory      *factory,
         }
     }
 
-  /* write the index file's header */
+  /* write the index file's header;  the count is filled in when done */
   {
-    guint64 zero_le = 0;
+    guint64 header_le = GUINT64_TO_LE ((guint64) rv->codec << CODEC_SHIFT);
     if (!mmap_writer_write (&rv->builder->writers[FILE_INDEX], 8,
-                            (guint8 *) &zero_le, error))
+                            (guint8 *) &header_le, error))
       {
         for (f = 0; f < N_FILES; f++)
           {
@@ -994,10 +1824,22 @@ flat__create_file      (GskTableFileFactory      *factory,
 
 
   rv->has_readers = FALSE;
-  rv->cache_entries_len = 0;
-  rv->cache_entries = NULL;
-  rv->cache_entries_count = 0;
-  rv->max_cache_entries = ffactory->max_cache_entries;
+  /* the bloom filter is sized from the hints, so we need a bound */
+  init_query_data (rv);
+  if (ffactory->bloom_bits_per_key > 0
+   && hints->max_entries != G_MAXUINT64
+   && !bloom_create (rv, dir, hints->max_entries,
+                     ffactory->bloom_bits_per_key, error))
+    {
+      for (f = 0; f < N_FILES; f++)
+        {
+          mmap_writer_clear (&rv->builder->writers[f]);
+          close (rv->fds[f]);
+        }
+      builder_recycle (ffactory, rv->builder);
+      g_slice_free (FlatFile, rv);
+      return NULL;
+    }
   return &rv->base_file;
 }
 
@@ -1019,7 +1861,19 @@ flat__open_building_file(GskTableFileFactory     *factory,
       return NULL;
     }
 
-  rv->builder = flat_file_builder_new (ffactory);
+  /* only the codec is valid in the header, until the file is done */
+  {
+    guint64 n_entries;
+    if (!read_index_header (rv, &n_entries, error))
+      {
+        guint f;
+        for (f = 0; f < N_FILES; f++)
+          close (rv->fds[f]);
+        g_slice_free (FlatFile, rv);
+        return NULL;
+      }
+  }
+  rv->builder = flat_file_builder_new (ffactory, rv->codec);
 
   /* seek according to 'state_data' */
   g_assert (state_len == 33);
@@ -1053,10 +1907,19 @@ flat__open_building_file(GskTableFileFactory     *factory,
   }
   rv->has_readers = FALSE;
 
-  rv->cache_entries_len = 0;
-  rv->cache_entries = NULL;
-  rv->cache_entries_count = 0;
-  rv->max_cache_entries = ffactory->max_cache_entries;
+  init_query_data (rv);
+  if (!bloom_open (rv, dir, TRUE, error))
+    {
+      guint f;
+      for (f = 0; f < N_FILES; f++)
+        {
+          mmap_writer_clear (&rv->builder->writers[f]);
+          close (rv->fds[f]);
+        }
+      builder_recycle (ffactory, rv->builder);
+      g_slice_free (FlatFile, rv);
+      return NULL;
+    }
 
   return &rv->base_file;
 }
@@ -1079,32 +1942,14 @@ flat__open_file        (GskTableFileFactory      *factory,
     }
   rv->builder = NULL;
 
-  /* pread() to get the number of records */
-  {
-    guint64 n_entries_le;
-    int prv = pread (rv->fds[FILE_INDEX], &n_entries_le, 8, 0);
-    if (prv < 0)
-      {
-        g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_PREAD,
-                     "error reading nrecords from index file: %s",
-                     g_strerror (errno));
-        for (f = 0; f < N_FILES; f++)
-          close (rv->fds[f]);
-        g_slice_free (FlatFile, rv);
-        return NULL;
-      }
-    if (prv < 8)
-      {
-        g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_PREAD,
-                     "premature eof reading nrecords from index file: %s",
-                     g_strerror (errno));
-        for (f = 0; f < N_FILES; f++)
-          close (rv->fds[f]);
-        g_slice_free (FlatFile, rv);
-        return NULL;
-      }
-    rv->base_file.n_entries = GUINT64_FROM_LE (n_entries_le);
-  }
+  /* pread() to get the number of records and the codec */
+  if (!read_index_header (rv, &rv->base_file.n_entries, error))
+    {
+      for (f = 0; f < N_FILES; f++)
+        close (rv->fds[f]);
+      g_slice_free (FlatFile, rv);
+      return NULL;
+    }
 
   /* mmap small files for reading */
   for (f = 0; f < N_FILES; f++)
@@ -1122,10 +1967,17 @@ flat__open_file        (GskTableFileFactory      *factory,
     }
   rv->has_readers = TRUE;
 
-  rv->cache_entries_len = 0;
-  rv->cache_entries = NULL;
-  rv->cache_entries_count = 0;
-  rv->max_cache_entries = ffactory->max_cache_entries;
+  init_query_data (rv);
+  if (!bloom_open (rv, dir, FALSE, error))
+    {
+      for (f = 0; f < N_FILES; f++)
+        {
+          mmap_reader_clear (&rv->readers[f]);
+          close (rv->fds[f]);
+        }
+      g_slice_free (FlatFile, rv);
+      return NULL;
+    }
 
   return &rv->base_file;
 }
@@ -1138,6 +1990,19 @@ do_compress (FlatFileBuilder *builder,
   //g_message ("do_compress: len=%u",len);
   builder->uncompressed_data_len += len;
 
+  /* the other codecs work on whole blocks */
+  switch (builder->codec)
+    {
+    case CODEC_NONE:
+      memcpy (gsk_table_buffer_append (&builder->compressed, len), data, len);
+      return;
+    case CODEC_LZ:
+      memcpy (gsk_table_buffer_append (&builder->block, len), data, len);
+      return;
+    case CODEC_ZLIB:
+      break;
+    }
+
   /* ensure there is enough data at the end of 'compressed' */
   gsk_table_buffer_ensure_extra (&builder->compressed, len / 2 + 16);
 
@@ -1176,6 +2041,18 @@ retry_deflate:
 static void
 do_compress_flush (FlatFileBuilder *builder)
 {
+  if (builder->codec == CODEC_NONE)
+    return;
+  if (builder->codec == CODEC_LZ)
+    {
+      guint block_len = builder->block.len;
+      guint8 *out = gsk_table_buffer_set_len (&builder->compressed,
+                                              GSK_TABLE_LZ_COMPRESS_BOUND (block_len));
+      gsk_table_buffer_set_len (&builder->compressed,
+                                gsk_table_lz_compress (block_len, builder->block.data, out));
+      return;
+    }
+
   /* 6 bytes is sufficient according to the zlib header file docs;
      add 10 for good measure. */
   gsk_table_buffer_ensure_extra (&builder->compressed, 6 + 10);
@@ -1204,9 +2081,10 @@ do_compress_flush (FlatFileBuilder *builder)
 }
 
 static gboolean
-flush_to_files (FlatFileBuilder *builder,
-                GError **error)
+flush_to_files (FlatFile *ffile,
+                GError  **error)
 {
+  FlatFileBuilder *builder = ffile->builder;
   /* emit index, keyfile and data file stuff */
   guint8 header[SIZEOF_INDEX_ENTRY];
   guint8 compressed_header[5 + 5];
@@ -1252,6 +2130,17 @@ flush_to_files (FlatFileBuilder *builder,
    || !mmap_writer_write (builder->writers + FILE_DATA, compressed_header_len, compressed_header, error)
    || !mmap_writer_write (builder->writers + FILE_DATA, builder->compressed.len, builder->compressed.data, error))
     return FALSE;
+
+  /* keep the in-memory index up-to-date, if it has been loaded */
+  if (ffile->has_key_index)
+    {
+      key_index_append (ffile,
+                        index_entry.compressed_data_offset,
+                        index_entry.compressed_data_len,
+                        index_entry.firstkeys_len);
+      memcpy (gsk_table_buffer_append (&ffile->key_index_keys, builder->first_key.len),
+              builder->first_key.data, builder->first_key.len);
+    }
   return TRUE;
 }
 
@@ -1273,6 +2162,8 @@ flat__feed_entry      (GskTableFile             *file,
   g_assert (builder != NULL);
 
   file->n_entries++;
+  if (ffile->bloom_mmapped != NULL)
+    bloom_add (ffile, key_len, key_data);
 
   if (builder->has_last_key)
     {
@@ -1318,12 +2209,14 @@ flat__feed_entry      (GskTableFile             *file,
   /* compress the value portion */
   do_compress (builder, value_len, value_data);
 
-  if (builder->compressed.len >= ffactory->bytes_per_chunk)
+  if ((builder->codec == CODEC_ZLIB ? builder->compressed.len
+                                    : builder->uncompressed_data_len)
+      >= ffactory->bytes_per_chunk)
     {
-      if (!flush_to_files (builder, error))
+      if (!flush_to_files (ffile, error))
         return GSK_TABLE_FEED_ENTRY_ERROR;
 
-      reinit_compressor (builder, ffactory->compression_level, TRUE);
+      reinit_compressor (builder, TRUE);
       builder->has_last_key = FALSE;
     }
   else
@@ -1347,7 +2240,7 @@ flat__done_feeding     (GskTableFile             *file,
   guint f;
   if (builder->has_last_key)
     {
-      if (!flush_to_files (builder, error))
+      if (!flush_to_files (ffile, error))
         return FALSE;
     }
 
@@ -1368,9 +2261,9 @@ flat__done_feeding     (GskTableFile             *file,
 
   /* write the number of records to the front */
   {
-    guint64 n_entries = file->n_entries;
-    guint64 n_entries_le = GUINT64_TO_LE (n_entries);
-    int pwrite_rv = pwrite (ffile->fds[FILE_INDEX], &n_entries_le, 8, 0);
+    guint64 header = file->n_entries | ((guint64) ffile->codec << CODEC_SHIFT);
+    guint64 header_le = GUINT64_TO_LE (header);
+    int pwrite_rv = pwrite (ffile->fds[FILE_INDEX], &header_le, 8, 0);
     if (pwrite_rv < 0)
       {
         g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_PWRITE,
@@ -1448,6 +2341,33 @@ flat__release_build_data(GskTableFile            *file)
   /* nothing to do, since we finish building immediately */
 }
 
+static gboolean
+flat__sync_file         (GskTableFile             *file,
+                         GError                  **error)
+{
+  FlatFile *ffile = (FlatFile *) file;
+  guint f;
+  for (f = 0; f < N_FILES; f++)
+    if (fsync (ffile->fds[f]) < 0)
+      {
+        g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                     "error syncing %s file: %s",
+                     file_extensions[f], g_strerror (errno));
+        return FALSE;
+      }
+
+  /* a stale bloom filter would hide keys, so it must be synced too */
+  if (ffile->bloom_mmapped != NULL
+   && msync (ffile->bloom_mmapped, ffile->bloom_mmapped_size, MS_SYNC) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                   "error syncing bloom file: %s",
+                   g_strerror (errno));
+      return FALSE;
+    }
+  return TRUE;
+}
+
 /* --- query api --- */
 static gboolean
 do_pread (FlatFile *ffile,
@@ -1476,11 +2396,10 @@ flat__query_file       (GskTableFile             *file,
                         GError                  **error)
 {
   FlatFile *ffile = (FlatFile *) file;
-  guint64 n_index_records, first, n;
+  guint64 n_index_records;
+  guint first, n;
   CacheEntry *cache_entry;
-  IndexEntry index_entry;
-  gboolean index_entry_up_to_date = FALSE;
-  guint8 index_entry_data[SIZEOF_INDEX_ENTRY];
+  KeyIndexEntry *index_entry;
   if (ffile->builder != NULL)
     n_index_records = (mmap_writer_offset (&ffile->builder->writers[FILE_INDEX]) - INDEX_HEADER_SIZE)
                     / SIZEOF_INDEX_ENTRY;
@@ -1495,101 +2414,61 @@ flat__query_file       (GskTableFile             *file,
       return FALSE;
     }
 
-  if (n_index_records == 0)
+  /* most keys are in few files: try to rule this one out cheaply */
+  if (query_inout->key_data != NULL
+   && ffile->bloom_mmapped != NULL
+   && !bloom_test (ffile, query_inout->key_len, query_inout->key_data))
+    {
+      query_inout->found = FALSE;
+      return TRUE;
+    }
+
+  if (!ffile->has_key_index
+   && !key_index_load (ffile, n_index_records, error))
+    return FALSE;
+
+  if (ffile->n_key_index == 0)
     {
       query_inout->found = FALSE;
       return TRUE;
     }
+
+  /* bsearch the in-memory index for the last chunk
+     whose first key is <= the key */
   first = 0;
-  n = n_index_records;
-  GskTableBuffer firstkey;
-  gsk_table_buffer_init (&firstkey);
+  n = ffile->n_key_index;
   while (n > 1)
     {
-      guint64 mid = first + n / 2;
+      guint mid = first + n / 2;
       gint compare_rv;
-
-      /* read index entry */
-      if (!do_pread (ffile, FILE_INDEX, mid * SIZEOF_INDEX_ENTRY + INDEX_HEADER_SIZE, SIZEOF_INDEX_ENTRY, index_entry_data, error))
-        {
-          gsk_table_buffer_clear (&firstkey);
-          return FALSE;
-        }
-      index_entry_deserialize (index_entry_data, &index_entry);
-
-      /* read key */
-      gsk_table_buffer_set_len (&firstkey, index_entry.firstkeys_len);
-      if (!do_pread (ffile, FILE_FIRSTKEYS, index_entry.firstkeys_offset, index_entry.firstkeys_len,
-                     firstkey.data, error))
-        {
-          gsk_table_buffer_clear (&firstkey);
-          return FALSE;
-        }
-
-      /* invoke comparator */
-      compare_rv = query_inout->compare (index_entry.firstkeys_len,
-                                         firstkey.data,
+      index_entry = ffile->key_index + mid;
+      compare_rv = query_inout->compare (index_entry->firstkey_len,
+                                         ffile->key_index_keys.data + index_entry->firstkey_offset,
                                          query_inout->compare_data);
-
       if (compare_rv < 0)
-        {
-          n = mid - first;
-          index_entry_up_to_date = FALSE;
-        }
+        n = mid - first;
       else if (compare_rv > 0)
         {
           n = first + n - mid;
           first = mid;
-          index_entry_up_to_date = TRUE;
         }
       else
         {
-          CacheEntryRecord *record;
-          cache_entry = cache_entry_force (ffile, mid,
-                                           &index_entry, firstkey.data,
-                                           error);
-          if (cache_entry == NULL)
-            {
-              gsk_table_buffer_clear (&firstkey);
-              return FALSE;
-            }
-          record = cache_entry->records + 0;
-          memcpy (gsk_table_buffer_set_len (&query_inout->value, record->value_len),
-                  record->value_data, record->value_len);
-          query_inout->found = TRUE;
-          gsk_table_buffer_clear (&firstkey);
-          return TRUE;
-        }
-    }
-
-  if (!index_entry_up_to_date)
-    {
-      /* read index entry */
-      if (!do_pread (ffile, FILE_INDEX, first * SIZEOF_INDEX_ENTRY + INDEX_HEADER_SIZE, SIZEOF_INDEX_ENTRY, index_entry_data, error))
-        return FALSE;
-      index_entry_deserialize (index_entry_data, &index_entry);
-
-      /* read firstkey */
-      gsk_table_buffer_set_len (&firstkey, index_entry.firstkeys_len);
-      if (!do_pread (ffile, FILE_FIRSTKEYS, index_entry.firstkeys_offset, index_entry.firstkeys_len,
-                     firstkey.data, error))
-        {
-          gsk_table_buffer_clear (&firstkey);
-          return FALSE;
+          first = mid;
+          break;
         }
     }
 
   /* uncompress block, cache */
-  cache_entry = cache_entry_force (ffile, first,
-                                   &index_entry, firstkey.data,
+  index_entry = ffile->key_index + first;
+  cache_entry = cache_entry_force (ffile, first, index_entry,
+                                   ffile->key_index_keys.data + index_entry->firstkey_offset,
                                    error);
   if (cache_entry == NULL)
-    {
-      gsk_table_buffer_clear (&firstkey);
-      return FALSE;
-    }
+    return FALSE;
 
   /* bsearch the uncompressed block */
+  query_inout->found = FALSE;
   {
     guint first = 0;
     guint n = cache_entry->n_entries;
@@ -1613,10 +2492,10 @@ flat__query_file       (GskTableFile             *file,
             memcpy (gsk_table_buffer_set_len (&query_inout->value, record->value_len),
                     record->value_data, record->value_len);
             query_inout->found = TRUE;
-            return TRUE;
+            break;
           }
       }
-    if (n == 1 && first < cache_entry->n_entries)
+    if (!query_inout->found && n == 1 && first < cache_entry->n_entries)
       {
         CacheEntryRecord *record = cache_entry->records + first;
         int compare_rv = query_inout->compare (record->key_len, record->key_data,
@@ -1626,11 +2505,10 @@ flat__query_file       (GskTableFile             *file,
             memcpy (gsk_table_buffer_set_len (&query_inout->value, record->value_len),
                     record->value_data, record->value_len);
             query_inout->found = TRUE;
-            return TRUE;
           }
       }
   }
-  query_inout->found = FALSE;
+  cache_entry_unref (cache_entry);
   return TRUE;
 }
 
@@ -1690,8 +2568,9 @@ read_and_uncompress_chunk (FlatFileReader *freader)
       return;
     }
 
-  /* do the actual un-gzipping and scanning */
-  freader->cache_entry = cache_entry_deserialize (freader->index_entry_index++,
+  /* do the actual uncompressing and scanning */
+  freader->cache_entry = cache_entry_deserialize (freader->codec, &freader->inflater,
+                                                  freader->index_entry_index++,
                                                   index_entry.firstkeys_len, firstkey,
                                                   index_entry.compressed_data_len, compressed_data,
                                                   &freader->base_reader.error);
@@ -1735,6 +2614,7 @@ reader_destroy (GskTableReader *reader)
   for (f = 0; f < N_FILES; f++)
     if (freader->fps[f] != NULL)
       fclose (freader->fps[f]);
+  inflater_clear (&freader->inflater);
   g_slice_free (FlatFileReader, freader);
 }
 
@@ -1747,6 +2627,8 @@ reader_open_fps (GskTableFile *file,
   guint f;
   freader->base_reader.eof = FALSE;
   freader->base_reader.error = NULL;
+  freader->codec = ((FlatFile *) file)->codec;
+  freader->inflater.inited = FALSE;
   for (f = 0; f < N_FILES; f++)
     {
       char fname_buf[GSK_TABLE_MAX_PATH];
@@ -1773,6 +2655,8 @@ reader_open_eof (void)
   guint f;
   freader->base_reader.eof = TRUE;
   freader->base_reader.error = NULL;
+  freader->codec = CODEC_NONE;
+  freader->inflater.inited = FALSE;
   for (f = 0; f < N_FILES; f++)
     freader->fps[f] = NULL;
   freader->base_reader.advance = reader_advance;
@@ -1904,6 +2788,7 @@ flat__recreate_reader  (GskTableFile             *file,
                          "unexpected eof restoring file reader");
           for (f = 0; f < N_FILES; f++)
             fclose (freader->fps[f]);
+          inflater_clear (&freader->inflater);
           g_slice_free (FlatFileReader, freader);
           return NULL;
         }
@@ -1918,6 +2803,7 @@ flat__recreate_reader  (GskTableFile             *file,
                          "record index out-of-bounds in state-data");
             for (f = 0; f < N_FILES; f++)
               fclose (freader->fps[f]);
+            inflater_clear (&freader->inflater);
             g_slice_free (FlatFileReader, freader);
             return NULL;
           }
@@ -1963,54 +2849,160 @@ flat__destroy_file     (GskTableFile             *file,
     }
   for (f = 0; f < N_FILES; f++)
     close (ffile->fds[f]);
+  clear_query_data (ffile);
   if (erase)
     {
+      char fname_buf[GSK_TABLE_MAX_PATH];
       for (f = 0; f < N_FILES; f++)
         {
-          char fname_buf[GSK_TABLE_MAX_PATH];
           gsk_table_mk_fname (fname_buf, dir, file->id, file_extensions[f]);
           unlink (fname_buf);
         }
+      gsk_table_mk_fname (fname_buf, dir, file->id, BLOOM_FILE_EXTENSION);
+      unlink (fname_buf);
     }
   g_slice_free (FlatFile, ffile);
   return TRUE;
 }
 
+static void flat__destroy_factory (GskTableFileFactory *factory);
+
+static FlatFactory default_flat_factory =
+{
+  {
+    flat__create_file,
+    flat__open_building_file,
+    flat__open_file,
+    flat__feed_entry,
+    flat__done_feeding,
+    flat__get_build_state,
+    flat__build_file,
+    flat__release_build_data,
+    flat__sync_file,
+    flat__query_file,
+    flat__create_reader,
+    flat__get_reader_state,
+    flat__recreate_reader,
+    flat__destroy_file,
+    flat__destroy_factory
+  },
+  16384,
+  CODEC_ZLIB,
+  3,                        /* zlib compression level */
+  0,                        /* n recycled builders */
+  8,                        /* max recycled builders */
+  NULL,                     /* recycled builder list */
+  NULL,                     /* block cache (the default one) */
+  10                        /* bloom filter bits per key */
+};
+
 static void
 flat__destroy_factory  (GskTableFileFactory      *factory)
 {
-  /* static factory */
+  FlatFactory *ffactory = (FlatFactory *) factory;
+  if (ffactory == &default_flat_factory)
+    return;
+  while (ffactory->recycled_builders != NULL)
+    {
+      FlatFileBuilder *builder = ffactory->recycled_builders;
+      ffactory->recycled_builders = builder->next_recycled_builder;
+      builder_free (builder);
+    }
+  if (ffactory->block_cache != default_block_cache)
+    block_cache_free (ffactory->block_cache);
+  g_free (ffactory);
 }
 
-
-/* for now, return a static factory object */
+/* the default factory is static, and shared by all tables */
 GskTableFileFactory *gsk_table_file_factory_new_flat (void)
 {
-  static FlatFactory the_factory =
+  default_flat_factory.block_cache
+    = peek_default_block_cache (default_flat_factory.bytes_per_chunk);
+  return &default_flat_factory.base_factory;
+}
+
+/**
+ * gsk_table_file_factory_new_flat_full:
+ * @compression: codec to use for the data blocks of new files.
+ * @compression_level: zlib's compression level, 0..9,
+ * or -1 for the default.
+ * @block_cache_bytes: the size of the factory's own cache
+ * of uncompressed blocks, or 0 to share the process-wide cache.
+ * @error: place to put the error if the arguments are invalid.
+ *
+ * Create a flat-file factory that compresses new files
+ * with the given codec.  Files record their codec,
+ * so any factory can open any file.
+ *
+ * returns: the new factory.
+ */
+GskTableFileFactory *
+gsk_table_file_factory_new_flat_full (GskTableCompression compression,
+                                      gint                compression_level,
+                                      gsize               block_cache_bytes,
+                                      GError            **error)
+{
+  FlatFactory *rv;
+  BlockCodec codec;
+  switch (compression)
     {
-      {
-        flat__create_file,
-        flat__open_building_file,
-        flat__open_file,
-        flat__feed_entry,
-        flat__done_feeding,
-        flat__get_build_state,
-        flat__build_file,
-        flat__release_build_data,
-        flat__query_file,
-        flat__create_reader,
-        flat__get_reader_state,
-        flat__recreate_reader,
-        flat__destroy_file,
-        flat__destroy_factory
-      },
-      16384,
-      3,                        /* zlib compression level */
-      0,                        /* n recycled builders */
-      8,                        /* max recycled builders */
-      NULL,                     /* recycled builder list */
-      24                        /* max cache entries */
-    };
-
-  return &the_factory.base_factory;
+    case GSK_TABLE_COMPRESSION_NONE: codec = CODEC_NONE; break;
+    case GSK_TABLE_COMPRESSION_ZLIB: codec = CODEC_ZLIB; break;
+    case GSK_TABLE_COMPRESSION_LZ:   codec = CODEC_LZ;   break;
+    default:
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_ARGUMENT,
+                   "unknown table compression %u", (guint) compression);
+      return NULL;
+    }
+  if (compression_level < -1 || compression_level > 9)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_ARGUMENT,
+                   "compression level %d out of range", compression_level);
+      return NULL;
+    }
+  if (codec == default_flat_factory.codec
+   && (compression_level < 0
+    || (guint) compression_level == default_flat_factory.compression_level)
+   && block_cache_bytes == 0)
+    return gsk_table_file_factory_new_flat ();
+
+  rv = g_new (FlatFactory, 1);
+  *rv = default_flat_factory;
+  rv->codec = codec;
+  if (compression_level >= 0)
+    rv->compression_level = compression_level;
+  rv->n_recycled_builders = 0;
+  rv->recycled_builders = NULL;
+  if (block_cache_bytes == 0)
+    rv->block_cache = peek_default_block_cache (rv->bytes_per_chunk);
+  else
+    rv->block_cache = block_cache_new (block_cache_bytes, rv->bytes_per_chunk);
+  return &rv->base_factory;
+}
+
+/**
+ * gsk_table_file_factory_flat_get_cache_stats:
+ * @factory: a factory from gsk_table_file_factory_new_flat()
+ * or gsk_table_file_factory_new_flat_full().
+ * @stats_out: the statistics of the factory's block cache.
+ *
+ * Get the counts of cache hits, misses and evictions,
+ * and the current usage of the factory's block cache,
+ * including how much of it holds hot blocks.
+ * If the cache is shared, so are the statistics.
+ */
+void
+gsk_table_file_factory_flat_get_cache_stats (GskTableFileFactory *factory,
+                                             GskTableCacheStats  *stats_out)
+{
+  BlockCache *cache = ((FlatFactory *) factory)->block_cache;
+  g_static_mutex_lock (&cache->lock);
+  stats_out->n_hits = cache->n_hits;
+  stats_out->n_misses = cache->n_misses;
+  stats_out->n_evictions = cache->n_evictions;
+  stats_out->n_blocks = cache->n_entries;
+  stats_out->n_bytes = cache->n_bytes;
+  stats_out->max_bytes = cache->max_bytes;
+  stats_out->n_hot_bytes = cache->n_bytes - cache->a1in_bytes;
+  g_static_mutex_unlock (&cache->lock);
 }
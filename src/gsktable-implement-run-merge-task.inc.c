@@ -66,10 +66,10 @@ MANGLE_FUNC_NAME(copy_file_reader) (GskTable  *table,
 
 static gboolean
 MANGLE_FUNC_NAME(run_merge_task)  (GskTable      *table,
+                                   MergeTask     *task,
                                    guint          iterations,
 	                           GError       **error)
 {
-  MergeTask *task = table->run_list;
   guint n_written = 0;
   g_assert (task->is_started);
 
@@ -95,14 +95,14 @@ MANGLE_FUNC_NAME(run_merge_task)  (GskTable      *table,
 # else
   GskTableSimplifyFuncNoLen simplify = table->simplify.no_len;
 # endif
-  GskTableBuffer *simp_buffer = &table->simplify_buffer;
+  GskTableBuffer *simp_buffer = &task->info.started.simplify_buffer;
 #endif
 
 #if !USE_MEMCMP || DO_SIMPLIFY || HAS_MERGE
   gpointer user_data = table->user_data;
 #endif
 #if HAS_MERGE
-  GskTableBuffer *merge_buf = &table->merge_buffer;
+  GskTableBuffer *merge_buf = &task->info.started.merge_buffer;
 #endif
 
 #if DO_FLUSH
@@ -432,7 +432,8 @@ do_advance_b:
   return TRUE;
 
 done:
-  return merge_task_done (table, task, error);
+  task->info.started.is_done = TRUE;
+  return TRUE;
 }
 
 #undef MAYBE_LEN
@@ -0,0 +1,237 @@
+#include <string.h>
+#include <glib.h>
+#include "gsktable-lz.h"
+
+#define MIN_MATCH       4
+#define MAX_OFFSET      65535
+
+/* the hash-table of recent positions: 16k on the stack */
+#define HASH_LOG        12
+#define HASH_SIZE       (1 << HASH_LOG)
+
+/* after this many misses in a row, start skipping ahead
+   faster; this keeps incompressible data cheap */
+#define SKIP_TRIGGER    6
+
+static inline guint32
+read32 (const guint8 *p)
+{
+  guint32 rv;
+  memcpy (&rv, p, 4);
+  return rv;
+}
+
+static inline guint
+hash32 (guint32 v)
+{
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static inline guint8 *
+emit_length (guint8 *out,
+             guint   len)
+{
+  while (len >= 255)
+    {
+      *out++ = 255;
+      len -= 255;
+    }
+  *out++ = len;
+  return out;
+}
+
+static inline guint8 *
+emit_literals (guint8       *out,
+               guint8       *token,
+               guint         len,
+               const guint8 *data)
+{
+  if (len >= 15)
+    {
+      *token = 15 << 4;
+      out = emit_length (out, len - 15);
+    }
+  else
+    *token = len << 4;
+  memcpy (out, data, len);
+  return out + len;
+}
+
+/**
+ * gsk_table_lz_compress:
+ * @in_len: length of the data to compress.
+ * @in_data: the data to compress.
+ * @out_data: buffer of at least GSK_TABLE_LZ_COMPRESS_BOUND(@in_len) bytes.
+ *
+ * Compress a block of data.
+ *
+ * returns: the number of bytes written to @out_data.
+ */
+guint
+gsk_table_lz_compress (guint         in_len,
+                       const guint8 *in_data,
+                       guint8       *out_data)
+{
+  guint32 table[HASH_SIZE];             /* position + 1, or 0 */
+  const guint8 *in_end = in_data + in_len;
+  const guint8 *at = in_data;
+  const guint8 *anchor = in_data;
+  guint8 *out = out_data;
+  guint8 *token;
+  guint n_misses = 0;
+
+  memset (table, 0, sizeof (table));
+  while (at + MIN_MATCH <= in_end)
+    {
+      guint32 v = read32 (at);
+      guint h = hash32 (v);
+      guint32 pos = table[h];
+      const guint8 *ref = in_data + pos - 1;
+      const guint8 *match_end;
+      guint offset, match_len;
+
+      table[h] = at - in_data + 1;
+      if (pos == 0
+       || at - ref > MAX_OFFSET
+       || read32 (ref) != v)
+        {
+          at += 1 + (n_misses++ >> SKIP_TRIGGER);
+          continue;
+        }
+      n_misses = 0;
+
+      /* extend the match backward into the pending literals,
+         and forward as far as it goes */
+      while (at > anchor && ref > in_data && at[-1] == ref[-1])
+        {
+          at--;
+          ref--;
+        }
+      match_end = at + MIN_MATCH;
+      ref += MIN_MATCH;
+      while (match_end < in_end && *match_end == *ref)
+        {
+          match_end++;
+          ref++;
+        }
+      offset = match_end - ref;
+      match_len = match_end - at - MIN_MATCH;
+
+      token = out++;
+      out = emit_literals (out, token, at - anchor, anchor);
+      *out++ = offset & 0xff;
+      *out++ = offset >> 8;
+      if (match_len >= 15)
+        {
+          *token |= 15;
+          out = emit_length (out, match_len - 15);
+        }
+      else
+        *token |= match_len;
+
+      /* remember a position inside the match too,
+         which helps runs and repeated records */
+      if (match_end - 2 >= in_data && match_end + 2 <= in_end)
+        table[hash32 (read32 (match_end - 2))] = match_end - 2 - in_data + 1;
+      at = anchor = match_end;
+    }
+
+  /* the last sequence:  just the remaining literals */
+  token = out++;
+  out = emit_literals (out, token, in_end - anchor, anchor);
+  return out - out_data;
+}
+
+static inline gboolean
+parse_length (const guint8 **at_inout,
+              const guint8  *end,
+              guint         *len_inout)
+{
+  const guint8 *at = *at_inout;
+  guint len = *len_inout;
+  guint8 b;
+  do
+    {
+      if (at == end || len > G_MAXUINT - 255)
+        return FALSE;
+      b = *at++;
+      len += b;
+    }
+  while (b == 255);
+  *at_inout = at;
+  *len_inout = len;
+  return TRUE;
+}
+
+/**
+ * gsk_table_lz_decompress:
+ * @in_len: length of the compressed data.
+ * @in_data: the compressed data.
+ * @out_len: the exact length of the uncompressed data.
+ * @out_data: buffer of @out_len bytes.
+ *
+ * Uncompress a block made by gsk_table_lz_compress().
+ * Corrupt input never reads or writes out-of-bounds.
+ *
+ * returns: whether the data was valid, and uncompressed to exactly @out_len bytes.
+ */
+gboolean
+gsk_table_lz_decompress (guint         in_len,
+                         const guint8 *in_data,
+                         guint         out_len,
+                         guint8       *out_data)
+{
+  const guint8 *at = in_data;
+  const guint8 *in_end = in_data + in_len;
+  guint8 *out = out_data;
+  guint8 *out_end = out_data + out_len;
+
+  for (;;)
+    {
+      guint token, len, offset;
+      const guint8 *ref;
+
+      if (at == in_end)
+        return FALSE;
+      token = *at++;
+
+      /* literals */
+      len = token >> 4;
+      if (len == 15 && !parse_length (&at, in_end, &len))
+        return FALSE;
+      if ((guint) (in_end - at) < len || (guint) (out_end - out) < len)
+        return FALSE;
+      memcpy (out, at, len);
+      out += len;
+      at += len;
+      if (at == in_end)
+        return out == out_end;
+
+      /* match */
+      if (in_end - at < 2)
+        return FALSE;
+      offset = at[0] | (at[1] << 8);
+      at += 2;
+      if (offset == 0 || offset > (guint) (out - out_data))
+        return FALSE;
+      len = token & 15;
+      if (len == 15 && !parse_length (&at, in_end, &len))
+        return FALSE;
+      len += MIN_MATCH;
+      if ((guint) (out_end - out) < len)
+        return FALSE;
+      ref = out - offset;
+      if (offset >= len)
+        {
+          memcpy (out, ref, len);
+          out += len;
+        }
+      else
+        {
+          /* overlapping copy:  repeats the last 'offset' bytes */
+          guint8 *end = out + len;
+          while (out < end)
+            *out++ = *ref++;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+/* GskTableLz:
+ *  A small, fast LZ77 block codec for GskTable's flat files.
+ *
+ *  The format is a series of sequences, each:
+ *      token:  high nibble is the literal length, low nibble the match length - 4;
+ *              15 means more length bytes follow (each adds 0..255, 255 means continue)
+ *      literal bytes
+ *      2-byte LE offset back into the output (1..65535)
+ *      more match-length bytes, if needed
+ *  The last sequence has only literals, and ends the input.
+ */
+
+#ifndef __GSK_TABLE_LZ_H_
+#define __GSK_TABLE_LZ_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* the maximum size gsk_table_lz_compress() may write */
+#define GSK_TABLE_LZ_COMPRESS_BOUND(in_len) \
+  ((in_len) + (in_len) / 255 + 16)
+
+guint    gsk_table_lz_compress   (guint         in_len,
+                                  const guint8 *in_data,
+                                  guint8       *out_data);
+gboolean gsk_table_lz_decompress (guint         in_len,
+                                  const guint8 *in_data,
+                                  guint         out_len,
+                                  guint8       *out_data);
+
+G_END_DECLS
+
+#endif
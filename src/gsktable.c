@@ -6,8 +6,6 @@
 /* NOTE: see 'setup' script for tests (etc) */
 /* POSSIBLE TODO: support key_fixed_length, value_fixed_length */
 /* POSSIBLE TODO: support disabling prefix compression */
-/* POSSIBLE TODO: support altering compression level */
-/* POSSIBLE TODO: support LZO compression */
 
 #include <string.h>
 #include <errno.h>
@@ -41,6 +39,10 @@ typedef struct _TreeNode TreeNode;
 #define DEBUG_JOURNAL_WRITING 0
 #define DEBUG_JOURNAL_REPLAY 0
 
+/* number of entries a merge thread writes before
+   giving other threads a chance to look at its task */
+#define MERGE_THREAD_BATCH_SIZE         4096
+
 #define TASK_IS_UNSTARTED(task) \
   ((task) == NULL || !(task)->is_started)
 
@@ -79,6 +81,15 @@ struct _MergeTask
         GskTableReader *reader;
       } inputs[2];
       MergeTask *next_run;
+
+      /* set while a merge thread is running the task:
+         only that thread may touch the readers and output */
+      gboolean is_claimed;
+      gboolean is_done;
+
+      /* scratch space for merge and simplify functions */
+      GskTableBuffer merge_buffer;
+      GskTableBuffer simplify_buffer;
     } started;
   } info;
 };
@@ -91,6 +102,7 @@ struct _FileInfo
   MergeTask *prev_task;         /* possible merge task with prior file */
   MergeTask *next_task;         /* possible merge task with next file */
   FileInfo *prev_file, *next_file;
+  gboolean is_synced;           /* for GSK_TABLE_JOURNAL_SYNC */
 };
 
 struct _TreeNode
@@ -106,8 +118,9 @@ struct _TreeNode
 #define GET_RUN_STACK(table) \
   MergeTask *, table->run_list, info.started.next_run
 
-/* always runs the table->run_list task */
+/* sets task->info.started.is_done once the inputs are exhausted */
 typedef gboolean (*RunTaskFunc) (GskTable   *table,
+                                 MergeTask  *task,
                                  guint       iterations,
                                  GError    **error);
 typedef struct _RunTaskFuncs RunTaskFuncs;
@@ -135,8 +148,14 @@ static RunTaskFuncs *
 static GskTableFileFactory *
               table_options_get_file_factory (const GskTableOptions *,
                                               GError **error);
+static gboolean start_merge_threads        (GskTable *table,
+                                            guint     n_threads,
+                                            GError  **error);
+static gboolean start_tasks_and_wakeup     (GskTable *table,
+                                            GError  **error);
 
 typedef TreeNode *(*InMemoryTreeLookupFunc) (GskTable     *table,
+                                             TreeNode     *top,
                                              guint         key_len,
                                              const guint8 *key_data);
 typedef int       (*TreeNodeCompareFunc)    (GskTable     *table,
@@ -183,6 +202,7 @@ struct _GskTable
   guint8 *journal_mmap;
   guint journal_len;                    /* current offset in journal */
   guint journal_size;                   /* size of journal data */
+  guint journal_synced_len;             /* for GSK_TABLE_JOURNAL_SYNC */
   GskTableJournalMode journal_mode;
   guint journal_flush_index;
 
@@ -211,6 +231,32 @@ struct _GskTable
   TreeNode *tree_node_pool;
   guint tree_node_pool_used;            /* out of max_in_memory_entries */
 
+  /* merge threads (only if n_merge_threads was given):
+     'lock' protects the whole table, except for the readers
+     and output of claimed tasks, and the flushing tree's nodes,
+     which are read-only until the flush is done. */
+  guint n_merge_threads;
+  GThread **merge_threads;
+  GMutex *lock;
+  GCond *work_cond;                     /* new task or flush; resume; shutdown */
+  GCond *idle_cond;                     /* task unclaimed; flush done */
+  guint n_claimed_tasks;
+  gboolean pause_merge_threads;
+  gboolean shutting_down;
+  GError *merge_thread_error;
+
+  /* the other tree: full, and waiting to be written
+     to a file by a merge thread */
+  gboolean is_flushing;                 /* until the journal is reset */
+  gboolean flush_pending;               /* no thread has started it */
+  TreeNode *flushing_tree;              /* NULL once the file is in place */
+  TreeNode *flushing_pool;
+  guint flushing_entry_count;
+  guint64 flushing_first_input_entry;
+  guint64 flushing_file_id;
+  guint journal_len_at_flush;           /* where the newer tree's adds start */
+  TreeNode *spare_tree_node_pool;
+
   /* fixed length keys and values can be optimized by not storing the length. */
   gssize key_fixed_length;               /* or -1 */
   gssize value_fixed_length;             /* or -1 */
@@ -218,7 +264,6 @@ struct _GskTable
   /* buffers */
   GskTableBuffer result_buffers[2];
   GskTableBuffer merge_buffer;
-  GskTableBuffer simplify_buffer;
   GskTableFileQuery file_query;
   guint file_query_key_len;
   const guint8 *file_query_key_data;
@@ -258,11 +303,18 @@ struct _GskTable
 #define TREE_NODE_IS_RED(node)         node->is_red
 #define TREE_NODE_SET_IS_RED(node,v)   node->is_red = v
 #define TREE_NODE_COMPARE(a,b,rv)      rv = table->tree_node_compare(table, a,b)
-#define GET_IN_MEMORY_TREE(table) \
-  (table)->in_memory_tree, TreeNode *, \
+#define GET_TREE(top) \
+  (top), TreeNode *, \
   TREE_NODE_IS_RED, TREE_NODE_SET_IS_RED, \
   parent, left, right, \
   TREE_NODE_COMPARE
+#define GET_IN_MEMORY_TREE(table) GET_TREE((table)->in_memory_tree)
+
+/* the lock only exists if there are merge threads */
+#define TABLE_LOCK(table) \
+  G_STMT_START{ if ((table)->lock) g_mutex_lock ((table)->lock); }G_STMT_END
+#define TABLE_UNLOCK(table) \
+  G_STMT_START{ if ((table)->lock) g_mutex_unlock ((table)->lock); }G_STMT_END
   
 
 static inline void
@@ -328,6 +380,7 @@ are_files_contiguous (GskTable *table)
 static gboolean read_journal  (GskTable    *table,
                                GError     **error);
 static gboolean reset_journal (GskTable    *table,
+                               guint        keep_from,
                                GError     **error);
 
 static inline void
@@ -693,6 +746,12 @@ read_journal (GskTable  *table,
       merge_task->is_started = TRUE;
       merge_task->inputs[0] = inputs[0].file_info;
       merge_task->inputs[1] = inputs[1].file_info;
+      merge_task->info.started.has_last_queryable_key = FALSE;
+      gsk_table_buffer_init (&merge_task->info.started.last_queryable_key);
+      merge_task->info.started.is_claimed = FALSE;
+      merge_task->info.started.is_done = FALSE;
+      gsk_table_buffer_init (&merge_task->info.started.merge_buffer);
+      gsk_table_buffer_init (&merge_task->info.started.simplify_buffer);
 
       for (j = 0; j < 2; j++)
         {
@@ -766,6 +825,7 @@ read_journal (GskTable  *table,
   /* setup various bits of the table;
      after doing this, do not goto error_cleanup,
      since it will free some of this data */
+  table->journal_fd = fd;
   table->journal_mmap = mmapped_journal;
   table->journal_size = journal_size;
   table->n_files = n_files;
@@ -890,8 +950,80 @@ resize_journal (gint       journal_fd,
   return TRUE;
 }
 
+/* make a rename() in the table's directory durable */
+static gboolean
+sync_dir (const char *dir,
+          GError    **error)
+{
+  int fd = open (dir, O_RDONLY);
+  if (fd < 0 || fsync (fd) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                   "error syncing directory %s: %s",
+                   dir, g_strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return FALSE;
+    }
+  close (fd);
+  return TRUE;
+}
+
+/* For GSK_TABLE_JOURNAL_SYNC: the new journal must not reach
+   the disk before the files it lists, nor before the partial
+   merge outputs whose build states it records.
+   Finished files never change, so each is synced only once. */
+static gboolean
+sync_table_files (GskTable *table,
+                  GError  **error)
+{
+  FileInfo *fi;
+  for (fi = table->first_file; fi; fi = fi->next_file)
+    {
+      if (!fi->is_synced)
+        {
+          if (!gsk_table_file_sync (fi->file, error))
+            return FALSE;
+          fi->is_synced = TRUE;
+        }
+      if (fi->next_task != NULL
+       && fi->next_task->is_started
+       && !gsk_table_file_sync (fi->next_task->info.started.output, error))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* For GSK_TABLE_JOURNAL_SYNC: write the adds journalled since
+   the last sync (and their terminator) to disk.  Called once
+   per gsk_table_add() or gsk_table_add_batch(). */
+static gboolean
+sync_journal (GskTable *table,
+              GError  **error)
+{
+  guint start, end;
+  if (table->journal_synced_len == table->journal_len)
+    return TRUE;
+  start = table->journal_synced_len & ~(guint) (getpagesize () - 1);
+  end = table->journal_len + 4;
+  if (msync (table->journal_mmap + start, end - start, MS_SYNC) < 0)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                   "error syncing journal: %s",
+                   g_strerror (errno));
+      return FALSE;
+    }
+  table->journal_synced_len = table->journal_len;
+  return TRUE;
+}
+
+/* Write a new journal describing the files and merge-tasks.
+   The adds journalled after 'keep_from' are copied into it:
+   they are the in-memory tree's, which is only nonempty
+   if a merge thread flushed the other tree. */
 static gboolean
 reset_journal (GskTable   *table,
+               guint       keep_from,
                GError    **error)
 {
   guint i;
@@ -900,11 +1032,21 @@ reset_journal (GskTable   *table,
   guint8 *journal_mmap;
   guint at;
   guint n_merge_tasks_written;
+  guint8 *kept = NULL;
+  guint kept_len = 0;
 
-  g_assert (table->in_memory_tree == NULL);
+  g_assert (table->n_claimed_tasks == 0);
 
   if (table->journal_mmap)
-    munmap (table->journal_mmap, table->journal_size);
+    {
+      g_assert (keep_from <= table->journal_len);
+      kept_len = table->journal_len - keep_from;
+      if (kept_len > 0)
+        kept = g_memdup (table->journal_mmap + keep_from, kept_len);
+      munmap (table->journal_mmap, table->journal_size);
+    }
+  else
+    g_assert (table->in_memory_entry_count == 0);
   if (table->journal_fd >= 0)
     close (table->journal_fd);
 
@@ -946,10 +1088,14 @@ reset_journal (GskTable   *table,
     header[0] = GUINT32_TO_LE (JOURNAL_FILE_MAGIC);
     header[1] = GUINT32_TO_LE (table->n_files);
     header[2] = GUINT32_TO_LE (table->n_running_tasks);
+    guint64 n_input_entries;
     header[3] = 0;              /* reserved */
-    tmp = table->n_input_entries;
+
+    /* replaying the kept adds will count them again */
+    n_input_entries = table->n_input_entries - table->in_memory_entry_count;
+    tmp = n_input_entries;
     header[4] = GUINT32_TO_LE (tmp);
-    tmp = table->n_input_entries>>32;
+    tmp = n_input_entries>>32;
     header[5] = GUINT32_TO_LE (tmp);
     memcpy (journal_mmap, header, 24);
   }
@@ -1047,6 +1193,41 @@ reset_journal (GskTable   *table,
       }
   g_assert (n_merge_tasks_written == table->n_running_tasks);
 
+#if DEBUG_JOURNAL_WRITING
+  g_message ("reset-journal: header length %u", at);
+#endif
+
+  /* align journal pointer */
+  if (at % 4 != 0)
+    at += 4 - (at % 4);
+
+  /* copy the kept adds, which are followed by a zero terminator */
+  if (kept_len > 0)
+    {
+      if (!resize_journal (journal_fd, &journal_mmap, &table->journal_size,
+                           at + kept_len + 4, error))
+        goto failed_writing_journal;
+      memcpy (journal_mmap + at, kept, kept_len);
+      memset (journal_mmap + at + kept_len, 0, 4);
+      at += kept_len;
+      g_free (kept);
+      kept = NULL;
+    }
+
+  /* the new journal must be on disk before it replaces the old one */
+  if (table->journal_mode == GSK_TABLE_JOURNAL_SYNC)
+    {
+      if (!sync_table_files (table, error))
+        goto failed_writing_journal;
+      if (fsync (journal_fd) < 0)
+        {
+          g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_FILE_WRITE,
+                       "error syncing new journal: %s",
+                       g_strerror (errno));
+          goto failed_writing_journal;
+        }
+    }
+
   /* move the journal into place */
   if (rename (table->journal_tmp_fname, table->journal_cur_fname) < 0)
     {
@@ -1055,18 +1236,14 @@ reset_journal (GskTable   *table,
                    g_strerror (errno));
       goto failed_writing_journal;
     }
-
-#if DEBUG_JOURNAL_WRITING
-  g_message ("reset-journal: header length %u", at);
-#endif
-
-
-  /* align journal pointer */
-  if (at % 4 != 0)
-    at += 4 - (at % 4);
+  if (table->journal_mode == GSK_TABLE_JOURNAL_SYNC
+   && !sync_dir (table->dir, error))
+    goto failed_writing_journal;
 
   table->journal_len = at;
+  table->journal_synced_len = at;
   table->journal_mmap = journal_mmap;
+  table->journal_fd = journal_fd;
 
   /* preserve old files */
   FileInfo **new_old_files;
@@ -1087,6 +1264,7 @@ reset_journal (GskTable   *table,
   return TRUE;
 
 failed_writing_journal:
+  g_free (kept);
   close (journal_fd);
   unlink (table->journal_tmp_fname);
   return FALSE;
@@ -1117,19 +1295,21 @@ static inline gint compare_memory (guint a_len, const guint8 *a_data,
 
 static TreeNode *
 in_memory_tree_lookup_memcmp (GskTable     *table,
+                              TreeNode     *top,
                               guint         key_len,
                               const guint8 *key_data)
 {
   TreeNode *found = NULL;
 #define TMP_KEY_COMPARATOR(unused, at, rv) \
   rv = compare_memory (key_len, key_data, at->key.len, at->key.data)
-  GSK_RBTREE_LOOKUP_COMPARATOR (GET_IN_MEMORY_TREE (table),
+  GSK_RBTREE_LOOKUP_COMPARATOR (GET_TREE (top),
                                 unused, TMP_KEY_COMPARATOR, found);
 #undef TMP_KEY_COMPARATOR
   return found;
 }
 static TreeNode *
 in_memory_tree_lookup_with_len (GskTable     *table,
+                                TreeNode     *top,
                                 guint         key_len,
                                 const guint8 *key_data)
 {
@@ -1138,7 +1318,7 @@ in_memory_tree_lookup_with_len (GskTable     *table,
   rv = table->compare.with_len (key_len, key_data, \
                                 at->key.len, at->key.data, \
                                 table->user_data)
-  GSK_RBTREE_LOOKUP_COMPARATOR (GET_IN_MEMORY_TREE (table),
+  GSK_RBTREE_LOOKUP_COMPARATOR (GET_TREE (top),
                                 unused, TMP_KEY_COMPARATOR, found);
 #undef TMP_KEY_COMPARATOR
   return found;
@@ -1146,13 +1326,14 @@ in_memory_tree_lookup_with_len (GskTable     *table,
 
 static TreeNode *
 in_memory_tree_lookup_no_len (GskTable     *table,
+                              TreeNode     *top,
                               guint         key_len,
                               const guint8 *key_data)
 {
   TreeNode *found = NULL;
 #define TMP_KEY_COMPARATOR(unused, at, rv) \
   rv = table->compare.no_len (key_data, at->key.data, table->user_data)
-  GSK_RBTREE_LOOKUP_COMPARATOR (GET_IN_MEMORY_TREE (table),
+  GSK_RBTREE_LOOKUP_COMPARATOR (GET_TREE (top),
                                 unused, TMP_KEY_COMPARATOR, found);
 #undef TMP_KEY_COMPARATOR
   return found;
@@ -1305,6 +1486,7 @@ gsk_table_new         (const char            *dir,
         {
           g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_EXISTS,
                        "table dir %s already exists", dir);
+          gsk_table_file_factory_destroy (factory);
           return NULL;
         }
       did_mkdir = FALSE;
@@ -1315,16 +1497,23 @@ gsk_table_new         (const char            *dir,
         {
           g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_EXISTS,
                        "table dir %s already exists", dir);
+          gsk_table_file_factory_destroy (factory);
           return NULL;
         }
       did_mkdir = TRUE;
       if (!gsk_mkdir_p (dir, 0755, error))
-        return FALSE;
+        {
+          gsk_table_file_factory_destroy (factory);
+          return NULL;
+        }
     }
 
   lock_fd = gsk_lock_dir (dir, FALSE, error);
   if (lock_fd < 0)
-    return FALSE;
+    {
+      gsk_table_file_factory_destroy (factory);
+      return NULL;
+    }
 
   table = g_new0 (GskTable, 1);
   table->dir = g_strdup (dir);
@@ -1345,7 +1534,7 @@ gsk_table_new         (const char            *dir,
                : has_len ? tree_node_compare_with_len
                : tree_node_compare_no_len;
   table->journal_mode = options->journal_mode;
-  table->max_running_tasks = 4;
+  table->max_running_tasks = MAX (4, options->n_merge_threads);
   table->max_merge_ratio_b16 = 3<<16;
   table->max_in_memory_bytes = options->max_in_memory_bytes;
   table->max_in_memory_entries = options->max_in_memory_entries;
@@ -1387,7 +1576,7 @@ gsk_table_new         (const char            *dir,
         journal_size += journal_size;
       table->journal_size = journal_size;
       table->journal_fd = -1;
-      if (!reset_journal (table, error))
+      if (!reset_journal (table, 0, error))
         {
           gsk_table_destroy (table);
           gsk_rm_rf (table->dir, NULL);
@@ -1412,6 +1601,25 @@ gsk_table_new         (const char            *dir,
         }
     }
 
+  /* the journal has been replayed, so from now on
+     merges and flushes go to the merge threads */
+  if (options->n_merge_threads > 0)
+    {
+      gboolean ok = start_merge_threads (table, options->n_merge_threads, error);
+      if (ok)
+        {
+          g_mutex_lock (table->lock);
+          ok = start_tasks_and_wakeup (table, error);
+          g_cond_broadcast (table->work_cond);
+          g_mutex_unlock (table->lock);
+        }
+      if (!ok)
+        {
+          gsk_table_destroy (table);
+          return NULL;
+        }
+    }
+
   return table;
 }
 
@@ -1430,6 +1638,7 @@ start_merge_task (GskTable   *table,
   guint input;
   GskTableReader *readers[2];
   guint64 n_input_entries = prev->file->n_entries + next->file->n_entries;
+  file_hints.max_entries = n_input_entries;   /* sizes the bloom filter */
 #if DEBUG_MERGE_TASKS
   g_message ("starting mergetask between "ID_FMT" and "ID_FMT" [%"G_GUINT64_FORMAT" input entries]",
              prev->file->id, next->file->id, n_input_entries);
@@ -1490,6 +1699,10 @@ start_merge_task (GskTable   *table,
   merge_task->info.started.inputs[1].reader = readers[1];
   merge_task->info.started.has_last_queryable_key = FALSE;
   gsk_table_buffer_init (&merge_task->info.started.last_queryable_key);
+  merge_task->info.started.is_claimed = FALSE;
+  merge_task->info.started.is_done = FALSE;
+  gsk_table_buffer_init (&merge_task->info.started.merge_buffer);
+  gsk_table_buffer_init (&merge_task->info.started.simplify_buffer);
 
   /* insert into run-list */
   MergeTask **p_next = &table->run_list;
@@ -1530,13 +1743,18 @@ maybe_start_tasks (GskTable *table,
   return TRUE;
 }
 
+static gboolean merge_task_finish_output (MergeTask *task,
+                                          GError   **error);
+static void     merge_task_done          (GskTable  *table,
+                                          MergeTask *task);
+
 static inline gboolean
 run_merge_task (GskTable   *table,
+                MergeTask  *merge_task,
                 guint       count,
                 gboolean    flush,
                 GError    **error)
 {
-  MergeTask *merge_task = table->run_list;
   RunTaskFuncs *run_funcs = table->run_funcs;
   RunTaskFunc func;
   gboolean use_simplify;
@@ -1555,7 +1773,7 @@ run_merge_task (GskTable   *table,
                                : run_funcs->simplify_noflush)
                       : (flush ? run_funcs->nosimplify_flush
                                : run_funcs->nosimplify_noflush);
-  return (*func) (table, count, error);
+  return (*func) (table, merge_task, count, error);
 }
 
 static gboolean
@@ -1576,51 +1794,95 @@ dump_tree_recursively (TreeNode    *node,
   return TRUE;
 }
 
+/* Finish feeding a newly written file; destroys it on failure. */
 static gboolean
-flush_tree (GskTable   *table,
-            GError    **error)
+finish_new_file (GskTable     *table,
+                 GskTableFile *file,
+                 GError      **error)
 {
-  guint64 id = ++(table->last_file_id);
-  GskTableFileHints file_hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
-  GskTableFile *file = gsk_table_file_factory_create_file (table->file_factory,
-                                                           table->dir,
-                                                           id,
-                                                           &file_hints,
-                                                           error);
-  FileInfo *fi;
   gboolean done;
+  if (!gsk_table_file_done_feeding (file, &done, error))
+    {
+      gsk_table_file_destroy (file, table->dir, TRUE, NULL);
+      return FALSE;
+    }
+  if (done == FALSE)
+    {
+      g_error ("TODO: handle files that require a bit of baking at end");
+    }
+  return TRUE;
+}
+
+/* Write a tree to a new file.  This only uses the table's
+   dir and file-factory, so merge threads may call it unlocked. */
+static GskTableFile *
+write_tree_file (GskTable   *table,
+                 TreeNode   *tree,
+                 guint64     id,
+                 guint       n_entries,
+                 GError    **error)
+{
+  GskTableFileHints file_hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GskTableFile *file;
+  file_hints.max_entries = n_entries;
+  file = gsk_table_file_factory_create_file (table->file_factory,
+                                             table->dir,
+                                             id,
+                                             &file_hints,
+                                             error);
   if (file == NULL)
     {
       gsk_g_error_add_prefix (error, "flushing in-memory tree");
-      return FALSE;
+      return NULL;
     }
-  if (!dump_tree_recursively (table->in_memory_tree, file, error))
+
+  /* every entry may have been dropped by merging */
+  if (tree != NULL && !dump_tree_recursively (tree, file, error))
     {
       gsk_g_error_add_prefix (error, "dumping in-memory tree");
       gsk_table_file_destroy (file, table->dir, TRUE, NULL);
-      return FALSE;
+      return NULL;
     }
-  if (!gsk_table_file_done_feeding (file, &done, error))
+  if (!finish_new_file (table, file, error))
     {
       gsk_g_error_add_prefix (error, "finishing flushing in-memory tree");
-      gsk_table_file_destroy (file, table->dir, TRUE, NULL);
-      return FALSE;
-    }
-  if (done == FALSE)
-    {
-      g_error ("TODO: handle files that require a bit of baking at end");
+      return NULL;
     }
+  return file;
+}
 
-  fi = g_slice_new0 (FileInfo);
+/* append a newly flushed file to the list of files */
+static void
+add_flushed_file (GskTable     *table,
+                  GskTableFile *file,
+                  guint64       first_input_entry,
+                  guint64       n_input_entries)
+{
+  FileInfo *fi = g_slice_new0 (FileInfo);
   fi->ref_count = 1;
-  fi->first_input_entry = table->n_input_entries - table->in_memory_entry_count;
-  fi->n_input_entries = table->in_memory_entry_count;
+  fi->first_input_entry = first_input_entry;
+  fi->n_input_entries = n_input_entries;
   fi->file = file;
   table->n_files++;
   GSK_LIST_APPEND (GET_FILE_INFO_LIST (table), fi);
   if (fi->prev_file && TASK_IS_UNSTARTED (fi->prev_file->prev_task))
     create_unstarted_merge_task (table, fi->prev_file, fi);
   CHECK_FILES_CONTIGUOUS (table);
+}
+
+static gboolean
+flush_tree (GskTable   *table,
+            GError    **error)
+{
+  guint64 id = ++(table->last_file_id);
+  GskTableFile *file;
+  file = write_tree_file (table, table->in_memory_tree, id,
+                          table->in_memory_entry_count, error);
+  if (file == NULL)
+    return FALSE;
+  add_flushed_file (table, file,
+                    table->n_input_entries - table->in_memory_entry_count,
+                    table->in_memory_entry_count);
 
   /* reset tree */
   table->in_memory_entry_count = 0;
@@ -1630,132 +1892,350 @@ flush_tree (GskTable   *table,
   return TRUE;
 }
 
-/**
- * gsk_table_add:
- * @table: the table to add data to.
- * @key_len:
- * @key_data:
- * @value_len:
- * @value_data:
- * @error: place to put the error if something goes wrong.
- *
- * Add a new key/value pair to a GskTable.
- * If the key already exists, the semantics are dependent
- * on the merge function; if no merge function is given,
- * then both rows will exist in the table.
- *
- * returns: whether the addition was successful.
- */
-gboolean
-gsk_table_add         (GskTable              *table,
-                       guint                  key_len,
-                       const guint8          *key_data,
-                       guint                  value_len,
-                       const guint8          *value_data,
-                       GError               **error)
+/* --- merge threads --- */
+/* called with the lock held */
+static void
+pause_merge_threads (GskTable *table)
 {
-  TreeNode *found;
-  gboolean must_write_journal = table->journal_mode == GSK_TABLE_JOURNAL_DEFAULT;
-  g_assert (table->key_fixed_length < 0
-         || (guint) table->key_fixed_length == key_len);
-  g_assert (table->value_fixed_length < 0
-         || (guint) table->value_fixed_length == value_len);
+  g_assert (!table->pause_merge_threads);
+  table->pause_merge_threads = TRUE;
+  while (table->n_claimed_tasks > 0)
+    g_cond_wait (table->idle_cond, table->lock);
+}
 
-  table->n_input_entries++;
+static void
+resume_merge_threads (GskTable *table)
+{
+  table->pause_merge_threads = FALSE;
+  g_cond_broadcast (table->work_cond);
+}
 
-  if (table->merge.no_len == NULL)
-    found = NULL;
-  else
-    found = table->in_memory_tree_lookup (table, key_len, key_data);
-  if (found)
+static gboolean
+start_tasks_and_wakeup (GskTable *table,
+                        GError  **error)
+{
+  guint old_n_running = table->n_running_tasks;
+  if (!maybe_start_tasks (table, error))
+    return FALSE;
+  if (table->n_running_tasks > old_n_running)
+    g_cond_broadcast (table->work_cond);
+  return TRUE;
+}
+
+/* Make the in-memory tree the flushing tree, and start a new one.
+   Called with the lock held, by the thread doing the add. */
+static gboolean
+swap_in_memory_trees (GskTable *table,
+                      GError  **error)
+{
+  /* wait for the last flush to finish;  this is the only
+     time an add waits for a merge thread */
+  while (table->is_flushing && table->merge_thread_error == NULL)
+    g_cond_wait (table->idle_cond, table->lock);
+  if (table->merge_thread_error != NULL)
     {
-      /* Merge the old data with the new data. */
-      GskTableMergeResult merge_result;
-      if (table->has_len)
-        merge_result = table->merge.with_len (key_len, key_data,
-                                       found->value.len, found->value.data,
-                                       value_len, value_data,
-                                       &table->merge_buffer, table->user_data);
-      else
-        merge_result = table->merge.no_len (key_data, found->value.data,
-                                       value_data,
-                                       &table->merge_buffer, table->user_data);
+      g_propagate_error (error, g_error_copy (table->merge_thread_error));
+      return FALSE;
+    }
 
-      switch (merge_result)
+  table->flushing_tree = table->in_memory_tree;
+  table->flushing_pool = table->tree_node_pool;
+  table->flushing_entry_count = table->in_memory_entry_count;
+  table->flushing_first_input_entry = table->n_input_entries
+                                    - table->in_memory_entry_count;
+  table->flushing_file_id = ++(table->last_file_id);
+  table->journal_len_at_flush = table->journal_len;
+  table->is_flushing = TRUE;
+  table->flush_pending = TRUE;
+
+  table->tree_node_pool = table->spare_tree_node_pool;
+  table->spare_tree_node_pool = NULL;
+  table->in_memory_tree = NULL;
+  table->in_memory_entry_count = 0;
+  table->in_memory_bytes = 0;
+  table->tree_node_pool_used = 0;
+
+  g_cond_signal (table->work_cond);
+  return TRUE;
+}
+
+/* Called with the lock held; drops it while writing the file. */
+static gboolean
+merge_thread_flush (GskTable *table,
+                    GError  **error)
+{
+  GskTableFile *file;
+  table->flush_pending = FALSE;
+
+  g_mutex_unlock (table->lock);
+  file = write_tree_file (table, table->flushing_tree,
+                          table->flushing_file_id,
+                          table->flushing_entry_count, error);
+  g_mutex_lock (table->lock);
+  if (file == NULL)
+    return FALSE;
+
+  /* queries now find these entries in the file */
+  add_flushed_file (table, file, table->flushing_first_input_entry,
+                    table->flushing_entry_count);
+  table->flushing_tree = NULL;
+
+  if (table->journal_mode != GSK_TABLE_JOURNAL_NONE
+   && (++(table->journal_flush_index) == table->journal_flush_period))
+    {
+      gboolean ok;
+      pause_merge_threads (table);
+      ok = reset_journal (table, table->journal_len_at_flush, error);
+      resume_merge_threads (table);
+      if (!ok)
         {
-        case GSK_TABLE_MERGE_RETURN_A:
-          /* nothing to do */
-          break;
-        case GSK_TABLE_MERGE_RETURN_B:
-          table->in_memory_bytes -= found->value.len;
-          table->in_memory_bytes += value_len;
-          set_buffer (&found->value, value_len, value_data);
-          break;
-        case GSK_TABLE_MERGE_SUCCESS:
-          table->in_memory_bytes -= found->value.len;
-          table->in_memory_bytes += table->merge_buffer.len;
-          copy_buffer (&found->value, &table->merge_buffer);
-          break;
-        case GSK_TABLE_MERGE_DROP:
-          GSK_RBTREE_REMOVE (GET_IN_MEMORY_TREE (table), found);
-          /* TreeNode itself will be auto-recycled */
-          break;
+          gsk_g_error_add_prefix (error, "error flushing journal");
+          return FALSE;
         }
+      table->journal_flush_index = 0;
     }
-  else
-    {
-      TreeNode *new = table->tree_node_pool + table->tree_node_pool_used++;
 
-      /* write key and value into the new node */
-      set_buffer (&new->key, key_len, key_data);
-      set_buffer (&new->value, value_len, value_data);
+  table->spare_tree_node_pool = table->flushing_pool;
+  table->flushing_pool = NULL;
+  table->is_flushing = FALSE;
+  g_cond_broadcast (table->idle_cond);
 
-      /* TODO: this repeats the work of the lookup.
-         maybe we need a GSK_RBTREE_INSERT_NO_REPLACE()
-         which can be used at the outset instead of LOOKUP_COMPARATOR? */
-      GSK_RBTREE_INSERT (GET_IN_MEMORY_TREE (table), new, found);
-      g_assert (found == NULL);
+  return start_tasks_and_wakeup (table, error);
+}
 
-      table->in_memory_bytes += key_len + value_len;
+static MergeTask *
+find_unclaimed_task (GskTable *table)
+{
+  MergeTask *task;
+  for (task = table->run_list; task != NULL; task = task->info.started.next_run)
+    if (!task->info.started.is_claimed)
+      return task;
+  return NULL;
+}
+
+/* Called with the lock held; drops it while merging. */
+static gboolean
+merge_thread_run_task (GskTable  *table,
+                       MergeTask *task,
+                       GError   **error)
+{
+  gboolean ok;
+  task->info.started.is_claimed = TRUE;
+  table->n_claimed_tasks++;
+
+  g_mutex_unlock (table->lock);
+  ok = run_merge_task (table, task, MERGE_THREAD_BATCH_SIZE, FALSE, error);
+  if (ok && task->info.started.is_done)
+    ok = merge_task_finish_output (task, error);
+  g_mutex_lock (table->lock);
+
+  table->n_claimed_tasks--;
+  g_cond_broadcast (table->idle_cond);
+  if (!ok)
+    return FALSE;               /* leave it claimed, so it isn't retried */
+  task->info.started.is_claimed = FALSE;
+  if (task->info.started.is_done)
+    {
+      merge_task_done (table, task);
+      return start_tasks_and_wakeup (table, error);
     }
+  return TRUE;
+}
 
-  table->in_memory_entry_count++;
-  if (table->in_memory_entry_count == table->max_in_memory_entries
-   || table->in_memory_bytes >= table->max_in_memory_bytes)
+static gpointer
+merge_thread_func (gpointer data)
+{
+  GskTable *table = data;
+  g_mutex_lock (table->lock);
+  while (!table->shutting_down)
     {
-      /* flush the tree */
-      if (!flush_tree (table, error))
+      GError *error = NULL;
+      gboolean ok;
+      MergeTask *task;
+
+      if (table->pause_merge_threads
+       || table->merge_thread_error != NULL)
         {
-          gsk_g_error_add_prefix (error, "flushing tree");
-          return FALSE;
+          g_cond_wait (table->work_cond, table->lock);
+          continue;
         }
 
-      /* maybe flush journal */
-      if (table->journal_mode != GSK_TABLE_JOURNAL_NONE
-       && (++(table->journal_flush_index) == table->journal_flush_period))
+      /* flushes come first, since adds may be waiting for them */
+      if (table->flush_pending)
+        ok = merge_thread_flush (table, &error);
+      else if ((task = find_unclaimed_task (table)) != NULL)
+        ok = merge_thread_run_task (table, task, &error);
+      else
         {
-          /* write new journal */
-          if (!reset_journal (table, error))
-            {
-              gsk_g_error_add_prefix (error, "error flushing journal");
-              return FALSE;
-            }
+          g_cond_wait (table->work_cond, table->lock);
+          continue;
+        }
 
-          table->journal_flush_index = 0;
-          must_write_journal = FALSE;
+      if (!ok)
+        {
+          g_warning ("GskTable merge thread: %s", error->message);
+          if (table->merge_thread_error == NULL)
+            table->merge_thread_error = error;
+          else
+            g_error_free (error);
+          g_cond_broadcast (table->idle_cond);
         }
+    }
+  g_mutex_unlock (table->lock);
+  return NULL;
+}
 
-      if (!maybe_start_tasks (table, error))
-        return FALSE;
+static gboolean
+start_merge_threads (GskTable *table,
+                     guint     n_threads,
+                     GError  **error)
+{
+  guint i;
+  if (!g_thread_supported ())
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_ARGUMENT,
+                   "merge threads requested, but threads are not initialized");
+      return FALSE;
     }
+  table->lock = g_mutex_new ();
+  table->work_cond = g_cond_new ();
+  table->idle_cond = g_cond_new ();
+  table->spare_tree_node_pool = g_new0 (TreeNode, table->max_in_memory_entries);
+  table->merge_threads = g_new (GThread *, n_threads);
+  for (i = 0; i < n_threads; i++)
+    {
+      table->merge_threads[i] = g_thread_create (merge_thread_func, table, TRUE, error);
+      if (table->merge_threads[i] == NULL)
+        {
+          gsk_g_error_add_prefix (error, "starting merge thread");
+          break;
+        }
+      table->n_merge_threads++;
+    }
+  return table->n_merge_threads == n_threads;
+}
+
+static void
+stop_merge_threads (GskTable *table)
+{
+  guint i;
+  if (table->lock == NULL)
+    return;
+  g_mutex_lock (table->lock);
+  table->shutting_down = TRUE;
+  g_cond_broadcast (table->work_cond);
+  g_mutex_unlock (table->lock);
+  for (i = 0; i < table->n_merge_threads; i++)
+    g_thread_join (table->merge_threads[i]);
+  g_free (table->merge_threads);
+  table->merge_threads = NULL;
+  table->n_merge_threads = 0;
+}
 
-  if (table->run_list != NULL)
+/* without merge threads, each add runs a little of the first merge task */
+static gboolean
+step_merge_tasks (GskTable *table,
+                  GError  **error)
+{
+  if (table->n_merge_threads == 0 && table->run_list != NULL)
     {
-      if (!run_merge_task (table, 32, FALSE, error))
+      MergeTask *task = table->run_list;
+      if (!run_merge_task (table, task, 32, FALSE, error))
         return FALSE;
+      if (task->info.started.is_done)
+        {
+          if (!merge_task_finish_output (task, error))
+            return FALSE;
+          merge_task_done (table, task);
+        }
+    }
+  return TRUE;
+}
+
+static gboolean
+add_unlocked (GskTable              *table,
+              guint                  key_len,
+              const guint8          *key_data,
+              guint                  value_len,
+              const guint8          *value_data,
+              GError               **error)
+{
+  TreeNode *found;
+  g_assert (table->key_fixed_length < 0
+         || (guint) table->key_fixed_length == key_len);
+  g_assert (table->value_fixed_length < 0
+         || (guint) table->value_fixed_length == value_len);
+
+  if (table->merge_thread_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (table->merge_thread_error));
+      return FALSE;
+    }
+
+  table->n_input_entries++;
+
+  if (table->merge.no_len == NULL)
+    found = NULL;
+  else
+    found = table->in_memory_tree_lookup (table, table->in_memory_tree,
+                                          key_len, key_data);
+  if (found)
+    {
+      /* Merge the old data with the new data. */
+      GskTableMergeResult merge_result;
+      if (table->has_len)
+        merge_result = table->merge.with_len (key_len, key_data,
+                                       found->value.len, found->value.data,
+                                       value_len, value_data,
+                                       &table->merge_buffer, table->user_data);
+      else
+        merge_result = table->merge.no_len (key_data, found->value.data,
+                                       value_data,
+                                       &table->merge_buffer, table->user_data);
+
+      switch (merge_result)
+        {
+        case GSK_TABLE_MERGE_RETURN_A:
+          /* nothing to do */
+          break;
+        case GSK_TABLE_MERGE_RETURN_B:
+          table->in_memory_bytes -= found->value.len;
+          table->in_memory_bytes += value_len;
+          set_buffer (&found->value, value_len, value_data);
+          break;
+        case GSK_TABLE_MERGE_SUCCESS:
+          table->in_memory_bytes -= found->value.len;
+          table->in_memory_bytes += table->merge_buffer.len;
+          copy_buffer (&found->value, &table->merge_buffer);
+          break;
+        case GSK_TABLE_MERGE_DROP:
+          GSK_RBTREE_REMOVE (GET_IN_MEMORY_TREE (table), found);
+          /* TreeNode itself will be auto-recycled */
+          break;
+        }
+    }
+  else
+    {
+      TreeNode *new = table->tree_node_pool + table->tree_node_pool_used++;
+
+      /* write key and value into the new node */
+      set_buffer (&new->key, key_len, key_data);
+      set_buffer (&new->value, value_len, value_data);
+
+      /* TODO: this repeats the work of the lookup.
+         maybe we need a GSK_RBTREE_INSERT_NO_REPLACE()
+         which can be used at the outset instead of LOOKUP_COMPARATOR? */
+      GSK_RBTREE_INSERT (GET_IN_MEMORY_TREE (table), new, found);
+      g_assert (found == NULL);
+
+      table->in_memory_bytes += key_len + value_len;
     }
+  table->in_memory_entry_count++;
 
-  if (must_write_journal)
+  /* journal the add before a flush, so that, with merge threads,
+     it falls on the flushing tree's side of journal_len_at_flush */
+  if (table->journal_mode == GSK_TABLE_JOURNAL_DEFAULT
+   || table->journal_mode == GSK_TABLE_JOURNAL_SYNC)
     {
       guint new_journal_len = 4 + key_len + 4 + value_len + table->journal_len;
       if (new_journal_len % 4 != 0)
@@ -1787,7 +2267,73 @@ gsk_table_add         (GskTable              *table,
          = GUINT32_TO_LE (key_len + 1);
       table->journal_len = new_journal_len;
     }
-  return TRUE;
+
+  if (table->in_memory_entry_count == table->max_in_memory_entries
+   || table->in_memory_bytes >= table->max_in_memory_bytes)
+    {
+      /* with merge threads, one of them writes the file */
+      if (table->n_merge_threads > 0)
+        return swap_in_memory_trees (table, error);
+
+      /* flush the tree */
+      if (!flush_tree (table, error))
+        {
+          gsk_g_error_add_prefix (error, "flushing tree");
+          return FALSE;
+        }
+
+      /* maybe flush journal */
+      if (table->journal_mode != GSK_TABLE_JOURNAL_NONE
+       && (++(table->journal_flush_index) == table->journal_flush_period))
+        {
+          /* write new journal */
+          if (!reset_journal (table, table->journal_len, error))
+            {
+              gsk_g_error_add_prefix (error, "error flushing journal");
+              return FALSE;
+            }
+
+          table->journal_flush_index = 0;
+        }
+
+      if (!maybe_start_tasks (table, error))
+        return FALSE;
+    }
+
+  return step_merge_tasks (table, error);
+}
+
+/**
+ * gsk_table_add:
+ * @table: the table to add data to.
+ * @key_len:
+ * @key_data:
+ * @value_len:
+ * @value_data:
+ * @error: place to put the error if something goes wrong.
+ *
+ * Add a new key/value pair to a GskTable.
+ * If the key already exists, the semantics are dependent
+ * on the merge function; if no merge function is given,
+ * then both rows will exist in the table.
+ *
+ * returns: whether the addition was successful.
+ */
+gboolean
+gsk_table_add         (GskTable              *table,
+                       guint                  key_len,
+                       const guint8          *key_data,
+                       guint                  value_len,
+                       const guint8          *value_data,
+                       GError               **error)
+{
+  gboolean rv;
+  TABLE_LOCK (table);
+  rv = add_unlocked (table, key_len, key_data, value_len, value_data, error);
+  if (rv && table->journal_mode == GSK_TABLE_JOURNAL_SYNC)
+    rv = sync_journal (table, error);
+  TABLE_UNLOCK (table);
+  return rv;
 }
 
 static inline int
@@ -1805,8 +2351,321 @@ do_compare (GskTable *table,
     return table->compare.no_len (a_data, b_data, table->user_data);
 }
 
+/* --- batches --- */
+/* Write a sorted batch straight to a new file, merging equal keys
+   in the order given, as the in-memory tree would have. */
+static GskTableFile *
+write_sorted_batch_file (GskTable                 *table,
+                         guint                     n_entries,
+                         const GskTableBatchEntry *entries,
+                         guint64                   id,
+                         GError                  **error)
+{
+  GskTableFileHints file_hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GskTableBuffer merged[2] = { GSK_TABLE_BUFFER_INIT, GSK_TABLE_BUFFER_INIT };
+  guint which = 0;
+  const GskTableBatchEntry *prev = NULL;
+  gboolean has_value = FALSE;
+  guint value_len = 0;
+  const guint8 *value_data = NULL;
+  GskTableFile *file;
+  guint i;
+
+  file_hints.max_entries = n_entries;
+  file = gsk_table_file_factory_create_file (table->file_factory,
+                                             table->dir, id,
+                                             &file_hints, error);
+  if (file == NULL)
+    return NULL;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      const GskTableBatchEntry *entry = entries + i;
+      g_assert (table->key_fixed_length < 0
+             || (guint) table->key_fixed_length == entry->key_len);
+      g_assert (table->value_fixed_length < 0
+             || (guint) table->value_fixed_length == entry->value_len);
+      if (prev != NULL)
+        {
+          int cmp = do_compare (table, prev->key_len, prev->key_data,
+                                entry->key_len, entry->key_data);
+          if (cmp > 0)
+            {
+              g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_ARGUMENT,
+                           "batch entry %u is out of order", i);
+              goto failed;
+            }
+          if (cmp == 0 && has_value && table->merge.no_len != NULL)
+            {
+              GskTableMergeResult merge_result;
+              GskTableBuffer *out = &merged[which];
+              if (table->has_len)
+                merge_result = table->merge.with_len (entry->key_len, entry->key_data,
+                                               value_len, value_data,
+                                               entry->value_len, entry->value_data,
+                                               out, table->user_data);
+              else
+                merge_result = table->merge.no_len (entry->key_data, value_data,
+                                               entry->value_data,
+                                               out, table->user_data);
+              switch (merge_result)
+                {
+                case GSK_TABLE_MERGE_RETURN_A:
+                  break;
+                case GSK_TABLE_MERGE_RETURN_B:
+                  value_len = entry->value_len;
+                  value_data = entry->value_data;
+                  break;
+                case GSK_TABLE_MERGE_SUCCESS:
+                  /* the next merge's output must not overwrite its input */
+                  value_len = out->len;
+                  value_data = out->data;
+                  which = 1 - which;
+                  break;
+                case GSK_TABLE_MERGE_DROP:
+                  has_value = FALSE;
+                  break;
+                }
+              continue;
+            }
+          if (has_value
+           && gsk_table_file_feed_entry (file, prev->key_len, prev->key_data,
+                                         value_len, value_data,
+                                         error) == GSK_TABLE_FEED_ENTRY_ERROR)
+            goto failed;
+        }
+      prev = entry;
+      has_value = TRUE;
+      value_len = entry->value_len;
+      value_data = entry->value_data;
+    }
+  if (has_value
+   && gsk_table_file_feed_entry (file, prev->key_len, prev->key_data,
+                                 value_len, value_data,
+                                 error) == GSK_TABLE_FEED_ENTRY_ERROR)
+    goto failed;
+
+  gsk_table_buffer_clear (&merged[0]);
+  gsk_table_buffer_clear (&merged[1]);
+  if (!finish_new_file (table, file, error))
+    return NULL;
+  return file;
+
+failed:
+  gsk_table_buffer_clear (&merged[0]);
+  gsk_table_buffer_clear (&merged[1]);
+  gsk_table_file_destroy (file, table->dir, TRUE, NULL);
+  return NULL;
+}
+
+/* A sorted batch skips the in-memory tree and the journal:
+   it becomes a file of its own, and a new journal lists that file. */
+static gboolean
+add_sorted_batch_unlocked (GskTable                 *table,
+                           guint                     n_entries,
+                           const GskTableBatchEntry *entries,
+                           GError                  **error)
+{
+  GskTableFile *file;
+  guint i;
+
+  /* the batch is newer than the in-memory tree,
+     so the tree's file must come first */
+  if (table->n_merge_threads > 0)
+    while (table->is_flushing && table->merge_thread_error == NULL)
+      g_cond_wait (table->idle_cond, table->lock);
+  if (table->merge_thread_error != NULL)
+    {
+      g_propagate_error (error, g_error_copy (table->merge_thread_error));
+      return FALSE;
+    }
+  if (table->in_memory_entry_count > 0 && !flush_tree (table, error))
+    {
+      gsk_g_error_add_prefix (error, "flushing tree");
+      return FALSE;
+    }
+
+  file = write_sorted_batch_file (table, n_entries, entries,
+                                  ++(table->last_file_id), error);
+  if (file == NULL)
+    {
+      gsk_g_error_add_prefix (error, "writing sorted batch");
+      return FALSE;
+    }
+  table->n_input_entries += n_entries;
+  add_flushed_file (table, file, table->n_input_entries - n_entries, n_entries);
+
+  if (table->journal_mode != GSK_TABLE_JOURNAL_NONE)
+    {
+      gboolean ok;
+      if (table->n_merge_threads > 0)
+        pause_merge_threads (table);
+      ok = reset_journal (table, table->journal_len, error);
+      if (table->n_merge_threads > 0)
+        resume_merge_threads (table);
+      if (!ok)
+        {
+          gsk_g_error_add_prefix (error, "error flushing journal");
+          return FALSE;
+        }
+      table->journal_flush_index = 0;
+    }
+
+  if (table->n_merge_threads > 0)
+    return start_tasks_and_wakeup (table, error);
+
+  /* run as much merging as adding the entries one at a time would */
+  if (!maybe_start_tasks (table, error))
+    return FALSE;
+  for (i = 0; i < n_entries && table->run_list != NULL; i++)
+    if (!step_merge_tasks (table, error))
+      return FALSE;
+  return TRUE;
+}
+
+/**
+ * gsk_table_add_batch:
+ * @table: the table to add data to.
+ * @n_entries: number of key/value pairs to add.
+ * @entries: the key/value pairs, oldest first.
+ * @flags: whether the batch is sorted.
+ * @error: place to put the error if something goes wrong.
+ *
+ * Add many key/value pairs, as if by gsk_table_add(),
+ * but taking the table's lock once, and (with GSK_TABLE_JOURNAL_SYNC)
+ * syncing the journal once.
+ *
+ * If the batch is GSK_TABLE_BATCH_SORTED and at least as large
+ * as the in-memory tree, it is written directly to a new file
+ * instead; an unsorted batch then fails with GSK_ERROR_INVALID_ARGUMENT,
+ * and none of it is added.  Other threads' adds and queries
+ * wait while that file is written.
+ *
+ * If an add fails, the entries before it may have been added.
+ *
+ * returns: whether the addition was successful.
+ */
 gboolean
-gsk_table_query       (GskTable              *table,
+gsk_table_add_batch   (GskTable                 *table,
+                       guint                     n_entries,
+                       const GskTableBatchEntry *entries,
+                       GskTableBatchFlags        flags,
+                       GError                  **error)
+{
+  gboolean rv = TRUE;
+  guint i;
+  TABLE_LOCK (table);
+  if ((flags & GSK_TABLE_BATCH_SORTED) != 0
+   && n_entries >= table->max_in_memory_entries)
+    rv = add_sorted_batch_unlocked (table, n_entries, entries, error);
+  else
+    {
+      for (i = 0; rv && i < n_entries; i++)
+        rv = add_unlocked (table,
+                           entries[i].key_len, entries[i].key_data,
+                           entries[i].value_len, entries[i].value_data,
+                           error);
+      if (rv && table->journal_mode == GSK_TABLE_JOURNAL_SYNC)
+        rv = sync_journal (table, error);
+    }
+  TABLE_UNLOCK (table);
+  return rv;
+}
+
+typedef struct _QueryResult QueryResult;
+struct _QueryResult
+{
+  gboolean has_result;
+  GskTableBuffer *result;
+  GskTableBuffer *other_result;
+};
+
+/* Fold a value found in a file or tree into the result;
+   values are found newest-first if query_reverse_chronologically.
+   Returns TRUE if no further values can change the result. */
+static gboolean
+query_result_add (GskTable     *table,
+                  QueryResult  *qr,
+                  guint         key_len,
+                  const guint8 *key_data,
+                  guint         value_len,
+                  const guint8 *value_data)
+{
+  gboolean reverse = table->query_reverse_chronologically;
+  if (!qr->has_result)
+    {
+      qr->has_result = TRUE;
+      set_buffer (qr->result, value_len, value_data);
+      if (table->merge.no_len == NULL)
+        return TRUE;
+    }
+  else
+    {
+      /* the older value is always 'a' */
+      GskTableMergeResult merge_result;
+      guint a_len = reverse ? value_len : qr->result->len;
+      const guint8 *a_data = reverse ? value_data : qr->result->data;
+      guint b_len = reverse ? qr->result->len : value_len;
+      const guint8 *b_data = reverse ? qr->result->data : value_data;
+      merge_result
+        = table->has_len
+             ? table->merge.with_len (key_len, key_data,
+                                      a_len, a_data, b_len, b_data,
+                                      qr->other_result,
+                                      table->user_data)
+             : table->merge.no_len (key_data, a_data, b_data,
+                                    qr->other_result,
+                                    table->user_data);
+      switch (merge_result)
+        {
+        case GSK_TABLE_MERGE_RETURN_A:
+          if (reverse)
+            set_buffer (qr->result, value_len, value_data);
+          break;
+        case GSK_TABLE_MERGE_RETURN_B:
+          if (!reverse)
+            set_buffer (qr->result, value_len, value_data);
+          break;
+        case GSK_TABLE_MERGE_SUCCESS:
+          {
+            GskTableBuffer *tmp = qr->result;
+            qr->result = qr->other_result;
+            qr->other_result = tmp;
+            break;
+          }
+        case GSK_TABLE_MERGE_DROP:
+          qr->has_result = FALSE;
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+    }
+
+  return qr->has_result
+      && table->is_stable_func != NULL
+      && table->is_stable_func (key_len, key_data,
+                                qr->result->len, qr->result->data,
+                                table->user_data);
+}
+
+static inline gboolean
+query_tree (GskTable     *table,
+            TreeNode     *top,
+            QueryResult  *qr,
+            guint         key_len,
+            const guint8 *key_data)
+{
+  TreeNode *node;
+  if (top == NULL)
+    return FALSE;
+  node = table->in_memory_tree_lookup (table, top, key_len, key_data);
+  return node != NULL
+      && query_result_add (table, qr, key_len, key_data,
+                           node->value.len, node->value.data);
+}
+
+static gboolean
+query_unlocked        (GskTable              *table,
                        guint                  key_len,
                        const guint8          *key_data,
                        gboolean              *found_value_out,
@@ -1815,18 +2674,24 @@ gsk_table_query       (GskTable              *table,
                        GError               **error)
 {
   gboolean reverse = table->query_reverse_chronologically;
-  gboolean has_result = FALSE;
-  GskTableBuffer *result_buffers = table->result_buffers;       /* [2] */
-  GskTableBuffer *result = result_buffers;
-  GskTableBuffer *other_result = result_buffers+1;
   GskTableFileQuery *query = &table->file_query;
+  QueryResult qr;
   FileInfo *fi;
-  gboolean use_merge_tasks = TRUE;
-  gpointer user_data = table->user_data;
+
+  qr.has_result = FALSE;
+  qr.result = table->result_buffers;
+  qr.other_result = table->result_buffers + 1;
 
   table->file_query_key_len = key_len;
   table->file_query_key_data = key_data;
 
+  /* only byte-wise equality lets files consult their bloom filters */
+  if (table->compare.no_len == NULL)
+    {
+      query->key_len = key_len;
+      query->key_data = key_data;
+    }
+
 #if DEBUG_PRINT_QUERIES
   {
     char *hex = gsk_escape_memory_hex (key_data, key_len);
@@ -1835,22 +2700,12 @@ gsk_table_query       (GskTable              *table,
   }
 #endif
 
-  /* first query rbtree (if in reverse-chronological mode (default)) */
+  /* first query the trees (if in reverse-chronological mode (default)) */
   if (reverse)
     {
-      TreeNode *node = table->in_memory_tree_lookup (table, key_len, key_data);
-      if (node != NULL)
-        {
-          has_result = TRUE;
-          copy_buffer (result, &node->value);
-
-          /* are we done? */
-          if (table->is_stable_func != NULL
-           && table->is_stable_func (key_len, key_data,
-                                     result->len, result->data,
-                                     table->user_data))
-            goto done_querying_copy_result;
-        }
+      if (query_tree (table, table->in_memory_tree, &qr, key_len, key_data)
+       || query_tree (table, table->flushing_tree, &qr, key_len, key_data))
+        goto done_querying;
     }
 
   /* walk through files, using merge-jobs as appropriate */
@@ -1859,195 +2714,76 @@ gsk_table_query       (GskTable              *table,
        fi = reverse ? fi->prev_file : fi->next_file)
     {
       MergeTask *mt = reverse ? fi->prev_task : fi->next_task;
+      GskTableFile *file = fi->file;
       gboolean used_merge_output = FALSE;
-      if (use_merge_tasks && mt != NULL && mt->is_started)
+
+      /* a merge thread may be writing a claimed task's output */
+      if (mt != NULL && mt->is_started
+       && !mt->info.started.is_claimed
+       && mt->info.started.has_last_queryable_key)
         {
-          if (mt->info.started.has_last_queryable_key)
+          /* compare last_queryable_key to key */
+          int rv = do_compare (table,
+                               mt->info.started.last_queryable_key.len,
+                               mt->info.started.last_queryable_key.data,
+                               key_len, key_data);
+          if (rv >= 0)
             {
-              /* compare last_queryable_key to key */
-              int rv = do_compare (table,
-                                   mt->info.started.last_queryable_key.len,
-                                   mt->info.started.last_queryable_key.data,
-                                   key_len, key_data);
-              if (rv < 0)
-                goto cannot_use_merge_output;
-
-
-              if (!gsk_table_file_query (mt->info.started.output,
-                                         query, error))
-                {
-                  gsk_g_error_add_prefix (error, "querying merge-task output");
-                  goto failed;
-                }
+              file = mt->info.started.output;
               used_merge_output = TRUE;
-              goto handle_file_query_result;
             }
         }
-cannot_use_merge_output:
-
-      /* query file */
-      if (!gsk_table_file_query (fi->file, query, error))
-        {
-          gsk_g_error_add_prefix (error, "querying merge-task output");
-          goto failed;
-        }
 
-handle_file_query_result:
-      if (query->found)
+      if (!gsk_table_file_query (file, query, error))
         {
-          if (has_result)
-            {
-              /* merge values */
-              GskTableMergeResult merge_result;
-              if (reverse)
-                merge_result
-                  = table->has_len ?
-                       table->merge.with_len (key_len, key_data,
-                                              query->value.len,
-                                              query->value.data,
-                                              result->len, result->data,
-                                              other_result,
-                                              user_data)
-                     : table->merge.no_len (key_data,
-                                            query->value.data,
-                                            result->data,
-                                            other_result,
-                                            user_data);
-              else
-                merge_result
-                  = table->has_len ?
-                       table->merge.with_len (key_len, key_data,
-                                              result->len, result->data,
-                                              query->value.len,
-                                              query->value.data,
-                                              other_result,
-                                              user_data)
-                     : table->merge.no_len (key_data,
-                                            result->data,
-                                            query->value.data,
-                                            other_result,
-                                            user_data);
-              switch (merge_result)
-                {
-                case GSK_TABLE_MERGE_RETURN_A:
-                  if (reverse)
-                    copy_buffer (result, &query->value);
-                  else
-                    (void) 0; /* do nothing: result is already correct */
-                  break;
-                case GSK_TABLE_MERGE_RETURN_B:
-                  if (!reverse)
-                    copy_buffer (result, &query->value);
-                  else
-                    (void) 0; /* do nothing: result is already correct */
-                  break;
-                case GSK_TABLE_MERGE_SUCCESS:
-                  {
-                    GskTableBuffer *tmp = result;
-                    result = other_result;
-                    other_result = tmp;
-                    break;
-                  }
-                case GSK_TABLE_MERGE_DROP:
-                  has_result = FALSE;
-                  break;
-                default:
-                  g_assert_not_reached ();
-                }
-            }
-          else if (table->merge.no_len == NULL)
-            {
-              *found_value_out = TRUE;
-              copy_buffer (result, &query->value);
-              goto done_querying_copy_result;
-            }
-          else
-            {
-              has_result = TRUE;
-              copy_buffer (result, &query->value);
-            }
-
-          /* are we done? */
-          if (table->is_stable_func != NULL
-           && table->is_stable_func (key_len, key_data,
-                                     result->len, result->data,
-                                     table->user_data))
-            goto done_querying_copy_result;
+          gsk_g_error_add_prefix (error, used_merge_output
+                                         ? "querying merge-task output"
+                                         : "querying file");
+          return FALSE;
         }
+      if (query->found
+       && query_result_add (table, &qr, key_len, key_data,
+                            query->value.len, query->value.data))
+        goto done_querying;
 
       /* skip one extra file */
       if (used_merge_output)
         fi = reverse ? fi->prev_file : fi->next_file;
     }
 
-  /* last query rbtree (if in chronological mode) */
+  /* last query the trees (if in chronological mode) */
   if (!reverse)
     {
-      TreeNode *node = table->in_memory_tree_lookup (table, key_len, key_data);
-      if (node != NULL)
-        {
-          if (has_result)
-            {
-              /* merge */
-              GskTableMergeResult merge_result;
-              merge_result
-                = table->has_len
-                     ? table->merge.with_len (key_len, key_data,
-                                              result->len, result->data,
-                                              node->value.len, node->value.data,
-                                              other_result,
-                                              user_data)
-                     : table->merge.no_len (key_data,
-                                            result->data,
-                                            node->value.data,
-                                            other_result,
-                                            user_data);
-              switch (merge_result)
-                {
-                case GSK_TABLE_MERGE_RETURN_A:
-                  break;
-                case GSK_TABLE_MERGE_RETURN_B:
-                  copy_buffer (result, &node->value);
-                  break;
-                case GSK_TABLE_MERGE_SUCCESS:
-                  {
-                    GskTableBuffer *tmp = result;
-                    result = other_result;
-                    other_result = tmp;
-                    break;
-                  }
-                case GSK_TABLE_MERGE_DROP:
-                  has_result = FALSE;
-                  break;
-                default:
-                  g_assert_not_reached ();
-                }
-            }
-          else
-            {
-              has_result = TRUE;
-              copy_buffer (result, &node->value);
-            }
-
-          /* note: no need to check stability,
-             since there's nothing more to do anyways. */
-        }
+      if (!query_tree (table, table->flushing_tree, &qr, key_len, key_data))
+        query_tree (table, table->in_memory_tree, &qr, key_len, key_data);
     }
 
-done_querying_copy_result:
-  *found_value_out = has_result;
-  if (has_result)
+done_querying:
+  *found_value_out = qr.has_result;
+  if (qr.has_result)
     {
-      *value_len_out = result->len;
-      *value_data_out = g_memdup (result->data, result->len);
+      *value_len_out = qr.result->len;
+      *value_data_out = g_memdup (qr.result->data, qr.result->len);
     }
-  /* fall through */
-
-//done_querying:
   return TRUE;
+}
 
-failed:
-  return FALSE;
+gboolean
+gsk_table_query       (GskTable              *table,
+                       guint                  key_len,
+                       const guint8          *key_data,
+                       gboolean              *found_value_out,
+                       guint                 *value_len_out,
+                       guint8               **value_data_out,
+                       GError               **error)
+{
+  gboolean rv;
+  TABLE_LOCK (table);
+  rv = query_unlocked (table, key_len, key_data,
+                       found_value_out, value_len_out, value_data_out,
+                       error);
+  TABLE_UNLOCK (table);
+  return rv;
 }
 
 const char *
@@ -2056,11 +2792,43 @@ gsk_table_peek_dir    (GskTable              *table)
   return table->dir;
 }
 
+/**
+ * gsk_table_get_cache_stats:
+ * @table: the table to query.
+ * @stats_out: the statistics of the table's block cache.
+ *
+ * Get the hit, miss and eviction counts of the cache of
+ * uncompressed blocks used by the table's queries, and how full it is.
+ * Tables without their own cache (see GskTableOptions.block_cache_bytes)
+ * share a cache, and so report the same statistics.
+ */
+void
+gsk_table_get_cache_stats (GskTable              *table,
+                           GskTableCacheStats    *stats_out)
+{
+  gsk_table_file_factory_flat_get_cache_stats (table->file_factory, stats_out);
+}
+
 void
 gsk_table_destroy     (GskTable              *table)
 {
   guint i;
   FileInfo *fi, *next=NULL;
+
+  /* merge threads finish their current batch;
+     anything unflushed is still in the journal */
+  stop_merge_threads (table);
+  if (table->lock != NULL)
+    {
+      g_mutex_free (table->lock);
+      g_cond_free (table->work_cond);
+      g_cond_free (table->idle_cond);
+      if (table->merge_thread_error)
+        g_error_free (table->merge_thread_error);
+      g_free (table->spare_tree_node_pool);
+      g_free (table->flushing_pool);
+    }
+
   for (fi = table->first_file; fi != NULL; fi = next)
     {
       next = fi->next_file;
@@ -2069,33 +2837,25 @@ gsk_table_destroy     (GskTable              *table)
   for (i = 0; i < table->n_old_files; i++)
     file_info_unref (table->old_files[i], table->dir, FALSE);
   g_free (table->old_files);
+  gsk_table_file_factory_destroy (table->file_factory);
   g_free (table->journal_cur_fname);
   g_free (table->journal_tmp_fname);
   munmap (table->journal_mmap, table->journal_size);
   gsk_table_buffer_clear (&table->result_buffers[0]);
   gsk_table_buffer_clear (&table->result_buffers[1]);
   gsk_table_buffer_clear (&table->merge_buffer);
-  gsk_table_buffer_clear (&table->simplify_buffer);
   g_slice_free (GskTable, table);
 }
 
 
 
+/* Finish writing the output of a task whose inputs are exhausted.
+   This only touches the task, so merge threads do it unlocked. */
 static gboolean
-merge_task_done (GskTable    *table,
-                 MergeTask   *task,
-                 GError     **error)
+merge_task_finish_output (MergeTask   *task,
+                          GError     **error)
 {
   gboolean done;
-  FileInfo *new_file;
-
-  g_assert (task == table->run_list);
-  g_assert (task->inputs[0]->prev_task == NULL);
-  g_assert (task->inputs[1]->next_task == NULL);
-
-  /* remove this task from the run list */
-  table->run_list = task->info.started.next_run;
-  table->n_running_tasks--;
 
 #if DEBUG_MERGE_TASKS
   g_message ("finished mergetask between "ID_FMT" and "ID_FMT, task->inputs[0]->file->id, task->inputs[1]->file->id);
@@ -2110,6 +2870,25 @@ merge_task_done (GskTable    *table,
   /* destroy the input readers */
   gsk_table_reader_destroy (task->info.started.inputs[0].reader);
   gsk_table_reader_destroy (task->info.started.inputs[1].reader);
+  return TRUE;
+}
+
+/* replace the task's inputs by its output in the list of files */
+static void
+merge_task_done (GskTable    *table,
+                 MergeTask   *task)
+{
+  FileInfo *new_file;
+  MergeTask **p_task;
+
+  g_assert (task->inputs[0]->prev_task == NULL);
+  g_assert (task->inputs[1]->next_task == NULL);
+
+  /* remove this task from the run list */
+  for (p_task = &table->run_list; *p_task != task; p_task = &(*p_task)->info.started.next_run)
+    g_assert (*p_task != NULL);
+  *p_task = task->info.started.next_run;
+  table->n_running_tasks--;
 
   /* create a new FileInfo */
   new_file = g_slice_new0 (FileInfo);
@@ -2135,9 +2914,10 @@ merge_task_done (GskTable    *table,
    && TASK_IS_UNSTARTED (new_file->next_file->next_task))
     create_unstarted_merge_task (table, new_file, new_file->next_file);
 
+  gsk_table_buffer_clear (&task->info.started.last_queryable_key);
+  gsk_table_buffer_clear (&task->info.started.merge_buffer);
+  gsk_table_buffer_clear (&task->info.started.simplify_buffer);
   g_slice_free (MergeTask, task);
-
-  return TRUE;
 }
 
 /* --- optimizing run_merge_task variants --- */
@@ -2194,12 +2974,12 @@ static RunTaskFuncs *table_options_get_run_funcs (const GskTableOptions *options
   return &all_run_task_funcs[has_len?1:0][has_compare?1:0][has_merge?1:0];
 }
 
-/* placeholder until there's actually some tunable stuff
-   in flat file-factory (there certainly could be:
-   chunk_size, compression_level) */
 static GskTableFileFactory *
 table_options_get_file_factory (const GskTableOptions *options,
                                 GError               **error)
 {
-  return gsk_table_file_factory_new_flat ();
+  return gsk_table_file_factory_new_flat_full (options->compression,
+                                               options->compression_level,
+                                               options->block_cache_bytes,
+                                               error);
 }
@@ -92,9 +92,20 @@ typedef enum
 {
   GSK_TABLE_JOURNAL_NONE,
   GSK_TABLE_JOURNAL_OCCASIONALLY,
-  GSK_TABLE_JOURNAL_DEFAULT
+  GSK_TABLE_JOURNAL_DEFAULT,
+
+  /* like DEFAULT, but every gsk_table_add() and gsk_table_add_batch()
+     is on disk when it returns:  a batch costs one msync(). */
+  GSK_TABLE_JOURNAL_SYNC
 } GskTableJournalMode;
 
+typedef enum
+{
+  GSK_TABLE_COMPRESSION_NONE,
+  GSK_TABLE_COMPRESSION_ZLIB,
+  GSK_TABLE_COMPRESSION_LZ              /* fast, built-in LZ77 */
+} GskTableCompression;
+
 typedef struct _GskTableOptions GskTableOptions;
 struct _GskTableOptions
 {
@@ -123,6 +134,24 @@ struct _GskTableOptions
   /* tunables */
   gsize max_in_memory_entries;
   gsize max_in_memory_bytes;
+
+  /* how new files' data blocks are compressed; existing files
+     record their own codec.  The level is only used by zlib (0..9);
+     -1 is the codec's default. */
+  GskTableCompression compression;
+  gint compression_level;
+
+  /* size of the table's own cache of uncompressed blocks.
+     If 0 (the default), the table shares a 16M cache
+     with every other table that has 0 here. */
+  gsize block_cache_bytes;
+
+  /* number of threads to run merges in the background.
+     If 0 (the default), merges are run a little at a time
+     by gsk_table_add().  Otherwise g_thread_init() must have been called,
+     and the compare, merge and simplify functions
+     may be called from the merge threads. */
+  guint n_merge_threads;
 };
 
 GskTableOptions     *gsk_table_options_new    (void);
@@ -149,6 +178,25 @@ gboolean    gsk_table_add         (GskTable              *table,
                                    guint                  value_len,
 	          	           const guint8          *value_data,
                                    GError               **error);
+
+typedef struct _GskTableBatchEntry GskTableBatchEntry;
+struct _GskTableBatchEntry
+{
+  guint key_len;
+  const guint8 *key_data;
+  guint value_len;
+  const guint8 *value_data;
+};
+typedef enum
+{
+  /* keys are in ascending order (equal keys are allowed) */
+  GSK_TABLE_BATCH_SORTED = (1<<0)
+} GskTableBatchFlags;
+gboolean    gsk_table_add_batch   (GskTable              *table,
+                                   guint                  n_entries,
+                                   const GskTableBatchEntry *entries,
+                                   GskTableBatchFlags     flags,
+                                   GError               **error);
 gboolean    gsk_table_query       (GskTable              *table,
                                    guint                  key_len,
 			           const guint8          *key_data,
@@ -159,6 +207,23 @@ gboolean    gsk_table_query       (GskTable              *table,
 const char *gsk_table_peek_dir    (GskTable              *table);
 void        gsk_table_destroy     (GskTable              *table);
 
+typedef struct _GskTableCacheStats GskTableCacheStats;
+struct _GskTableCacheStats
+{
+  guint64 n_hits;
+  guint64 n_misses;
+  guint64 n_evictions;
+  guint n_blocks;
+  gsize n_bytes;
+  gsize max_bytes;
+
+  /* the part of n_bytes in blocks that were wanted again
+     soon after being evicted, which a scan does not displace */
+  gsize n_hot_bytes;
+};
+void        gsk_table_get_cache_stats (GskTable          *table,
+                                       GskTableCacheStats *stats_out);
+
 
 struct _GskTableReader
 {
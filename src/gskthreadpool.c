@@ -1,11 +1,37 @@
 #include "gskthreadpool.h"
 #include "gskerrno.h"
 #include "gskghelpers.h"
+#include "gskmemorybarrier.h"
+#include "config.h"
 #include <unistd.h>
 #include <errno.h>
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/* Design:
+ *
+ * Each worker thread has its own queue of tasks, protected by its
+ * own mutex.  The main thread hands a new task to an idle worker
+ * if there is one;  otherwise to the workers in turn.
+ * A worker takes tasks from the head of its own queue,
+ * and when that is empty, steals from the tail of the others'.
+ * So the only contention is between a worker and a thief.
+ *
+ * Idle workers sleep on a single pool-wide condition.  The number of
+ * queued tasks is counted, and a worker only goes to sleep if the count
+ * is zero while it holds `idle_lock', under which a push signals:
+ * so a task can't be queued behind a busy worker while another sleeps.
+ *
+ * Finished tasks are pushed onto a lock-free stack, `done_tasks';
+ * the main thread takes the whole stack at once.
+ * Only the push that finds the stack empty wakes the main-loop,
+ * so a burst of completions costs a single write to the eventfd
+ * (or pipe, where eventfd is unavailable).
+ */
 
 typedef struct _TaskInfo TaskInfo;
-typedef struct _ThreadInfo ThreadInfo;
+typedef struct _Worker Worker;
 
 struct _GskThreadPool
 {
@@ -13,20 +39,27 @@ struct _GskThreadPool
   /*< private >*/
   GskSource *wakeup_source;
   int wakeup_read_fd;
-  int wakeup_write_fd;
+  int wakeup_write_fd;          /* same as wakeup_read_fd for an eventfd */
 
-  guint num_threads;
   guint max_threads;
+  guint num_workers;            /* only modified by the main thread */
+  volatile gint num_threads;    /* workers which have not exited */
 
-  GCond *task_available;
-  GMutex *task_available_mutex;
+  /* list of workers;  only ever prepended to, by the main thread,
+     so other threads may traverse it without locking */
+  Worker * volatile first_worker;
+  Worker *next_worker;          /* round-robin position */
 
-  GMutex *lock;
-  GQueue *unstarted_tasks;
-  GQueue *done_results;
-  GQueue *idle_threads;
+  /* finished tasks, newest first */
+  TaskInfo * volatile done_tasks;
 
-  gboolean destroy_pending;
+  /* idle workers wait on idle_cond;  n_sleeping is protected by idle_lock */
+  GMutex *idle_lock;
+  GCond *idle_cond;
+  guint n_sleeping;
+  volatile gint n_queued;       /* tasks in the workers' queues */
+
+  volatile gint destroy_pending;
   GDestroyNotify destroy_notify;
   gpointer destroy_data;
 };
@@ -39,27 +72,142 @@ struct _TaskInfo
   gpointer                 run_data;
   gpointer                 result_data;
   GskThreadPoolDestroyFunc destroy;
+  TaskInfo                *next;        /* in done_tasks */
 };
 
 /* Per GThread information */
-struct _ThreadInfo
+struct _Worker
 {
   GskThreadPool           *pool;
   GThread                 *thread;
-  GCond                   *cond;
-  TaskInfo                *running_task;
-  gboolean                 cancelled;
+  Worker                  *next;
+
+  /* protected by lock */
+  GMutex                  *lock;
+  GQueue                  *tasks;
+
+  /* set under the pool's idle_lock;  elsewhere only a hint */
+  gboolean                 sleeping;
 };
 
+static void
+wake_main_loop (GskThreadPool *pool)
+{
+#if HAVE_SYS_EVENTFD_H
+  guint64 one = 1;
+  const void *ping = &one;
+  guint ping_len = sizeof (one);
+#else
+  char zero = 0;
+  const void *ping = &zero;
+  guint ping_len = 1;
+#endif
+  for (;;)
+    {
+      if (write (pool->wakeup_write_fd, ping, ping_len) == (gssize) ping_len)
+        return;
+      if (errno == EINTR)
+        continue;
+
+      /* a full pipe (or eventfd) will wake the main-loop anyway */
+      if (errno != EAGAIN)
+        g_warning ("error writing wakeup fd: %s", g_strerror (errno));
+      return;
+    }
+}
+
+/* called from worker threads:  lock-free */
+static void
+push_done_task (GskThreadPool *pool,
+                TaskInfo      *task)
+{
+  TaskInfo *old;
+  do
+    {
+      old = g_atomic_pointer_get ((gpointer *) &pool->done_tasks);
+      task->next = old;
+    }
+  while (!g_atomic_pointer_compare_and_exchange ((gpointer *) &pool->done_tasks,
+                                                 old, task));
+  if (old == NULL)
+    wake_main_loop (pool);
+}
+
+/* called from the main thread:  returns the done tasks,
+   in the order they finished */
+static TaskInfo *
+take_done_tasks (GskThreadPool *pool)
+{
+  TaskInfo *list, *rv = NULL;
+  do
+    list = g_atomic_pointer_get ((gpointer *) &pool->done_tasks);
+  while (list != NULL
+      && !g_atomic_pointer_compare_and_exchange ((gpointer *) &pool->done_tasks,
+                                                 list, NULL));
+  while (list != NULL)
+    {
+      TaskInfo *next = list->next;
+      list->next = rv;
+      rv = list;
+      list = next;
+    }
+  return rv;
+}
+
+static void
+run_done_tasks (GskThreadPool *pool)
+{
+  TaskInfo *task_info = take_done_tasks (pool);
+  while (task_info != NULL)
+    {
+      TaskInfo *next = task_info->next;
+      (*task_info->handle_result) (task_info->run_data, task_info->result_data);
+      if (task_info->destroy != NULL)
+	(*task_info->destroy) (task_info->run_data, task_info->result_data);
+      g_free (task_info);
+      task_info = next;
+    }
+}
+
 static void
 destroy_now (GskThreadPool *pool)
 {
-  if (pool->wakeup_source != NULL)
-    gsk_source_remove (pool->wakeup_source);
+  Worker *worker;
+  GskSource *wakeup_source = pool->wakeup_source;
+
+  /* clear it first, so that wakefd_source_destroyed() does nothing */
+  pool->wakeup_source = NULL;
+  if (wakeup_source != NULL)
+    gsk_source_remove (wakeup_source);
+
+  /* all workers have exited (or are exiting):  reap them */
+  while ((worker = pool->first_worker) != NULL)
+    {
+      TaskInfo *task;
+      pool->first_worker = worker->next;
+      if (worker->thread != NULL)
+        g_thread_join (worker->thread);
+
+      /* tasks that were never started:  there is no result */
+      while ((task = g_queue_pop_head (worker->tasks)) != NULL)
+        {
+          if (task->destroy != NULL)
+            (*task->destroy) (task->run_data, NULL);
+          g_free (task);
+        }
+      g_queue_free (worker->tasks);
+      g_mutex_free (worker->lock);
+      g_free (worker);
+    }
+
+  /* tasks that finished after the last wakeup was handled */
+  run_done_tasks (pool);
 
-  g_mutex_free (pool->lock);
-  g_queue_free (pool->done_results);
-  g_queue_free (pool->idle_threads);
+  g_cond_free (pool->idle_cond);
+  g_mutex_free (pool->idle_lock);
+  close (pool->wakeup_read_fd);
+  if (pool->wakeup_write_fd != pool->wakeup_read_fd)
+    close (pool->wakeup_write_fd);
   if (pool->destroy_notify)
     (*pool->destroy_notify) (pool->destroy_data);
   g_free (pool);
@@ -72,7 +220,6 @@ handle_wakeup_fd_pinged (int fd, GIOCondition condition, gpointer data)
   GskThreadPool *pool = data;
   char buf[4096];
   int rv = read (pool->wakeup_read_fd, buf, sizeof (buf));
-  TaskInfo *task_info;
   if (rv == 0)
     {
       /* end-of-file??? */
@@ -88,19 +235,12 @@ handle_wakeup_fd_pinged (int fd, GIOCondition condition, gpointer data)
 	  return TRUE;
 	}
     }
-  g_mutex_lock (pool->lock);
-  while ((task_info = g_queue_pop_head (pool->done_results)) != NULL)
-    {
-      g_mutex_unlock (pool->lock);
-      (*task_info->handle_result) (task_info->run_data, task_info->result_data);
-      if (task_info->destroy != NULL)
-	(*task_info->destroy) (task_info->run_data, task_info->result_data);
-      g_free (task_info);
-      g_mutex_lock (pool->lock);
-    }
-  g_mutex_unlock (pool->lock);
 
-  if (pool->destroy_pending && pool->num_threads == 0)
+  /* the wakeup was consumed before taking the list,
+     so anything pushed after this will wake us again. */
+  run_done_tasks (pool);
+
+  if (pool->destroy_pending && g_atomic_int_get (&pool->num_threads) == 0)
     return FALSE;
 
   return TRUE;
@@ -110,9 +250,11 @@ static void
 wakefd_source_destroyed (gpointer data)
 {
   GskThreadPool *pool = data;
+  if (pool->wakeup_source == NULL)
+    return;             /* removed by destroy_now() */
   pool->wakeup_source = NULL;
 
-  if (pool->destroy_pending && pool->num_threads == 0)
+  if (pool->destroy_pending && g_atomic_int_get (&pool->num_threads) == 0)
     destroy_now (pool);
 }
 
@@ -132,12 +274,22 @@ GskThreadPool *gsk_thread_pool_new     (GskMainLoop             *main_loop,
 {
   GskThreadPool *thread_pool;
   int pipe_fds[2];
+#if HAVE_SYS_EVENTFD_H
+  pipe_fds[0] = pipe_fds[1] = eventfd (0, 0);
+  if (pipe_fds[0] < 0)
+    {
+      g_error ("error creating eventfd: %s", g_strerror (errno));
+    }
+#else
   if (pipe (pipe_fds) < 0)
     {
       g_error ("error creating pipe: %s", g_strerror (errno));
     }
+#endif
 
   gsk_fd_set_nonblocking (pipe_fds[0]);
+  if (pipe_fds[1] != pipe_fds[0])
+    gsk_fd_set_nonblocking (pipe_fds[1]);
 
   thread_pool = g_new (GskThreadPool, 1);
   thread_pool->wakeup_read_fd = pipe_fds[0];
@@ -149,61 +301,147 @@ GskThreadPool *gsk_thread_pool_new     (GskMainLoop             *main_loop,
 						     thread_pool,
 						     wakefd_source_destroyed);
   thread_pool->num_threads = 0;
+  thread_pool->num_workers = 0;
   thread_pool->max_threads = max_threads;
+  thread_pool->first_worker = NULL;
+  thread_pool->next_worker = NULL;
+  thread_pool->done_tasks = NULL;
+  thread_pool->idle_lock = g_mutex_new ();
+  thread_pool->idle_cond = g_cond_new ();
+  thread_pool->n_sleeping = 0;
+  thread_pool->n_queued = 0;
   thread_pool->destroy_pending = FALSE;
-  thread_pool->lock = g_mutex_new ();
-  thread_pool->idle_threads = g_queue_new ();
-  thread_pool->unstarted_tasks = g_queue_new ();
-  thread_pool->done_results = g_queue_new ();
+  thread_pool->destroy_notify = NULL;
+  thread_pool->destroy_data = NULL;
   return thread_pool;
 }
 
-static void
-write_byte (int fd)
+/* take a task from the tail of some other worker's queue */
+static TaskInfo *
+steal_task (GskThreadPool *pool,
+            Worker        *thief)
 {
-  char zero = 0;
-  write (fd, &zero, 1);
+  Worker *victim;
+  Worker *first = g_atomic_pointer_get ((gpointer *) &pool->first_worker);
+
+  /* start after ourselves, so that thieves spread out */
+  for (victim = thief->next ? thief->next : first;
+       victim != thief;
+       victim = victim->next ? victim->next : first)
+    {
+      TaskInfo *task = NULL;
+      if (victim->tasks->length == 0)       /* unlocked peek */
+        continue;
+      g_mutex_lock (victim->lock);
+      task = g_queue_pop_tail (victim->tasks);
+      g_mutex_unlock (victim->lock);
+      if (task != NULL)
+        return task;
+    }
+  return NULL;
 }
 
 static gpointer
 the_thread_func (gpointer data)
 {
-  ThreadInfo *thread_info = data;
-  GskThreadPool *pool = thread_info->pool;
-  while (thread_info->running_task
-      && !thread_info->cancelled
-      && !pool->destroy_pending)
+  Worker *worker = data;
+  GskThreadPool *pool = worker->pool;
+  for (;;)
     {
-      TaskInfo *task = thread_info->running_task;
-      task->result_data = (*task->run) (task->run_data);
-
-      g_mutex_lock (pool->lock);
-      g_queue_push_tail (pool->done_results, task);
-      write_byte (pool->wakeup_write_fd);
-      thread_info->running_task = g_queue_pop_head (pool->unstarted_tasks);
-      if (thread_info->running_task == NULL)
-	{
-	  g_queue_push_tail (pool->idle_threads, thread_info);
-	  while (!pool->destroy_pending
-             && !thread_info->cancelled
-             && thread_info->running_task == NULL)
-	    {
-	      g_cond_wait (thread_info->cond, pool->lock);
-	    }
-	}
-      g_mutex_unlock (pool->lock);
+      TaskInfo *task;
+
+      g_mutex_lock (worker->lock);
+      task = g_queue_pop_head (worker->tasks);
+      g_mutex_unlock (worker->lock);
+      if (task == NULL && !g_atomic_int_get (&pool->destroy_pending))
+        task = steal_task (pool, worker);
+
+      if (task != NULL)
+        {
+          g_atomic_int_add (&pool->n_queued, -1);
+          task->result_data = (*task->run) (task->run_data);
+          push_done_task (pool, task);
+          if (g_atomic_int_get (&pool->destroy_pending))
+            break;
+          continue;
+        }
+
+      /* a task pushed after this check will signal idle_cond */
+      g_mutex_lock (pool->idle_lock);
+      if (g_atomic_int_get (&pool->destroy_pending))
+        {
+          g_mutex_unlock (pool->idle_lock);
+          break;
+        }
+      if (g_atomic_int_get (&pool->n_queued) == 0)
+        {
+          worker->sleeping = TRUE;
+          pool->n_sleeping++;
+          g_cond_wait (pool->idle_cond, pool->idle_lock);
+          pool->n_sleeping--;
+          worker->sleeping = FALSE;
+        }
+      g_mutex_unlock (pool->idle_lock);
     }
 
-  g_mutex_lock (pool->lock);
-  --pool->num_threads;
-  g_mutex_unlock (pool->lock);
+  /* the main thread joins us before freeing anything */
+  g_atomic_int_add (&pool->num_threads, -1);
+  wake_main_loop (pool);
 
-  write_byte (pool->wakeup_write_fd);
+  return NULL;
+}
 
-  g_cond_free (thread_info->cond);
-  g_free (thread_info);
+/* Start a new worker, whose queue initially holds FIRST_TASK.
+   Returns FALSE if the task must be queued elsewhere. */
+static gboolean
+create_worker (GskThreadPool *pool,
+               TaskInfo      *first_task)
+{
+  GError *error = NULL;
+  Worker *worker = g_new (Worker, 1);
+  gboolean retracted;
+  worker->pool = pool;
+  worker->lock = g_mutex_new ();
+  worker->tasks = g_queue_new ();
+  worker->sleeping = FALSE;
+  g_atomic_int_inc (&pool->n_queued);
+  g_queue_push_tail (worker->tasks, first_task);
+  worker->next = pool->first_worker;
+
+  /* publish before the thread starts:  it must be on the list to steal */
+  GSK_MEMORY_BARRIER ();
+  pool->first_worker = worker;
+  g_atomic_int_add (&pool->num_threads, 1);
+  worker->thread = g_thread_create (the_thread_func, worker, TRUE, &error);
+  if (worker->thread != NULL)
+    {
+      pool->num_workers++;
+      return TRUE;
+    }
 
-  return NULL;
+  g_message ("error creating thread: %s", error->message);
+  g_error_free (error);
+  g_atomic_int_add (&pool->num_threads, -1);
+
+  /* The worker stays on the list (others may be traversing it),
+     but is never given tasks.  Its task may already have been stolen. */
+  g_mutex_lock (worker->lock);
+  retracted = g_queue_pop_head (worker->tasks) != NULL;
+  g_mutex_unlock (worker->lock);
+  if (retracted)
+    g_atomic_int_add (&pool->n_queued, -1);
+  return !retracted;
+}
+
+/* Called after a task has been counted and queued:
+   any sleeping worker can take it, by stealing if need be. */
+static void
+wake_sleeping_worker (GskThreadPool *pool)
+{
+  g_mutex_lock (pool->idle_lock);
+  if (pool->n_sleeping > 0)
+    g_cond_signal (pool->idle_cond);
+  g_mutex_unlock (pool->idle_lock);
 }
 
 /**
@@ -237,44 +475,54 @@ gsk_thread_pool_push   (GskThreadPool           *pool,
 			GskThreadPoolDestroyFunc destroy)
 {
   TaskInfo *info = g_new (TaskInfo, 1);
-  ThreadInfo *thread_info;
+  Worker *worker;
   g_return_if_fail (pool->destroy_pending == FALSE);
   info->run = run;
   info->handle_result = handle_result;
   info->run_data = run_data;
   info->destroy = destroy;
+  info->next = NULL;
 
-  g_mutex_lock (pool->lock);
-  thread_info = g_queue_pop_head (pool->idle_threads);
+  /* prefer a sleeping worker (`sleeping' is only a hint here) */
+  for (worker = pool->first_worker; worker != NULL; worker = worker->next)
+    if (worker->sleeping)
+      break;
 
-  if (thread_info != NULL)
+  if (worker == NULL
+   && (pool->max_threads == 0 || pool->num_workers < pool->max_threads))
     {
-      thread_info->running_task = info;
-      g_cond_signal (thread_info->cond);
+      if (create_worker (pool, info))
+        return;
     }
-  else if (pool->max_threads == 0 || pool->num_threads < pool->max_threads)
+
+  if (worker == NULL)
     {
-      GError *error = NULL;
-      thread_info = g_new (ThreadInfo, 1);
-      thread_info->pool = pool;
-      thread_info->cond = g_cond_new ();
-      thread_info->running_task = info;
-      thread_info->cancelled = FALSE;
-      thread_info->thread = g_thread_create (the_thread_func, thread_info, TRUE, &error);
-      if (thread_info->thread == NULL)
-	{
-	  /* uh, destroy thread_info and print a warning. */
-	  g_message ("error creating thread: %s", error->message);
-	  g_cond_free (thread_info->cond);
-	  g_free (thread_info);
-	  thread_info = NULL;
-	}
-      else
-	pool->num_threads++;
+      /* everyone is busy:  queue it round-robin; it'll be stolen
+         by whichever worker becomes free first */
+      guint n_tried = 0;
+      do
+        {
+          if (pool->next_worker == NULL)
+            pool->next_worker = pool->first_worker;
+          worker = pool->next_worker;
+          if (worker != NULL)
+            pool->next_worker = worker->next;
+        }
+      while (worker != NULL && worker->thread == NULL
+          && ++n_tried <= pool->num_workers);
+      if (worker == NULL || worker->thread == NULL)
+        {
+          g_warning ("gsk_thread_pool_push: no worker threads");
+          g_free (info);
+          return;
+        }
     }
-  if (thread_info == NULL)
-    g_queue_push_tail (pool->unstarted_tasks, info);
-  g_mutex_unlock (pool->lock);
+
+  g_atomic_int_inc (&pool->n_queued);
+  g_mutex_lock (worker->lock);
+  g_queue_push_tail (worker->tasks, info);
+  g_mutex_unlock (worker->lock);
+  wake_sleeping_worker (pool);
 }
 
 /**
@@ -286,7 +534,7 @@ gsk_thread_pool_push   (GskThreadPool           *pool,
  *
  * Destroy a thread-pool.
  * This may take some time,
- * so you may register a handler that will be 
+ * so you may register a handler that will be
  * called from the main thread once the thread-pool
  * is destructed.  (The memory is not yet deallocated though,
  * so that hash-tables keyed off the thread-pool
@@ -297,22 +545,16 @@ gsk_thread_pool_destroy (GskThreadPool           *pool,
 			 GDestroyNotify           destroy,
 			 gpointer                 destroy_data)
 {
-  ThreadInfo *info;
-  gboolean do_destroy;
   g_return_if_fail (pool->destroy_pending == FALSE);
-  pool->destroy_pending = TRUE;
   pool->destroy_notify = destroy;
   pool->destroy_data = destroy_data;
-  g_mutex_lock (pool->lock);
-  while ((info = g_queue_pop_head (pool->idle_threads)) != NULL)
-    {
-      /* Destroy the idle thread. */
-      info->cancelled = TRUE;
-      g_cond_signal (info->cond);
-    }
-  do_destroy = pool->num_threads == 0;
-  g_mutex_unlock (pool->lock);
+  g_atomic_int_add (&pool->destroy_pending, 1);
+
+  /* wake the idle threads so they can exit. */
+  g_mutex_lock (pool->idle_lock);
+  g_cond_broadcast (pool->idle_cond);
+  g_mutex_unlock (pool->idle_lock);
 
-  if (do_destroy)
+  if (g_atomic_int_get (&pool->num_threads) == 0)
     destroy_now (pool);
 }
@@ -0,0 +1,553 @@
+#include <string.h>
+#include "gskhash-accel.h"
+
+/* Vector extensions, for the multi-buffer functions. */
+#if defined(__clang__) \
+ || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+#define HAVE_VECTORS    1
+#else
+#define HAVE_VECTORS    0
+#endif
+
+/* SHA and PCLMULQDQ intrinsics, enabled per-function. */
+#if (defined(__x86_64__) || defined(__i386__)) \
+ && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_X86        1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define HAVE_X86        0
+#endif
+
+static const guint32 sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * x86:  SHA extensions and carry-less multiplication.
+ */
+#if HAVE_X86
+#define SHA_TARGET      __attribute__ ((target ("sha,sse4.1,ssse3")))
+#define CLMUL_TARGET    __attribute__ ((target ("pclmul,sse4.1")))
+
+/* The message schedule runs four words at a time:
+   m0..m3 are the previous sixteen words, oldest first;
+   the next four replace m0. */
+#define SHA1_SCHEDULE(m0, m1, m2, m3) \
+  m0 = _mm_sha1msg2_epu32 (_mm_xor_si128 (_mm_sha1msg1_epu32 (m0, m1), m2), m3)
+#define SHA1_ROUNDS4(m, func)                                   \
+  G_STMT_START{                                                 \
+    e = _mm_sha1nexte_epu32 (saved_abcd, m);                    \
+    saved_abcd = abcd;                                          \
+    abcd = _mm_sha1rnds4_epu32 (abcd, e, func);                 \
+  }G_STMT_END
+
+static void SHA_TARGET
+sha1_blocks_shani (guint32       *state,
+                   const guint8  *data,
+                   guint          n_blocks)
+{
+  const __m128i bswap = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) state), 0x1b);
+  __m128i e0 = _mm_set_epi32 (state[4], 0, 0, 0);
+
+  while (n_blocks-- > 0)
+    {
+      __m128i abcd_save = abcd;
+      __m128i e0_save = e0;
+      __m128i saved_abcd, e;
+      __m128i m0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data +  0)), bswap);
+      __m128i m1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)), bswap);
+      __m128i m2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)), bswap);
+      __m128i m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)), bswap);
+
+      /* rounds 0-3 take e from the state */
+      e = _mm_add_epi32 (e0, m0);
+      saved_abcd = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e, 0);
+      SHA1_ROUNDS4 (m1, 0);
+      SHA1_ROUNDS4 (m2, 0);
+      SHA1_ROUNDS4 (m3, 0);
+      SHA1_SCHEDULE (m0, m1, m2, m3); SHA1_ROUNDS4 (m0, 0);
+      SHA1_SCHEDULE (m1, m2, m3, m0); SHA1_ROUNDS4 (m1, 1);
+      SHA1_SCHEDULE (m2, m3, m0, m1); SHA1_ROUNDS4 (m2, 1);
+      SHA1_SCHEDULE (m3, m0, m1, m2); SHA1_ROUNDS4 (m3, 1);
+      SHA1_SCHEDULE (m0, m1, m2, m3); SHA1_ROUNDS4 (m0, 1);
+      SHA1_SCHEDULE (m1, m2, m3, m0); SHA1_ROUNDS4 (m1, 1);
+      SHA1_SCHEDULE (m2, m3, m0, m1); SHA1_ROUNDS4 (m2, 2);
+      SHA1_SCHEDULE (m3, m0, m1, m2); SHA1_ROUNDS4 (m3, 2);
+      SHA1_SCHEDULE (m0, m1, m2, m3); SHA1_ROUNDS4 (m0, 2);
+      SHA1_SCHEDULE (m1, m2, m3, m0); SHA1_ROUNDS4 (m1, 2);
+      SHA1_SCHEDULE (m2, m3, m0, m1); SHA1_ROUNDS4 (m2, 2);
+      SHA1_SCHEDULE (m3, m0, m1, m2); SHA1_ROUNDS4 (m3, 3);
+      SHA1_SCHEDULE (m0, m1, m2, m3); SHA1_ROUNDS4 (m0, 3);
+      SHA1_SCHEDULE (m1, m2, m3, m0); SHA1_ROUNDS4 (m1, 3);
+      SHA1_SCHEDULE (m2, m3, m0, m1); SHA1_ROUNDS4 (m2, 3);
+      SHA1_SCHEDULE (m3, m0, m1, m2); SHA1_ROUNDS4 (m3, 3);
+
+      e0 = _mm_sha1nexte_epu32 (saved_abcd, e0_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+      data += 64;
+    }
+
+  _mm_storeu_si128 ((__m128i *) state, _mm_shuffle_epi32 (abcd, 0x1b));
+  state[4] = _mm_extract_epi32 (e0, 3);
+}
+#undef SHA1_SCHEDULE
+#undef SHA1_ROUNDS4
+
+#define SHA256_SCHEDULE(m0, m1, m2, m3)                                 \
+  m0 = _mm_sha256msg2_epu32 (_mm_add_epi32 (_mm_sha256msg1_epu32 (m0, m1), \
+                                            _mm_alignr_epi8 (m3, m2, 4)),  \
+                             m3)
+#define SHA256_ROUNDS4(m, t)                                            \
+  G_STMT_START{                                                         \
+    __m128i wk = _mm_add_epi32 (m, _mm_loadu_si128 ((const __m128i *) (sha256_k + (t)))); \
+    cdgh = _mm_sha256rnds2_epu32 (cdgh, abef, wk);                      \
+    abef = _mm_sha256rnds2_epu32 (abef, cdgh, _mm_shuffle_epi32 (wk, 0x0e)); \
+  }G_STMT_END
+
+static void SHA_TARGET
+sha256_blocks_shani (guint32       *state,
+                     const guint8  *data,
+                     guint          n_blocks)
+{
+  const __m128i bswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i dcba = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) state), 0xb1);
+  __m128i hgfe = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (state + 4)), 0x1b);
+  __m128i abef = _mm_alignr_epi8 (dcba, hgfe, 8);
+  __m128i cdgh = _mm_blend_epi16 (hgfe, dcba, 0xf0);
+
+  while (n_blocks-- > 0)
+    {
+      __m128i abef_save = abef;
+      __m128i cdgh_save = cdgh;
+      __m128i m0 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data +  0)), bswap);
+      __m128i m1 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 16)), bswap);
+      __m128i m2 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 32)), bswap);
+      __m128i m3 = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (data + 48)), bswap);
+      guint t;
+
+      SHA256_ROUNDS4 (m0, 0);
+      SHA256_ROUNDS4 (m1, 4);
+      SHA256_ROUNDS4 (m2, 8);
+      SHA256_ROUNDS4 (m3, 12);
+      for (t = 16; t < 64; t += 16)
+        {
+          SHA256_SCHEDULE (m0, m1, m2, m3); SHA256_ROUNDS4 (m0, t);
+          SHA256_SCHEDULE (m1, m2, m3, m0); SHA256_ROUNDS4 (m1, t + 4);
+          SHA256_SCHEDULE (m2, m3, m0, m1); SHA256_ROUNDS4 (m2, t + 8);
+          SHA256_SCHEDULE (m3, m0, m1, m2); SHA256_ROUNDS4 (m3, t + 12);
+        }
+
+      abef = _mm_add_epi32 (abef, abef_save);
+      cdgh = _mm_add_epi32 (cdgh, cdgh_save);
+      data += 64;
+    }
+
+  {
+    __m128i feba = _mm_shuffle_epi32 (abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32 (cdgh, 0xb1);
+    _mm_storeu_si128 ((__m128i *) state, _mm_blend_epi16 (feba, dchg, 0xf0));
+    _mm_storeu_si128 ((__m128i *) (state + 4), _mm_alignr_epi8 (dchg, feba, 8));
+  }
+}
+#undef SHA256_SCHEDULE
+#undef SHA256_ROUNDS4
+
+/* CRC-32 by folding with carry-less multiplication:  see Gopal et al.,
+   "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+   Instruction" (Intel, 2009).  The constants are for the bit-reflected
+   polynomial 0xedb88320:  x^(4*128+32), x^(4*128-32), x^(128+32),
+   x^(128-32), x^64 mod P, and the Barrett constants P and floor(x^64/P). */
+static const guint64 crc32_k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const guint64 crc32_k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const guint64 crc32_k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const guint64 crc32_poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+#define CRC32_FOLD(x, k, next)                                  \
+  _mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x, k, 0x00), \
+                                _mm_clmulepi64_si128 (x, k, 0x11)), \
+                 next)
+
+static guint32 CLMUL_TARGET
+crc32_clmul (guint32        crc,
+             const guint8  *data,
+             guint          len)
+{
+  const __m128i mask32 = _mm_setr_epi32 (~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, k;
+
+  x1 = _mm_loadu_si128 ((const __m128i *) (data +  0));
+  x2 = _mm_loadu_si128 ((const __m128i *) (data + 16));
+  x3 = _mm_loadu_si128 ((const __m128i *) (data + 32));
+  x4 = _mm_loadu_si128 ((const __m128i *) (data + 48));
+  x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (crc));
+  data += 64;
+  len -= 64;
+
+  /* fold four lanes of 128 bits over each 64 bytes */
+  k = _mm_loadu_si128 ((const __m128i *) crc32_k1k2);
+  while (len >= 64)
+    {
+      x1 = CRC32_FOLD (x1, k, _mm_loadu_si128 ((const __m128i *) (data +  0)));
+      x2 = CRC32_FOLD (x2, k, _mm_loadu_si128 ((const __m128i *) (data + 16)));
+      x3 = CRC32_FOLD (x3, k, _mm_loadu_si128 ((const __m128i *) (data + 32)));
+      x4 = CRC32_FOLD (x4, k, _mm_loadu_si128 ((const __m128i *) (data + 48)));
+      data += 64;
+      len -= 64;
+    }
+
+  /* fold them into one, then fold in what's left 16 bytes at a time */
+  k = _mm_loadu_si128 ((const __m128i *) crc32_k3k4);
+  x1 = CRC32_FOLD (x1, k, x2);
+  x1 = CRC32_FOLD (x1, k, x3);
+  x1 = CRC32_FOLD (x1, k, x4);
+  while (len >= 16)
+    {
+      x1 = CRC32_FOLD (x1, k, _mm_loadu_si128 ((const __m128i *) data));
+      data += 16;
+      len -= 16;
+    }
+
+  /* 128 bits to 64 */
+  x2 = _mm_clmulepi64_si128 (x1, k, 0x10);
+  x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+  k = _mm_loadl_epi64 ((const __m128i *) crc32_k5k0);
+  x2 = _mm_srli_si128 (x1, 4);
+  x1 = _mm_and_si128 (x1, mask32);
+  x1 = _mm_xor_si128 (_mm_clmulepi64_si128 (x1, k, 0x00), x2);
+
+  /* Barrett reduction to 32 bits */
+  k = _mm_loadu_si128 ((const __m128i *) crc32_poly);
+  x2 = _mm_and_si128 (x1, mask32);
+  x2 = _mm_clmulepi64_si128 (x2, k, 0x10);
+  x2 = _mm_and_si128 (x2, mask32);
+  x2 = _mm_clmulepi64_si128 (x2, k, 0x00);
+  x1 = _mm_xor_si128 (x1, x2);
+  return _mm_extract_epi32 (x1, 1);
+}
+#undef CRC32_FOLD
+#endif  /* HAVE_X86 */
+
+/*
+ * Multi-buffer:  each 32-bit word of the state is kept in a vector
+ * holding that word for all the streams.  This is written with the
+ * compiler's generic vectors, and compiled twice:  once for the baseline
+ * instruction set, and once for AVX2 (where a vector is one register).
+ */
+#if HAVE_VECTORS
+typedef guint32 V8 __attribute__ ((vector_size (4 * GSK_HASH_ACCEL_N_LANES)));
+#define N_LANES         GSK_HASH_ACCEL_N_LANES
+#define ALWAYS_INLINE   __attribute__ ((always_inline))
+
+#define ROTL(x, n)      (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n)      (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* word i of each stream's block */
+#define LOAD_WORDS(v, data, i, FROM_ORDER)                      \
+  G_STMT_START{                                                 \
+    guint lane_;                                                \
+    for (lane_ = 0; lane_ < N_LANES; lane_++)                   \
+      {                                                         \
+        guint32 w_;                                             \
+        memcpy (&w_, (data)[lane_] + 4 * (i), 4);               \
+        (v)[lane_] = FROM_ORDER (w_);                           \
+      }                                                         \
+  }G_STMT_END
+#define GATHER_STATE(v, states, i)                              \
+  G_STMT_START{                                                 \
+    guint lane_;                                                \
+    for (lane_ = 0; lane_ < N_LANES; lane_++)                   \
+      (v)[lane_] = (states)[lane_][i];                          \
+  }G_STMT_END
+#define SCATTER_STATE(v, states, i)                             \
+  G_STMT_START{                                                 \
+    guint lane_;                                                \
+    for (lane_ = 0; lane_ < N_LANES; lane_++)                   \
+      (states)[lane_][i] = (v)[lane_];                          \
+  }G_STMT_END
+
+static const guint32 md5_k[64] =
+{
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+static const guint8 md5_shift[4][4] =
+{
+  { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+};
+
+static inline ALWAYS_INLINE void
+md5_multi (guint32      **states,
+           const guint8 **data_in,
+           guint          n_blocks)
+{
+  const guint8 *data[N_LANES];
+  V8 a, b, c, d;
+  memcpy (data, data_in, sizeof (data));
+  GATHER_STATE (a, states, 0);
+  GATHER_STATE (b, states, 1);
+  GATHER_STATE (c, states, 2);
+  GATHER_STATE (d, states, 3);
+  while (n_blocks-- > 0)
+    {
+      V8 x[16];
+      V8 aa = a, bb = b, cc = c, dd = d;
+      guint i;
+      for (i = 0; i < 16; i++)
+        LOAD_WORDS (x[i], data, i, GUINT32_FROM_LE);
+      for (i = 0; i < 64; i++)
+        {
+          V8 f, tmp;
+          guint g;
+          switch (i / 16)
+            {
+            case 0:  f = (b & c) | (~b & d); g = i;                break;
+            case 1:  f = (b & d) | (c & ~d); g = (5 * i + 1) % 16; break;
+            case 2:  f = b ^ c ^ d;          g = (3 * i + 5) % 16; break;
+            default: f = c ^ (b | ~d);       g = (7 * i) % 16;     break;
+            }
+          tmp = a + f + md5_k[i] + x[g];
+          a = d;
+          d = c;
+          c = b;
+          b = b + ROTL (tmp, md5_shift[i / 16][i % 4]);
+        }
+      a += aa;
+      b += bb;
+      c += cc;
+      d += dd;
+      for (i = 0; i < N_LANES; i++)
+        data[i] += 64;
+    }
+  SCATTER_STATE (a, states, 0);
+  SCATTER_STATE (b, states, 1);
+  SCATTER_STATE (c, states, 2);
+  SCATTER_STATE (d, states, 3);
+}
+
+static inline ALWAYS_INLINE void
+sha1_multi (guint32      **states,
+            const guint8 **data_in,
+            guint          n_blocks)
+{
+  const guint8 *data[N_LANES];
+  V8 h[5];
+  guint i;
+  memcpy (data, data_in, sizeof (data));
+  for (i = 0; i < 5; i++)
+    GATHER_STATE (h[i], states, i);
+  while (n_blocks-- > 0)
+    {
+      V8 w[16];
+      V8 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+      guint t;
+      for (t = 0; t < 80; t++)
+        {
+          V8 f, tmp;
+          guint32 k;
+          if (t < 16)
+            LOAD_WORDS (w[t], data, t, GUINT32_FROM_BE);
+          else
+            {
+              tmp = w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15];
+              w[t & 15] = ROTL (tmp, 1);
+            }
+          if (t < 20)
+            { f = (b & c) | (~b & d);          k = 0x5a827999; }
+          else if (t < 40)
+            { f = b ^ c ^ d;                   k = 0x6ed9eba1; }
+          else if (t < 60)
+            { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+          else
+            { f = b ^ c ^ d;                   k = 0xca62c1d6; }
+          tmp = ROTL (a, 5) + f + e + w[t & 15] + k;
+          e = d;
+          d = c;
+          c = ROTL (b, 30);
+          b = a;
+          a = tmp;
+        }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+      for (i = 0; i < N_LANES; i++)
+        data[i] += 64;
+    }
+  for (i = 0; i < 5; i++)
+    SCATTER_STATE (h[i], states, i);
+}
+
+static inline ALWAYS_INLINE void
+sha256_multi (guint32      **states,
+              const guint8 **data_in,
+              guint          n_blocks)
+{
+  const guint8 *data[N_LANES];
+  V8 h[8];
+  guint i;
+  memcpy (data, data_in, sizeof (data));
+  for (i = 0; i < 8; i++)
+    GATHER_STATE (h[i], states, i);
+  while (n_blocks-- > 0)
+    {
+      V8 w[64];
+      V8 a = h[0], b = h[1], c = h[2], d = h[3];
+      V8 e = h[4], f = h[5], g = h[6], hh = h[7];
+      guint t;
+      for (t = 0; t < 16; t++)
+        LOAD_WORDS (w[t], data, t, GUINT32_FROM_BE);
+      for (t = 16; t < 64; t++)
+        {
+          V8 s0 = ROTR (w[t-15], 7) ^ ROTR (w[t-15], 18) ^ (w[t-15] >> 3);
+          V8 s1 = ROTR (w[t-2], 17) ^ ROTR (w[t-2], 19) ^ (w[t-2] >> 10);
+          w[t] = w[t-16] + s0 + w[t-7] + s1;
+        }
+      for (t = 0; t < 64; t++)
+        {
+          V8 S1 = ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25);
+          V8 ch = (e & f) ^ (~e & g);
+          V8 temp1 = hh + S1 + ch + sha256_k[t] + w[t];
+          V8 S0 = ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22);
+          V8 maj = (a & b) ^ (a & c) ^ (b & c);
+          V8 temp2 = S0 + maj;
+          hh = g;
+          g = f;
+          f = e;
+          e = d + temp1;
+          d = c;
+          c = b;
+          b = a;
+          a = temp1 + temp2;
+        }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+      h[5] += f;
+      h[6] += g;
+      h[7] += hh;
+      for (i = 0; i < N_LANES; i++)
+        data[i] += 64;
+    }
+  for (i = 0; i < 8; i++)
+    SCATTER_STATE (h[i], states, i);
+}
+
+#define DEFINE_MULTI(name, target_attr, suffix)                         \
+static void target_attr                                                 \
+name##_blocks_multi_##suffix (guint32 **states,                         \
+                              const guint8 **data,                      \
+                              guint n_blocks)                           \
+{                                                                       \
+  name##_multi (states, data, n_blocks);                                \
+}
+DEFINE_MULTI (md5, , generic)
+DEFINE_MULTI (sha1, , generic)
+DEFINE_MULTI (sha256, , generic)
+#if HAVE_X86
+#define AVX2_TARGET     __attribute__ ((target ("avx2")))
+DEFINE_MULTI (md5, AVX2_TARGET, avx2)
+DEFINE_MULTI (sha1, AVX2_TARGET, avx2)
+DEFINE_MULTI (sha256, AVX2_TARGET, avx2)
+#endif
+#undef DEFINE_MULTI
+#endif  /* HAVE_VECTORS */
+
+/*
+ * Choosing the functions.
+ */
+static GskHashAccel portable_accel;
+static GskHashAccel cpu_accel;
+
+#if HAVE_X86
+static gboolean
+os_saves_ymm (void)
+{
+  guint32 lo, hi;
+  __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+  return (lo & 6) == 6;
+}
+#endif
+
+/* Run once, through g_once():  the tables are built in locals
+   and only copied out before any caller can see them. */
+static gpointer
+init_accel (gpointer data)
+{
+  GskHashAccel portable, cpu;
+  memset (&portable, 0, sizeof (portable));
+#if HAVE_VECTORS
+  portable.md5_blocks_multi = md5_blocks_multi_generic;
+  portable.sha1_blocks_multi = sha1_blocks_multi_generic;
+  portable.sha256_blocks_multi = sha256_blocks_multi_generic;
+#endif
+  cpu = portable;
+
+#if HAVE_X86
+  {
+    unsigned eax, ebx, ecx, edx;
+    unsigned max_leaf = __get_cpuid_max (0, NULL);
+    gboolean ssse3 = FALSE, sse41 = FALSE, pclmul = FALSE, osxsave = FALSE;
+    gboolean sha = FALSE, avx2 = FALSE;
+    if (max_leaf >= 1)
+      {
+        __cpuid (1, eax, ebx, ecx, edx);
+        ssse3 = (ecx & (1 << 9)) != 0;
+        sse41 = (ecx & (1 << 19)) != 0;
+        pclmul = (ecx & (1 << 1)) != 0;
+        osxsave = (ecx & (1 << 27)) != 0;
+      }
+    if (max_leaf >= 7)
+      {
+        __cpuid_count (7, 0, eax, ebx, ecx, edx);
+        sha = (ebx & (1 << 29)) != 0;
+        avx2 = (ebx & (1 << 5)) != 0 && osxsave && os_saves_ymm ();
+      }
+    if (sha && ssse3 && sse41)
+      {
+        cpu.sha1_blocks = sha1_blocks_shani;
+        cpu.sha256_blocks = sha256_blocks_shani;
+      }
+    if (pclmul && sse41)
+      cpu.crc32 = crc32_clmul;
+#if HAVE_VECTORS
+    if (avx2)
+      {
+        cpu.md5_blocks_multi = md5_blocks_multi_avx2;
+        cpu.sha1_blocks_multi = sha1_blocks_multi_avx2;
+        cpu.sha256_blocks_multi = sha256_blocks_multi_avx2;
+      }
+#endif
+  }
+#endif
+  portable_accel = portable;
+  cpu_accel = cpu;
+  return NULL;
+}
+
+const GskHashAccel *
+_gsk_hash_accel_get (gboolean use_cpu_features)
+{
+  static GOnce accel_once = G_ONCE_INIT;
+  g_once (&accel_once, init_accel, NULL);
+  return use_cpu_features ? &cpu_accel : &portable_accel;
+}
@@ -0,0 +1,50 @@
+/* GskHashAccel:
+ *  Faster block functions for GskHash, chosen according to the CPU.
+ *  Private to gskhash.c.
+ *
+ *  Every function here gives exactly the same results as the portable
+ *  code in gskhash.c;  states are the algorithms' 32-bit words,
+ *  in native byte-order.
+ */
+
+#ifndef __GSK_HASH_ACCEL_H_
+#define __GSK_HASH_ACCEL_H_
+
+#include <glib.h>
+
+/* number of streams the multi-buffer functions hash at once */
+#define GSK_HASH_ACCEL_N_LANES          8
+
+typedef struct _GskHashAccel GskHashAccel;
+struct _GskHashAccel
+{
+  /* hash n_blocks 64-byte blocks */
+  void    (*sha1_blocks)   (guint32       *state,
+                            const guint8  *data,
+                            guint          n_blocks);
+  void    (*sha256_blocks) (guint32       *state,
+                            const guint8  *data,
+                            guint          n_blocks);
+
+  /* update a crc32 register;  len is a multiple of 16, at least 64 */
+  guint32 (*crc32)         (guint32        crc,
+                            const guint8  *data,
+                            guint          len);
+
+  /* hash n_blocks 64-byte blocks from each of GSK_HASH_ACCEL_N_LANES streams */
+  void    (*md5_blocks_multi)    (guint32      **states,
+                                  const guint8 **data,
+                                  guint          n_blocks);
+  void    (*sha1_blocks_multi)   (guint32      **states,
+                                  const guint8 **data,
+                                  guint          n_blocks);
+  void    (*sha256_blocks_multi) (guint32      **states,
+                                  const guint8 **data,
+                                  guint          n_blocks);
+};
+
+/* Any member may be NULL.  If use_cpu_features is FALSE,
+   only portable functions are returned. */
+const GskHashAccel *_gsk_hash_accel_get (gboolean use_cpu_features);
+
+#endif
@@ -2,6 +2,7 @@
 #include "gskhash.h"
 #include "../gskghelpers.h"
 #include "../gskmacros.h"
+#include "gskhash-accel.h"
 #include <string.h>
 
 /* --- macros which we might later expose for efficiency --- */
@@ -22,6 +23,23 @@
 #define GSK_HASH_GET_SIZE(hash)				\
 	  ((hash)->size)
 
+/* --- cpu-specific block functions --- */
+static gboolean use_cpu_features = TRUE;
+
+static inline const GskHashAccel *
+peek_accel (void)
+{
+  return _gsk_hash_accel_get (use_cpu_features);
+}
+
+/* For testing:  whether to use the instructions of this cpu,
+   or only the portable code.  Not thread-safe. */
+void
+_gsk_hash_set_use_cpu_features (gboolean use)
+{
+  use_cpu_features = use;
+}
+
 /**
  * gsk_hash_feed:
  * @hash: the hash to feed data.
@@ -917,6 +935,17 @@ sha1_loop(ctxt, input, len)
 	off = 0;
 
 	while (off < len) {
+		if (COUNT == 0 && len - off >= 64) {
+			const GskHashAccel *accel = peek_accel ();
+			if (accel->sha1_blocks != NULL) {
+				guint n_blocks = (len - off) / 64;
+				(*accel->sha1_blocks) (ctxt->h.b32, &input[off],
+						       n_blocks);
+				ctxt->c.b64[0] += (guint64) n_blocks * 512;
+				off += (size_t) n_blocks * 64;
+				continue;
+			}
+		}
 		gapstart = COUNT % 64;
 		gaplen = 64 - gapstart;
 
@@ -969,7 +998,7 @@ typedef struct _HashSHA1 HashSHA1;
 struct _HashSHA1
 {
   GskHash hash;
-  guint8  sha1value[16];
+  guint8  sha1value[20];
   SHA1_CTX context;
 };
 
@@ -1224,6 +1253,18 @@ sha256_feed (GskHash *hash, gconstpointer buffer, guint length)
       left = 0;
     }
 
+  if (length >= 64)
+    {
+      const GskHashAccel *accel = peek_accel ();
+      if (accel->sha256_blocks != NULL)
+        {
+          guint n_blocks = length / 64;
+          (*accel->sha256_blocks) (ctx->state, input, n_blocks);
+          length -= n_blocks * 64;
+          input += n_blocks * 64;
+        }
+    }
+
   while (length >= 64)
     {
       sha256_process_64 (ctx, input);
@@ -1432,6 +1473,18 @@ gsk_hash_crc32_feed (GskHash       *hash,
 		     guint          len)
 {
   HashCRC32 *hash_crc32 = (HashCRC32 *) hash;
+  if (len >= 64)
+    {
+      const GskHashAccel *accel = peek_accel ();
+      if (accel->crc32 != NULL)
+        {
+          guint fold_len = len & ~15;
+          hash_crc32->cur_value = (*accel->crc32) (hash_crc32->cur_value,
+                                                   data, fold_len);
+          data = (const guint8 *) data + fold_len;
+          len -= fold_len;
+        }
+    }
   hash_crc32->cur_value = crc32 (hash_crc32->cur_value, data, len);
 }
 
@@ -1482,3 +1535,239 @@ gsk_hash_new_crc32 (gboolean big_endian)
   hash_crc32->cur_value = 0;
   return hash;
 }
+
+/*
+ *  __  __       _ _   _       _            __  __
+ * |  \/  |_   _| | |_(_)     | |__  _   _ / _|/ _| ___ _ __
+ * | |\/| | | | | | __| |_____| '_ \| | | | |_| |_ / _ \ '__|
+ * | |  | | |_| | | |_| |_____| |_) | |_| |  _|  _|  __/ |
+ * |_|  |_|\__,_|_|\__|_|     |_.__/ \__,_|_| |_|  \___|_|
+ */
+#define N_LANES         GSK_HASH_ACCEL_N_LANES
+
+typedef enum
+{
+  MULTI_MD5,
+  MULTI_SHA1,
+  MULTI_SHA256,
+  N_MULTI_KINDS
+} MultiKind;
+
+typedef void (*FeedFunc)        (GskHash       *hash,
+                                 gconstpointer  data,
+                                 guint          len);
+typedef void (*MultiBlocksFunc) (guint32      **states,
+                                 const guint8 **data,
+                                 guint          n_blocks);
+
+static FeedFunc multi_feed_funcs[N_MULTI_KINDS] =
+{
+  gsk_hash_md5_feed,
+  gsk_hash_sha1_feed,
+  sha256_feed
+};
+
+static MultiBlocksFunc
+get_multi_blocks_func (MultiKind kind)
+{
+  const GskHashAccel *accel = peek_accel ();
+
+  /* the single-stream instructions beat running side-by-side */
+  switch (kind)
+    {
+    case MULTI_MD5:
+      return accel->md5_blocks_multi;
+    case MULTI_SHA1:
+      return accel->sha1_blocks != NULL ? NULL : accel->sha1_blocks_multi;
+    case MULTI_SHA256:
+      return accel->sha256_blocks != NULL ? NULL : accel->sha256_blocks_multi;
+    default:
+      g_return_val_if_reached (NULL);
+    }
+}
+
+/* the number of bytes waiting for a full block, and the state words */
+static guint
+peek_multi_lane (MultiKind  kind,
+                 GskHash   *hash,
+                 guint32  **state_out)
+{
+  switch (kind)
+    {
+    case MULTI_MD5:
+      *state_out = ((HashMD5 *) hash)->context.md5_st.md5_state32;
+      return ((HashMD5 *) hash)->context.md5_i;
+    case MULTI_SHA1:
+      *state_out = ((HashSHA1 *) hash)->context.h.b32;
+      return ((HashSHA1 *) hash)->context.count % 64;
+    case MULTI_SHA256:
+      *state_out = ((HashSHA256 *) hash)->state;
+      return ((HashSHA256 *) hash)->total[0] & 0x3f;
+    default:
+      g_return_val_if_reached (0);
+    }
+}
+
+/* account for blocks hashed behind the hash's back */
+static void
+count_multi_blocks (MultiKind kind,
+                    GskHash  *hash,
+                    guint     n_blocks)
+{
+  switch (kind)
+    {
+    case MULTI_MD5:
+      ((HashMD5 *) hash)->context.md5_n += (guint64) n_blocks * 512;
+      break;
+    case MULTI_SHA1:
+      ((HashSHA1 *) hash)->context.c.b64[0] += (guint64) n_blocks * 512;
+      break;
+    case MULTI_SHA256:
+      {
+        HashSHA256 *ctx = (HashSHA256 *) hash;
+        guint32 n_bytes = n_blocks * 64;
+        ctx->total[0] += n_bytes;
+        if (ctx->total[0] < n_bytes)
+          ctx->total[1]++;
+      }
+      break;
+    default:
+      g_return_if_reached ();
+    }
+}
+
+static void
+feed_lanes (MultiKind       kind,
+            MultiBlocksFunc blocks_func,
+            guint           n_lanes,
+            GskHash       **hashes,
+            const guint8  **data,
+            guint          *lengths)
+{
+  guint32 spare_states[N_LANES][8];
+  guint32 *states[N_LANES];
+  guint i;
+
+  /* finish any partial blocks the ordinary way */
+  for (i = 0; i < n_lanes; i++)
+    {
+      guint n_buffered = peek_multi_lane (kind, hashes[i], &states[i]);
+      if (n_buffered > 0)
+        {
+          guint fill = MIN (64 - n_buffered, lengths[i]);
+          GSK_HASH_FEED (hashes[i], data[i], fill);
+          data[i] += fill;
+          lengths[i] -= fill;
+        }
+    }
+
+  /* run the lanes side-by-side, while at least two have whole blocks;
+     the unused lanes hash a copy of the first lane's data, and go nowhere */
+  memset (spare_states, 0, sizeof (spare_states));
+  for (;;)
+    {
+      GskHash *run_hashes[N_LANES];
+      guint32 *run_states[N_LANES];
+      const guint8 *run_data[N_LANES];
+      guint run_index[N_LANES];
+      guint n_run = 0;
+      guint n_blocks = G_MAXUINT;
+      for (i = 0; i < n_lanes; i++)
+        if (lengths[i] >= 64)
+          {
+            run_hashes[n_run] = hashes[i];
+            run_states[n_run] = states[i];
+            run_data[n_run] = data[i];
+            run_index[n_run] = i;
+            n_blocks = MIN (n_blocks, lengths[i] / 64);
+            n_run++;
+          }
+      if (n_run < 2)
+        break;
+      for (i = n_run; i < N_LANES; i++)
+        {
+          run_states[i] = spare_states[i];
+          run_data[i] = run_data[0];
+        }
+      (*blocks_func) (run_states, run_data, n_blocks);
+      for (i = 0; i < n_run; i++)
+        {
+          guint lane = run_index[i];
+          count_multi_blocks (kind, run_hashes[i], n_blocks);
+          data[lane] += n_blocks * 64;
+          lengths[lane] -= n_blocks * 64;
+        }
+    }
+
+  /* the tails */
+  for (i = 0; i < n_lanes; i++)
+    if (lengths[i] > 0)
+      GSK_HASH_FEED (hashes[i], data[i], lengths[i]);
+}
+
+/**
+ * gsk_hash_feed_multi:
+ * @n_hashes: the number of hashes to feed.
+ * @hashes: the hashes to feed; no hash may appear twice.
+ * @data: the data for each hash.
+ * @lengths: the length of each hash's data.
+ *
+ * Feed a different piece of data to each of several hashes.
+ * This has the same effect as calling gsk_hash_feed() on
+ * each hash in turn, but MD5, SHA1 and SHA256 hashes
+ * may be computed several at a time, using the
+ * CPU's vector instructions.
+ *
+ * This is worthwhile when there are many hashes of the same type,
+ * fed similar amounts of data:  for example, checksumming
+ * a batch of blocks.
+ */
+void
+gsk_hash_feed_multi (guint           n_hashes,
+                     GskHash       **hashes,
+                     gconstpointer  *data,
+                     const guint    *lengths)
+{
+  MultiBlocksFunc blocks_funcs[N_MULTI_KINDS];
+  guint kind, i;
+
+  for (kind = 0; kind < N_MULTI_KINDS; kind++)
+    blocks_funcs[kind] = get_multi_blocks_func (kind);
+
+  /* hashes that can't go side-by-side */
+  for (i = 0; i < n_hashes; i++)
+    {
+      for (kind = 0; kind < N_MULTI_KINDS; kind++)
+        if (hashes[i]->feed == multi_feed_funcs[kind])
+          break;
+      if (kind == N_MULTI_KINDS || blocks_funcs[kind] == NULL)
+        GSK_HASH_FEED (hashes[i], data[i], lengths[i]);
+    }
+
+  /* the rest, in groups of N_LANES of the same type */
+  for (kind = 0; kind < N_MULTI_KINDS; kind++)
+    {
+      GskHash *lane_hashes[N_LANES];
+      const guint8 *lane_data[N_LANES];
+      guint lane_lengths[N_LANES];
+      guint n_lanes = 0;
+      if (blocks_funcs[kind] == NULL)
+        continue;
+      for (i = 0; i < n_hashes; i++)
+        if (hashes[i]->feed == multi_feed_funcs[kind])
+          {
+            lane_hashes[n_lanes] = hashes[i];
+            lane_data[n_lanes] = data[i];
+            lane_lengths[n_lanes] = lengths[i];
+            if (++n_lanes == N_LANES)
+              {
+                feed_lanes (kind, blocks_funcs[kind], n_lanes,
+                            lane_hashes, lane_data, lane_lengths);
+                n_lanes = 0;
+              }
+          }
+      if (n_lanes > 0)
+        feed_lanes (kind, blocks_funcs[kind], n_lanes,
+                    lane_hashes, lane_data, lane_lengths);
+    }
+}
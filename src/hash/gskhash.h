@@ -25,6 +25,12 @@ void       gsk_hash_get_hex    (GskHash        *hash,
                                 gchar          *hex_out);
 void       gsk_hash_destroy    (GskHash        *hash);
 
+/* feed many hashes at once */
+void       gsk_hash_feed_multi (guint           n_hashes,
+                                GskHash       **hashes,
+                                gconstpointer  *data,
+                                const guint    *lengths);
+
 
 /* --- for implementing new types of hash functions --- */
 struct _GskHash
@@ -44,6 +50,9 @@ struct _GskHash
   gpointer    hash_value;
 };
 
+/*< private >*/
+void _gsk_hash_set_use_cpu_features (gboolean use);
+
 G_END_DECLS
 
 #endif
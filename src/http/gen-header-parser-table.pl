@@ -0,0 +1,101 @@
+#! /usr/bin/perl -w
+
+# Generate perfect hash-tables mapping HTTP header names
+# to entries in the parser arrays of gskhttpheader-input.c.
+#
+# usage: gen-header-parser-table.pl gskhttpheader-input.c > gskhttpheader-parsers.inc
+#
+# The header names are taken from the common_parsers, request_parsers
+# and response_parsers arrays, in order.  The hash function
+# must match parser_name_hash() in gskhttpheader-input.c:
+#     h = seed;  for each char c:  h = h * 33 + (c | 0x20)   (mod 2^32)
+# which is case-insensitive for header names.
+#
+# Each slot is 0 if empty;  1..N_COMMON for common_parsers;
+# otherwise N_COMMON + 1 + the index into the request/response array.
+
+use strict;
+
+my $input = shift or die "usage: $0 gskhttpheader-input.c";
+open my $fh, '<', $input or die "error opening $input: $!";
+my $source = do { local $/; <$fh> };
+close $fh;
+
+sub get_names ($)
+{
+  my $array = shift;
+  $source =~ /static\s+GskHttpHeaderLineParser\s+$array\s*\[\]\s*=\s*\{(.*?)\};/s
+    or die "array $array not found in $input";
+  my @names;
+  for my $line (split /\n/, $1)
+    {
+      next if $line =~ m{^\s*//};
+      push @names, lc($1) if $line =~ /_LINE_PARSER\s*\(\s*"([^"]+)"/;
+    }
+  return @names;
+}
+
+my @common = get_names ('common_parsers');
+my @request = get_names ('request_parsers');
+my @response = get_names ('response_parsers');
+
+sub hash ($$)
+{
+  my ($seed, $name) = @_;
+  my $h = $seed;
+  for my $c (unpack ('C*', $name))
+    {
+      $h = ($h * 33 + ($c | 0x20)) % 4294967296;
+    }
+  return $h;
+}
+
+# returns the slot array, or undef if there is a collision
+sub make_slots ($$$)
+{
+  my ($seed, $size, $specific) = @_;
+  my @slots = (0) x $size;
+  my $value = 1;
+  for my $name (@common, @$specific)
+    {
+      my $slot = hash ($seed, $name) % $size;
+      return undef if $slots[$slot];
+      $slots[$slot] = $value++;
+    }
+  return \@slots;
+}
+
+my $n_max = (@common + @request > @common + @response)
+          ? @common + @request : @common + @response;
+my ($seed, $size, $request_slots, $response_slots);
+SEARCH:
+for ($size = $n_max; $size <= 8 * $n_max; $size++)
+  {
+    for ($seed = 0; $seed < 4096; $seed++)
+      {
+        $request_slots = make_slots ($seed, $size, \@request) or next;
+        $response_slots = make_slots ($seed, $size, \@response) or next;
+        last SEARCH;
+      }
+  }
+die "no perfect hash found" unless defined $response_slots;
+die "too many parsers for guint8 slots" if $n_max > 255;
+
+sub print_slots ($$)
+{
+  my ($name, $slots) = @_;
+  print "static const guint8 ${name}[PARSER_TABLE_SIZE] =\n{\n";
+  for (my $i = 0; $i < @$slots; $i += 16)
+    {
+      my $last = $i + 15 < $#$slots ? $i + 15 : $#$slots;
+      print "  ", join (", ", @$slots[$i..$last]), ",\n";
+    }
+  print "};\n";
+}
+
+print "/* generated by gen-header-parser-table.pl from $input: do not edit */\n";
+print "#define PARSER_HASH_SEED  $seed\n";
+print "#define PARSER_TABLE_SIZE $size\n";
+print "#define N_COMMON_PARSERS  ", scalar (@common), "\n";
+print_slots ('request_parser_slots', $request_slots);
+print_slots ('response_parser_slots', $response_slots);
@@ -125,7 +125,6 @@ struct _GskHttpClientRequest
 
   GskHttpResponse *response;
   GskHttpClientContentStream *content_stream;
-  GHashTable *response_command_table;
 
   RequestState state;
   guint64 remaining_data;  /* only during READING_RESPONSE_CONTENT_* */
@@ -146,6 +145,17 @@ had_eof_terminated_post_data (GskHttpClientRequest *request)
       && GSK_HTTP_HEADER (request->request)->content_length == -1;
 }
 
+/* Responses which never have a body,
+   whatever their headers say (RFC 2616, 4.4). */
+static inline gboolean
+response_has_no_body (GskHttpClientRequest *request)
+{
+  GskHttpStatus status = request->response->status_code;
+  return request->request->verb == GSK_HTTP_VERB_HEAD
+      || status == GSK_HTTP_STATUS_NO_CONTENT
+      || status == GSK_HTTP_STATUS_NOT_MODIFIED;
+}
+
 static inline void
 set_state_to_reading_response (GskHttpClientRequest *request)
 {
@@ -289,15 +299,13 @@ handle_firstline_header (GskHttpClientRequest  *request,
       return;
     }
   request->state = READING_RESPONSE_HEADER;
-  request->response_command_table = gsk_http_header_get_parser_table (FALSE);
-  DEBUG ("initializing command table for request %p", request);
 }
 
 static void
 handle_response_header   (GskHttpClientRequest  *request,
 			  const char            *line)
 {
-  GskHttpHeaderLineParser *parser;
+  const GskHttpHeaderLineParser *parser;
   GskHttpHeader *response_header = GSK_HTTP_HEADER (request->response);
   char *lowercase;
   const char *colon;
@@ -306,6 +314,7 @@ handle_response_header   (GskHttpClientRequest  *request,
   GSK_SKIP_WHITESPACE (line);		/* unnecessary */
   if (*line == 0)
     {
+      gboolean no_body;
       DEBUG ("got whitespace line");
       if (request->response->status_code == GSK_HTTP_STATUS_CONTINUE)
         {
@@ -317,7 +326,13 @@ handle_response_header   (GskHttpClientRequest  *request,
 
       request->content_stream = gsk_http_client_content_stream_new (request->client);
       /* done parsing header */
-      if (response_header->transfer_encoding_type == GSK_HTTP_TRANSFER_ENCODING_CHUNKED)
+      no_body = response_has_no_body (request);
+      if (no_body)
+        {
+          request->state = READING_RESPONSE_CONTENT_NO_ENCODING;
+          request->remaining_data = 0;
+        }
+      else if (response_header->transfer_encoding_type == GSK_HTTP_TRANSFER_ENCODING_CHUNKED)
 	request->state = READING_RESPONSE_CONTENT_CHUNK_HEADER;
       else if (response_header->content_length < 0)
 	{
@@ -335,7 +350,7 @@ handle_response_header   (GskHttpClientRequest  *request,
 				  GSK_STREAM (request->content_stream),
 				  request->handle_response_data);
 
-      if (response_header->content_length == 0)
+      if (no_body || response_header->content_length == 0)
 	{
 	  request->state = DONE;
 	  gsk_http_client_content_stream_shutdown (request->content_stream);
@@ -351,21 +366,21 @@ handle_response_header   (GskHttpClientRequest  *request,
       return;	/* XXX: error handling! */
     }
 
-  /* lowercase the header */
-  lowercase = g_alloca (colon - (char*)line + 1);
-  for (i = 0; line[i] != ':'; i++)
-    lowercase[i] = g_ascii_tolower (line[i]);
-  lowercase[i] = '\0';
-
   val = colon + 1;
   GSK_SKIP_WHITESPACE (val);
-  
-  parser = g_hash_table_lookup (request->response_command_table, lowercase);
+
+  parser = gsk_http_header_lookup_line_parser (FALSE, line, colon - line);
   if (parser == NULL)
     {
       /* XXX: error handling */
       gboolean is_nonstandard = (line[0] == 'x' || line[0] == 'X')
                               && line[1] == '-';
+
+      /* misc headers are stored with lowercased names */
+      lowercase = g_alloca (colon - line + 1);
+      for (i = 0; line[i] != ':'; i++)
+        lowercase[i] = g_ascii_tolower (line[i]);
+      lowercase[i] = '\0';
       if (!is_nonstandard)
         gsk_debug ("Gsk-Http-Parser", "couldn't handle header line %s", line);
       gsk_http_header_add_misc (GSK_HTTP_HEADER (request->response),
@@ -939,7 +954,6 @@ gsk_http_client_request  (GskHttpClient         *client,
   request->handle_response_destroy = hook_destroy;
   request->response = NULL;
   request->content_stream = NULL;
-  request->response_command_table = NULL;
   request->state = INIT;
   request->remaining_data = 0;
   request->next = NULL;
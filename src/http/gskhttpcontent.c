@@ -4,12 +4,14 @@
 #include "../gskmemory.h"
 #include "../gskutils.h"
 #include "../gskstreamfd.h"
+#include "../gskmemorybarrier.h"
 #include "../gskstreamlistenersocket.h"
 #include "../mime/gskmimemultipartdecoder.h"
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
 
 /* --- helper functions --- */
 static void
@@ -1027,8 +1029,76 @@ struct _DataInfo
   guint          data_len;
   gpointer       destroy_data;
   GDestroyNotify destroy;
+
+  /* pre-rendered response headers, indexed by the request's
+     connection-type and HTTP minor version.  These are created
+     on demand, and never change after being published. */
+  GskHttpResponseTemplate *templates[3][2];
 };
 
+G_LOCK_DEFINE_STATIC (data_templates);
+
+/* the Content-Type depends on the path, which may vary */
+static gboolean
+template_has_mime_type (GskHttpResponseTemplate *templ,
+                        GskHttpContent          *content,
+                        GskHttpRequest          *request)
+{
+  GskHttpHeader *header = GSK_HTTP_HEADER (gsk_http_response_template_peek_response (templ));
+  const char *type, *subtype;
+  if (!gsk_http_content_get_mime_type (content, request->path, &type, &subtype))
+    return !header->has_content_type;
+  return header->has_content_type
+      && header->content_type != NULL
+      && header->content_subtype != NULL
+      && strcmp (header->content_type, type) == 0
+      && strcmp (header->content_subtype, subtype) == 0;
+}
+
+static GskHttpResponseTemplate *
+get_data_template (DataInfo       *di,
+                   GskHttpContent *content,
+                   GskHttpRequest *request)
+{
+  GskHttpHeader *header = GSK_HTTP_HEADER (request);
+  GskHttpResponseTemplate **p_templ;
+  GskHttpResponseTemplate *templ;
+
+  if (header->http_major_version != 1
+   || header->http_minor_version > 1
+   || header->connection_type > GSK_HTTP_CONNECTION_KEEPALIVE)
+    return NULL;
+  p_templ = &di->templates[header->connection_type][header->http_minor_version];
+  templ = g_atomic_pointer_get ((gpointer *) p_templ);
+  if (templ == NULL)
+    {
+      GskHttpResponse *response;
+      response = gsk_http_response_from_request (request,
+                                                 GSK_HTTP_STATUS_OK,
+                                                 di->data_len);
+      try_add_content_type (content, request, response);
+      gsk_http_header_set_date (response, time (NULL));
+      templ = gsk_http_response_template_new (response);
+      g_object_unref (response);
+
+      G_LOCK (data_templates);
+      if (*p_templ == NULL)
+        {
+          GSK_MEMORY_BARRIER ();
+          *p_templ = templ;
+        }
+      else
+        {
+          gsk_http_response_template_unref (templ);
+          templ = *p_templ;
+        }
+      G_UNLOCK (data_templates);
+    }
+  if (!template_has_mime_type (templ, content, request))
+    return NULL;
+  return templ;
+}
+
 static GskHttpContentResult
 handle_data_request (GskHttpContent        *content,
                      GskHttpContentHandler *handler,
@@ -1038,17 +1108,25 @@ handle_data_request (GskHttpContent        *content,
                      gpointer               data)
 {
   DataInfo *di = data;
-  GskHttpResponse *response;
+  GskHttpResponseTemplate *templ;
   GskStream *stream;
-  response = gsk_http_response_from_request (request,
-                                             GSK_HTTP_STATUS_OK,
-                                             di->data_len);
   handler_ref (handler);
   stream = gsk_memory_slab_source_new (di->data, di->data_len,
                                        di->destroy, di->destroy_data);
-  try_add_content_type (content, request, response);
-  gsk_http_server_respond (server, request, response, stream);
-  g_object_unref (response);
+  templ = get_data_template (di, content, request);
+  if (templ != NULL)
+    gsk_http_server_respond_template (server, request, templ,
+                                      di->data_len, NULL, stream);
+  else
+    {
+      GskHttpResponse *response;
+      response = gsk_http_response_from_request (request,
+                                                 GSK_HTTP_STATUS_OK,
+                                                 di->data_len);
+      try_add_content_type (content, request, response);
+      gsk_http_server_respond (server, request, response, stream);
+      g_object_unref (response);
+    }
   g_object_unref (stream);
   return GSK_HTTP_CONTENT_OK;
 }
@@ -1064,6 +1142,7 @@ data_info_alloc ( gconstpointer            data,
   di->data_len = data_len;
   di->destroy_data = destroy_data;
   di->destroy = destroy;
+  memset (di->templates, 0, sizeof (di->templates));
   return di;
 }
 
@@ -1071,8 +1150,13 @@ static void
 data_info_destroy (gpointer data)
 {
   DataInfo *di = data;
+  guint i, j;
   if (di->destroy)
     di->destroy (di->destroy_data);
+  for (i = 0; i < G_N_ELEMENTS (di->templates); i++)
+    for (j = 0; j < G_N_ELEMENTS (di->templates[i]); j++)
+      if (di->templates[i][j] != NULL)
+        gsk_http_response_template_unref (di->templates[i][j]);
   g_free (di);
 }
 
@@ -1200,6 +1284,9 @@ handle_file_request (GskHttpContent        *content,
     size = stat_buf.st_size;
   response = gsk_http_response_from_request (request, GSK_HTTP_STATUS_OK, size);
   try_add_content_type (content, request, response);
+
+  /* with a known size, the server can sendfile() the file
+     straight to the client's socket */
   gsk_http_server_respond (server, request, response, stream);
   g_object_unref (response);
   g_object_unref (stream);
@@ -1371,3 +1458,43 @@ gsk_http_content_listen (GskHttpContent   *content,
                                      content, NULL);
   return TRUE;
 }
+
+static void
+setup_group_listener (GskStreamListener *listener,
+                      guint              worker_index,
+                      gpointer           data)
+{
+  gsk_stream_listener_handle_accept (listener, handler_new_connection,
+                                     handler_listener_failed,
+                                     data, NULL);
+}
+
+/**
+ * gsk_http_content_listen_group:
+ * @content: the content database which will handle requests.
+ * @address: the address to bind to, typically in the TCP namespace.
+ * @n_workers: the number of threads to serve requests with.
+ * @error: where to put the error if something goes wrong.
+ *
+ * Like gsk_http_content_listen(), but accept and serve connections
+ * in @n_workers threads, each with its own main-loop and (where
+ * SO_REUSEPORT is supported) its own listening socket.
+ *
+ * The content's handlers will be run concurrently from the worker threads,
+ * so @content must not be modified once this has been called,
+ * and any custom handlers must be thread-safe.
+ *
+ * returns: the listener group, which may be stopped with
+ * gsk_stream_listener_group_destroy(), or NULL on error.
+ */
+GskStreamListenerGroup *
+gsk_http_content_listen_group (GskHttpContent   *content,
+                               GskSocketAddress *address,
+                               guint             n_workers,
+                               GError          **error)
+{
+  return gsk_stream_listener_group_new (address, n_workers,
+                                        GSK_STREAM_LISTENER_GROUP_REUSE_PORT,
+                                        setup_group_listener, content,
+                                        error);
+}
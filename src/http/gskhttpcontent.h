@@ -4,6 +4,7 @@
 #include "gskhttpserver.h"
 #include "../mime/gskmimemultipartpiece.h"
 #include "../gsksocketaddress.h"
+#include "../gskstreamlistenergroup.h"
 
 G_BEGIN_DECLS
 
@@ -166,6 +167,11 @@ void           gsk_http_content_add_file_by_id
 gboolean gsk_http_content_listen (GskHttpContent *content,
                                   GskSocketAddress *address,
                                   GError          **error);
+GskStreamListenerGroup *
+         gsk_http_content_listen_group (GskHttpContent   *content,
+                                        GskSocketAddress *address,
+                                        guint             n_workers,
+                                        GError          **error);
 void gsk_http_content_respond    (GskHttpContent *content,
                                   GskHttpServer  *server,
                                   GskHttpRequest *request,
@@ -101,10 +101,8 @@ gsk_http_request_parse_first_line (GskHttpRequest *request,
       return GSK_HTTP_REQUEST_FIRST_LINE_ERROR;
     }
 
-  g_free (request->path);
-  request->path = g_new (char, request_length + 1);
-  memcpy (request->path, line + request_start, request_length);
-  request->path[request_length] = '\0';
+  gsk_http_header_set_string_len (request, &request->path,
+                                  line + request_start, request_length);
 
   header->http_minor_version = 0;
   while (line[at] && (line[at] == ' ' || line[at] == '\t'))
@@ -1521,8 +1519,9 @@ handle_content_type (GskHttpHeader *header,
   gsk_http_header_set_string_len (header, &header->content_subtype, type_info.subtype_start, type_info.subtype_len);
   gsk_http_header_set_string_len (header, &header->content_charset, type_info.charset_start, type_info.charset_len);
   for (i = 0; i < type_info.n_additional; i++)
-    addl = g_slist_prepend (addl, g_strndup (type_info.additional_starts[i],
-                                             type_info.additional_lens[i]));
+    addl = g_slist_prepend (addl, gsk_http_header_cut_string (header,
+                                   type_info.additional_starts[i],
+                                   type_info.additional_starts[i] + type_info.additional_lens[i]));
   header->content_additional = g_slist_concat (header->content_additional,
                                                g_slist_reverse (addl));
   return TRUE;
@@ -1926,6 +1925,56 @@ static GskHttpHeaderLineParser response_parsers[] =
   GENERIC_LINE_PARSER ("www-authenticate", handle_www_authenticate),
 };
 
+#include "gskhttpheader-parsers.inc"
+
+static inline guint32
+parser_name_hash (const char *name,
+                  guint       len)
+{
+  guint32 h = PARSER_HASH_SEED;
+  guint i;
+  for (i = 0; i < len; i++)
+    h = h * 33 + ((guint8) name[i] | 0x20);
+  return h;
+}
+
+/**
+ * gsk_http_header_lookup_line_parser:
+ * @is_request: whether the header line is part of a request (versus a response).
+ * @name: the header name, in any case.  It need not be NUL-terminated.
+ * @name_len: the length of @name.
+ *
+ * Find the parser for a header line, given the part before the colon.
+ * This uses a perfect hash-table generated when GSK is built,
+ * so it takes no locks and does not need a lowercased copy of @name.
+ *
+ * returns: the parser, or NULL if this header should be treated
+ * as a miscellaneous header.
+ */
+const GskHttpHeaderLineParser *
+gsk_http_header_lookup_line_parser (gboolean    is_request,
+                                    const char *name,
+                                    guint       name_len)
+{
+  guint slot = parser_name_hash (name, name_len) % PARSER_TABLE_SIZE;
+  guint value = is_request ? request_parser_slots[slot] : response_parser_slots[slot];
+  const GskHttpHeaderLineParser *parser;
+  if (value == 0)
+    return NULL;
+  if (value <= N_COMMON_PARSERS)
+    parser = common_parsers + (value - 1);
+  else if (is_request)
+    parser = request_parsers + (value - 1 - N_COMMON_PARSERS);
+  else
+    parser = response_parsers + (value - 1 - N_COMMON_PARSERS);
+  /* compare lengths first:  the slot may hold a shorter name,
+     and NAME may contain a NUL */
+  if (strlen (parser->name) != name_len
+   || g_ascii_strncasecmp (parser->name, name, name_len) != 0)
+    return NULL;
+  return parser;
+}
+
 /**
  * gsk_http_header_get_parser_table:
  * @is_request: whether to get the parse table for request (versus for responses).
@@ -1934,6 +1983,9 @@ static GskHttpHeaderLineParser response_parsers[] =
  * to #GskHttpHeaderLineParser's.  There are different maps
  * for requests and responses.
  *
+ * gsk_http_header_lookup_line_parser() is faster
+ * and doesn't require lowercasing.
+ *
  * returns: the hash-table mapping, which is global and should not be freed.
  */
 GHashTable *
@@ -1963,33 +2015,85 @@ gsk_http_header_get_parser_table (gboolean is_request)
   return table_table[index];
 }
 
+/* A line of the header as a NUL-terminated string.
+ * A line which lies in one of the buffer's own fragments
+ * is terminated in place (the overwritten character is put back
+ * by line_buf_restore(), since the buffer may still be reparsed);
+ * any other line is copied into 'mem'. */
+typedef struct _LineBuf LineBuf;
+struct _LineBuf
+{
+  gsize mem_size;
+  char *mem;
+  gboolean mem_from_stack;
+  char *nul_at;
+  char nul_saved;
+};
+
 static void
-snip_between (GskBufferIterator *start,
-	      GskBufferIterator *end,
-              gsize *line_size,
-	      char **line_mem,
-	      gboolean *line_mem_from_stack)
+line_buf_restore (LineBuf *line_buf)
 {
-  gboolean must_realloc = FALSE;
+  if (line_buf->nul_at != NULL)
+    {
+      *line_buf->nul_at = line_buf->nul_saved;
+      line_buf->nul_at = NULL;
+    }
+}
+
+static void
+line_buf_destruct (LineBuf *line_buf)
+{
+  line_buf_restore (line_buf);
+  if (!line_buf->mem_from_stack)
+    g_free (line_buf->mem);
+}
+
+static char *
+line_buf_get (LineBuf           *line_buf,
+              GskBufferIterator *start,
+	      GskBufferIterator *end)
+{
+  GskBufferFragment *fragment = start->fragment;
+  char *line = (char *) start->cur_data + start->in_cur;
   guint len = end->offset - start->offset;
-  while (len + 1 > *line_size)
+  char *nul_at;
+
+  line_buf_restore (line_buf);
+
+  /* the iterator may be at the very end of the previous fragment */
+  if (start->in_cur == start->cur_length && fragment->next != NULL)
     {
-      *line_size += *line_size;
-      must_realloc = TRUE;
+      fragment = fragment->next;
+      line = fragment->buf + fragment->buf_start;
     }
-  if (must_realloc)
+
+  if (fragment == end->fragment && !fragment->is_foreign)
+    {
+      nul_at = line + len;
+      if (len > 0 && line[len - 1] == '\r')
+        nul_at--;
+      line_buf->nul_at = nul_at;
+      line_buf->nul_saved = *nul_at;
+      *nul_at = '\0';
+      return line;
+    }
+
+  if (len + 1 > line_buf->mem_size)
     {
-      if (!*line_mem_from_stack)
-	g_free (*line_mem);
+      while (len + 1 > line_buf->mem_size)
+        line_buf->mem_size += line_buf->mem_size;
+      if (!line_buf->mem_from_stack)
+	g_free (line_buf->mem);
       else
-	*line_mem_from_stack = FALSE;
-      *line_mem = g_malloc (*line_size);
+	line_buf->mem_from_stack = FALSE;
+      line_buf->mem = g_malloc (line_buf->mem_size);
     }
-  gsk_buffer_iterator_peek (start, *line_mem, len);
-  if (len > 0 && (*line_mem)[len - 1] == '\r')
-    (*line_mem)[len-1] = '\0';
+  gsk_buffer_iterator_peek (start, line_buf->mem, len);
+  if (len > 0 && line_buf->mem[len - 1] == '\r')
+    line_buf->mem[len-1] = '\0';
   else
-    (*line_mem)[len] = '\0';
+    line_buf->mem[len] = '\0';
+  return line_buf->mem;
 }
 
 /**
@@ -1997,8 +2101,11 @@ snip_between (GskBufferIterator *start,
  * @input: the buffer from which to parse the request.
  * @is_request: whether this is a request; otherwise, it is a response.
  * @flags: preferences for parsing.
+ * @error: place to put the error if the header is malformed.
  *
  * Parse the HTTP header from the buffer.
+ * If the buffer doesn't contain the whole header yet,
+ * NULL is returned without setting @error, and the buffer is unchanged.
  *
  * returns: a new reference to the header.
  */
@@ -2010,25 +2117,28 @@ gsk_http_header_from_buffer (GskBuffer     *input,
 {
   GskBufferIterator iterator;
   GskBufferIterator newline;
-  gsize line_size = 4096;
-  char *line_mem = g_alloca (line_size);
-  gboolean line_mem_from_stack = TRUE;
+  LineBuf line_buf;
+  char *line;
   GType header_type;
   GskHttpHeader *rv;
-  GHashTable *parser_table;
   gboolean save_errors = ((flags & GSK_HTTP_PARSE_SAVE_ERRORS) != 0);
 
   gsk_buffer_iterator_construct (&iterator, input);
   newline = iterator;
   if (!gsk_buffer_iterator_find_char (&newline, '\n'))
     return NULL;
-  snip_between (&iterator, &newline, &line_size, &line_mem, &line_mem_from_stack);
+  line_buf.mem_size = 4096;
+  line_buf.mem = g_alloca (line_buf.mem_size);
+  line_buf.mem_from_stack = TRUE;
+  line_buf.nul_at = NULL;
+  line = line_buf_get (&line_buf, &iterator, &newline);
   header_type = is_request ? GSK_TYPE_HTTP_REQUEST : GSK_TYPE_HTTP_RESPONSE;
   rv = g_object_new (header_type, NULL);
+  if ((flags & GSK_HTTP_PARSE_ZERO_COPY) != 0)
+    gsk_http_header_use_arena (rv);
 #define ERROR_RETURN()                          \
   G_STMT_START{                                 \
-    if (!line_mem_from_stack)                   \
-      g_free (line_mem);                        \
+    line_buf_destruct (&line_buf);              \
     g_object_unref (rv);                        \
     return NULL;                                \
   }G_STMT_END
@@ -2036,17 +2146,12 @@ gsk_http_header_from_buffer (GskBuffer     *input,
   if (is_request)
     {
       switch (gsk_http_request_parse_first_line (GSK_HTTP_REQUEST (rv),
-                                                 line_mem, 
-                                                 error))
+                                                 line, error))
         {
         case GSK_HTTP_REQUEST_FIRST_LINE_ERROR:
-          g_object_unref (rv);
-          if (!line_mem_from_stack)
-            g_free (line_mem);
-          return NULL;
+          ERROR_RETURN ();
         case GSK_HTTP_REQUEST_FIRST_LINE_SIMPLE:
-          if (!line_mem_from_stack)
-            g_free (line_mem);
+          line_buf_destruct (&line_buf);
           gsk_buffer_discard (input, gsk_buffer_iterator_offset (&newline) + 1);
           return rv;
         case GSK_HTTP_REQUEST_FIRST_LINE_FULL:
@@ -2057,7 +2162,7 @@ gsk_http_header_from_buffer (GskBuffer     *input,
     }
   else
     {
-      if (!gsk_http_response_process_first_line (GSK_HTTP_RESPONSE (rv), line_mem))
+      if (!gsk_http_response_process_first_line (GSK_HTTP_RESPONSE (rv), line))
         {
           if (rv->g_error)
             {
@@ -2071,44 +2176,47 @@ gsk_http_header_from_buffer (GskBuffer     *input,
   gsk_buffer_iterator_skip (&newline, 1);
   iterator = newline;
 
-  parser_table = gsk_http_header_get_parser_table (is_request);
   for (;;)
     {
       /* Assert:  newline == iterator */
       char *at, *colon;
-      GskHttpHeaderLineParser *parser;
+      const GskHttpHeaderLineParser *parser;
 
       if (!gsk_buffer_iterator_find_char (&newline, '\n'))
 	ERROR_RETURN ();
-      snip_between (&iterator, &newline, &line_size, &line_mem, &line_mem_from_stack);
-      if (line_mem[0] == '\0' || isspace (line_mem[0]))
+      line = line_buf_get (&line_buf, &iterator, &newline);
+      if (line[0] == '\0' || isspace (line[0]))
 	break;
 
-      colon = strchr (line_mem, ':');
+      colon = strchr (line, ':');
       if (colon == NULL)
-	ERROR_RETURN ();
-      at = line_mem;
-      while (at < colon)
-	{
-	  *at = tolower (*at);
-	  at++;
-	}
-      *at++ = 0;
+        {
+          g_set_error (error, GSK_G_ERROR_DOMAIN,
+                       GSK_ERROR_HTTP_PARSE,
+                       "parsing HTTP header: no colon in header line `%s'",
+                       line);
+	  ERROR_RETURN ();
+        }
+      at = colon + 1;
       GSK_SKIP_WHITESPACE (at);
-      parser = g_hash_table_lookup (parser_table, line_mem);
+      parser = gsk_http_header_lookup_line_parser (is_request, line,
+                                                   colon - line);
       if (parser == NULL)
 	{
 	  /* Add it as an additional field. */
-	  gsk_http_header_add_misc (rv, line_mem, at);
+	  gsk_http_header_add_misc_len (rv, line, colon - line, at);
 	}
-      else
-	{
-	  if (!(*parser->func)(rv, at, parser->data))
+      else if (!(*parser->func)(rv, at, parser->data))
+        {
+          if (save_errors)
+	    gsk_http_header_add_misc_len (rv, line, colon - line, at);
+          else
             {
-              if (save_errors)
-	        gsk_http_header_add_misc (rv, line_mem, at);
-              else
-	        ERROR_RETURN ();
+              g_set_error (error, GSK_G_ERROR_DOMAIN,
+                           GSK_ERROR_HTTP_PARSE,
+                           "parsing HTTP header: error parsing `%s'",
+                           line);
+	      ERROR_RETURN ();
             }
 	}
       gsk_buffer_iterator_skip (&newline, 1);
@@ -2116,10 +2224,8 @@ gsk_http_header_from_buffer (GskBuffer     *input,
     }
 #undef ERROR_RETURN
 
+  line_buf_destruct (&line_buf);
   gsk_buffer_discard (input, gsk_buffer_iterator_offset (&newline) + 1);
 
-  if (!line_mem_from_stack)
-    g_free (line_mem);
-
   return rv;
 }
@@ -1076,13 +1076,18 @@ gsk_http_header_print(GskHttpHeader          *http_header,
   /*
    * And the miscellaneous headers.
    */
-  if (http_header->header_lines)
+  if (http_header->header_lines || http_header->unparsed_misc)
     {
       PrintInfo info;
+      GskHttpHeaderMiscLine *line;
       info.print_func = print_func;
       info.print_data = print_data;
-      g_hash_table_foreach (http_header->header_lines,
-			    append_key_value_to_print_info, &info);
+      if (http_header->header_lines)
+        g_hash_table_foreach (http_header->header_lines,
+                              append_key_value_to_print_info, &info);
+      for (line = http_header->unparsed_misc; line != NULL; line = line->next)
+        append_key_value_to_print_info ((gpointer) line->key,
+                                        (gpointer) line->value, &info);
     }
 }
 
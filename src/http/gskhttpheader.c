@@ -40,16 +40,23 @@ enum
  * (May be NULL)
  *
  * Private function to set a string in a HTTP header.
- * (Currently this uses strdup, but we may eventually switch
- * allocation strategies).
+ * (This uses strdup, unless the header was parsed with
+ * GSK_HTTP_PARSE_ZERO_COPY, in which case the string
+ * is allocated from the header's arena).
  */
 void
 gsk_http_header_set_string (gpointer         http_header,
                             char           **p_str,
                             const char      *str)
 {
+  GskHttpHeader *header = http_header;
   char *cpy;
   g_return_if_fail (GSK_IS_HTTP_HEADER (http_header));
+  if (header->uses_arena)
+    {
+      *p_str = gsk_mem_pool_strdup (&header->arena, str);
+      return;
+    }
   cpy = g_strdup (str);
   if (*p_str)
     g_free (*p_str);
@@ -62,8 +69,14 @@ gsk_http_header_set_string_len (gpointer         http_header,
                                 const char      *str,
                                 guint            len)
 {
+  GskHttpHeader *header = http_header;
   char *cpy;
   g_return_if_fail (GSK_IS_HTTP_HEADER (http_header));
+  if (header->uses_arena)
+    {
+      *p_str = str ? gsk_http_header_cut_string (header, str, str + len) : NULL;
+      return;
+    }
   cpy = g_strndup (str, len);
   if (*p_str)
     g_free (*p_str);
@@ -107,7 +120,12 @@ gsk_http_header_cut_string (gpointer    http_header,
                             const char *start,
                             const char *end)
 {
-  char *rv = g_new (char, end - start + 1);
+  GskHttpHeader *header = http_header;
+  char *rv;
+  if (header->uses_arena)
+    rv = gsk_mem_pool_alloc_unaligned (&header->arena, end - start + 1);
+  else
+    rv = g_new (char, end - start + 1);
   memcpy (rv, start, end - start);
   rv[end - start] = 0;
   return rv;
@@ -128,7 +146,23 @@ gsk_http_header_free_string (gpointer http_header,
 			     char    *str)
 {
   g_return_if_fail (GSK_IS_HTTP_HEADER (http_header));
-  g_free (str);
+  if (!GSK_HTTP_HEADER (http_header)->uses_arena)
+    g_free (str);
+}
+
+/**
+ * gsk_http_header_use_arena:
+ * @header: a newly created HTTP header.
+ *
+ * private.
+ * Make the header allocate its strings from a memory pool
+ * which is freed with the header.  This must be called
+ * before any strings are set.
+ */
+void
+gsk_http_header_use_arena (GskHttpHeader *header)
+{
+  header->uses_arena = 1;
 }
 
 
@@ -538,6 +572,7 @@ gsk_http_header_finalize (GObject *object)
   g_slist_foreach (header->pragmas, (GFunc) g_free, NULL);
   g_slist_free (header->errors);
   g_slist_free (header->pragmas);
+  gsk_mem_pool_destruct (&header->arena);
   parent_class->finalize (object);
 }
 
@@ -552,6 +587,7 @@ gsk_http_header_init (GskHttpHeader *http_header)
   http_header->range_start = http_header->range_end = -1;
   http_header->transfer_encoding_type = GSK_HTTP_TRANSFER_ENCODING_NONE;
   http_header->content_encoding_type = GSK_HTTP_CONTENT_ENCODING_IDENTITY;
+  gsk_mem_pool_construct (&http_header->arena);
 }
 
 static void
@@ -722,6 +758,7 @@ gsk_http_header_add_misc    (GskHttpHeader *header,
 {
   /* TODO: should use a case-insensitive hash function,
            instead of g_ascii_strdown()!!! */
+  gsk_http_header_flush_misc (header);
   if (header->header_lines == NULL)
     header->header_lines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   g_hash_table_insert (header->header_lines, g_ascii_strdown (key, -1), g_strdup (value));
@@ -748,6 +785,8 @@ gsk_http_header_remove_misc  (GskHttpHeader *header,
     lower[i] = g_ascii_tolower (key[i]);
   lower[i] = 0;
 
+  gsk_http_header_flush_misc (header);
+  g_return_if_fail (header->header_lines != NULL);
   g_return_if_fail (g_hash_table_lookup (header->header_lines, lower) != NULL);
   g_hash_table_remove (header->header_lines, lower);
 }
@@ -770,6 +809,13 @@ gsk_http_header_lookup_misc  (GskHttpHeader *header,
   char *lower;
   guint i;
 
+  if (header->unparsed_misc != NULL)
+    {
+      GskHttpHeaderMiscLine *line;
+      for (line = header->unparsed_misc; line != NULL; line = line->next)
+        if (g_ascii_strcasecmp (line->key, key) == 0)
+          return line->value;
+    }
   if (header->header_lines == NULL)
     return NULL;
 
@@ -781,6 +827,80 @@ gsk_http_header_lookup_misc  (GskHttpHeader *header,
   return g_hash_table_lookup (header->header_lines, lower);
 }
 
+/**
+ * gsk_http_header_add_misc_len:
+ * @header: the header to affect.
+ * @key: the name of the header line, in any case.
+ * @key_len: the length of @key in bytes.
+ * @value: a case-sensitive value for that key.
+ *
+ * private.
+ * Add a raw header line, as found by the parser.
+ * Headers which use an arena just keep the line
+ * until the table of misc-headers is needed.
+ */
+void
+gsk_http_header_add_misc_len (GskHttpHeader *header,
+                              const char    *key,
+                              guint          key_len,
+                              const char    *value)
+{
+  char *lower;
+  guint i;
+  if (header->uses_arena)
+    {
+      GskHttpHeaderMiscLine *line;
+      line = gsk_mem_pool_alloc (&header->arena, sizeof (GskHttpHeaderMiscLine));
+      lower = gsk_mem_pool_alloc_unaligned (&header->arena, key_len + 1);
+      for (i = 0; i < key_len; i++)
+        lower[i] = g_ascii_tolower (key[i]);
+      lower[i] = 0;
+      line->key = lower;
+      line->value = gsk_mem_pool_strdup (&header->arena, value);
+
+      /* prepend, so that the latest line wins, as with the hash-table */
+      line->next = header->unparsed_misc;
+      header->unparsed_misc = line;
+      return;
+    }
+
+  if (header->header_lines == NULL)
+    header->header_lines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_hash_table_insert (header->header_lines, g_ascii_strdown (key, key_len), g_strdup (value));
+}
+
+/**
+ * gsk_http_header_flush_misc:
+ * @header: the header to affect.
+ *
+ * private.
+ * Move any lines kept by gsk_http_header_add_misc_len()
+ * into the table of misc-headers.
+ */
+void
+gsk_http_header_flush_misc (GskHttpHeader *header)
+{
+  GskHttpHeaderMiscLine *lines = NULL;
+  GskHttpHeaderMiscLine *at;
+
+  if (header->unparsed_misc == NULL)
+    return;
+
+  /* reverse the list, so that the lines are added in order */
+  while (header->unparsed_misc != NULL)
+    {
+      at = header->unparsed_misc;
+      header->unparsed_misc = at->next;
+      at->next = lines;
+      lines = at;
+    }
+
+  if (header->header_lines == NULL)
+    header->header_lines = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  for (at = lines; at != NULL; at = at->next)
+    g_hash_table_insert (header->header_lines, g_strdup (at->key), g_strdup (at->value));
+}
+
 /* --- Enum type registration --- */
 #include "gskhttpheader.inc"    /* machine-generated enum-value tables */
 #define DEFINE_ENUM_GET_TYPE_FUNC(class, lower)                                 \
@@ -31,6 +31,7 @@
 
 #include <glib-object.h>
 #include "../gskbuffer.h"
+#include "../gskmempool.h"
 
 G_BEGIN_DECLS
 
@@ -47,6 +48,7 @@ typedef struct _GskHttpMediaTypeSet GskHttpMediaTypeSet;
 typedef struct _GskHttpContentEncodingSet GskHttpContentEncodingSet;
 typedef struct _GskHttpTransferEncodingSet GskHttpTransferEncodingSet;
 typedef struct _GskHttpRangeSet GskHttpRangeSet;
+typedef struct _GskHttpHeaderMiscLine GskHttpHeaderMiscLine;
 
 /* enums */
 GType gsk_http_status_get_type (void) G_GNUC_CONST;
@@ -606,6 +608,22 @@ struct _GskHttpHeader
 
   /* and actual accumulated parse error (a bit of a hack) */
   GError                       *g_error;
+
+  /*< private >*/
+  /* For headers parsed with GSK_HTTP_PARSE_ZERO_COPY:
+     the strings are allocated from 'arena', and unrecognized
+     lines are kept in 'unparsed_misc' until header_lines is needed. */
+  guint                         uses_arena : 1;
+  GskMemPool                    arena;
+  GskHttpHeaderMiscLine        *unparsed_misc;
+};
+
+/*< private >*/
+struct _GskHttpHeaderMiscLine
+{
+  const char                   *key;          /* lowercase */
+  const char                   *value;
+  GskHttpHeaderMiscLine        *next;
 };
 
 
@@ -616,7 +634,13 @@ typedef enum
 
   /* instead of giving up on unknown headers, just 
    * add them as misc-headers */
-  GSK_HTTP_PARSE_SAVE_ERRORS = (1 << 1)
+  GSK_HTTP_PARSE_SAVE_ERRORS = (1 << 1),
+
+  /* don't copy each line out of the buffer; allocate the header's
+   * strings from a per-header arena, and only build the table
+   * of misc-headers if it is needed.  The string members of such a header
+   * must not be g_free()d directly:  use the property setters. */
+  GSK_HTTP_PARSE_ZERO_COPY = (1 << 2)
 } GskHttpParseFlags;
 
 GskHttpHeader  *gsk_http_header_from_buffer      (GskBuffer     *input,
@@ -686,6 +710,12 @@ struct _GskHttpHeaderLineParser
   gpointer data;
 };
   
+/* Find the parser for a header name (in any case;  not NUL-terminated) */
+const GskHttpHeaderLineParser *
+                   gsk_http_header_lookup_line_parser (gboolean    is_request,
+                                                       const char *name,
+                                                       guint       name_len);
+
 /* The returned table is a map from g_str_hash(lowercase(header)) to
    GskHttpHeaderLineParser. */
 GHashTable        *gsk_http_header_get_parser_table(gboolean       is_request);
@@ -757,6 +787,12 @@ char * gsk_http_header_cut_string (gpointer    http_header,
 
 void gsk_http_header_free_string (gpointer http_header,
 			          char    *str);
+void gsk_http_header_use_arena (GskHttpHeader *header);
+void gsk_http_header_add_misc_len (GskHttpHeader *header,
+                                   const char    *key,
+                                   guint          key_len,
+                                   const char    *value);
+void gsk_http_header_flush_misc (GskHttpHeader *header);
 void gsk_http_header_set_connection_string (GskHttpHeader *header,
                                             const char    *str);
 void gsk_http_header_set_content_encoding_string  (GskHttpHeader *header,
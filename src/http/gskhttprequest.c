@@ -122,8 +122,8 @@ gsk_http_request_finalize (GObject *object)
   FREE_LIST (GskHttpLanguageSet, gsk_http_language_set_free, accept_languages);
 #undef FREE_LIST
 
-  g_free (request->path);
-  g_free (request->host);
+  gsk_http_header_free_string (request, request->path);
+  gsk_http_header_free_string (request, request->host);
   if (request->had_if_match)
     g_strfreev (request->if_match);
   gsk_http_header_free_string (request, request->user_agent);
@@ -137,10 +137,10 @@ gsk_http_request_finalize (GObject *object)
     {
       gsk_http_request_cache_directive_free (request->cache_control);
     }
-  g_free (request->ua_color);
-  g_free (request->ua_os);
-  g_free (request->ua_cpu);
-  g_free (request->ua_language);
+  gsk_http_header_free_string (request, request->ua_color);
+  gsk_http_header_free_string (request, request->ua_os);
+  gsk_http_header_free_string (request, request->ua_cpu);
+  gsk_http_header_free_string (request, request->ua_language);
   g_slist_foreach (request->cookies, (GFunc) gsk_http_cookie_free, NULL);
   g_slist_free (request->cookies);
 
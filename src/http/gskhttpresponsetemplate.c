@@ -0,0 +1,215 @@
+#include <string.h>
+#include <time.h>
+#include "gskhttpresponsetemplate.h"
+#include "../gskmainloop.h"
+#include "../common/gskdate.h"
+
+struct _GskHttpResponseTemplate
+{
+  gint ref_count;
+  GskHttpResponse *response;
+
+  /* the first line and the invariant header lines,
+     each terminated by CRLF */
+  char *fixed;
+  guint fixed_len;
+
+  guint has_date : 1;
+};
+
+/* --- the cached Date line --- */
+typedef struct _DateLineCache DateLineCache;
+struct _DateLineCache
+{
+  glong sec;
+  guint len;
+  char line[80];                /* "Date: ...\r\n" */
+};
+
+static gpointer
+make_date_line_cache_quark (gpointer data)
+{
+  return GUINT_TO_POINTER (g_quark_from_static_string ("gsk-http-date-line-cache"));
+}
+
+/* Each main-loop has its own cache, so this needs no locking
+   even when each thread of a listener-group writes responses. */
+static const char *
+peek_date_line (guint *len_out)
+{
+  static GOnce quark_once = G_ONCE_INIT;
+  GskMainLoop *loop = gsk_main_loop_default ();
+  GQuark date_line_cache_quark;
+  DateLineCache *cache;
+  glong now;
+
+  /* the main-loops of several threads may get here at once */
+  date_line_cache_quark = GPOINTER_TO_UINT (g_once (&quark_once, make_date_line_cache_quark, NULL));
+  cache = g_object_get_qdata (G_OBJECT (loop), date_line_cache_quark);
+  if (cache == NULL)
+    {
+      cache = g_new (DateLineCache, 1);
+      cache->sec = -1;
+      g_object_set_qdata_full (G_OBJECT (loop), date_line_cache_quark,
+                               cache, g_free);
+    }
+
+  /* the main-loop's time is only set once it has run */
+  now = loop->current_time.tv_sec;
+  if (now == 0)
+    now = time (NULL);
+
+  if (cache->sec != now)
+    {
+      cache->sec = now;
+      memcpy (cache->line, "Date: ", 6);
+      gsk_date_print_timet (now, cache->line + 6, sizeof (cache->line) - 8,
+                            GSK_DATE_FORMAT_1123);
+      cache->len = strlen (cache->line);
+      memcpy (cache->line + cache->len, "\r\n", 2);
+      cache->len += 2;
+    }
+  *len_out = cache->len;
+  return cache->line;
+}
+
+/* --- compiling --- */
+static gboolean
+is_variable_line (const char *text)
+{
+  return g_ascii_strncasecmp (text, "Date:", 5) == 0
+      || g_ascii_strncasecmp (text, "Content-Length:", 15) == 0
+      || g_ascii_strncasecmp (text, "ETag:", 5) == 0;
+}
+
+static void
+compile_print_func (const char *text,
+                    gpointer    data)
+{
+  GString *str = data;
+  if (is_variable_line (text))
+    return;
+  g_string_append (str, text);
+  g_string_append_len (str, "\r\n", 2);
+}
+
+/**
+ * gsk_http_response_template_new:
+ * @response: the response to render.
+ *
+ * Render all of the response's header,
+ * except its Date, Content-Length and ETag lines,
+ * which are written by gsk_http_response_template_write().
+ *
+ * returns: the new template.
+ */
+GskHttpResponseTemplate *
+gsk_http_response_template_new (GskHttpResponse *response)
+{
+  GskHttpResponseTemplate *templ;
+  GString *str;
+  g_return_val_if_fail (GSK_IS_HTTP_RESPONSE (response), NULL);
+
+  str = g_string_new ("");
+  gsk_http_header_print (GSK_HTTP_HEADER (response), compile_print_func, str);
+
+  templ = g_new (GskHttpResponseTemplate, 1);
+  templ->ref_count = 1;
+  templ->response = g_object_ref (response);
+  templ->fixed_len = str->len;
+  templ->fixed = g_string_free (str, FALSE);
+  templ->has_date = (GSK_HTTP_HEADER (response)->date != -1);
+  return templ;
+}
+
+/**
+ * gsk_http_response_template_ref:
+ * @templ: the template to reference.
+ *
+ * Increase the reference count of the template.
+ * Templates may be shared between threads.
+ *
+ * returns: @templ, for convenience.
+ */
+GskHttpResponseTemplate *
+gsk_http_response_template_ref (GskHttpResponseTemplate *templ)
+{
+  g_return_val_if_fail (templ->ref_count > 0, NULL);
+  g_atomic_int_inc (&templ->ref_count);
+  return templ;
+}
+
+/**
+ * gsk_http_response_template_unref:
+ * @templ: the template to unreference.
+ *
+ * Decrease the reference count of the template,
+ * freeing it when it reaches zero.
+ */
+void
+gsk_http_response_template_unref (GskHttpResponseTemplate *templ)
+{
+  g_return_if_fail (templ->ref_count > 0);
+  if (g_atomic_int_dec_and_test (&templ->ref_count))
+    {
+      g_object_unref (templ->response);
+      g_free (templ->fixed);
+      g_free (templ);
+    }
+}
+
+/**
+ * gsk_http_response_template_peek_response:
+ * @templ: the template to query.
+ *
+ * Get the response the template was created from.
+ * It should not be modified.
+ *
+ * returns: the response, without adding a reference.
+ */
+GskHttpResponse *
+gsk_http_response_template_peek_response (GskHttpResponseTemplate *templ)
+{
+  return templ->response;
+}
+
+/**
+ * gsk_http_response_template_write:
+ * @templ: the template to write.
+ * @content_length: the Content-Length, or -1 to omit that line.
+ * @etag: the ETag, or NULL to use the one in the template's response.
+ * @output: the buffer to append the header to.
+ *
+ * Append the header to @output, with its terminating blank line.
+ */
+void
+gsk_http_response_template_write (GskHttpResponseTemplate *templ,
+                                  gint64                   content_length,
+                                  const char              *etag,
+                                  GskBuffer               *output)
+{
+  char tmp[64];
+  guint len;
+
+  gsk_buffer_append (output, templ->fixed, templ->fixed_len);
+  if (templ->has_date)
+    {
+      const char *date_line = peek_date_line (&len);
+      gsk_buffer_append (output, date_line, len);
+    }
+  if (content_length >= 0)
+    {
+      len = g_snprintf (tmp, sizeof (tmp), "Content-Length: %"G_GUINT64_FORMAT"\r\n",
+                        (guint64) content_length);
+      gsk_buffer_append (output, tmp, len);
+    }
+  if (etag == NULL)
+    etag = templ->response->etag;
+  if (etag != NULL)
+    {
+      gsk_buffer_append (output, "ETag: ", 6);
+      gsk_buffer_append_string (output, etag);
+      gsk_buffer_append (output, "\r\n", 2);
+    }
+  gsk_buffer_append (output, "\r\n", 2);
+}
@@ -0,0 +1,39 @@
+#ifndef __GSK_HTTP_RESPONSE_TEMPLATE_H_
+#define __GSK_HTTP_RESPONSE_TEMPLATE_H_
+
+#include "gskhttprequest.h"
+#include "gskhttpresponse.h"
+
+G_BEGIN_DECLS
+
+/* A response header compiled into text, for serving
+   many responses that differ only in their
+   Date, Content-Length and ETag lines.
+
+   The rest of the header is rendered once, when the template
+   is created;  changing the response afterward has no effect
+   on the template.  The Date line is written if the response
+   had a date, and always gives the current time
+   (updated at most once per second per main-loop). */
+typedef struct _GskHttpResponseTemplate GskHttpResponseTemplate;
+
+GskHttpResponseTemplate *
+            gsk_http_response_template_new    (GskHttpResponse         *response);
+GskHttpResponseTemplate *
+            gsk_http_response_template_ref    (GskHttpResponseTemplate *templ);
+void        gsk_http_response_template_unref  (GskHttpResponseTemplate *templ);
+
+/* The response the template was compiled from. */
+GskHttpResponse *
+            gsk_http_response_template_peek_response (GskHttpResponseTemplate *templ);
+
+/* Append the header to output.  content_length may be -1 to omit it;
+   etag may be NULL to use the response's ETag, if any. */
+void        gsk_http_response_template_write  (GskHttpResponseTemplate *templ,
+                                               gint64                   content_length,
+                                               const char              *etag,
+                                               GskBuffer               *output);
+
+G_END_DECLS
+
+#endif
@@ -1,6 +1,10 @@
 #include <ctype.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "gskhttpserver.h"
+#include "../gskstreamfd.h"
+#include "../gskerror.h"
 #include "../gskmacros.h"
 
 static GObjectClass *parent_class = NULL;
@@ -33,7 +37,6 @@ typedef enum
 struct _GskHttpServerResponse
 {
   GskHttpServer *server;
-  GHashTable *request_parser_table;
 
   GskHttpRequest *request;
   GskHttpServerPostStream *post_data;
@@ -48,6 +51,9 @@ struct _GskHttpServerResponse
   GskHttpResponse *response;
   GskStream *content;
 
+  /* the Content-Length promised in the response, or -1 */
+  gint64 content_length;
+
   /* have we written all the content out */
   guint is_done_writing : 1;
 
@@ -61,6 +67,12 @@ struct _GskHttpServerResponse
 
   /* whether this response failed for some reason */
   guint failed : 1;
+
+  /* whether 'content' is a regular file of known length:
+     such content is never trapped, since it is always readable;
+     instead it is read directly by raw_read,
+     or sent directly by raw_sendfile. */
+  guint content_is_file : 1;
   
   /* number of bytes of content written thus far */
   guint content_written;
@@ -206,7 +218,7 @@ handle_content_shutdown (GskStream *content_stream, gpointer data)
 {
   GskHttpServer *server = GSK_HTTP_SERVER (data);
   GskHttpServerResponse *trapped_response = server->trapped_response;
-  gint content_length;
+  gint64 content_length;
   g_return_val_if_fail (trapped_response != NULL && trapped_response->content == content_stream, FALSE);
   trapped_response->content = NULL;
   server->trapped_response = NULL;
@@ -222,7 +234,7 @@ handle_content_shutdown (GskStream *content_stream, gpointer data)
       if (was_empty)
 	gsk_io_mark_idle_notify_read (server);
     }
-  content_length = GSK_HTTP_HEADER (trapped_response->response)->content_length;
+  content_length = trapped_response->content_length;
   if (content_length >= 0)
     {
       if (trapped_response->content_received != (guint)content_length)
@@ -230,7 +242,7 @@ handle_content_shutdown (GskStream *content_stream, gpointer data)
           gsk_io_set_error (GSK_IO (server), GSK_IO_ERROR_READ,
                             GSK_ERROR_INVALID_STATE,
                             "expected %u bytes of data, got %u",
-                            content_length,
+                            (guint) content_length,
                             trapped_response->content_received);
           g_object_unref (content_stream);
           return FALSE;
@@ -251,6 +263,44 @@ handle_content_shutdown (GskStream *content_stream, gpointer data)
   return FALSE;
 }
 
+static gboolean
+is_regular_file_content (GskHttpServerResponse *response)
+{
+  GskStream *content = response->content;
+  struct stat stat_buf;
+  if (response->content_length < 0
+   || GSK_HTTP_HEADER (response->response)->transfer_encoding_type == GSK_HTTP_TRANSFER_ENCODING_CHUNKED)
+    return FALSE;
+  if (G_OBJECT_TYPE (content) != GSK_TYPE_STREAM_FD
+   || GSK_STREAM_FD (content)->is_pollable)
+    return FALSE;
+  return fstat (GSK_STREAM_FD_GET_FD (content), &stat_buf) == 0
+      && S_ISREG (stat_buf.st_mode);
+}
+
+/* Called after data has been taken from a response's file content:
+   if the file is finished, release it.  */
+static gboolean
+check_file_content_done (GskHttpServerResponse *response,
+                         GError               **error)
+{
+  GskStream *content = response->content;
+  if (response->content_received < (guint) response->content_length
+   && gsk_io_get_is_readable (content))
+    return TRUE;
+  response->content = NULL;
+  g_object_unref (content);
+  if (response->content_received != (guint) response->content_length)
+    {
+      g_set_error (error, GSK_G_ERROR_DOMAIN, GSK_ERROR_INVALID_STATE,
+                   "expected %u bytes of data, got %u",
+                   (guint) response->content_length,
+                   response->content_received);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 static gboolean
 handle_keepalive_idle_timeout (gpointer data)
 {
@@ -269,6 +319,9 @@ add_keepalive_idle_timeout (GskHttpServer *server)
     = gsk_main_loop_add_timer (gsk_main_loop_default (),
                                handle_keepalive_idle_timeout, server, NULL,
                                server->keepalive_idle_timeout_ms, -1);
+
+  /* idle-timeouts are re-armed constantly and need not be exact */
+  gsk_source_set_timer_coarse (server->keepalive_idle_timeout, TRUE);
 }
 
 static void
@@ -318,11 +371,14 @@ gsk_http_server_prune_done_responses (GskHttpServer *server,
       return;
     }
 
-  gsk_io_set_idle_notify_read (server, at != NULL && at->outgoing.size != 0);
+  gsk_io_set_idle_notify_read (server, at != NULL
+                                    && (at->outgoing.size != 0
+                                     || (at->content_is_file && at->content != NULL)));
 
   /* if we are blocking on the content-stream for data,
      trap its readability. */
   if (at != NULL && at->outgoing.size == 0 && at->content != NULL
+   && !at->content_is_file
    && server->read_poll && server->trapped_response != at)
     {
       /* Untrap the old stream (if applicable),
@@ -459,6 +515,22 @@ gsk_http_server_raw_read      (GskStream     *stream,
 	      rv += amt;
 	    }
 	}
+      if (at->outgoing.size == 0 && at->content_is_file && at->content != NULL)
+	{
+	  /* A regular file can be read right away.
+	     (Normally, a GskStreamConnection will have sent it
+	     with raw_sendfile instead.) */
+	  guint amt = MIN (length - rv, at->content_length - at->content_received);
+	  if (amt)
+	    {
+	      guint n_read = gsk_stream_read (at->content, (char *) data + rv, amt, error);
+	      rv += n_read;
+	      at->content_received += n_read;
+	    }
+	  if ((error != NULL && *error != NULL)
+	   || !check_file_content_done (at, error))
+	    return rv;
+	}
       if (at->outgoing.size == 0 && at->content == NULL)
 	{
 	  /* ok, done with this response */
@@ -481,12 +553,60 @@ gsk_http_server_raw_read      (GskStream     *stream,
   return rv;
 }
 
+static gboolean
+gsk_http_server_raw_sendfile  (GskStream     *stream,
+			       GskStream     *write_side,
+			       guint          max_bytes,
+			       guint         *n_written_out,
+			       GError       **error)
+{
+  GskHttpServer *server = GSK_HTTP_SERVER (stream);
+  GskHttpServerResponse *at;
+  GError *e = NULL;
+  guint n_written = 0;
+  for (at = server->first_response; at != NULL; at = at->next)
+    if (!at->is_done_writing)
+      break;
+  if (at == NULL
+   || at->outgoing.size > 0
+   || !at->content_is_file
+   || at->content == NULL
+   || gsk_stream_fd_get_transfer_mode (at->content, write_side) != GSK_STREAM_FD_TRANSFER_SENDFILE)
+    return FALSE;
+  if (max_bytes == 0)
+    return TRUE;
+
+  if (max_bytes > at->content_length - at->content_received)
+    max_bytes = at->content_length - at->content_received;
+  if (max_bytes > 0)
+    n_written = gsk_stream_fd_sendfile (GSK_STREAM_FD (write_side),
+                                        GSK_STREAM_FD (at->content),
+                                        max_bytes, &e);
+  at->content_received += n_written;
+  *n_written_out = n_written;
+  if (e != NULL)
+    {
+      g_propagate_error (error, e);
+      return TRUE;
+    }
+  if (!check_file_content_done (at, error))
+    return TRUE;
+  if (at->content == NULL)
+    {
+      /* ok, done with this response */
+      at->is_done_writing = TRUE;
+      if (gsk_http_header_get_connection (GSK_HTTP_HEADER (at->response)) == GSK_HTTP_CONNECTION_CLOSE)
+        server->got_close = TRUE;
+      gsk_http_server_prune_done_responses (server, FALSE);
+    }
+  return TRUE;
+}
+
 static GskHttpServerResponse *
 create_new_response (GskHttpServer *server)
 {
   GskHttpServerResponse *response = gsk_http_server_response_alloc ();
   response->server = server;
-  response->request_parser_table = NULL;
   response->request = NULL;
   response->post_data = NULL;
   response->parse_state = INIT;
@@ -494,11 +614,13 @@ create_new_response (GskHttpServer *server)
   response->content_received = 0;
   response->response = NULL;
   response->content = NULL;
+  response->content_length = -1;
   response->is_done_writing = 0;
   response->got_content_eof = 0;
   response->user_fetched = 0;
   response->content_written = 0;
   response->failed = 0;
+  response->content_is_file = 0;
   response->next = NULL;
 
   /* append this response to the queue */
@@ -518,6 +640,7 @@ first_line_parser_callback  (GskHttpServerResponse *response,
   GError *error = NULL;
   g_assert (response->request == NULL);
   response->request = gsk_http_request_new_blank ();
+  gsk_http_header_use_arena (GSK_HTTP_HEADER (response->request));
 
   switch (gsk_http_request_parse_first_line (response->request, text, &error))
     {
@@ -533,14 +656,12 @@ first_line_parser_callback  (GskHttpServerResponse *response,
 
     case GSK_HTTP_REQUEST_FIRST_LINE_SIMPLE:
       response->parse_state = DONE_READING;
-      response->request_parser_table = gsk_http_header_get_parser_table (TRUE);
       response->post_data = NULL;
       gsk_hook_notify (GSK_HTTP_SERVER_HOOK (response->server));
       break;
 
     case GSK_HTTP_REQUEST_FIRST_LINE_FULL:
       response->parse_state = READING_REQUEST;
-      response->request_parser_table = gsk_http_header_get_parser_table (TRUE);
       break;
 
     default:
@@ -552,10 +673,8 @@ static void
 header_line_parser_callback (GskHttpServerResponse *response,
 			     const char            *line)
 {
-  GskHttpHeaderLineParser *parser;
-  char *lowercase;
+  const GskHttpHeaderLineParser *parser;
   const char *colon;
-  unsigned i;
   const char *val;
   if (line[0] == 0)
     {
@@ -587,24 +706,20 @@ header_line_parser_callback (GskHttpServerResponse *response,
       return;	/* XXX: error handling! */
     }
 
-  /* lowercase the header */
-  lowercase = g_alloca (colon - (char*)line + 1);
-  for (i = 0; line[i] != ':'; i++)
-    lowercase[i] = g_ascii_tolower (line[i]);
-  lowercase[i] = '\0';
-
   val = colon + 1;
   GSK_SKIP_WHITESPACE (val);
-  
-  parser = g_hash_table_lookup (response->request_parser_table, lowercase);
+
+  parser = gsk_http_header_lookup_line_parser (TRUE, line, colon - line);
   if (parser == NULL)
     {
       /* XXX: error handling */
       gboolean is_nonstandard = (line[0] == 'x' || line[0] == 'X')
                               && line[1] == '-';
+
       if (!is_nonstandard)
         g_warning ("couldn't handle header line %s", line);
-      gsk_http_header_add_misc (GSK_HTTP_HEADER (response->request), lowercase, val);
+      gsk_http_header_add_misc_len (GSK_HTTP_HEADER (response->request),
+                                    line, colon - line, val);
       return;
     }
 
@@ -618,6 +733,45 @@ header_line_parser_callback (GskHttpServerResponse *response,
 
 #define MAX_STACK_ALLOC	4096
 
+/* Discard the next line of server->incoming and pass it to callback.
+   A line which doesn't end its fragment is handed over in place,
+   since the discard leaves that fragment allocated;
+   others are copied to stack_buf, or the heap if they are too long.
+
+   Returns FALSE if there is no complete line yet. */
+static gboolean
+handle_incoming_line (GskHttpServer         *server,
+                      GskHttpServerResponse *response,
+                      char                  *stack_buf,
+                      void                 (*callback) (GskHttpServerResponse *,
+                                                        const char *))
+{
+  GskBufferFragment *fragment = server->incoming.first_frag;
+  int nl = gsk_buffer_index_of (&server->incoming, '\n');
+  char *line;
+  char *free_line = NULL;
+  if (nl < 0)
+    return FALSE;
+  if ((guint) nl + 1 < fragment->buf_length && !fragment->is_foreign)
+    {
+      line = fragment->buf + fragment->buf_start;
+      gsk_buffer_discard (&server->incoming, nl + 1);
+    }
+  else
+    {
+      if (nl > MAX_STACK_ALLOC - 1)
+        free_line = line = g_malloc (nl + 1);
+      else
+        line = stack_buf;
+      gsk_buffer_read (&server->incoming, line, nl + 1);
+    }
+  line[nl] = '\0';
+  g_strchomp (line);
+  (*callback) (response, line);
+  g_free (free_line);
+  return TRUE;
+}
+
 static guint
 gsk_http_server_raw_write     (GskStream     *stream,
 			       gconstpointer  data,
@@ -651,41 +805,14 @@ gsk_http_server_raw_write     (GskStream     *stream,
           at->parse_state = READING_REQUEST_FIRST_LINE;
           break;
         case READING_REQUEST_FIRST_LINE:
-          {
-            int nl = gsk_buffer_index_of (&server->incoming, '\n');
-            char *first_line;
-            char *free_line = NULL;
-            if (nl < 0)
-              goto done;
-            if (nl > MAX_STACK_ALLOC - 1)
-              free_line = first_line = g_malloc (nl + 1);
-            else
-              first_line = stack_buf;
-            gsk_buffer_read (&server->incoming, first_line, nl + 1);
-            first_line[nl] = '\0';
-            g_strchomp (first_line);
-            first_line_parser_callback (at, first_line);
-            g_free (free_line);
-          }
+          if (!handle_incoming_line (server, at, stack_buf,
+                                     first_line_parser_callback))
+            goto done;
           break;
-
         case READING_REQUEST:
-          {
-            int nl = gsk_buffer_index_of (&server->incoming, '\n');
-            char *header_line;
-            char *free_line = NULL;
-            if (nl < 0)
-              goto done;
-            if (nl > MAX_STACK_ALLOC - 1)
-              free_line = header_line = g_malloc (nl + 1);
-            else
-              header_line = stack_buf;
-            gsk_buffer_read (&server->incoming, header_line, nl + 1);
-            header_line[nl] = '\0';
-            g_strchomp (header_line);
-            header_line_parser_callback (at, header_line);
-            g_free (free_line);
-          }
+          if (!handle_incoming_line (server, at, stack_buf,
+                                     header_line_parser_callback))
+            goto done;
           break;
         case READING_POST:
           if (gsk_http_server_post_stream_process (at->post_data))
@@ -742,6 +869,7 @@ gsk_http_server_class_init (GskHttpServerClass *class)
   parent_class = g_type_class_peek_parent (class);
   stream_class->raw_read = gsk_http_server_raw_read;
   stream_class->raw_write = gsk_http_server_raw_write;
+  stream_class->raw_sendfile = gsk_http_server_raw_sendfile;
   object_class->finalize = gsk_http_server_finalize;
   io_class->set_poll_read = gsk_http_server_set_poll_read;
   io_class->shutdown_read = gsk_http_server_shutdown_read;
@@ -1086,24 +1214,13 @@ gsk_http_server_get_request (GskHttpServer   *server,
   return FALSE;
 }
 
-/**
- * gsk_http_server_respond:
- * @server: the server to write the response to.
- * @request: the request obtained with gsk_http_server_get_request().
- * @response: the response constructed to this request.
- * @content: content data if appropriate to this request.
- *
- * Give a response to a client's request.
- */
-void
-gsk_http_server_respond     (GskHttpServer   *server,
-			     GskHttpRequest  *request,
-			     GskHttpResponse *response,
-			     GskStream       *content)
+/* Find the response-slot for request, or return NULL
+   if it is unknown or has already been answered. */
+static GskHttpServerResponse *
+find_unanswered_response (GskHttpServer  *server,
+                          GskHttpRequest *request)
 {
   GskHttpServerResponse *sresponse;
-  g_return_if_fail (content == NULL || !gsk_hook_is_trapped (GSK_IO_READ_HOOK (content)));
-  g_return_if_fail (response != NULL);
   for (sresponse = server->first_response;
        sresponse != NULL;
        sresponse = sresponse->next)
@@ -1111,21 +1228,34 @@ gsk_http_server_respond     (GskHttpServer   *server,
       if (sresponse->request == request)
 	break;
     }
-  g_return_if_fail (sresponse != NULL);
+  g_return_val_if_fail (sresponse != NULL, NULL);
   if (sresponse->response != NULL)
     {
       g_warning ("got multiple responses to request for '%s'", request->path);
-      return;
+      return NULL;
     }
-  g_return_if_fail (sresponse->content == NULL);
+  g_return_val_if_fail (sresponse->content == NULL, NULL);
+  return sresponse;
+}
 
+/* Called once the response header is in sresponse->outgoing. */
+static void
+start_response (GskHttpServer         *server,
+                GskHttpServerResponse *sresponse,
+                GskHttpResponse       *response,
+                gint64                 content_length,
+                GskStream             *content)
+{
   if (content != NULL && !GSK_HTTP_HEADER (response)->has_content_type)
     g_warning ("HTTP response has content but no Content-Type header");
 
   sresponse->response = g_object_ref (response);
+  sresponse->content_length = content_length;
   if (content)
-    sresponse->content = g_object_ref (content);
-  gsk_http_header_to_buffer (GSK_HTTP_HEADER (response), &sresponse->outgoing);
+    {
+      sresponse->content = g_object_ref (content);
+      sresponse->content_is_file = is_regular_file_content (sresponse);
+    }
   
   if (!gsk_io_get_idle_notify_read (server))
     {
@@ -1148,6 +1278,71 @@ gsk_http_server_respond     (GskHttpServer   *server,
     }
 }
 
+/**
+ * gsk_http_server_respond:
+ * @server: the server to write the response to.
+ * @request: the request obtained with gsk_http_server_get_request().
+ * @response: the response constructed to this request.
+ * @content: content data if appropriate to this request.
+ *
+ * Give a response to a client's request.
+ *
+ * If @content is a regular file (opened with gsk_stream_fd_new_read_file(),
+ * for example) and the response has a Content-Length,
+ * it will be sent with sendfile(2) when the server is attached
+ * to a #GskStreamFd.
+ */
+void
+gsk_http_server_respond     (GskHttpServer   *server,
+			     GskHttpRequest  *request,
+			     GskHttpResponse *response,
+			     GskStream       *content)
+{
+  GskHttpServerResponse *sresponse;
+  g_return_if_fail (content == NULL || !gsk_hook_is_trapped (GSK_IO_READ_HOOK (content)));
+  g_return_if_fail (response != NULL);
+  sresponse = find_unanswered_response (server, request);
+  if (sresponse == NULL)
+    return;
+  gsk_http_header_to_buffer (GSK_HTTP_HEADER (response), &sresponse->outgoing);
+  start_response (server, sresponse, response,
+                  GSK_HTTP_HEADER (response)->content_length, content);
+}
+
+/**
+ * gsk_http_server_respond_template:
+ * @server: the server to write the response to.
+ * @request: the request obtained with gsk_http_server_get_request().
+ * @templ: the pre-rendered response header.
+ * @content_length: length of @content, or -1 if it is unknown.
+ * @etag: ETag of this content, or NULL to use the template's.
+ * @content: content data if appropriate to this request.
+ *
+ * Give a response to a client's request,
+ * using a header rendered ahead of time.
+ * This is much cheaper than gsk_http_server_respond()
+ * for responses that are mostly the same every time.
+ */
+void
+gsk_http_server_respond_template (GskHttpServer   *server,
+			          GskHttpRequest  *request,
+			          GskHttpResponseTemplate *templ,
+			          gint64           content_length,
+			          const char      *etag,
+			          GskStream       *content)
+{
+  GskHttpServerResponse *sresponse;
+  g_return_if_fail (content == NULL || !gsk_hook_is_trapped (GSK_IO_READ_HOOK (content)));
+  g_return_if_fail (templ != NULL);
+  sresponse = find_unanswered_response (server, request);
+  if (sresponse == NULL)
+    return;
+  gsk_http_response_template_write (templ, content_length, etag, &sresponse->outgoing);
+  start_response (server, sresponse,
+                  gsk_http_response_template_peek_response (templ),
+                  content_length, content);
+}
+
 /* TODO: we should have an idle_time member
    so that we can start the timer from
    when the server went idle, as opposed to from
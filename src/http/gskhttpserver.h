@@ -4,6 +4,7 @@
 #include "gskhttpheader.h"
 #include "gskhttprequest.h"
 #include "gskhttpresponse.h"
+#include "gskhttpresponsetemplate.h"
 #include "../gskstream.h"
 #include "../gskmainloop.h"
 
@@ -65,6 +66,13 @@ void            gsk_http_server_respond     (GskHttpServer   *server,
 					     GskHttpRequest  *request,
 					     GskHttpResponse *response,
 					     GskStream       *content);
+void            gsk_http_server_respond_template
+                                            (GskHttpServer   *server,
+					     GskHttpRequest  *request,
+					     GskHttpResponseTemplate *templ,
+					     gint64           content_length,
+					     const char      *etag,
+					     GskStream       *content);
 void            gsk_http_server_set_idle_timeout
                                             (GskHttpServer   *server,
                                              gint             millis);
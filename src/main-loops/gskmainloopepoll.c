@@ -8,16 +8,43 @@ static GObjectClass *parent_class = NULL;
 #if HAVE_EPOLL_SUPPORT
 
 #include <sys/epoll.h>
+#include <sys/poll.h>
 #include <errno.h>
+#include <string.h>
 
 /* epoll_create() etc based main-loop.
 
-   Note that we use Level-Triggered behavior,
-   not edge-triggered, since that is how GskMainLoops are.
+   By default we use Level-Triggered behavior,
+   since that is how GskMainLoops are.
+
+   If the main-loop was created with GSK_MAIN_LOOP_EDGE_TRIGGERED,
+   each fd is registered once (for both input and output,
+   edge-triggered) and the read/write interest that
+   gsk_source_adjust_io() toggles is kept in user-space,
+   so toggling costs no system call.
+
+   To preserve the level-triggered semantics, an fd whose
+   handler ran may still be ready (the handler need not drain it):
+   those fds are put on the `recheck' list, which is checked
+   with a single poll() at the start of the next iteration.
+   The fds which are no longer ready are dropped from the list;
+   the kernel will give us a new edge when they become ready.
  */
 
 #define EPOLL_INITIAL_SIZE	2048
-#define MAX_EPOLL_EVENTS	512
+#define INITIAL_EPOLL_EVENTS	512
+
+/* bits in fd_states[] */
+#define FD_WANT_IN	(1<<0)
+#define FD_WANT_OUT	(1<<1)
+#define FD_READY_IN	(1<<2)
+#define FD_READY_OUT	(1<<3)
+#define FD_REGISTERED	(1<<4)
+#define FD_IN_RECHECK	(1<<5)
+#define FD_EMITTED	(1<<6)	/* reported during this do_polling() */
+
+#define FD_WANT_MASK	(FD_WANT_IN|FD_WANT_OUT)
+#define FD_READY_SHIFT	2
 
 static inline const char *
 op_to_string (int op)
@@ -28,12 +55,30 @@ op_to_string (int op)
        : "op-unknown";
 }
 
+static void
+ensure_epoll_events (GskMainLoopEpoll *epoll,
+                     guint             max_events)
+{
+  if (epoll->n_epoll_events < max_events)
+    {
+      guint n = epoll->n_epoll_events ? epoll->n_epoll_events : INITIAL_EPOLL_EVENTS;
+      while (n < max_events)
+        n *= 2;
+      epoll->epoll_events = g_renew (struct epoll_event, epoll->epoll_events, n);
+      epoll->n_epoll_events = n;
+    }
+}
+
 /* --- GskMainLoopPollBase methods --- */
 static gboolean
 gsk_main_loop_epoll_setup  (GskMainLoop       *main_loop)
 {
   GskMainLoopClass *pclass = GSK_MAIN_LOOP_CLASS (parent_class);
   int fd;
+
+  /* decide on the mode before any fd can be configured */
+  if (main_loop->edge_triggered)
+    GSK_MAIN_LOOP_EPOLL (main_loop)->recheck_fds = g_array_new (FALSE, FALSE, sizeof (int));
   if (pclass->setup != NULL)
     if (!(*pclass->setup) (main_loop))
       return FALSE;
@@ -45,6 +90,81 @@ gsk_main_loop_epoll_setup  (GskMainLoop       *main_loop)
   return TRUE;
 }
 
+static void
+do_epoll_ctl (GskMainLoopEpoll *epoll,
+              int               op,
+              int               fd,
+              unsigned          events)
+{
+  struct epoll_event event;
+  memset (&event, 0, sizeof (event));
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl (epoll->fd, op, fd, &event) < 0)
+    {
+      g_warning ("epoll_ctl: op=%s, fd=%d, new_events=%x failed: %s",
+		 op_to_string (op), fd, event.events, g_strerror (errno));
+    }
+}
+
+static inline void
+add_to_recheck (GskMainLoopEpoll *epoll,
+                int               fd)
+{
+  if ((epoll->fd_states[fd] & FD_IN_RECHECK) == 0)
+    {
+      epoll->fd_states[fd] |= FD_IN_RECHECK;
+      g_array_append_val (epoll->recheck_fds, fd);
+    }
+}
+
+static void
+config_fd_edge_triggered (GskMainLoopEpoll *epoll,
+                          int               fd,
+                          GIOCondition      io_conditions)
+{
+  guint8 want = ((io_conditions & G_IO_IN) ? FD_WANT_IN : 0)
+              | ((io_conditions & G_IO_OUT) ? FD_WANT_OUT : 0);
+  guint8 state;
+
+  if ((guint) fd >= epoll->n_fd_states)
+    {
+      guint old_n = epoll->n_fd_states;
+      guint n = old_n ? old_n : 64;
+      while (n <= (guint) fd)
+        n *= 2;
+      epoll->fd_states = g_renew (guint8, epoll->fd_states, n);
+      memset (epoll->fd_states + old_n, 0, n - old_n);
+      epoll->n_fd_states = n;
+    }
+  state = epoll->fd_states[fd];
+
+  if (io_conditions == 0)
+    {
+      /* the fd may be closed and its number reused,
+         so we really must forget about it.
+         (FD_IN_RECHECK stays set until the recheck list drops it) */
+      if (state & FD_REGISTERED)
+        do_epoll_ctl (epoll, EPOLL_CTL_DEL, fd, 0);
+      epoll->fd_states[fd] = state & FD_IN_RECHECK;
+      return;
+    }
+
+  if ((state & FD_REGISTERED) == 0)
+    {
+      /* registering reports the current readiness as an edge */
+      do_epoll_ctl (epoll, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+      epoll->fd_states[fd] = (state & FD_IN_RECHECK) | FD_REGISTERED | want;
+      return;
+    }
+
+  epoll->fd_states[fd] = (state & ~FD_WANT_MASK) | want;
+
+  /* newly interested in a condition whose edge we've already consumed? */
+  if (((state >> FD_READY_SHIFT) & want & ~state) != 0)
+    add_to_recheck (epoll, fd);
+}
+
 static void
 gsk_main_loop_epoll_config_fd (GskMainLoopPollBase   *main_loop,
                                int                    fd,
@@ -55,19 +175,191 @@ gsk_main_loop_epoll_config_fd (GskMainLoopPollBase   *main_loop,
   int op = (io_conditions == 0) ? EPOLL_CTL_DEL
          : (old_io_conditions == 0) ? EPOLL_CTL_ADD
 	 : EPOLL_CTL_MOD;
-  struct epoll_event event;
   if (old_io_conditions == 0 && io_conditions == 0)
     return;
-  event.events = ((io_conditions & G_IO_IN) ? (EPOLLIN) : 0)
-               | ((io_conditions & G_IO_OUT) ? (EPOLLOUT) : 0)
-               | ((io_conditions & G_IO_HUP) ? (EPOLLHUP) : 0)
-	       ;
-  event.data.fd = fd;
-  if (epoll_ctl (epoll->fd, op, fd, &event) < 0)
+  if (epoll->recheck_fds != NULL)
     {
-      g_warning ("epoll_ctl: op=%s, fd=%d, new_events=%x failed: %s",
-		 op_to_string (op), fd, event.events, g_strerror (errno));
+      config_fd_edge_triggered (epoll, fd, io_conditions);
+      return;
     }
+  do_epoll_ctl (epoll, op, fd,
+                ((io_conditions & G_IO_IN) ? (EPOLLIN) : 0)
+              | ((io_conditions & G_IO_OUT) ? (EPOLLOUT) : 0)
+              | ((io_conditions & G_IO_HUP) ? (EPOLLHUP) : 0));
+}
+
+static inline GIOCondition
+epoll_events_to_condition (unsigned e)
+{
+  GIOCondition condition = 0;
+  if (e & EPOLLIN)
+    condition |= G_IO_IN;
+  if (e & EPOLLHUP)
+    condition |= (G_IO_HUP|G_IO_IN);
+  if (e & EPOLLERR)
+    condition |= (G_IO_ERR|G_IO_IN|G_IO_OUT);
+  if (e & EPOLLOUT)
+    condition |= G_IO_OUT;
+  return condition;
+}
+
+static inline guint8
+condition_to_ready (GIOCondition condition)
+{
+  return ((condition & G_IO_IN) ? FD_READY_IN : 0)
+       | ((condition & G_IO_OUT) ? FD_READY_OUT : 0);
+}
+
+/* Poll the fds which were reported last time,
+   emitting events for those which are still ready. */
+static guint
+recheck_edge_triggered (GskMainLoopEpoll *epoll,
+                        guint             max_events,
+                        GskMainLoopEvent *events)
+{
+  GArray *recheck = epoll->recheck_fds;
+  struct pollfd *pfds;
+  guint n_pfds = 0;
+  guint n_out = 0;
+  guint i, o;
+  int rv;
+
+  if (epoll->n_poll_fds < recheck->len)
+    {
+      guint n = epoll->n_poll_fds ? epoll->n_poll_fds : 64;
+      while (n < recheck->len)
+        n *= 2;
+      epoll->poll_fds = g_renew (struct pollfd, epoll->poll_fds, n);
+      epoll->n_poll_fds = n;
+    }
+  pfds = epoll->poll_fds;
+
+  /* drop the fds that were removed or lost interest */
+  for (i = o = 0; i < recheck->len; i++)
+    {
+      int fd = g_array_index (recheck, int, i);
+      guint8 state = epoll->fd_states[fd];
+      if ((state & FD_WANT_MASK) == 0)
+        {
+          epoll->fd_states[fd] = state & ~FD_IN_RECHECK;
+          continue;
+        }
+      g_array_index (recheck, int, o++) = fd;
+      pfds[n_pfds].fd = fd;
+      pfds[n_pfds].events = POLLIN | POLLOUT;
+      pfds[n_pfds].revents = 0;
+      n_pfds++;
+    }
+  g_array_set_size (recheck, o);
+  if (n_pfds == 0)
+    return 0;
+
+  rv = poll (pfds, n_pfds, 0);
+  if (rv < 0)
+    {
+      /* try again next time; the fds stay on the list */
+      if (!gsk_errno_is_ignorable (errno))
+        g_warning ("error rechecking epoll fds: %s", g_strerror (errno));
+      return 0;
+    }
+
+  for (i = o = 0; i < n_pfds; i++)
+    {
+      int fd = pfds[i].fd;
+      guint8 state = epoll->fd_states[fd];
+      GIOCondition condition = 0;
+      if (pfds[i].revents & POLLIN)
+        condition |= G_IO_IN;
+      if (pfds[i].revents & POLLHUP)
+        condition |= (G_IO_HUP|G_IO_IN);
+      if (pfds[i].revents & POLLERR)
+        condition |= (G_IO_ERR|G_IO_IN|G_IO_OUT);
+      if (pfds[i].revents & POLLOUT)
+        condition |= G_IO_OUT;
+      state = (state & ~(FD_READY_IN|FD_READY_OUT)) | condition_to_ready (condition);
+      if ((state >> FD_READY_SHIFT) & state & FD_WANT_MASK)
+        {
+          if (n_out < max_events)
+            {
+              events[n_out].type = GSK_MAIN_LOOP_EVENT_IO;
+              events[n_out].data.io.events = condition;
+              events[n_out].data.io.fd = fd;
+              n_out++;
+              state |= FD_EMITTED;
+            }
+          /* still (maybe) ready:  keep it on the list */
+          epoll->fd_states[fd] = state;
+          g_array_index (recheck, int, o++) = fd;
+        }
+      else
+        {
+          /* the next change of readiness will be an edge */
+          epoll->fd_states[fd] = state & ~FD_IN_RECHECK;
+        }
+    }
+  g_array_set_size (recheck, o);
+  return n_out;
+}
+
+static gboolean
+do_polling_edge_triggered (GskMainLoopEpoll      *epoll,
+                           int                    max_timeout,
+                           guint                  max_events,
+                           guint                 *num_events_out,
+                           GskMainLoopEvent      *events)
+{
+  struct epoll_event *e_events = epoll->epoll_events;
+  guint n_out = 0;
+  int n_events = 0;
+  int i;
+
+  if (epoll->recheck_fds->len > 0)
+    n_out = recheck_edge_triggered (epoll, max_events, events);
+
+  if (n_out < max_events)
+    {
+      errno = EINTR;
+      n_events = epoll_wait (epoll->fd, e_events, max_events - n_out,
+                             n_out > 0 ? 0 : max_timeout);
+      if (n_events < 0)
+        {
+          int e = errno;
+          n_events = 0;
+          if (!gsk_errno_is_ignorable (e))
+            g_warning ("error running epoll_wait: %s", g_strerror (e));
+        }
+    }
+
+  for (i = 0; i < n_events; i++)
+    {
+      int fd = e_events[i].data.fd;
+      GIOCondition condition = epoll_events_to_condition (e_events[i].events);
+      guint8 state;
+      if ((guint) fd >= epoll->n_fd_states)
+        continue;
+      state = epoll->fd_states[fd];
+      if ((state & FD_REGISTERED) == 0)
+        continue;               /* removed since the kernel queued the event */
+      state |= condition_to_ready (condition);
+      epoll->fd_states[fd] = state;
+      if ((state & FD_EMITTED) == 0
+       && ((state >> FD_READY_SHIFT) & state & FD_WANT_MASK) != 0)
+        {
+          events[n_out].type = GSK_MAIN_LOOP_EVENT_IO;
+          events[n_out].data.io.events = condition;
+          events[n_out].data.io.fd = fd;
+          n_out++;
+          epoll->fd_states[fd] |= FD_EMITTED;
+
+          /* the handler may not drain the fd */
+          add_to_recheck (epoll, fd);
+        }
+    }
+
+  for (i = 0; (guint) i < n_out; i++)
+    epoll->fd_states[events[i].data.io.fd] &= ~FD_EMITTED;
+  *num_events_out = n_out;
+  return TRUE;
 }
 
 static gboolean
@@ -78,14 +370,20 @@ gsk_main_loop_epoll_do_polling (GskMainLoopPollBase   *main_loop,
                                 GskMainLoopEvent      *events)
 {
   GskMainLoopEpoll *main_loop_epoll = GSK_MAIN_LOOP_EPOLL (main_loop);
-  struct epoll_event *e_events = main_loop_epoll->epoll_events;
+  struct epoll_event *e_events;
   int n_events;
   int i;
   guint n_out = 0;
+
+  /* gsk_main_loop_run() grows max_events whenever we fill it */
+  ensure_epoll_events (main_loop_epoll, max_events);
+  if (main_loop_epoll->recheck_fds != NULL)
+    return do_polling_edge_triggered (main_loop_epoll, max_timeout, max_events,
+                                      num_events_out, events);
+  e_events = main_loop_epoll->epoll_events;
   errno = EINTR;		/* HACK: ignore errors which don't set errno !?! */
   n_events = epoll_wait (main_loop_epoll->fd, e_events,
-			 MIN (max_events, MAX_EPOLL_EVENTS),
-			 max_timeout);
+			 max_events, max_timeout);
 #if 0
   g_message ("epoll_wait: max_timeout=%d, max_events=%u, n_events out=%d",
 	     max_timeout, max_events, n_events);
@@ -103,16 +401,7 @@ gsk_main_loop_epoll_do_polling (GskMainLoopPollBase   *main_loop,
   for (i = 0; i < n_events; i++)
     {
       int fd = e_events[i].data.fd;
-      unsigned e = e_events[i].events;
-      GIOCondition condition = 0;
-      if (e & EPOLLIN)
-	condition |= G_IO_IN;
-      if (e & EPOLLHUP)
-	condition |= (G_IO_HUP|G_IO_IN);
-      if (e & EPOLLERR)
-	condition |= (G_IO_ERR|G_IO_IN|G_IO_OUT);
-      if (e & EPOLLOUT)
-	condition |= G_IO_OUT;
+      GIOCondition condition = epoll_events_to_condition (e_events[i].events);
       events[n_out].type = GSK_MAIN_LOOP_EVENT_IO;
       events[n_out].data.io.events = condition;
       events[n_out].data.io.fd = fd;
@@ -127,8 +416,12 @@ static void
 gsk_main_loop_epoll_finalize (GObject *object)
 {
   GskMainLoopEpoll *main_loop_epoll = GSK_MAIN_LOOP_EPOLL (object);
-  g_free (main_loop_epoll->epoll_events);
   (*parent_class->finalize) (object);
+  g_free (main_loop_epoll->epoll_events);
+  g_free (main_loop_epoll->fd_states);
+  g_free (main_loop_epoll->poll_fds);
+  if (main_loop_epoll->recheck_fds != NULL)
+    g_array_free (main_loop_epoll->recheck_fds, TRUE);
 }
 #endif  /* HAVE_EPOLL_SUPPORT */
 
@@ -138,7 +431,7 @@ gsk_main_loop_epoll_init (GskMainLoopEpoll *main_loop_epoll)
 {
 #if HAVE_EPOLL_SUPPORT
   main_loop_epoll->fd = -1;
-  main_loop_epoll->epoll_events = g_new (struct epoll_event, MAX_EPOLL_EVENTS);
+  ensure_epoll_events (main_loop_epoll, INITIAL_EPOLL_EVENTS);
 #endif  /* HAVE_EPOLL_SUPPORT */
 }
 
@@ -28,6 +28,15 @@ struct _GskMainLoopEpoll
   GskMainLoopPollBase      main_loop_poll_base;
   int                      fd;
   gpointer                 epoll_events;
+  guint                    n_epoll_events;
+
+  /* edge-triggered mode only:  per-fd interest and readiness,
+     and the fds which may still be ready after their last event */
+  guint8                  *fd_states;
+  guint                    n_fd_states;
+  GArray                  *recheck_fds;
+  gpointer                 poll_fds;
+  guint                    n_poll_fds;
 };
 
 /* --- prototypes --- */
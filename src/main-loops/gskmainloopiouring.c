@@ -0,0 +1,569 @@
+#include "gskmainloopiouring.h"
+#include "../config.h"
+#include "../gskerrno.h"
+#include "../gskutils.h"
+#include "../gskmemorybarrier.h"
+
+static GObjectClass *parent_class = NULL;
+
+#if HAVE_IO_URING_SUPPORT
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/* io_uring based main-loop.
+
+   Each fd is watched by one multishot IORING_OP_POLL_ADD,
+   for both input and output;  read/write interest is kept
+   in user-space, so gsk_source_adjust_io() costs nothing.
+
+   Like the edge-triggered epoll mode, a multishot poll only
+   reports new readiness, while GskMainLoop handlers
+   are level-triggered and need not drain their fds.
+   So after an fd's handler runs, we queue a one-shot poll
+   on it:  if the fd is still ready it completes immediately.
+
+   All of these requests (and cancellations) are queued in the
+   submission ring and handed to the kernel with the same
+   io_uring_enter() that waits for completions,
+   so each iteration costs one system call.
+
+   This needs linux 5.13 (for multishot poll and timed waits);
+   on older kernels setup() fails and gsk_main_loop_new()
+   falls back to another main-loop type.
+ */
+
+#define RING_ENTRIES		1024
+
+/* bits in FdInfo.state */
+#define FD_WANT_IN	(1<<0)
+#define FD_WANT_OUT	(1<<1)
+#define FD_READY_IN	(1<<2)
+#define FD_READY_OUT	(1<<3)
+#define FD_REGISTERED	(1<<4)
+#define FD_RECHECK_ARMED (1<<5)
+#define FD_EMITTED	(1<<6)	/* reported during this do_polling() */
+
+#define FD_WANT_MASK	(FD_WANT_IN|FD_WANT_OUT)
+#define FD_READY_SHIFT	2
+
+#define POLL_MASK	(POLLIN|POLLOUT|POLLERR|POLLHUP)
+
+/* user_data of our requests:  generation, fd, and whether this is a recheck.
+   The generation changes whenever an fd is removed,
+   so that completions for a closed (and reused) fd are ignored. */
+#define MAKE_USER_DATA(gen, fd, is_recheck) \
+  (((guint64)(gen) << 32) | ((guint64)(fd) << 1) | (is_recheck))
+#define USER_DATA_GET_GEN(ud)		((guint32) ((ud) >> 32))
+#define USER_DATA_GET_FD(ud)		((int) (((ud) & 0xffffffff) >> 1))
+#define USER_DATA_IS_RECHECK(ud)	((ud) & 1)
+
+/* completions of POLL_REMOVE requests */
+#define USER_DATA_IGNORE		G_GUINT64_CONSTANT (0xffffffffffffffff)
+
+typedef struct _FdInfo FdInfo;
+struct _FdInfo
+{
+  guint32 generation;
+  guint8 state;
+};
+
+typedef struct _Ring Ring;
+struct _Ring
+{
+  int fd;
+
+  /* submission queue */
+  void *sq_ptr;
+  size_t sq_map_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  size_t sqes_map_size;
+  unsigned n_unsubmitted;
+
+  /* completion queue */
+  void *cq_ptr;
+  size_t cq_map_size;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+static int
+ring_enter (Ring     *ring,
+            unsigned  to_submit,
+            unsigned  min_complete,
+            unsigned  flags,
+            void     *arg,
+            size_t    arg_size)
+{
+  return syscall (__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                  flags, arg, arg_size);
+}
+
+static void
+ring_destroy (Ring *ring)
+{
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_map_size);
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    munmap (ring->cq_ptr, ring->cq_map_size);
+  if (ring->sq_ptr != NULL)
+    munmap (ring->sq_ptr, ring->sq_map_size);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  g_free (ring);
+}
+
+static Ring *
+ring_new (unsigned entries)
+{
+  struct io_uring_params params;
+  Ring *ring = g_new0 (Ring, 1);
+  char *sq, *cq;
+
+  memset (&params, 0, sizeof (params));
+  ring->fd = syscall (__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    {
+      g_free (ring);
+      return NULL;
+    }
+  gsk_fd_set_close_on_exec (ring->fd, TRUE);
+  if ((params.features & IORING_FEAT_EXT_ARG) == 0)
+    {
+      /* pre-5.11 kernels can't wait with a timeout */
+      ring_destroy (ring);
+      return NULL;
+    }
+
+  ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      ring->sq_map_size = ring->cq_map_size = MAX (ring->sq_map_size, ring->cq_map_size);
+    }
+  ring->sq_ptr = mmap (NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    {
+      ring->sq_ptr = NULL;
+      ring_destroy (ring);
+      return NULL;
+    }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ptr = ring->sq_ptr;
+  else
+    {
+      ring->cq_ptr = mmap (NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+        {
+          ring->cq_ptr = NULL;
+          ring_destroy (ring);
+          return NULL;
+        }
+    }
+  ring->sqes_map_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      ring_destroy (ring);
+      return NULL;
+    }
+
+  sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+}
+
+/* hand the queued requests to the kernel now;
+   only needed when the submission ring is full. */
+static void
+ring_flush (Ring *ring)
+{
+  while (ring->n_unsubmitted > 0)
+    {
+      int rv = ring_enter (ring, ring->n_unsubmitted, 0, 0, NULL, 0);
+      if (rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EBUSY)
+            g_warning ("io_uring_enter: error submitting: %s", g_strerror (errno));
+          return;
+        }
+      ring->n_unsubmitted -= rv;
+    }
+}
+
+static struct io_uring_sqe *
+ring_get_sqe (Ring *ring)
+{
+  unsigned tail = *ring->sq_tail;
+  unsigned head;
+  struct io_uring_sqe *sqe;
+  GSK_MEMORY_BARRIER ();
+  head = *(volatile unsigned *) ring->sq_head;
+  if (tail - head >= ring->sq_entries)
+    {
+      ring_flush (ring);
+      GSK_MEMORY_BARRIER ();
+      head = *(volatile unsigned *) ring->sq_head;
+      if (tail - head >= ring->sq_entries)
+        return NULL;
+    }
+  sqe = ring->sqes + (tail & *ring->sq_mask);
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+/* publish an sqe obtained by ring_get_sqe() */
+static void
+ring_queue_sqe (Ring *ring)
+{
+  unsigned tail = *ring->sq_tail;
+  ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+  GSK_MEMORY_BARRIER ();
+  *(volatile unsigned *) ring->sq_tail = tail + 1;
+  ring->n_unsubmitted++;
+}
+
+static void
+queue_poll_add (GskMainLoopIoUring *uring,
+                int                 fd,
+                guint64             user_data,
+                gboolean            multishot)
+{
+  Ring *ring = uring->ring;
+  struct io_uring_sqe *sqe = ring_get_sqe (ring);
+  if (sqe == NULL)
+    {
+      g_warning ("io_uring: submission queue full: cannot watch fd %d", fd);
+      return;
+    }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLL_MASK;
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = user_data;
+  ring_queue_sqe (ring);
+}
+
+static void
+queue_poll_remove (GskMainLoopIoUring *uring,
+                   guint64             target_user_data)
+{
+  Ring *ring = uring->ring;
+  struct io_uring_sqe *sqe = ring_get_sqe (ring);
+  if (sqe == NULL)
+    {
+      g_warning ("io_uring: submission queue full: cannot remove poll");
+      return;
+    }
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target_user_data;
+  sqe->user_data = USER_DATA_IGNORE;
+  ring_queue_sqe (ring);
+}
+
+static inline void
+arm_recheck (GskMainLoopIoUring *uring,
+             int                 fd)
+{
+  FdInfo *info = (FdInfo *) uring->fd_infos + fd;
+  if ((info->state & FD_RECHECK_ARMED) == 0)
+    {
+      info->state |= FD_RECHECK_ARMED;
+      queue_poll_add (uring, fd, MAKE_USER_DATA (info->generation, fd, 1), FALSE);
+    }
+}
+
+/* --- GskMainLoopPollBase methods --- */
+static gboolean
+gsk_main_loop_io_uring_setup  (GskMainLoop       *main_loop)
+{
+  GskMainLoopClass *pclass = GSK_MAIN_LOOP_CLASS (parent_class);
+  GskMainLoopIoUring *uring = GSK_MAIN_LOOP_IO_URING (main_loop);
+  uring->ring = ring_new (RING_ENTRIES);
+  if (uring->ring == NULL)
+    return FALSE;
+  if (pclass->setup != NULL)
+    if (!(*pclass->setup) (main_loop))
+      return FALSE;
+  return TRUE;
+}
+
+static void
+gsk_main_loop_io_uring_config_fd (GskMainLoopPollBase   *main_loop,
+                                  int                    fd,
+                                  GIOCondition           old_io_conditions,
+                                  GIOCondition           io_conditions)
+{
+  GskMainLoopIoUring *uring = GSK_MAIN_LOOP_IO_URING (main_loop);
+  guint8 want = ((io_conditions & G_IO_IN) ? FD_WANT_IN : 0)
+              | ((io_conditions & G_IO_OUT) ? FD_WANT_OUT : 0);
+  FdInfo *info;
+  guint8 state;
+
+  if (uring->ring == NULL || (old_io_conditions == 0 && io_conditions == 0))
+    return;
+  if ((guint) fd >= uring->n_fd_infos)
+    {
+      guint old_n = uring->n_fd_infos;
+      guint n = old_n ? old_n : 64;
+      while (n <= (guint) fd)
+        n *= 2;
+      uring->fd_infos = g_renew (FdInfo, uring->fd_infos, n);
+      memset ((FdInfo *) uring->fd_infos + old_n, 0, (n - old_n) * sizeof (FdInfo));
+      uring->n_fd_infos = n;
+    }
+  info = (FdInfo *) uring->fd_infos + fd;
+  state = info->state;
+
+  if (io_conditions == 0)
+    {
+      if (state & FD_REGISTERED)
+        queue_poll_remove (uring, MAKE_USER_DATA (info->generation, fd, 0));
+      if (state & FD_RECHECK_ARMED)
+        queue_poll_remove (uring, MAKE_USER_DATA (info->generation, fd, 1));
+      info->generation++;
+      info->state = 0;
+      return;
+    }
+
+  if ((state & FD_REGISTERED) == 0)
+    {
+      /* a new poll reports the current readiness immediately */
+      info->state = FD_REGISTERED | want;
+      queue_poll_add (uring, fd, MAKE_USER_DATA (info->generation, fd, 0), TRUE);
+      return;
+    }
+
+  info->state = (state & ~FD_WANT_MASK) | want;
+
+  /* newly interested in a condition whose completion we've already seen? */
+  if (((state >> FD_READY_SHIFT) & want & ~state) != 0)
+    arm_recheck (uring, fd);
+}
+
+static inline GIOCondition
+poll_events_to_condition (int res)
+{
+  GIOCondition condition = 0;
+  if (res < 0)
+    return (G_IO_ERR|G_IO_IN|G_IO_OUT);
+  if (res & POLLIN)
+    condition |= G_IO_IN;
+  if (res & POLLHUP)
+    condition |= (G_IO_HUP|G_IO_IN);
+  if (res & POLLERR)
+    condition |= (G_IO_ERR|G_IO_IN|G_IO_OUT);
+  if (res & POLLOUT)
+    condition |= G_IO_OUT;
+  return condition;
+}
+
+static inline guint8
+condition_to_ready (GIOCondition condition)
+{
+  return ((condition & G_IO_IN) ? FD_READY_IN : 0)
+       | ((condition & G_IO_OUT) ? FD_READY_OUT : 0);
+}
+
+static gboolean
+gsk_main_loop_io_uring_do_polling (GskMainLoopPollBase   *main_loop,
+                                   int                    max_timeout,
+                                   guint                  max_events,
+                                   guint                 *num_events_out,
+                                   GskMainLoopEvent      *events)
+{
+  GskMainLoopIoUring *uring = GSK_MAIN_LOOP_IO_URING (main_loop);
+  Ring *ring = uring->ring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head, tail;
+  guint n_out = 0;
+  guint i;
+  gboolean have_completions;
+  int rv;
+
+  memset (&arg, 0, sizeof (arg));
+  if (max_timeout >= 0)
+    {
+      ts.tv_sec = max_timeout / 1000;
+      ts.tv_nsec = (max_timeout % 1000) * 1000000;
+      arg.ts = (guint64) (gsize) &ts;
+    }
+
+  /* when blocking indefinitely, don't return just because
+     of completions we had no use for (eg from removed fds) */
+  do
+    {
+      GSK_MEMORY_BARRIER ();
+      have_completions = *(volatile unsigned *) ring->cq_tail != *ring->cq_head;
+
+      /* submit and wait in one call */
+      rv = 0;
+      if (have_completions || max_timeout == 0)
+        {
+          if (ring->n_unsubmitted > 0)
+            {
+              rv = ring_enter (ring, ring->n_unsubmitted, 0, 0, NULL, 0);
+              if (rv > 0)
+                ring->n_unsubmitted -= rv;
+            }
+        }
+      else
+        {
+          rv = ring_enter (ring, ring->n_unsubmitted, 1,
+                           IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                           &arg, sizeof (arg));
+          if (rv >= 0)
+            ring->n_unsubmitted -= MIN ((guint) rv, ring->n_unsubmitted);
+          else if (errno != ETIME && errno != EBUSY
+                && !gsk_errno_is_ignorable (errno))
+            g_warning ("error running io_uring_enter: %s", g_strerror (errno));
+        }
+
+      /* harvest completions */
+      head = *ring->cq_head;
+      GSK_MEMORY_BARRIER ();
+      tail = *(volatile unsigned *) ring->cq_tail;
+      for ( ; head != tail && n_out < max_events; head++)
+        {
+          struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+          guint64 user_data = cqe->user_data;
+          int fd;
+          FdInfo *info;
+          GIOCondition condition;
+
+          if (user_data == USER_DATA_IGNORE)
+            continue;
+          fd = USER_DATA_GET_FD (user_data);
+          if ((guint) fd >= uring->n_fd_infos)
+            continue;
+          info = (FdInfo *) uring->fd_infos + fd;
+          if (info->generation != USER_DATA_GET_GEN (user_data)
+           || (info->state & FD_REGISTERED) == 0)
+            continue;               /* fd removed since the request was made */
+          if (cqe->res == -ECANCELED)
+            continue;
+
+          if (USER_DATA_IS_RECHECK (user_data))
+            info->state &= ~FD_RECHECK_ARMED;
+          else if ((cqe->flags & IORING_CQE_F_MORE) == 0 && cqe->res >= 0)
+            {
+              /* the kernel terminated the multishot poll (eg on overflow) */
+              queue_poll_add (uring, fd, user_data, TRUE);
+            }
+
+          condition = poll_events_to_condition (cqe->res);
+          info->state |= condition_to_ready (condition);
+          if (((info->state >> FD_READY_SHIFT) & info->state & FD_WANT_MASK) == 0)
+            continue;
+
+          if (info->state & FD_EMITTED)
+            {
+              /* already reporting this fd:  merge the conditions */
+              for (i = 0; i < n_out; i++)
+                if (events[i].data.io.fd == (guint) fd)
+                  events[i].data.io.events |= condition;
+            }
+          else
+            {
+              events[n_out].type = GSK_MAIN_LOOP_EVENT_IO;
+              events[n_out].data.io.events = condition;
+              events[n_out].data.io.fd = fd;
+              n_out++;
+              info->state |= FD_EMITTED;
+            }
+
+          /* the handler may not drain the fd:  find out next time */
+          info->state &= ~(FD_READY_IN|FD_READY_OUT);
+          arm_recheck (uring, fd);
+        }
+      GSK_MEMORY_BARRIER ();
+      *(volatile unsigned *) ring->cq_head = head;
+    }
+  while (n_out == 0 && max_timeout < 0 && rv >= 0);
+
+  for (i = 0; i < n_out; i++)
+    ((FdInfo *) uring->fd_infos)[events[i].data.io.fd].state &= ~FD_EMITTED;
+  *num_events_out = n_out;
+  return TRUE;
+}
+
+static void
+gsk_main_loop_io_uring_finalize (GObject *object)
+{
+  GskMainLoopIoUring *uring = GSK_MAIN_LOOP_IO_URING (object);
+  (*parent_class->finalize) (object);
+  if (uring->ring != NULL)
+    ring_destroy (uring->ring);
+  g_free (uring->fd_infos);
+}
+#endif  /* HAVE_IO_URING_SUPPORT */
+
+/* --- functions --- */
+static void
+gsk_main_loop_io_uring_init (GskMainLoopIoUring *main_loop_io_uring)
+{
+}
+
+static void
+gsk_main_loop_io_uring_class_init (GskMainLoopIoUringClass *class)
+{
+#if HAVE_IO_URING_SUPPORT
+  GskMainLoopPollBaseClass *main_loop_poll_base_class = GSK_MAIN_LOOP_POLL_BASE_CLASS (class);
+  GskMainLoopClass *main_loop_class = GSK_MAIN_LOOP_CLASS (class);
+  GObjectClass *object_class = G_OBJECT_CLASS (class);
+  main_loop_class->setup = gsk_main_loop_io_uring_setup;
+  main_loop_poll_base_class->config_fd = gsk_main_loop_io_uring_config_fd;
+  main_loop_poll_base_class->do_polling = gsk_main_loop_io_uring_do_polling;
+  object_class->finalize = gsk_main_loop_io_uring_finalize;
+#endif  /* HAVE_IO_URING_SUPPORT */
+  parent_class = g_type_class_peek_parent (class);
+}
+
+GType gsk_main_loop_io_uring_get_type()
+{
+  static GType main_loop_io_uring_type = 0;
+  if (!main_loop_io_uring_type)
+    {
+      static const GTypeInfo main_loop_io_uring_info =
+      {
+	sizeof(GskMainLoopIoUringClass),
+	(GBaseInitFunc) NULL,
+	(GBaseFinalizeFunc) NULL,
+	(GClassInitFunc) gsk_main_loop_io_uring_class_init,
+	NULL,		/* class_finalize */
+	NULL,		/* class_data */
+	sizeof (GskMainLoopIoUring),
+	0,		/* n_preallocs */
+	(GInstanceInitFunc) gsk_main_loop_io_uring_init,
+	NULL		/* value_table */
+      };
+      main_loop_io_uring_type = g_type_register_static (GSK_TYPE_MAIN_LOOP_POLL_BASE,
+                                                        "GskMainLoopIoUring",
+                                                        &main_loop_io_uring_info, 0);
+    }
+  return main_loop_io_uring_type;
+}
@@ -0,0 +1,44 @@
+#ifndef __GSK_MAIN_LOOP_IO_URING_H_
+#define __GSK_MAIN_LOOP_IO_URING_H_
+
+#include "gskmainlooppollbase.h"
+
+G_BEGIN_DECLS
+
+/* --- typedefs --- */
+typedef struct _GskMainLoopIoUring GskMainLoopIoUring;
+typedef struct _GskMainLoopIoUringClass GskMainLoopIoUringClass;
+
+/* --- type macros --- */
+GType gsk_main_loop_io_uring_get_type(void) G_GNUC_CONST;
+#define GSK_TYPE_MAIN_LOOP_IO_URING			(gsk_main_loop_io_uring_get_type ())
+#define GSK_MAIN_LOOP_IO_URING(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GSK_TYPE_MAIN_LOOP_IO_URING, GskMainLoopIoUring))
+#define GSK_MAIN_LOOP_IO_URING_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), GSK_TYPE_MAIN_LOOP_IO_URING, GskMainLoopIoUringClass))
+#define GSK_MAIN_LOOP_IO_URING_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS ((obj), GSK_TYPE_MAIN_LOOP_IO_URING, GskMainLoopIoUringClass))
+#define GSK_IS_MAIN_LOOP_IO_URING(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GSK_TYPE_MAIN_LOOP_IO_URING))
+#define GSK_IS_MAIN_LOOP_IO_URING_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE ((klass), GSK_TYPE_MAIN_LOOP_IO_URING))
+
+/* --- structures --- */
+struct _GskMainLoopIoUringClass 
+{
+  GskMainLoopPollBaseClass main_loop_poll_base_class;
+};
+struct _GskMainLoopIoUring 
+{
+  GskMainLoopPollBase      main_loop_poll_base;
+
+  /*< private >*/
+  gpointer                 ring;
+
+  /* per-fd interest, readiness and generation number */
+  gpointer                 fd_infos;
+  guint                    n_fd_infos;
+};
+
+/* --- prototypes --- */
+
+
+
+G_END_DECLS
+
+#endif
@@ -9,6 +9,7 @@ usage (void)
   g_printerr ("gsk-webserver OPTIONS\n\n"
               "OPTIONS include:\n");
   g_printerr ("  --bind-tcp=PORT\n");
+  g_printerr ("  --threads=N\n");
   g_printerr ("  --mime PREFIX*SUFFIX TYPE/SUBTYPE\n");
   g_printerr ("  --default-mime TYPE/SUBTYPE\n");
   g_printerr ("  --location FS_PATH URI_PATH\n");
@@ -20,18 +21,26 @@ int main(int argc, char **argv)
   guint i;
   GskHttpContent *content;
   GError *error = NULL;
-  gsk_init_without_threads (&argc, &argv);
+  GArray *ports = g_array_new (FALSE, FALSE, sizeof (guint));
+  guint n_threads = 0;
+  for (i = 1; i < (guint)argc; i++)
+    if (g_str_has_prefix (argv[i], "--threads="))
+      n_threads = atoi (strchr (argv[i], '=') + 1);
+  if (n_threads > 0)
+    gsk_init (&argc, &argv, NULL);
+  else
+    gsk_init_without_threads (&argc, &argv);
   content = gsk_http_content_new ();
   for (i = 1; i < (guint)argc; i++)
     {
       if (g_str_has_prefix (argv[i], "--bind-tcp="))
         {
 	  guint port = atoi (strchr (argv[i], '=') + 1);
-          GskSocketAddress *addr;
-          addr = gsk_socket_address_ipv4_new (gsk_ipv4_ip_address_any, port);
-          if (!gsk_http_content_listen (content, addr, &error))
-            g_error ("error binding: %s", error->message);
-          g_object_unref (addr);
+          g_array_append_val (ports, port);
+        }
+      else if (g_str_has_prefix (argv[i], "--threads="))
+        {
+          /* handled above */
         }
       else if (strcmp (argv[i], "--mime") == 0)
         {
@@ -85,5 +94,23 @@ int main(int argc, char **argv)
         }
     }
 
+  /* bind only after the content is fully configured:
+     worker threads start serving immediately. */
+  for (i = 0; i < ports->len; i++)
+    {
+      guint port = g_array_index (ports, guint, i);
+      GskSocketAddress *addr;
+      addr = gsk_socket_address_ipv4_new (gsk_ipv4_ip_address_any, port);
+      if (n_threads > 0)
+        {
+          if (gsk_http_content_listen_group (content, addr, n_threads, &error) == NULL)
+            g_error ("error binding: %s", error->message);
+        }
+      else if (!gsk_http_content_listen (content, addr, &error))
+        g_error ("error binding: %s", error->message);
+      g_object_unref (addr);
+    }
+  g_array_free (ports, TRUE);
+
   return gsk_main_run ();
 }
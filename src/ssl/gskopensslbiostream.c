@@ -21,6 +21,12 @@ struct _GskBufferStreamOpenssl
 {
   GskBufferStream      buffer_stream;
   BIO *bio;
+
+  /* While detached, the BIO uses these instead of the
+     stream's buffers, so that it may be used by another thread. */
+  gboolean detached;
+  GskBuffer detached_incoming;          /* ciphertext for SSL to read */
+  GskBuffer detached_outgoing;          /* ciphertext written by SSL */
 };
 static GObjectClass *parent_class = NULL;
 
@@ -43,14 +49,26 @@ gsk_buffer_stream_openssl_shutdown_write  (GskIO      *io,
 }
 #endif
 
+static void
+gsk_buffer_stream_openssl_finalize (GObject *object)
+{
+  GskBufferStreamOpenssl *openssl_stream = GSK_BUFFER_STREAM_OPENSSL (object);
+  gsk_buffer_destruct (&openssl_stream->detached_incoming);
+  gsk_buffer_destruct (&openssl_stream->detached_outgoing);
+  (*parent_class->finalize) (object);
+}
+
 static void
 gsk_buffer_stream_openssl_init (GskBufferStreamOpenssl *buffer_stream_openssl)
 {
+  gsk_buffer_construct (&buffer_stream_openssl->detached_incoming);
+  gsk_buffer_construct (&buffer_stream_openssl->detached_outgoing);
 }
 static void
 gsk_buffer_stream_openssl_class_init (GskBufferStreamOpensslClass *class)
 {
   parent_class = g_type_class_peek_parent (class);
+  G_OBJECT_CLASS (class)->finalize = gsk_buffer_stream_openssl_finalize;
 #if MONITOR_BUFFER_STREAM_SHUTDOWN
   GSK_IO_CLASS (class)->shutdown_read = gsk_buffer_stream_openssl_shutdown_read;
   GSK_IO_CLASS (class)->shutdown_write = gsk_buffer_stream_openssl_shutdown_write;
@@ -107,6 +125,12 @@ bio_gsk_stream_pair_bwrite (BIO *bio,
 		       int length)
 {
   GskBufferStream *buffer_stream = GSK_BUFFER_STREAM (bio->ptr);
+  GskBufferStreamOpenssl *openssl_stream = bio->ptr;
+  if (openssl_stream->detached)
+    {
+      gsk_buffer_append (&openssl_stream->detached_outgoing, out, length);
+      return length;
+    }
   DEBUG_BIO("bio_gsk_stream_pair_bwrite: writing %d bytes to read-buffer of backend", length);
   gsk_buffer_append (gsk_buffer_stream_peek_read_buffer (buffer_stream), out, length);
   gsk_buffer_stream_read_buffer_changed (buffer_stream);
@@ -119,7 +143,11 @@ bio_gsk_stream_pair_bread (BIO *bio,
 		      int max_length)
 {
   GskBufferStream *buffer_stream = GSK_BUFFER_STREAM (bio->ptr);
-  guint length = gsk_buffer_read (gsk_buffer_stream_peek_write_buffer (buffer_stream), in, max_length);
+  GskBufferStreamOpenssl *openssl_stream = bio->ptr;
+  guint length;
+  if (openssl_stream->detached)
+    return gsk_buffer_read (&openssl_stream->detached_incoming, in, max_length);
+  length = gsk_buffer_read (gsk_buffer_stream_peek_write_buffer (buffer_stream), in, max_length);
   DEBUG_BIO("bio_gsk_stream_pair_bread: read %u bytes of %d bytes from backend write buffer", length, max_length);
   if (length > 0)
     gsk_buffer_stream_write_buffer_changed (buffer_stream);
@@ -141,9 +169,15 @@ bio_gsk_stream_pair_ctrl (BIO  *bio,
     {
     case BIO_CTRL_DUP:
     case BIO_CTRL_FLUSH:
+      return 1;
     case BIO_CTRL_PENDING:
+      /* ciphertext waiting to be read by SSL */
+      if (openssl_buffer_stream->detached)
+        return openssl_buffer_stream->detached_incoming.size;
+      return gsk_buffer_stream_peek_write_buffer (GSK_BUFFER_STREAM (openssl_buffer_stream))->size;
     case BIO_CTRL_WPENDING:
-      return 1;
+      /* writes go straight to the stream's read buffer */
+      return 0;
     }
 
   /* -1 seems more appropriate, but this is
@@ -214,3 +248,55 @@ gsk_openssl_bio_stream_pair (BIO              **bio_out,
   openssl_stream->bio = *bio_out;
   return TRUE;
 }
+
+/**
+ * gsk_openssl_bio_stream_detach:
+ * @bio: a BIO made by gsk_openssl_bio_stream_pair().
+ *
+ * Take the ciphertext waiting in the stream,
+ * and make the BIO independent of the stream until
+ * gsk_openssl_bio_stream_reattach() is called.
+ * Meanwhile, the BIO (and the SSL object using it)
+ * may be used from another thread; the stream may not.
+ */
+void
+gsk_openssl_bio_stream_detach (BIO *bio)
+{
+  GskBufferStreamOpenssl *openssl_stream = GSK_BUFFER_STREAM_OPENSSL (bio->ptr);
+  GskBuffer *incoming = gsk_buffer_stream_peek_write_buffer (openssl_stream);
+  g_return_if_fail (!openssl_stream->detached);
+  if (gsk_buffer_drain (&openssl_stream->detached_incoming, incoming) > 0)
+    gsk_buffer_stream_write_buffer_changed (GSK_BUFFER_STREAM (openssl_stream));
+  openssl_stream->detached = TRUE;
+}
+
+/**
+ * gsk_openssl_bio_stream_reattach:
+ * @bio: a BIO which was detached.
+ *
+ * Deliver the ciphertext written to the BIO while it was detached,
+ * and return any it did not read to the front of the stream.
+ * Must be called from the stream's thread, once the other thread
+ * is done with the BIO.
+ */
+void
+gsk_openssl_bio_stream_reattach (BIO *bio)
+{
+  GskBufferStreamOpenssl *openssl_stream = GSK_BUFFER_STREAM_OPENSSL (bio->ptr);
+  GskBufferStream *buffer_stream = GSK_BUFFER_STREAM (openssl_stream);
+  g_return_if_fail (openssl_stream->detached);
+  openssl_stream->detached = FALSE;
+  if (openssl_stream->detached_incoming.size > 0)
+    {
+      GskBuffer *incoming = gsk_buffer_stream_peek_write_buffer (buffer_stream);
+      gsk_buffer_drain (&openssl_stream->detached_incoming, incoming);
+      gsk_buffer_drain (incoming, &openssl_stream->detached_incoming);
+      gsk_buffer_stream_write_buffer_changed (buffer_stream);
+    }
+  if (openssl_stream->detached_outgoing.size > 0)
+    {
+      gsk_buffer_drain (gsk_buffer_stream_peek_read_buffer (buffer_stream),
+                        &openssl_stream->detached_outgoing);
+      gsk_buffer_stream_read_buffer_changed (buffer_stream);
+    }
+}
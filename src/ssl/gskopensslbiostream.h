@@ -14,6 +14,11 @@ G_BEGIN_DECLS
 gboolean gsk_openssl_bio_stream_pair (BIO             **bio_out,
                                       GskBufferStream **stream_out);
 
+/* Let the BIO be used by another thread for a while,
+ * buffering its I/O privately. */
+void     gsk_openssl_bio_stream_detach   (BIO              *bio);
+void     gsk_openssl_bio_stream_reattach (BIO              *bio);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,240 @@
+#include <string.h>
+#include <time.h>
+#include "gsksslsessioncache.h"
+#include "../gsklistmacros.h"
+
+#define N_SHARDS        16
+
+typedef struct _Entry Entry;
+typedef struct _Shard Shard;
+
+struct _Entry
+{
+  guint hash;
+  guint key_len;
+  guint data_len;
+  const guint8 *key;            /* follows the Entry; then the data */
+  gulong expire_time;
+  Entry *prev_lru, *next_lru;
+};
+#define ENTRY_DATA(entry)  ((guint8 *) ((entry) + 1) + (entry)->key_len)
+
+struct _Shard
+{
+  GStaticMutex mutex;
+  GHashTable *table;            /* Entry => Entry */
+  guint n_entries;
+  Entry *newest, *oldest;
+};
+#define GET_LRU_LIST(shard) \
+  Entry *, (shard)->newest, (shard)->oldest, prev_lru, next_lru
+
+struct _GskSslSessionCache
+{
+  guint max_per_shard;
+  Shard shards[N_SHARDS];
+};
+
+static guint
+hash_key (guint key_len, const guint8 *key)
+{
+  guint rv = 2166136261U;       /* FNV-1a */
+  guint i;
+  for (i = 0; i < key_len; i++)
+    rv = (rv ^ key[i]) * 16777619U;
+  return rv;
+}
+
+static guint
+entry_hash (gconstpointer a)
+{
+  return ((const Entry *) a)->hash;
+}
+
+static gboolean
+entry_equal (gconstpointer a, gconstpointer b)
+{
+  const Entry *ea = a;
+  const Entry *eb = b;
+  return ea->key_len == eb->key_len
+      && memcmp (ea->key, eb->key, ea->key_len) == 0;
+}
+
+/**
+ * gsk_ssl_session_cache_new:
+ * @max_sessions: the most sessions to keep.
+ *
+ * Create an empty session cache.
+ *
+ * returns: the new cache.
+ */
+GskSslSessionCache *
+gsk_ssl_session_cache_new (guint max_sessions)
+{
+  GskSslSessionCache *cache = g_new (GskSslSessionCache, 1);
+  guint i;
+  for (i = 0; i < N_SHARDS; i++)
+    {
+      Shard *shard = cache->shards + i;
+      g_static_mutex_init (&shard->mutex);
+      shard->table = g_hash_table_new (entry_hash, entry_equal);
+      shard->n_entries = 0;
+      shard->newest = shard->oldest = NULL;
+    }
+  gsk_ssl_session_cache_set_max_sessions (cache, max_sessions);
+  return cache;
+}
+
+/**
+ * gsk_ssl_session_cache_set_max_sessions:
+ * @cache: the cache to limit.
+ * @max_sessions: the most sessions to keep.
+ *
+ * Change the size of the cache.  Shards which are too
+ * large shrink as new sessions are stored.
+ */
+void
+gsk_ssl_session_cache_set_max_sessions (GskSslSessionCache *cache,
+                                        guint               max_sessions)
+{
+  cache->max_per_shard = (max_sessions + N_SHARDS - 1) / N_SHARDS;
+}
+
+static inline Shard *
+peek_shard (GskSslSessionCache *cache, guint hash)
+{
+  return cache->shards + (hash >> 16) % N_SHARDS;
+}
+
+/* called with the shard locked */
+static void
+remove_entry (Shard *shard, Entry *entry)
+{
+  g_hash_table_remove (shard->table, entry);
+  GSK_LIST_REMOVE (GET_LRU_LIST (shard), entry);
+  shard->n_entries--;
+  g_free (entry);
+}
+
+/**
+ * gsk_ssl_session_cache_store:
+ * @cache: the cache to add to.
+ * @key_len: length of the key.
+ * @key: the key to file the session under.
+ * @data_len: length of the serialized session.
+ * @data: the serialized session.
+ * @expire_time: when the session should be forgotten, as a unix time.
+ *
+ * Store a session in the cache, replacing any session with the same key.
+ * If the cache is full, its least-recently-used sessions are dropped.
+ */
+void
+gsk_ssl_session_cache_store (GskSslSessionCache *cache,
+                             guint               key_len,
+                             const guint8       *key,
+                             guint               data_len,
+                             const guint8       *data,
+                             gulong              expire_time)
+{
+  guint hash = hash_key (key_len, key);
+  Shard *shard = peek_shard (cache, hash);
+  Entry *entry, *old;
+
+  entry = g_malloc (sizeof (Entry) + key_len + data_len);
+  entry->hash = hash;
+  entry->key_len = key_len;
+  entry->data_len = data_len;
+  entry->key = (const guint8 *) (entry + 1);
+  entry->expire_time = expire_time;
+  memcpy (entry + 1, key, key_len);
+  memcpy (ENTRY_DATA (entry), data, data_len);
+
+  g_static_mutex_lock (&shard->mutex);
+  old = g_hash_table_lookup (shard->table, entry);
+  if (old != NULL)
+    remove_entry (shard, old);
+  while (shard->n_entries > 0 && shard->n_entries >= cache->max_per_shard)
+    remove_entry (shard, shard->oldest);
+  if (cache->max_per_shard == 0)
+    g_free (entry);
+  else
+    {
+      g_hash_table_insert (shard->table, entry, entry);
+      GSK_LIST_PREPEND (GET_LRU_LIST (shard), entry);
+      shard->n_entries++;
+    }
+  g_static_mutex_unlock (&shard->mutex);
+}
+
+/**
+ * gsk_ssl_session_cache_lookup:
+ * @cache: the cache to search.
+ * @key_len: length of the key.
+ * @key: the key the session was filed under.
+ * @data_len_out: the length of the serialized session.
+ *
+ * Find an unexpired session.
+ *
+ * returns: a copy of the serialized session,
+ * which must be freed with g_free(), or NULL.
+ */
+guint8 *
+gsk_ssl_session_cache_lookup (GskSslSessionCache *cache,
+                              guint               key_len,
+                              const guint8       *key,
+                              guint              *data_len_out)
+{
+  Entry probe;
+  Entry *entry;
+  Shard *shard;
+  guint8 *rv = NULL;
+  probe.hash = hash_key (key_len, key);
+  probe.key_len = key_len;
+  probe.key = key;
+  shard = peek_shard (cache, probe.hash);
+
+  g_static_mutex_lock (&shard->mutex);
+  entry = g_hash_table_lookup (shard->table, &probe);
+  if (entry != NULL && entry->expire_time <= (gulong) time (NULL))
+    {
+      remove_entry (shard, entry);
+      entry = NULL;
+    }
+  if (entry != NULL)
+    {
+      GSK_LIST_REMOVE (GET_LRU_LIST (shard), entry);
+      GSK_LIST_PREPEND (GET_LRU_LIST (shard), entry);
+      rv = g_memdup (ENTRY_DATA (entry), entry->data_len);
+      *data_len_out = entry->data_len;
+    }
+  g_static_mutex_unlock (&shard->mutex);
+  return rv;
+}
+
+/**
+ * gsk_ssl_session_cache_remove:
+ * @cache: the cache to remove from.
+ * @key_len: length of the key.
+ * @key: the key the session was filed under.
+ *
+ * Forget a session, if it is in the cache.
+ */
+void
+gsk_ssl_session_cache_remove (GskSslSessionCache *cache,
+                              guint               key_len,
+                              const guint8       *key)
+{
+  Entry probe;
+  Entry *entry;
+  Shard *shard;
+  probe.hash = hash_key (key_len, key);
+  probe.key_len = key_len;
+  probe.key = key;
+  shard = peek_shard (cache, probe.hash);
+
+  g_static_mutex_lock (&shard->mutex);
+  entry = g_hash_table_lookup (shard->table, &probe);
+  if (entry != NULL)
+    remove_entry (shard, entry);
+  g_static_mutex_unlock (&shard->mutex);
+}
@@ -0,0 +1,43 @@
+#ifndef __GSK_SSL_SESSION_CACHE_H_
+#define __GSK_SSL_SESSION_CACHE_H_
+
+/* GskSslSessionCache:
+ *  An in-process cache of serialized SSL sessions, for resumption.
+ *
+ *  Entries are found by an arbitrary binary key (a session-id on servers,
+ *  "host:port" on clients).  The cache is split into shards,
+ *  each with its own lock and LRU list, so that threads
+ *  doing handshakes rarely contend.  Each shard keeps
+ *  at most its share of max_sessions;  expired entries
+ *  are dropped when they are found.
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GskSslSessionCache GskSslSessionCache;
+
+GskSslSessionCache *gsk_ssl_session_cache_new    (guint               max_sessions);
+void                gsk_ssl_session_cache_set_max_sessions
+                                                 (GskSslSessionCache *cache,
+                                                  guint               max_sessions);
+void                gsk_ssl_session_cache_store  (GskSslSessionCache *cache,
+                                                  guint               key_len,
+                                                  const guint8       *key,
+                                                  guint               data_len,
+                                                  const guint8       *data,
+                                                  gulong              expire_time);
+
+/* returns a newly allocated copy of the data, or NULL */
+guint8             *gsk_ssl_session_cache_lookup (GskSslSessionCache *cache,
+                                                  guint               key_len,
+                                                  const guint8       *key,
+                                                  guint              *data_len_out);
+void                gsk_ssl_session_cache_remove (GskSslSessionCache *cache,
+                                                  guint               key_len,
+                                                  const guint8       *key);
+
+G_END_DECLS
+
+#endif
@@ -1,4 +1,5 @@
 #include "gskstreamlistenerssl.h"
+#include "../gskstreamlistenersocket.h"
 #include "../gskmacros.h"
 
 static GObjectClass *parent_class = NULL;
@@ -15,6 +16,32 @@ enum
   PROP_PASSWORD
 };
 
+static void
+handle_handshakes_drained (gpointer data)
+{
+  GskStreamListenerSsl *listener_ssl = GSK_STREAM_LISTENER_SSL (data);
+  listener_ssl->underlying_paused = FALSE;
+  if (listener_ssl->underlying != NULL)
+    gsk_stream_listener_socket_set_paused (GSK_STREAM_LISTENER_SOCKET (listener_ssl->underlying), FALSE);
+  g_object_unref (listener_ssl);
+}
+
+/* If handshakes are backing up in the thread-pool,
+   leave new connections in the kernel's listen queue for now. */
+static void
+maybe_pause_underlying (GskStreamListenerSsl *listener_ssl)
+{
+  if (listener_ssl->underlying_paused
+   || listener_ssl->underlying == NULL
+   || !GSK_IS_STREAM_LISTENER_SOCKET (listener_ssl->underlying)
+   || !_gsk_stream_ssl_handshakes_backlogged ())
+    return;
+  listener_ssl->underlying_paused = TRUE;
+  gsk_stream_listener_socket_set_paused (GSK_STREAM_LISTENER_SOCKET (listener_ssl->underlying), TRUE);
+  _gsk_stream_ssl_notify_handshakes_drained (handle_handshakes_drained,
+                                             g_object_ref (listener_ssl));
+}
+
 static gboolean
 handle_underlying_accept (GskStream    *stream,
 			  gpointer      data,
@@ -34,6 +61,7 @@ handle_underlying_accept (GskStream    *stream,
 
   gsk_stream_listener_notify_accepted (GSK_STREAM_LISTENER (listener_ssl), ssl);
   g_object_unref (ssl);
+  maybe_pause_underlying (listener_ssl);
   return TRUE;
 }
 
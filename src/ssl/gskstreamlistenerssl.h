@@ -30,6 +30,7 @@ struct _GskStreamListenerSsl
   char *key_file;
   char *password;
   GskStreamListener *underlying;
+  gboolean underlying_paused;   /* while handshakes are backlogged */
 };
 
 /* --- prototypes --- */
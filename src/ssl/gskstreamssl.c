@@ -14,14 +14,20 @@
 
 #include "gskstreamssl.h"
 #include "gskopensslbiostream.h"
+#include "gsksslsessioncache.h"
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
 #include "../gskbufferstream.h"
 #include "../gskstreamconnection.h"
+#include "../gskthreadpool.h"
 #include "../gskdebug.h"
 #include "../debug.h"
 #include "../gskmacros.h"
 #include <string.h>
+#include <time.h>
 
 static GObjectClass *parent_class = NULL;
 
@@ -38,7 +44,10 @@ enum
 
   /* for clients and servers. */
   PROP_CERT_FILE,
-  PROP_IS_CLIENT
+  PROP_IS_CLIENT,
+
+  /* only for clients. */
+  PROP_SESSION_KEY
 };
 
 #define DEBUG(ssl, args)				\
@@ -99,21 +108,287 @@ set_backend_flags_raw_to_underlying (GskStreamSsl *ssl)
   set_backend_flags_raw (ssl, ssl->this_readable, ssl->this_writable);
 }
 
+/* --- session resumption --- */
+/* Sessions are kept serialized, in caches shared by all streams
+   (each stream has its own SSL_CTX, so OpenSSL's internal cache
+   would never be hit).  Servers also issue session tickets,
+   encrypted with a key which is replaced periodically;
+   tickets made with the previous keys are still accepted,
+   but are renewed. */
+#define DEFAULT_SERVER_SESSION_CACHE_SIZE       20000
+#define DEFAULT_SERVER_SESSION_TIMEOUT          300
+#define DEFAULT_TICKET_KEY_ROTATION             3600
+#define CLIENT_SESSION_CACHE_SIZE               1024
+#define N_TICKET_KEYS                           3
+
+static guint server_session_cache_size = DEFAULT_SERVER_SESSION_CACHE_SIZE;
+static guint server_session_timeout = DEFAULT_SERVER_SESSION_TIMEOUT;
+static GskSslSessionCache *server_sessions = NULL;
+static GskSslSessionCache *client_sessions = NULL;
+G_LOCK_DEFINE_STATIC (session_caches);
+
+typedef struct _TicketKey TicketKey;
+struct _TicketKey
+{
+  guint8 name[16];
+  guint8 aes_key[16];
+  guint8 hmac_key[16];
+  gulong created;
+};
+static guint ticket_key_rotation = DEFAULT_TICKET_KEY_ROTATION;
+static TicketKey ticket_keys[N_TICKET_KEYS];    /* newest first */
+static guint n_ticket_keys = 0;
+G_LOCK_DEFINE_STATIC (ticket_keys);
+
+static GskSslSessionCache *
+peek_session_cache (gboolean is_client)
+{
+  GskSslSessionCache *rv;
+  G_LOCK (session_caches);
+  if (is_client)
+    {
+      if (client_sessions == NULL)
+        client_sessions = gsk_ssl_session_cache_new (CLIENT_SESSION_CACHE_SIZE);
+      rv = client_sessions;
+    }
+  else
+    {
+      if (server_sessions == NULL)
+        server_sessions = gsk_ssl_session_cache_new (server_session_cache_size);
+      rv = server_sessions;
+    }
+  G_UNLOCK (session_caches);
+  return rv;
+}
+
+static void
+store_session (GskSslSessionCache *cache,
+               guint               key_len,
+               const guint8       *key,
+               SSL_SESSION        *session)
+{
+  int len = i2d_SSL_SESSION (session, NULL);
+  guint8 *data;
+  unsigned char *at;
+  if (len <= 0)
+    return;
+  data = g_malloc (len);
+  at = data;
+  i2d_SSL_SESSION (session, &at);
+  gsk_ssl_session_cache_store (cache, key_len, key, len, data,
+                               SSL_SESSION_get_time (session)
+                               + SSL_SESSION_get_timeout (session));
+  g_free (data);
+}
+
+static SSL_SESSION *
+lookup_session (GskSslSessionCache *cache,
+                guint               key_len,
+                const guint8       *key)
+{
+  guint len;
+  guint8 *data = gsk_ssl_session_cache_lookup (cache, key_len, key, &len);
+  const unsigned char *at = data;
+  SSL_SESSION *rv;
+  if (data == NULL)
+    return NULL;
+  rv = d2i_SSL_SESSION (NULL, &at, len);
+  g_free (data);
+  return rv;
+}
+
+static int
+server_new_session_cb (SSL *ssl, SSL_SESSION *session)
+{
+  guint id_len;
+  const unsigned char *id = SSL_SESSION_get_id (session, &id_len);
+  store_session (peek_session_cache (FALSE), id_len, id, session);
+  return 0;             /* we did not keep a reference */
+}
+
+static SSL_SESSION *
+server_get_session_cb (SSL *ssl, const unsigned char *id, int id_len, int *copy)
+{
+  *copy = 0;
+  return lookup_session (peek_session_cache (FALSE), id_len, id);
+}
+
+static void
+server_remove_session_cb (SSL_CTX *ctx, SSL_SESSION *session)
+{
+  guint id_len;
+  const unsigned char *id = SSL_SESSION_get_id (session, &id_len);
+  gsk_ssl_session_cache_remove (peek_session_cache (FALSE), id_len, id);
+}
+
+/* called with the ticket_keys lock held */
 static gboolean
-do_handshake (GskStreamSsl *stream_ssl, SSL* ssl, GError **error)
+rotate_ticket_keys_unlocked (gulong now)
+{
+  TicketKey key;
+  if (RAND_bytes (key.name, sizeof (key.name)) <= 0
+   || RAND_bytes (key.aes_key, sizeof (key.aes_key)) <= 0
+   || RAND_bytes (key.hmac_key, sizeof (key.hmac_key)) <= 0)
+    return FALSE;
+  key.created = now;
+  memmove (ticket_keys + 1, ticket_keys,
+           sizeof (TicketKey) * (N_TICKET_KEYS - 1));
+  ticket_keys[0] = key;
+  if (n_ticket_keys < N_TICKET_KEYS)
+    n_ticket_keys++;
+  return TRUE;
+}
+
+/* See SSL_CTX_set_tlsext_ticket_key_cb(3):  returns 1 to use
+   the ticket as-is, 2 to use it and issue a new one,
+   0 if the ticket is unknown, or -1 on error. */
+static int
+ticket_key_cb (SSL            *ssl,
+               unsigned char  *key_name,
+               unsigned char  *iv,
+               EVP_CIPHER_CTX *cipher_ctx,
+               HMAC_CTX       *hmac_ctx,
+               int             enc)
+{
+  gulong now = time (NULL);
+  TicketKey key;
+  guint i = 0;
+
+  G_LOCK (ticket_keys);
+  if (n_ticket_keys == 0
+   || (ticket_key_rotation != 0
+       && ticket_keys[0].created + ticket_key_rotation <= now))
+    {
+      if (!rotate_ticket_keys_unlocked (now) && n_ticket_keys == 0)
+        {
+          G_UNLOCK (ticket_keys);
+          return -1;
+        }
+    }
+  if (!enc)
+    for (i = 0; i < n_ticket_keys; i++)
+      if (memcmp (ticket_keys[i].name, key_name, 16) == 0)
+        break;
+  if (i == n_ticket_keys)
+    {
+      G_UNLOCK (ticket_keys);
+      return 0;
+    }
+  key = ticket_keys[i];
+  G_UNLOCK (ticket_keys);
+
+  if (enc)
+    {
+      memcpy (key_name, key.name, 16);
+      if (RAND_bytes (iv, 16) <= 0)
+        return -1;
+      EVP_EncryptInit_ex (cipher_ctx, EVP_aes_128_cbc (), NULL, key.aes_key, iv);
+    }
+  else
+    EVP_DecryptInit_ex (cipher_ctx, EVP_aes_128_cbc (), NULL, key.aes_key, iv);
+  HMAC_Init_ex (hmac_ctx, key.hmac_key, 16, EVP_sha256 (), NULL);
+  return i == 0 ? 1 : 2;
+}
+
+/* Servers:  share the session cache and ticket keys
+   with all other streams using the same certificate. */
+static void
+ssl_ctx_setup_server_sessions (GskStreamSsl *ssl)
+{
+  SSL_CTX *ctx = ssl->ctx;
+  guint8 sid_ctx[SHA_DIGEST_LENGTH];
+  char *id = g_strdup_printf ("%s|%s",
+                              ssl->cert_file ? ssl->cert_file : "",
+                              ssl->key_file ? ssl->key_file : "");
+  guint cache_size, timeout, rotation;
+
+  G_LOCK (session_caches);
+  cache_size = server_session_cache_size;
+  timeout = server_session_timeout;
+  G_UNLOCK (session_caches);
+  G_LOCK (ticket_keys);
+  rotation = ticket_key_rotation;
+  G_UNLOCK (ticket_keys);
+
+  SHA1 ((unsigned char *) id, strlen (id), sid_ctx);
+  g_free (id);
+  SSL_CTX_set_session_id_context (ctx, sid_ctx, sizeof (sid_ctx));
+  SSL_CTX_set_timeout (ctx, timeout);
+
+  if (cache_size == 0)
+    SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_OFF);
+  else
+    {
+      SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER
+                                         | SSL_SESS_CACHE_NO_INTERNAL);
+      SSL_CTX_sess_set_new_cb (ctx, server_new_session_cb);
+      SSL_CTX_sess_set_get_cb (ctx, server_get_session_cb);
+      SSL_CTX_sess_set_remove_cb (ctx, server_remove_session_cb);
+    }
+
+  if (rotation == 0)
+    SSL_CTX_set_options (ctx, SSL_OP_NO_TICKET);
+  else
+    SSL_CTX_set_tlsext_ticket_key_cb (ctx, ticket_key_cb);
+}
+
+/* Clients:  remember each session the server issues.
+   Under TLS 1.3 this happens after the handshake,
+   when a session ticket arrives. */
+static int
+client_new_session_cb (SSL *ssl, SSL_SESSION *session)
+{
+  GskStreamSsl *stream_ssl = SSL_get_app_data (ssl);
+  store_session (peek_session_cache (TRUE),
+                 strlen (stream_ssl->session_key),
+                 (const guint8 *) stream_ssl->session_key,
+                 session);
+  return 0;             /* we did not keep a reference */
+}
+
+/* Clients:  offer the last session used with this session-key. */
+static void
+ssl_setup_client_session (GskStreamSsl *ssl)
+{
+  SSL_SESSION *session;
+  if (ssl->session_key == NULL)
+    return;
+  SSL_set_app_data (ssl->ssl, ssl);
+  SSL_CTX_set_session_cache_mode (ssl->ctx, SSL_SESS_CACHE_CLIENT
+                                          | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb (ssl->ctx, client_new_session_cb);
+  session = lookup_session (peek_session_cache (TRUE),
+                            strlen (ssl->session_key),
+                            (const guint8 *) ssl->session_key);
+  if (session != NULL)
+    {
+      SSL_set_session (ssl->ssl, session);
+      SSL_SESSION_free (session);
+    }
+}
+
+static void
+handshake_done (GskStreamSsl *stream_ssl)
+{
+  stream_ssl->doing_handshake = 0;
+  set_backend_flags_raw_to_underlying (stream_ssl);
+}
+
+/* Deal with the outcome of SSL_do_handshake().
+   err is the first error in the queue of the thread that ran it. */
+static gboolean
+handle_handshake_result (GskStreamSsl *stream_ssl,
+                         int           rv,
+                         int           error_code,
+                         gulong        err,
+                         GError      **error)
 {
-  int rv;
-  DEBUG (stream_ssl, ("do_handshake[client=%u]: start", stream_ssl->is_client));
-  rv = SSL_do_handshake (ssl);
   if (rv <= 0)
     {
-      int error_code = SSL_get_error (ssl, rv);
-      gulong l = ERR_peek_error();
       switch (error_code)
 	{
 	case SSL_ERROR_NONE:
-	  stream_ssl->doing_handshake = 0;
-	  set_backend_flags_raw_to_underlying (stream_ssl);
+	  handshake_done (stream_ssl);
 	  //g_message ("DONE HANDSHAKE (is-client=%u)", stream_ssl->is_client);
 	  break;
 	case SSL_ERROR_SYSCALL:
@@ -131,19 +406,263 @@ do_handshake (GskStreamSsl *stream_ssl, SSL* ssl, GError **error)
 			 GSK_G_ERROR_DOMAIN,
 			 GSK_ERROR_BAD_FORMAT,
 			 _("error doing-handshake on SSL socket: %s: %s [code=%08lx (%lu)] [rv=%d]"),
-			 ERR_func_error_string(l),
-			 ERR_reason_error_string(l),
-			 l, l, error_code);
+			 ERR_func_error_string(err),
+			 ERR_reason_error_string(err),
+			 err, err, error_code);
 	    return FALSE;
 	  }
 	}
     }
   else
+    handshake_done (stream_ssl);
+  return TRUE;
+}
+
+/* --- handshake offloading --- */
+/* The handshake's public-key operations may be run in a thread-pool,
+   so that a burst of new connections does not stall the established
+   ones.  While a step runs, the SSL's BIO is detached from the backend
+   (see gsk_openssl_bio_stream_detach()) and the stream leaves its SSL
+   object alone.  At most max_handshakes_running steps are in the pool;
+   the other streams wait their turn in waiting_handshakes,
+   and while any are waiting, GskStreamListenerSsl stops accepting.
+
+   All of this state belongs to the main thread. */
+static GskThreadPool *handshake_pool = NULL;
+static gboolean offload_handshakes = FALSE;
+static guint max_handshakes_running = 0;
+static guint n_handshakes_running = 0;
+static GQueue *waiting_handshakes = NULL;       /* of GskStreamSsl, ref'd */
+static GSList *drained_notifies = NULL;         /* of DrainedNotify */
+
+typedef struct _DrainedNotify DrainedNotify;
+struct _DrainedNotify
+{
+  GDestroyNotify func;
+  gpointer data;
+};
+
+typedef struct _HandshakeStep HandshakeStep;
+struct _HandshakeStep
+{
+  GskStreamSsl *stream_ssl;
+  SSL *ssl;
+
+  /* set by the worker */
+  int rv;
+  int error_code;
+  gulong err;
+};
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* older OpenSSLs must be given locks before use from several threads */
+static GMutex **openssl_locks = NULL;
+
+static void
+openssl_locking_callback (int mode, int n, const char *file, int line)
+{
+  if (mode & CRYPTO_LOCK)
+    g_mutex_lock (openssl_locks[n]);
+  else
+    g_mutex_unlock (openssl_locks[n]);
+}
+
+static unsigned long
+openssl_thread_id_callback (void)
+{
+  return (unsigned long) g_thread_self ();
+}
+
+static void
+setup_openssl_threads (void)
+{
+  int i, n = CRYPTO_num_locks ();
+  if (openssl_locks != NULL || CRYPTO_get_locking_callback () != NULL)
+    return;
+  openssl_locks = g_new (GMutex *, n);
+  for (i = 0; i < n; i++)
+    openssl_locks[i] = g_mutex_new ();
+  CRYPTO_set_id_callback (openssl_thread_id_callback);
+  CRYPTO_set_locking_callback (openssl_locking_callback);
+}
+#else
+#define setup_openssl_threads()
+#endif
+
+static void offload_handshake_step (GskStreamSsl *stream_ssl);
+
+static void
+notify_handshakes_drained (void)
+{
+  GSList *list = drained_notifies;
+  drained_notifies = NULL;
+  while (list != NULL)
     {
-      stream_ssl->doing_handshake = 0;
-      set_backend_flags_raw_to_underlying (stream_ssl);
+      DrainedNotify *notify = list->data;
+      list = g_slist_delete_link (list, list);
+      (*notify->func) (notify->data);
+      g_free (notify);
     }
-  return TRUE;
+}
+
+static void
+start_waiting_handshakes (void)
+{
+  while (n_handshakes_running < max_handshakes_running
+      && !g_queue_is_empty (waiting_handshakes))
+    {
+      GskStreamSsl *stream_ssl = g_queue_pop_head (waiting_handshakes);
+      stream_ssl->handshake_waiting = 0;
+      if (stream_ssl->doing_handshake
+       && stream_ssl->state == GSK_STREAM_SSL_STATE_NORMAL)
+        offload_handshake_step (stream_ssl);
+      g_object_unref (stream_ssl);
+    }
+  if (g_queue_is_empty (waiting_handshakes))
+    notify_handshakes_drained ();
+}
+
+static gpointer
+run_handshake_step (gpointer data)
+{
+  HandshakeStep *step = data;
+  step->rv = SSL_do_handshake (step->ssl);
+  step->error_code = step->rv > 0 ? SSL_ERROR_NONE
+                                  : SSL_get_error (step->ssl, step->rv);
+  step->err = ERR_get_error ();
+  ERR_clear_error ();
+  return step;
+}
+
+static gboolean gsk_stream_ssl_shutdown_both (GskStreamSsl *ssl,
+                                              GError      **error);
+
+static void
+handle_handshake_step_done (gpointer run_data,
+                            gpointer result_data)
+{
+  HandshakeStep *step = run_data;
+  GskStreamSsl *stream_ssl = step->stream_ssl;
+  GError *error = NULL;
+
+  gsk_openssl_bio_stream_reattach (SSL_get_rbio (step->ssl));
+  stream_ssl->handshake_offloaded = 0;
+  n_handshakes_running--;
+
+  if (!handle_handshake_result (stream_ssl, step->rv, step->error_code,
+                                step->err, &error))
+    gsk_io_set_gerror (GSK_IO (stream_ssl), GSK_IO_ERROR_INIT, error);
+  else if (stream_ssl->shutdown_after_handshake)
+    {
+      stream_ssl->shutdown_after_handshake = 0;
+      gsk_stream_ssl_shutdown_both (stream_ssl, &error);
+      if (error)
+        gsk_io_set_gerror (GSK_IO (stream_ssl), GSK_IO_ERROR_SHUTDOWN_READ, error);
+    }
+  g_object_unref (stream_ssl);
+  g_free (step);
+
+  start_waiting_handshakes ();
+}
+
+static void
+offload_handshake_step (GskStreamSsl *stream_ssl)
+{
+  HandshakeStep *step;
+
+  /* the backend is ignored until the step is done */
+  set_backend_flags_raw (stream_ssl, FALSE, FALSE);
+
+  if (n_handshakes_running >= max_handshakes_running)
+    {
+      stream_ssl->handshake_waiting = 1;
+      g_queue_push_tail (waiting_handshakes, g_object_ref (stream_ssl));
+      return;
+    }
+
+  step = g_new (HandshakeStep, 1);
+  step->stream_ssl = g_object_ref (stream_ssl);
+  step->ssl = stream_ssl->ssl;
+  stream_ssl->handshake_offloaded = 1;
+  n_handshakes_running++;
+  gsk_openssl_bio_stream_detach (SSL_get_rbio (step->ssl));
+  gsk_thread_pool_push (handshake_pool,
+                        run_handshake_step,
+                        handle_handshake_step_done,
+                        step,
+                        NULL);
+}
+
+/* Used by GskStreamListenerSsl to stop accepting
+   while handshakes are waiting for the pool. */
+gboolean
+_gsk_stream_ssl_handshakes_backlogged (void)
+{
+  return waiting_handshakes != NULL && !g_queue_is_empty (waiting_handshakes);
+}
+
+void
+_gsk_stream_ssl_notify_handshakes_drained (GDestroyNotify func,
+                                           gpointer       data)
+{
+  DrainedNotify *notify = g_new (DrainedNotify, 1);
+  notify->func = func;
+  notify->data = data;
+  drained_notifies = g_slist_prepend (drained_notifies, notify);
+}
+
+/**
+ * gsk_stream_ssl_set_handshake_offload:
+ * @max_threads: the number of threads to run handshakes in,
+ * or 0 to run them in the main-loop's thread.
+ * @max_running: the most handshake steps to give the threads at once;
+ * other handshakes wait, and SSL listeners stop accepting
+ * connections until they have started.
+ *
+ * Run the expensive steps of SSL handshakes in a thread-pool,
+ * so that many new connections do not delay established ones.
+ * Results are delivered to the default main-loop, which must
+ * be the one the SSL streams use.
+ *
+ * The number of threads is fixed the first time this is enabled;
+ * it may be disabled and re-enabled later.
+ */
+void
+gsk_stream_ssl_set_handshake_offload (guint max_threads,
+                                      guint max_running)
+{
+  offload_handshakes = (max_threads > 0);
+  max_handshakes_running = MAX (max_running, 1);
+  if (offload_handshakes && handshake_pool == NULL)
+    {
+      setup_openssl_threads ();
+      waiting_handshakes = g_queue_new ();
+      handshake_pool = gsk_thread_pool_new (gsk_main_loop_default (), max_threads);
+    }
+  if (handshake_pool != NULL)
+    {
+      if (!offload_handshakes)
+        max_handshakes_running = G_MAXUINT;
+      start_waiting_handshakes ();
+    }
+}
+
+static gboolean
+do_handshake (GskStreamSsl *stream_ssl, SSL* ssl, GError **error)
+{
+  int rv;
+  if (stream_ssl->handshake_offloaded || stream_ssl->handshake_waiting)
+    return TRUE;
+  if (offload_handshakes)
+    {
+      offload_handshake_step (stream_ssl);
+      return TRUE;
+    }
+  DEBUG (stream_ssl, ("do_handshake[client=%u]: start", stream_ssl->is_client));
+  rv = SSL_do_handshake (ssl);
+  return handle_handshake_result (stream_ssl, rv,
+                                  rv > 0 ? SSL_ERROR_NONE : SSL_get_error (ssl, rv),
+                                  ERR_peek_error (), error);
 }
 
 static inline void
@@ -198,6 +717,18 @@ gsk_stream_ssl_shutdown_both (GskStreamSsl *ssl,
         gsk_io_shutdown (GSK_IO (ssl->backend), NULL);
       return TRUE;
     }
+  if (ssl->handshake_offloaded)
+    {
+      /* the SSL object is in use:  finish up when it's returned */
+      ssl->shutdown_after_handshake = 1;
+      return FALSE;
+    }
+  if (ssl->handshake_waiting)
+    {
+      ssl->handshake_waiting = 0;
+      g_queue_remove (waiting_handshakes, ssl);
+      g_object_unref (ssl);
+    }
   rv = SSL_shutdown (ssl->ssl);
   if (rv == 0)
     {
@@ -281,52 +812,16 @@ gsk_stream_ssl_shutdown_write (GskIO      *io,
   return FALSE;
 }
 
-static guint
-gsk_stream_ssl_raw_read       (GskStream     *stream,
-			       gpointer       data,
-			       guint          length,
-			       GError       **error)
-{
-  GskStreamSsl *ssl = GSK_STREAM_SSL (stream);
-  guint read_length;
-  int ssl_read_rv;
-  if (length == 0)
-    return 0;
-  if (ssl->doing_handshake)
-    return 0;
+/* The most plaintext a TLS record holds.  Writes are cut into
+   records of this size, so small writes are coalesced up to it. */
+#define MAX_RECORD_PLAINTEXT    16384
 
-process_has_read_buffer:
-  if (ssl->read_buffer_length > 0)
-    {
-      guint rv = MIN (ssl->read_buffer_length, length);
-      g_assert (rv > 0);
-      memcpy (data, ssl->read_buffer, rv);
-      ssl->read_buffer_length -= rv;
-      if (ssl->read_buffer_length > 0)
-	g_memmove (ssl->read_buffer, ssl->read_buffer + rv, ssl->read_buffer_length);
-      return rv;
-    }
-
-  /* Make sure our buffer is long enough to accomodate the
-     amount of data requested.  */
-  if (!ssl->reread_length && ssl->read_buffer_alloc < length)
-    {
-      if (ssl->read_buffer_alloc == 0)
-	ssl->read_buffer_alloc = 4096;
-      while (ssl->read_buffer_alloc < length)
-	ssl->read_buffer_alloc *= 2;
-      ssl->read_buffer = g_realloc (ssl->read_buffer, ssl->read_buffer_alloc);
-    }
-
-  /* Do underlying read. */
-  read_length = ssl->reread_length ? ssl->reread_length : length;
-  ssl_read_rv = SSL_read (ssl->ssl, ssl->read_buffer, read_length);
-  if (ssl_read_rv > 0)
-    {
-      ssl->reread_length = 0;
-      ssl->read_buffer_length = ssl_read_rv;
-      goto process_has_read_buffer;
-    }
+/* Handle an SSL_read() that returned no data. */
+static void
+handle_read_failure (GskStreamSsl *ssl,
+                     int           ssl_read_rv,
+                     GError      **error)
+{
   if (ssl_read_rv == 0)
     {
       if (!gsk_io_get_is_readable (ssl->backend)
@@ -345,7 +840,7 @@ process_has_read_buffer:
 #endif
         }
     }
-  else if (ssl_read_rv < 0)
+  else
     {
       int error_code = SSL_get_error (ssl->ssl, ssl_read_rv);
       switch (error_code)
@@ -383,19 +878,85 @@ process_has_read_buffer:
 	}
       maybe_update_backend_poll_state (ssl);
     }
+}
+
+static guint
+gsk_stream_ssl_raw_read       (GskStream     *stream,
+			       gpointer       data,
+			       guint          length,
+			       GError       **error)
+{
+  GskStreamSsl *ssl = GSK_STREAM_SSL (stream);
+  int ssl_read_rv;
+  if (length == 0)
+    return 0;
+  if (ssl->doing_handshake)
+    return 0;
+
+  /* SSL_read() may be retried with any buffer,
+     so decrypt straight into the caller's. */
+  ssl_read_rv = SSL_read (ssl->ssl, data, MIN (length, G_MAXINT));
+  if (ssl_read_rv > 0)
+    return ssl_read_rv;
+  handle_read_failure (ssl, ssl_read_rv, error);
   return 0;
 }
 
 static guint
-try_writing_the_write_buffer (GskStreamSsl *ssl, GError **error)
+gsk_stream_ssl_raw_read_buffer(GskStream     *stream,
+			       GskBuffer     *buffer,
+			       GError       **error)
+{
+  GskStreamSsl *ssl = GSK_STREAM_SSL (stream);
+  guint total = 0;
+  if (ssl->doing_handshake)
+    return 0;
+
+  /* Decrypt into the end of the buffer, a record at a time,
+     until there's no complete record left. */
+  for (;;)
+    {
+      guint length = MAX_RECORD_PLAINTEXT;
+      gpointer area = gsk_buffer_begin_append (buffer, &length);
+      int ssl_read_rv = SSL_read (ssl->ssl, area, length);
+      if (ssl_read_rv > 0)
+        {
+          gsk_buffer_end_append (buffer, ssl_read_rv);
+          total += ssl_read_rv;
+          continue;
+        }
+      gsk_buffer_end_append (buffer, 0);
+
+      /* after some data, leave any error or shutdown
+         to the next read, but notice what SSL is waiting for */
+      if (total == 0)
+        handle_read_failure (ssl, ssl_read_rv, error);
+      else if (ssl_read_rv < 0)
+        switch (SSL_get_error (ssl->ssl, ssl_read_rv))
+          {
+          case SSL_ERROR_WANT_READ:
+          case SSL_ERROR_WANT_WRITE:
+            handle_read_failure (ssl, ssl_read_rv, error);
+            break;
+          }
+      return total;
+    }
+}
+
+/* Returns the number of bytes written, or 0 if the write
+   must be retried with the same length, or on error. */
+static guint
+do_ssl_write (GskStreamSsl *ssl,
+              gconstpointer data,
+              guint         length,
+              GError      **error)
 {
   int ssl_write_rv;
 
-  ssl_write_rv = SSL_write (ssl->ssl, ssl->write_buffer, ssl->write_buffer_length);
+  ssl_write_rv = SSL_write (ssl->ssl, data, length);
   if (ssl_write_rv > 0)
     {
-      ssl->write_buffer_length -= ssl_write_rv;
-      memmove (ssl->write_buffer, ssl->write_buffer + ssl_write_rv, ssl->write_buffer_length);
+      ssl->rewrite_length = 0;
       return ssl_write_rv;
     }
   if (ssl_write_rv == 0)
@@ -415,9 +976,11 @@ try_writing_the_write_buffer (GskStreamSsl *ssl, GError **error)
 	{
 	case SSL_ERROR_WANT_READ:
 	  ssl->read_needed_to_write = 1;
+	  ssl->rewrite_length = length;
 	  break;
 	case SSL_ERROR_WANT_WRITE:
 	  ssl->read_needed_to_write = 0;
+	  ssl->rewrite_length = length;
 	  break;
 	case SSL_ERROR_SYSCALL:
 	  g_set_error (error,
@@ -461,44 +1024,78 @@ gsk_stream_ssl_raw_write      (GskStream     *stream,
     return 0;
   if (ssl->doing_handshake)
     return 0;
+  length = MIN (length, G_MAXINT);
+
+  /* a retried write must repeat the length of the one that failed
+     (the data is still at the front of the caller's, but may have
+     moved:  see SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER) */
+  if (ssl->rewrite_length > 0 && ssl->rewrite_length <= length)
+    length = ssl->rewrite_length;
+  return do_ssl_write (ssl, data, length, error);
+}
 
-  if (ssl->write_buffer_length > 0)
-    {
-      try_writing_the_write_buffer (ssl, error);
-      return 0;
-    }
+static guint
+gsk_stream_ssl_raw_write_buffer (GskStream    *stream,
+				 GskBuffer    *buffer,
+				 GError      **error)
+{
+  GskStreamSsl *ssl = GSK_STREAM_SSL (stream);
+  guint total = 0;
+  if (ssl->doing_handshake)
+    return 0;
 
-  /* Make sure our buffer is long enough to accomodate the
-     amount of data requested.  */
-  if (ssl->write_buffer_alloc < length)
+  while (buffer->size > 0)
     {
-      if (ssl->write_buffer_alloc == 0)
-	ssl->write_buffer_alloc = 4096;
-      while (ssl->write_buffer_alloc < length)
-	ssl->write_buffer_alloc *= 2;
-      ssl->write_buffer = g_realloc (ssl->write_buffer, ssl->write_buffer_alloc);
-    }
+      GskBufferFragment *frag = buffer->first_frag;
+      guint8 record[MAX_RECORD_PLAINTEXT];
+      guint8 *copy = NULL;
+      const guint8 *data;
+      guint length, written;
 
-  /* Do underlying write. */
-  memcpy (ssl->write_buffer, data, length);
-  ssl->write_buffer_length = length;
-  length = try_writing_the_write_buffer (ssl, error);
-  if (*error)
-    {
-      ssl->write_buffer_length = 0;
-      return 0;
-    }
-  if (length > 0)
-    {
-      /* On partial success, just throw away the write buffer. */
-      ssl->write_buffer_length = 0;
-    }
-  else if (length == 0)
-    {
-      /* We will automatically retry this write. */
-      length = ssl->write_buffer_length;
+      if (ssl->rewrite_length > 0)
+        {
+          /* repeat the write that failed */
+          length = MIN (ssl->rewrite_length, buffer->size);
+        }
+      else if (frag->buf_length >= MAX_RECORD_PLAINTEXT
+            || frag->buf_length == buffer->size)
+        {
+          /* whole records, unless this is the end of the data */
+          length = frag->buf_length;
+          if (length < buffer->size)
+            length -= length % MAX_RECORD_PLAINTEXT;
+        }
+      else
+        length = MIN (buffer->size, MAX_RECORD_PLAINTEXT);
+
+      if (length <= frag->buf_length)
+        {
+          /* encrypt straight out of the fragment */
+          data = (const guint8 *) frag->buf + frag->buf_start;
+        }
+      else if (length <= MAX_RECORD_PLAINTEXT)
+        {
+          /* coalesce small fragments into a full record */
+          gsk_buffer_peek (buffer, record, length);
+          data = record;
+        }
+      else
+        {
+          /* repeating a longer write made by gsk_stream_ssl_raw_write(),
+             which may span several fragments */
+          copy = g_malloc (length);
+          gsk_buffer_peek (buffer, copy, length);
+          data = copy;
+        }
+
+      written = do_ssl_write (ssl, data, length, error);
+      g_free (copy);
+      if (written == 0)
+        break;
+      gsk_buffer_discard (buffer, written);
+      total += written;
     }
-  return length;
+  return total;
 }
 
 static void
@@ -520,16 +1117,14 @@ gsk_stream_ssl_finalize (GObject *object)
   if (ssl->ssl)
     SSL_free (ssl->ssl);
   SSL_CTX_free (ssl->ctx);
-  g_free (ssl->read_buffer);
-  g_free (ssl->write_buffer);
   g_free (ssl->cert_file);
   g_free (ssl->key_file);
   g_free (ssl->password);
+  g_free (ssl->session_key);
   (*parent_class->finalize) (object);
 }
 
 /* --- transport hooks --- */
-/* TODO: these should probably handle write_buffer/read_buffer themselves... */
 static gboolean
 backend_buffered_write_hook (GskStream    *backend,
 		     gpointer      data)
@@ -584,7 +1179,7 @@ backend_buffered_write_shutdown (GskStream    *backend,
 {
   GskStreamSsl *ssl = GSK_STREAM_SSL (data);
   g_return_val_if_fail (ssl->backend == backend, FALSE);
-  if (ssl->read_buffer_length == 0)
+  if (ssl->handshake_offloaded || SSL_pending (ssl->ssl) == 0)
     gsk_io_notify_read_shutdown (ssl);
   return FALSE;
 }
@@ -652,7 +1247,8 @@ static void
 gsk_stream_ssl_init (GskStreamSsl *stream_ssl)
 {
   SSL_CTX *ctx = SSL_CTX_new (SSLv23_method ());
-  SSL_CTX_set_mode (ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+  SSL_CTX_set_mode (ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                       | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
   stream_ssl->ctx = ctx;
   stream_ssl->state = GSK_STREAM_SSL_STATE_CONSTRUCTING;
 
@@ -770,6 +1366,9 @@ ssl_ctx_setup (GskStreamSsl *ssl)
       SSL_CTX_set_verify (ssl->ctx, verify_flags, verify_callback);
       SSL_CTX_set_verify_depth (ssl->ctx, 4);
     }
+
+  if (!ssl->is_client)
+    ssl_ctx_setup_server_sessions (ssl);
   return TRUE;
 }
 
@@ -784,6 +1383,8 @@ gsk_stream_ssl_constructor    (GType                  type,
   if (ssl_ctx_setup (ssl))
     {
       ssl->ssl = SSL_new (ssl->ctx);
+      if (ssl->is_client)
+        ssl_setup_client_session (ssl);
       gsk_stream_ssl_alloc_backend (ssl);
       ssl->state = GSK_STREAM_SSL_STATE_NORMAL;
     }
@@ -845,6 +1446,11 @@ gsk_stream_ssl_set_property           (GObject        *object,
 	g_assert (ssl->ssl == NULL);
 	ssl->is_client = g_value_get_boolean (value) ? 1 : 0;
 	break;
+      case PROP_SESSION_KEY:
+	arg = g_value_dup_string (value);
+	g_free (ssl->session_key);
+	ssl->session_key = arg;
+        break;
       default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	break;
@@ -870,6 +1476,9 @@ gsk_stream_ssl_get_property	      (GObject        *object,
       case PROP_IS_CLIENT:
 	g_value_set_boolean (value, ssl->is_client);
         break;
+      case PROP_SESSION_KEY:
+	g_value_set_string (value, ssl->session_key);
+        break;
       default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
 	break;
@@ -920,6 +1529,8 @@ gsk_stream_ssl_class_init (GskStreamSslClass *class)
   io_class->shutdown_write = gsk_stream_ssl_shutdown_write;
   stream_class->raw_read = gsk_stream_ssl_raw_read;
   stream_class->raw_write = gsk_stream_ssl_raw_write;
+  stream_class->raw_read_buffer = gsk_stream_ssl_raw_read_buffer;
+  stream_class->raw_write_buffer = gsk_stream_ssl_raw_write_buffer;
   object_class->constructor = gsk_stream_ssl_constructor;
   object_class->get_property = gsk_stream_ssl_get_property;
   object_class->set_property = gsk_stream_ssl_set_property;
@@ -958,6 +1569,13 @@ gsk_stream_ssl_class_init (GskStreamSslClass *class)
 			       NULL,
 			       G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY);
   g_object_class_install_property (object_class, PROP_PASSWORD, pspec);
+
+  pspec = g_param_spec_string ("session-key",
+			       _("Session Key"),
+			       _("clients with the same session-key try to resume each other's sessions"),
+			       NULL,
+			       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+  g_object_class_install_property (object_class, PROP_SESSION_KEY, pspec);
 }
 
 GType gsk_stream_ssl_get_type()
@@ -1110,10 +1728,12 @@ GskStream   *gsk_stream_ssl_new_server   (const char   *cert_file,
 }
 
 /**
- * gsk_stream_ssl_new_client:
+ * gsk_stream_ssl_new_client_with_session:
  * @cert_file: the PEM x509 certificate file.
  * @key_file: key file???
  * @password: password required by the certificate, or NULL.
+ * @session_key: key under which to remember the session for
+ * resumption, typically "host:port", or NULL.
  * @transport: optional transport layer (which will be connected
  * to the backend stream by bidirectionally).
  * @error: optional location in which to store a #GError.
@@ -1122,11 +1742,20 @@ GskStream   *gsk_stream_ssl_new_server   (const char   *cert_file,
  * This should be attached to a connecting or connected stream,
  * usually provided as the @transport argument.
  *
+ * If @session_key is given, the handshake tries to resume the last
+ * session negotiated under that key (by any stream in this process),
+ * and the new session is remembered for the next connection.
+ * A resumed session keeps the client authentication it was
+ * negotiated with, so streams using different certificates
+ * must use different keys.
+ *
  * returns: the new SSL stream, or NULL if an error occurs.
  */
-GskStream   *gsk_stream_ssl_new_client   (const char   *cert_file,
+GskStream   *gsk_stream_ssl_new_client_with_session
+                                         (const char   *cert_file,
 					  const char   *key_file,
 					  const char   *password,
+					  const char   *session_key,
 					  GskStream    *transport,
 					  GError      **error)
 {
@@ -1135,6 +1764,7 @@ GskStream   *gsk_stream_ssl_new_client   (const char   *cert_file,
 					   "password", password,
 				           "cert-file", cert_file,
 				           "key-file", key_file,
+				           "session-key", session_key,
 				           NULL);
   SSL *ssl;
   //GError *suberror = NULL;
@@ -1178,6 +1808,71 @@ GskStream   *gsk_stream_ssl_new_client   (const char   *cert_file,
   return GSK_STREAM (stream_ssl);
 }
 
+/**
+ * gsk_stream_ssl_new_client:
+ * @cert_file: the PEM x509 certificate file.
+ * @key_file: key file???
+ * @password: password required by the certificate, or NULL.
+ * @transport: optional transport layer (which will be connected
+ * to the backend stream by bidirectionally).
+ * @error: optional location in which to store a #GError.
+ *
+ * Create the client end of a SSL connection.
+ * This should be attached to a connecting or connected stream,
+ * usually provided as the @transport argument.
+ *
+ * returns: the new SSL stream, or NULL if an error occurs.
+ */
+GskStream   *gsk_stream_ssl_new_client   (const char   *cert_file,
+					  const char   *key_file,
+					  const char   *password,
+					  GskStream    *transport,
+					  GError      **error)
+{
+  return gsk_stream_ssl_new_client_with_session (cert_file, key_file, password,
+                                                 NULL, transport, error);
+}
+
+/**
+ * gsk_stream_ssl_set_server_session_cache:
+ * @max_sessions: the most sessions to remember, or 0 to disable
+ * session-id resumption.
+ * @timeout_seconds: how long a session may be resumed.
+ *
+ * Configure the session cache shared by all SSL servers
+ * in this process.  The timeout also bounds the lifetime of
+ * session tickets.  This affects servers created afterward.
+ */
+void
+gsk_stream_ssl_set_server_session_cache (guint max_sessions,
+                                         guint timeout_seconds)
+{
+  G_LOCK (session_caches);
+  server_session_cache_size = max_sessions;
+  server_session_timeout = timeout_seconds;
+  if (server_sessions != NULL)
+    gsk_ssl_session_cache_set_max_sessions (server_sessions, max_sessions);
+  G_UNLOCK (session_caches);
+}
+
+/**
+ * gsk_stream_ssl_set_ticket_key_rotation:
+ * @rotate_seconds: how often to make a new ticket key, or 0
+ * to disable session tickets.
+ *
+ * Configure session tickets for SSL servers created afterward.
+ * Tickets are encrypted with the newest key;  tickets
+ * made with the previous two keys are still accepted, but
+ * are replaced with new ones.
+ */
+void
+gsk_stream_ssl_set_ticket_key_rotation (guint rotate_seconds)
+{
+  G_LOCK (ticket_keys);
+  ticket_key_rotation = rotate_seconds;
+  G_UNLOCK (ticket_keys);
+}
+
 /**
  * gsk_stream_ssl_peek_backend:
  * @ssl: the stream to query.
@@ -59,16 +59,17 @@ struct _GskStreamSsl
      and this_writable==transport_poll_write. */
   guint          read_needed_to_write : 1;
   guint          write_needed_to_read : 1;
-  guint          reread_length;
-  guint          rewrite_length;
 
-  guint          read_buffer_alloc;
-  guint          write_buffer_alloc;
-  guint          read_buffer_length;
-  guint          write_buffer_length;
-  guint8        *read_buffer;
-  guint8        *write_buffer;
+  /* Is a handshake step running in (or waiting for) the
+     handshake thread-pool?  The SSL object is off-limits meanwhile. */
+  guint          handshake_offloaded : 1;
+  guint          handshake_waiting : 1;
+  guint          shutdown_after_handshake : 1;
 
+  /* If nonzero, an SSL_write() of this many bytes must be retried.
+     Plaintext is never buffered here:  unwritten data stays
+     with the caller, and reads decrypt into the caller's memory. */
+  guint          rewrite_length;
 
   GskStreamSslState state;
 
@@ -77,6 +78,7 @@ struct _GskStreamSsl
   char    *ca_dir;
   char    *cert_file;
   char    *key_file;
+  char    *session_key;         /* clients:  for resumption */
 
   GskStream     *backend;     /* buffered transport layer */
   GskStream     *transport;   /* raw transport layer */
@@ -93,8 +95,30 @@ GskStream   *gsk_stream_ssl_new_client   (const char   *cert_file,
 					  const char   *password,
 					  GskStream    *transport,
 					  GError      **error);
+GskStream   *gsk_stream_ssl_new_client_with_session
+                                         (const char   *cert_file,
+					  const char   *key_file,
+					  const char   *password,
+					  const char   *session_key,
+					  GskStream    *transport,
+					  GError      **error);
 GskStream   *gsk_stream_ssl_peek_backend (GskStreamSsl *ssl);
 
+/* Session resumption:  these affect streams created afterward. */
+void         gsk_stream_ssl_set_server_session_cache (guint max_sessions,
+                                                      guint timeout_seconds);
+void         gsk_stream_ssl_set_ticket_key_rotation  (guint rotate_seconds);
+
+/* Run handshakes in a thread-pool. */
+void         gsk_stream_ssl_set_handshake_offload    (guint max_threads,
+                                                      guint max_running);
+
+/*< private >*/
+gboolean     _gsk_stream_ssl_handshakes_backlogged   (void);
+void         _gsk_stream_ssl_notify_handshakes_drained
+                                                     (GDestroyNotify func,
+                                                      gpointer       data);
+
 
 G_END_DECLS
 
@@ -0,0 +1,238 @@
+#include "../gskmainloop.h"
+#include <stdlib.h>
+#include "../gskinit.h"
+
+/* Exercise the timing-wheel used for coarse timers:
+   timers must never run early, must run at most once per expiry,
+   and adjusting or removing them must work from anywhere. */
+
+typedef struct _TimerInfo TimerInfo;
+struct _TimerInfo
+{
+  GTimeVal earliest;
+  guint n_runs_left;
+  guint period;
+  GskSource *source;
+};
+
+#define NUM_TIMERS		5000
+#define MAX_RANDOM_EXPIRE	700
+
+static GskMainLoop *main_loop;
+static guint n_timers_alive = 0;
+static TimerInfo *infos[NUM_TIMERS];
+
+static void
+add_ms (GTimeVal *tv_inout, guint ms)
+{
+  tv_inout->tv_sec += ms / 1000;
+  tv_inout->tv_usec += (ms % 1000) * 1000;
+  if (tv_inout->tv_usec >= 1000 * 1000)
+    {
+      tv_inout->tv_usec -= 1000 * 1000;
+      tv_inout->tv_sec++;
+    }
+}
+
+static void
+set_earliest (TimerInfo *info, guint ms)
+{
+  info->earliest = main_loop->current_time;
+  add_ms (&info->earliest, ms);
+}
+
+static gboolean
+handle_timer (gpointer data)
+{
+  TimerInfo *info = data;
+  GTimeVal *now = &main_loop->current_time;
+  g_assert (now->tv_sec > info->earliest.tv_sec
+         || (now->tv_sec == info->earliest.tv_sec
+          && now->tv_usec >= info->earliest.tv_usec));
+  g_assert (info->n_runs_left > 0);
+  if (--(info->n_runs_left) == 0)
+    return FALSE;
+  /* periods are measured from the scheduled time, not the actual time */
+  add_ms (&info->earliest, info->period);
+  return TRUE;
+}
+
+static void
+destroy_timer (gpointer data)
+{
+  TimerInfo *info = data;
+  guint i;
+  for (i = 0; i < NUM_TIMERS; i++)
+    if (infos[i] == info)
+      infos[i] = NULL;
+  g_free (info);
+  n_timers_alive--;
+}
+
+/* --- timers beyond the range of the lowest level of the wheel --- */
+
+/* The wheel has 10ms ticks and 256 slots per level, so level 0
+   holds timers within 2.56 seconds, level 1 within about 11 minutes,
+   and level 2 within about 46 hours. */
+#define LEVEL_1_MILLIS          (256 * 10)
+#define LEVEL_2_MILLIS          (256 * 256 * 10)
+#define LEVEL_3_MILLIS          (256 * 256 * 256 * 10)
+
+typedef struct _OrderedTimer OrderedTimer;
+struct _OrderedTimer
+{
+  GTimeVal earliest;
+  guint expire;
+  gboolean ran;
+};
+
+static guint last_expire_run;
+static guint n_ordered_timers_run;
+
+/* timers whose expiries are a multiple of the tick
+   must run in order of expiry */
+static gboolean
+handle_ordered_timer (gpointer data)
+{
+  OrderedTimer *timer = data;
+  GTimeVal *now = &main_loop->current_time;
+  g_assert (now->tv_sec > timer->earliest.tv_sec
+         || (now->tv_sec == timer->earliest.tv_sec
+          && now->tv_usec >= timer->earliest.tv_usec));
+  g_assert (!timer->ran);
+  g_assert (timer->expire >= last_expire_run);
+  timer->ran = TRUE;
+  last_expire_run = timer->expire;
+  n_ordered_timers_run++;
+  return FALSE;
+}
+
+static void
+run_ordered_timers (guint n_timers, const guint *expires)
+{
+  OrderedTimer *timers = g_new0 (OrderedTimer, n_timers);
+  guint i;
+  last_expire_run = 0;
+  n_ordered_timers_run = 0;
+
+  /* add them in reverse order, so that the order of insertion
+     does not happen to give the order of expiry */
+  for (i = n_timers; i-- > 0; )
+    {
+      g_assert (expires[i] % 10 == 0);
+      timers[i].expire = expires[i];
+      timers[i].earliest = main_loop->current_time;
+      add_ms (&timers[i].earliest, expires[i]);
+      gsk_main_loop_add_timer (main_loop, handle_ordered_timer, timers + i,
+                               NULL, expires[i], -1);
+    }
+  while (n_ordered_timers_run < n_timers)
+    gsk_main_loop_run (main_loop, -1, NULL);
+  for (i = 0; i < n_timers; i++)
+    g_assert (timers[i].ran);
+  g_free (timers);
+}
+
+/* Timers in level 1 are cascaded down to level 0
+   as it wraps around:  this takes a few seconds. */
+static void
+test_level_1_timers (void)
+{
+  static const guint expires[] = {
+    100,
+    LEVEL_1_MILLIS - 10,
+    LEVEL_1_MILLIS,
+    LEVEL_1_MILLIS + 10,
+    LEVEL_1_MILLIS + 300,
+    LEVEL_1_MILLIS * 2 - 10,
+  };
+  main_loop = gsk_main_loop_new (GSK_MAIN_LOOP_COARSE_TIMERS);
+  run_ordered_timers (G_N_ELEMENTS (expires), expires);
+  g_object_unref (main_loop);
+}
+
+/* Timers in levels 2 and 3 would take minutes or days to run,
+   so pretend that the main-loop's timers were added two days ago:
+   the next iteration then has to cascade them all the way down. */
+static void
+test_far_timers (void)
+{
+  static const guint expires[] = {
+    10,
+    LEVEL_1_MILLIS + 10,
+    LEVEL_2_MILLIS - 10,
+    LEVEL_2_MILLIS,
+    LEVEL_2_MILLIS + 10,
+    LEVEL_2_MILLIS * 5,
+    LEVEL_3_MILLIS - 10,
+    LEVEL_3_MILLIS,
+    LEVEL_3_MILLIS + 10,
+    LEVEL_3_MILLIS + LEVEL_2_MILLIS + LEVEL_1_MILLIS,
+  };
+  main_loop = gsk_main_loop_new (GSK_MAIN_LOOP_COARSE_TIMERS);
+  main_loop->current_time.tv_sec -= 48 * 3600;
+  run_ordered_timers (G_N_ELEMENTS (expires), expires);
+  g_object_unref (main_loop);
+}
+
+int main (int argc, char **argv)
+{
+  guint i;
+  guint n_iterations = 0;
+
+  gsk_init_without_threads (&argc, &argv);
+  main_loop = gsk_main_loop_new (GSK_MAIN_LOOP_COARSE_TIMERS);
+  srand (1);
+
+  for (i = 0; i < NUM_TIMERS; i++)
+    {
+      TimerInfo *info = g_new (TimerInfo, 1);
+      guint expire = rand () % MAX_RANDOM_EXPIRE;
+      info->period = 1 + rand () % 100;
+      info->n_runs_left = 1 + rand () % 3;
+      set_earliest (info, expire);
+      info->source = gsk_main_loop_add_timer (main_loop, handle_timer, info,
+                                              destroy_timer,
+                                              expire, info->period);
+      infos[i] = info;
+      n_timers_alive++;
+    }
+
+  /* a few precise timers mixed in */
+  for (i = 0; i < NUM_TIMERS; i += 97)
+    if (infos[i] != NULL)
+      gsk_source_set_timer_coarse (infos[i]->source, FALSE);
+
+  while (n_timers_alive > 0)
+    {
+      gsk_main_loop_run (main_loop, -1, NULL);
+      n_iterations++;
+
+      /* push back some timers, like an idle-timeout would be */
+      for (i = 0; i < 50; i++)
+        {
+          TimerInfo *info = infos[rand () % NUM_TIMERS];
+          if (info == NULL)
+            continue;
+          switch (rand () % 4)
+            {
+            case 0:
+              gsk_source_remove (info->source);
+              break;
+            default:
+              {
+                guint expire = rand () % MAX_RANDOM_EXPIRE;
+                set_earliest (info, expire);
+                gsk_source_adjust_timer (info->source, expire, info->period);
+              }
+              break;
+            }
+        }
+    }
+  g_assert (main_loop->num_sources == 0);
+  g_object_unref (main_loop);
+
+  test_level_1_timers ();
+  test_far_timers ();
+  return 0;
+}
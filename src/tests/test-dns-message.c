@@ -0,0 +1,135 @@
+#include "../gskdns.h"
+#include "../gskinit.h"
+#include <string.h>
+
+static GskDnsMessage *
+round_trip (GskDnsMessage *message)
+{
+  GskPacket *packet = gsk_dns_message_to_packet (message);
+  guint used = 0;
+  GskDnsMessage *rv = gsk_dns_message_parse_data (packet->data, packet->len, &used);
+  g_assert (rv != NULL);
+  g_assert (used == packet->len);
+  gsk_packet_unref (packet);
+  return rv;
+}
+
+int main (int argc, char **argv)
+{
+  static const guint8 one_two_three_four[4] = {1,2,3,4};
+  GskDnsMessage *message, *parsed;
+  GskDnsQuestion *question;
+  GskDnsResourceRecord *rr;
+  GskPacket *packet;
+  guint8 bad[64];
+  guint len;
+  gsk_init_without_threads (&argc, &argv);
+
+  message = gsk_dns_message_new (0x1234, FALSE);
+  message->recursion_available = 1;
+  gsk_dns_message_append_question (message,
+                 gsk_dns_question_new ("www.example.com", GSK_DNS_RR_HOST_ADDRESS,
+                                       GSK_DNS_CLASS_INTERNET, message));
+  gsk_dns_message_append_answer (message,
+                 gsk_dns_rr_new_cname ("www.example.com", 300, "web.example.com", message));
+  gsk_dns_message_append_answer (message,
+                 gsk_dns_rr_new_a ("web.example.com", 60, one_two_three_four, message));
+  gsk_dns_message_append_auth (message,
+                 gsk_dns_rr_new_soa ("example.com", 3600, "ns.example.com",
+                                     "hostmaster.example.com", 7, 100, 200, 300, 400,
+                                     message));
+  gsk_dns_message_append_addl (message,
+                 gsk_dns_rr_new_mx ("example.com", 3600, 10, "mail.example.com", message));
+  gsk_dns_message_append_addl (message,
+                 gsk_dns_rr_new_txt ("example.com", 3600, "hello world", message));
+
+  parsed = round_trip (message);
+  g_assert (parsed->id == 0x1234);
+  g_assert (!parsed->is_query);
+  g_assert (parsed->recursion_available);
+  g_assert (g_slist_length (parsed->questions) == 1);
+  g_assert (g_slist_length (parsed->answers) == 2);
+  g_assert (g_slist_length (parsed->authority) == 1);
+  g_assert (g_slist_length (parsed->additional) == 2);
+
+  question = parsed->questions->data;
+  g_assert (strcmp (question->query_name, "www.example.com") == 0);
+  g_assert (question->query_type == GSK_DNS_RR_HOST_ADDRESS);
+
+  rr = parsed->answers->data;
+  g_assert (rr->type == GSK_DNS_RR_CANONICAL_NAME);
+  g_assert (rr->time_to_live == 300);
+  g_assert (strcmp (rr->rdata.domain_name, "web.example.com") == 0);
+  /* names are interned */
+  g_assert (rr->owner == question->query_name);
+  rr = parsed->answers->next->data;
+  g_assert (rr->type == GSK_DNS_RR_HOST_ADDRESS);
+  g_assert (strcmp (rr->owner, "web.example.com") == 0);
+  g_assert (memcmp (rr->rdata.a.ip_address, one_two_three_four, 4) == 0);
+
+  rr = parsed->authority->data;
+  g_assert (rr->type == GSK_DNS_RR_START_OF_AUTHORITY);
+  g_assert (strcmp (rr->rdata.soa.mname, "ns.example.com") == 0);
+  g_assert (strcmp (rr->rdata.soa.rname, "hostmaster.example.com") == 0);
+  g_assert (rr->rdata.soa.serial == 7);
+  g_assert (rr->rdata.soa.minimum_time == 400);
+
+  rr = parsed->additional->data;
+  g_assert (rr->type == GSK_DNS_RR_MAIL_EXCHANGE);
+  g_assert (rr->rdata.mx.preference_value == 10);
+  g_assert (strcmp (rr->rdata.mx.mail_exchange_host_name, "mail.example.com") == 0);
+  rr = parsed->additional->next->data;
+  g_assert (rr->type == GSK_DNS_RR_TEXT);
+  g_assert (strcmp (rr->rdata.txt, "hello world") == 0);
+
+  /* records from the packet can be removed like any others */
+  rr = parsed->answers->data;
+  gsk_dns_message_remove_answer (parsed, rr);
+  g_assert (g_slist_length (parsed->answers) == 1);
+  gsk_dns_message_unref (parsed);
+
+  /* the result should compress well:  "example.com" only appears once */
+  packet = gsk_dns_message_to_packet (message);
+  for (len = 0; len + 11 <= packet->len; len++)
+    if (memcmp ((guint8 *) packet->data + len, "\7example\3com", 11) == 0)
+      break;
+  g_assert (len + 11 <= packet->len);
+  for (len++; len + 11 <= packet->len; len++)
+    g_assert (memcmp ((guint8 *) packet->data + len, "\7example\3com", 11) != 0);
+
+  /* truncated messages */
+  for (len = 0; len < packet->len; len++)
+    {
+      parsed = gsk_dns_message_parse_data (packet->data, len, NULL);
+      if (parsed != NULL)
+        gsk_dns_message_unref (parsed);
+    }
+  gsk_packet_unref (packet);
+  gsk_dns_message_unref (message);
+
+  /* a compression pointer to itself */
+  memset (bad, 0, sizeof (bad));
+  bad[5] = 1;                           /* one question */
+  bad[12] = 0xc0;
+  bad[13] = 12;
+  g_assert (gsk_dns_message_parse_data (bad, 18, NULL) == NULL);
+
+  /* compression pointers into the header */
+  memset (bad, 0, sizeof (bad));
+  bad[5] = 1;                           /* one question */
+  bad[12] = 1;                          /* "a" ... */
+  bad[13] = 'a';
+  bad[14] = 0xc0;                       /* ... followed by a pointer */
+  bad[15] = 0;
+  g_assert (gsk_dns_message_parse_data (bad, 20, NULL) == NULL);
+  bad[15] = 5;
+  g_assert (gsk_dns_message_parse_data (bad, 20, NULL) == NULL);
+
+  /* more records than could fit */
+  memset (bad, 0, sizeof (bad));
+  bad[6] = 0xff;
+  bad[7] = 0xff;
+  g_assert (gsk_dns_message_parse_data (bad, sizeof (bad), NULL) == NULL);
+
+  return 0;
+}
@@ -2,6 +2,164 @@
 #include <time.h>
 #include <string.h>
 
+static gboolean
+has_address (GskDnsRRCache *rr_cache,
+             const char    *name,
+             const guint8  *ip_address)
+{
+  GskDnsResourceRecord *found;
+  gboolean rv;
+  found = gsk_dns_rr_cache_lookup_one (rr_cache, name,
+                                       GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET,
+                                       GSK_DNS_RR_CACHE_LOOKUP_LOCK);
+  if (found == NULL)
+    return FALSE;
+  rv = memcmp (found->rdata.a.ip_address, ip_address, 4) == 0;
+  gsk_dns_rr_cache_unlock (rr_cache, found);
+  return rv;
+}
+
+/* The expiry wheel has one bucket per second for 1024 seconds:
+   records which live longer must survive being passed over. */
+static void
+test_long_ttl (gulong cur_time)
+{
+  GskDnsRRCache *rr_cache = gsk_dns_rr_cache_new (1024 * 1024, 1024);
+  GskDnsMessage *allocator = gsk_dns_message_new (0, FALSE);
+  guint8 ip_address[4] = {5,6,7,8};
+  GskDnsResourceRecord *rr;
+  gulong t;
+
+  rr = gsk_dns_rr_new_a ("long.example", 3000, ip_address, allocator);
+  gsk_dns_rr_cache_insert (rr_cache, rr, TRUE, cur_time);
+  rr = gsk_dns_rr_new_a ("short.example", 10, ip_address, allocator);
+  gsk_dns_rr_cache_insert (rr_cache, rr, TRUE, cur_time);
+  gsk_dns_message_unref (allocator);
+
+  /* a little more than one revolution, a few seconds at a time */
+  for (t = cur_time; t <= cur_time + 1100; t += 3)
+    gsk_dns_rr_cache_flush (rr_cache, t);
+  g_assert (has_address (rr_cache, "long.example", ip_address));
+  g_assert (!has_address (rr_cache, "short.example", ip_address));
+
+  /* and more than two revolutions at once */
+  gsk_dns_rr_cache_flush (rr_cache, cur_time + 2999);
+  g_assert (has_address (rr_cache, "long.example", ip_address));
+  gsk_dns_rr_cache_flush (rr_cache, cur_time + 3000);
+  g_assert (!has_address (rr_cache, "long.example", ip_address));
+  gsk_dns_rr_cache_unref (rr_cache);
+}
+
+/* --- a cache shared between threads --- */
+#define N_THREADS       4
+#define N_SHARED_NAMES  64
+#define N_ITERATIONS    5000
+
+static GskDnsRRCache *shared_cache;
+
+/* every thread inserts the same address for a name,
+   so a lookup may miss but must never find anything else */
+static void
+shared_name (guint index, char *name, guint8 *ip_address)
+{
+  g_snprintf (name, 64, "shared%u.example", index);
+  ip_address[0] = 10;
+  ip_address[1] = 0;
+  ip_address[2] = index / 256;
+  ip_address[3] = index % 256;
+}
+
+static gpointer
+run_shared_cache_thread (gpointer data)
+{
+  guint thread_index = GPOINTER_TO_UINT (data);
+  GskDnsMessage *allocator = gsk_dns_message_new (0, FALSE);
+  gulong cur_time = time (NULL);
+  guint i;
+  for (i = 0; i < N_ITERATIONS; i++)
+    {
+      char name[64];
+      guint8 ip_address[4];
+      shared_name ((i * 7 + thread_index) % N_SHARED_NAMES, name, ip_address);
+      if (i % 3 == 0)
+        {
+          GskDnsResourceRecord *rr;
+          rr = gsk_dns_rr_new_a (name, 100 + i % 50, ip_address, allocator);
+          gsk_dns_rr_cache_insert (shared_cache, rr, TRUE, cur_time);
+        }
+      else
+        {
+          GskDnsResourceRecord *found;
+          found = gsk_dns_rr_cache_lookup_one (shared_cache, name,
+                                               GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET,
+                                               GSK_DNS_RR_CACHE_LOOKUP_LOCK);
+          if (found != NULL)
+            {
+              if (memcmp (found->rdata.a.ip_address, ip_address, 4) != 0)
+                g_error ("thread %u: wrong address for %s", thread_index, name);
+              gsk_dns_rr_cache_unlock (shared_cache, found);
+            }
+        }
+      if (i % 500 == 0)
+        gsk_dns_rr_cache_flush (shared_cache, cur_time + i / 500);
+    }
+  gsk_dns_message_unref (allocator);
+  return NULL;
+}
+
+/* Phases of short and long names in a small cache:
+   the slabs fill up with one size, and later records
+   must come from the heap instead. */
+static void
+test_size_churn (gulong cur_time)
+{
+  GskDnsRRCache *rr_cache = gsk_dns_rr_cache_new (4096, 1000);
+  GskDnsMessage *allocator = gsk_dns_message_new (0, FALSE);
+  guint8 addr[4] = {10,0,0,1};
+  char name[256];
+  guint phase, i;
+  for (phase = 0; phase < 6; phase++)
+    for (i = 0; i < 200; i++)
+      {
+        GskDnsResourceRecord *rr;
+        if (phase % 2 == 0)
+          g_snprintf (name, sizeof (name), "h%u.%u", phase, i);
+        else
+          g_snprintf (name, sizeof (name),
+                      "a-rather-long-host-name-number-%u-in-phase-%u"
+                      ".somewhere.in.a.deeply.nested.example.domain",
+                      i, phase);
+        rr = gsk_dns_rr_new_a (name, 1000, addr, allocator);
+        gsk_dns_rr_cache_insert (rr_cache, rr, TRUE, cur_time);
+        g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, name,
+                                               GSK_DNS_RR_HOST_ADDRESS,
+                                               GSK_DNS_CLASS_INTERNET, 0) != NULL);
+      }
+  gsk_dns_message_unref (allocator);
+  gsk_dns_rr_cache_unref (rr_cache);
+}
+
+/* Several threads inserting, looking up and flushing at once,
+   with more names than there is room for. */
+static void
+test_shared (void)
+{
+  GThread *threads[N_THREADS];
+  guint i;
+  shared_cache = gsk_dns_rr_cache_new_shared (1024 * 1024, N_SHARED_NAMES / 2, 4);
+  for (i = 0; i < N_THREADS; i++)
+    {
+      GError *error = NULL;
+      threads[i] = g_thread_create (run_shared_cache_thread,
+                                    GUINT_TO_POINTER (i), TRUE, &error);
+      if (threads[i] == NULL)
+        g_error ("error creating thread: %s", error->message);
+    }
+  for (i = 0; i < N_THREADS; i++)
+    g_thread_join (threads[i]);
+  gsk_dns_rr_cache_unref (shared_cache);
+}
+
 int main (int argc, char **argv)
 {
   GskDnsRRCache *rr_cache;
@@ -12,7 +170,7 @@ int main (int argc, char **argv)
   gulong cur_time = time(NULL);
   char *err_msg = NULL;
   guint8 one_two_three_four[4] = {1,2,3,4};
-  gsk_init_without_threads (&argc, &argv);
+  gsk_init (&argc, &argv, NULL);
 
   rr_cache = gsk_dns_rr_cache_new (1024 * 1024, 1024);
 
@@ -146,6 +304,45 @@ int main (int argc, char **argv)
 
   gsk_dns_rr_cache_unref (rr_cache);
 
+  /* eviction and expiry */
+  rr_cache = gsk_dns_rr_cache_new (1024 * 1024, 8);
+  allocator = gsk_dns_message_new (0, FALSE);
+  {
+    guint i;
+    char name[64];
+    for (i = 0; i < 100; i++)
+      {
+        g_snprintf (name, sizeof (name), "host%u.example", i);
+        rr = gsk_dns_rr_new_a (name, 100 + i, one_two_three_four, allocator);
+        gsk_dns_rr_cache_insert (rr_cache, rr, TRUE, cur_time);
+        if (i == 0)
+          {
+            /* keep the first record locked */
+            found = gsk_dns_rr_cache_lookup_one (rr_cache, name,
+                                                 GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET,
+                                                 GSK_DNS_RR_CACHE_LOOKUP_LOCK);
+            g_assert (found != NULL);
+          }
+      }
+  }
+  g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, "host0.example",
+                                         GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET, 0) == found);
+  g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, "host1.example",
+                                         GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET, 0) == NULL);
+  g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, "host99.example",
+                                         GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET, 0) != NULL);
+  gsk_dns_rr_cache_flush (rr_cache, cur_time + 500);
+  g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, "host99.example",
+                                         GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET, 0) == NULL);
+  g_assert (gsk_dns_rr_cache_lookup_one (rr_cache, "host0.example",
+                                         GSK_DNS_RR_HOST_ADDRESS, GSK_DNS_CLASS_INTERNET, 0) == found);
+  gsk_dns_rr_cache_unlock (rr_cache, found);
+  gsk_dns_message_unref (allocator);
+  gsk_dns_rr_cache_unref (rr_cache);
+
+  test_long_ttl (cur_time);
+  test_size_churn (cur_time);
+  test_shared ();
 
   return 0;
 }
@@ -0,0 +1,105 @@
+#include "../gskmainloop.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include "../gskinit.h"
+
+/* With GSK_MAIN_LOOP_EDGE_TRIGGERED or GSK_MAIN_LOOP_IO_URING,
+   the main-loop is notified of edges internally, but must still
+   behave level-triggered:  a handler which does not drain its fd
+   is called again, and re-enabling interest in an fd
+   that is already readable must notice that it is. */
+
+#define N_BYTES		10
+
+static guint n_read = 0;
+static guint n_write_events = 0;
+
+static gboolean
+handle_read_one_byte (int fd, GIOCondition condition, gpointer data)
+{
+  char c;
+  g_assert (condition & G_IO_IN);
+  if (read (fd, &c, 1) != 1)
+    g_error ("error reading one byte");
+  g_assert (c == 'a' + n_read % 26);
+  n_read++;
+  return TRUE;
+}
+
+static gboolean
+handle_writable (int fd, GIOCondition condition, gpointer data)
+{
+  g_assert (condition & G_IO_OUT);
+  n_write_events++;
+  return TRUE;
+}
+
+static void
+test_level_triggered (GskMainLoopCreateFlags flags)
+{
+  GskMainLoop *main_loop;
+  GskSource *read_source, *write_source;
+  int fds[2];
+  guint i;
+
+  n_read = n_write_events = 0;
+  main_loop = gsk_main_loop_new (flags);
+  if (pipe (fds) < 0)
+    g_error ("error creating pipe");
+
+  read_source = gsk_main_loop_add_io (main_loop, fds[0], G_IO_IN,
+                                      handle_read_one_byte, NULL, NULL);
+  for (i = 0; i < N_BYTES; i++)
+    {
+      char c = 'a' + i % 26;
+      if (write (fds[1], &c, 1) != 1)
+        g_error ("error writing to pipe");
+    }
+
+  /* one byte per iteration, though only one edge was generated */
+  for (i = 0; i < N_BYTES; i++)
+    {
+      gsk_main_loop_run (main_loop, 1000, NULL);
+      g_assert (n_read == i + 1);
+    }
+  gsk_main_loop_run (main_loop, 0, NULL);
+  g_assert (n_read == N_BYTES);
+
+  /* data arriving while we are not interested */
+  gsk_source_adjust_io (read_source, 0);
+  if (write (fds[1], "k", 1) != 1)
+    g_error ("error writing to pipe");
+  gsk_main_loop_run (main_loop, 0, NULL);
+  g_assert (n_read == N_BYTES);
+  gsk_source_adjust_io (read_source, G_IO_IN);
+  gsk_main_loop_run (main_loop, 1000, NULL);
+  g_assert (n_read == N_BYTES + 1);
+
+  /* toggling write-interest on an always-writable fd */
+  write_source = gsk_main_loop_add_io (main_loop, fds[1], G_IO_OUT,
+                                       handle_writable, NULL, NULL);
+  gsk_main_loop_run (main_loop, 1000, NULL);
+  g_assert (n_write_events == 1);
+  gsk_main_loop_run (main_loop, 1000, NULL);
+  g_assert (n_write_events == 2);
+  gsk_source_adjust_io (write_source, 0);
+  gsk_main_loop_run (main_loop, 0, NULL);
+  g_assert (n_write_events == 2);
+  gsk_source_adjust_io (write_source, G_IO_OUT);
+  gsk_main_loop_run (main_loop, 1000, NULL);
+  g_assert (n_write_events == 3);
+
+  gsk_source_remove (write_source);
+  gsk_source_remove (read_source);
+  close (fds[0]);
+  close (fds[1]);
+  g_object_unref (main_loop);
+}
+
+int main (int argc, char **argv)
+{
+  gsk_init_without_threads (&argc, &argv);
+  test_level_triggered (GSK_MAIN_LOOP_EDGE_TRIGGERED);
+  test_level_triggered (GSK_MAIN_LOOP_IO_URING);
+  return 0;
+}
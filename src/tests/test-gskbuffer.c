@@ -161,5 +161,99 @@ int main(int argc, char** argv)
     gsk_buffer_destruct (&buffer);
   }
 
+  /* Test that small appends use small fragments,
+     and that shrinking compacts leftover data. */
+  {
+    char big[100000];
+    guint i;
+    for (i = 0; i < sizeof (big); i++)
+      big[i] = i % 251;
+    gsk_buffer_construct (&gskbuffer);
+    gsk_buffer_append (&gskbuffer, big, 200);
+    g_assert (gskbuffer.first_frag->buf_max_size < 512);
+    gsk_buffer_destruct (&gskbuffer);
+
+    gsk_buffer_construct (&gskbuffer);
+    gsk_buffer_append (&gskbuffer, big, sizeof (big));
+    g_assert (gskbuffer.first_frag->buf_max_size >= 32768);
+    g_assert (gsk_buffer_discard (&gskbuffer, sizeof (big) - 100)
+              == sizeof (big) - 100);
+    g_assert (gsk_buffer_shrink (&gskbuffer) > 0);
+    g_assert (gskbuffer.first_frag == gskbuffer.last_frag);
+    g_assert (gskbuffer.first_frag->buf_max_size < 512);
+    g_assert (gsk_buffer_read (&gskbuffer, buf, sizeof (buf)) == 100);
+    g_assert (memcmp (buf, big + sizeof (big) - 100, 100) == 0);
+    g_assert (gsk_buffer_shrink (&gskbuffer) == 0);
+    gsk_buffer_destruct (&gskbuffer);
+  }
+
+  /* Test producing data in place at the end of a buffer. */
+  {
+    guint length, fill;
+    char *area;
+    gsk_buffer_construct (&gskbuffer);
+    length = 5;
+    area = gsk_buffer_begin_append (&gskbuffer, &length);
+    g_assert (length == 5);
+    g_assert (gskbuffer.size == 0);
+    gsk_buffer_end_append (&gskbuffer, 0);
+    g_assert (gskbuffer.first_frag == NULL && gskbuffer.last_frag == NULL);
+
+    gsk_buffer_append_string (&gskbuffer, "hello");
+    length = 100000;
+    area = gsk_buffer_begin_append (&gskbuffer, &length);
+    g_assert (length > 0 && length < 100000);
+    memcpy (area, " world", 6);
+    gsk_buffer_end_append (&gskbuffer, 6);
+    g_assert (gskbuffer.size == 11);
+
+    /* fill the last fragment:  an unused new fragment is removed */
+    fill = gskbuffer.last_frag->buf_max_size
+         - gskbuffer.last_frag->buf_start
+         - gskbuffer.last_frag->buf_length;
+    gsk_buffer_append_repeated_char (&gskbuffer, '!', fill);
+    length = 10;
+    gsk_buffer_begin_append (&gskbuffer, &length);
+    g_assert (gskbuffer.last_frag->buf_length == 0);
+    gsk_buffer_end_append (&gskbuffer, 0);
+    g_assert (gskbuffer.last_frag->buf_length > 0);
+    g_assert (gskbuffer.size == 11 + fill);
+    g_assert (gsk_buffer_read (&gskbuffer, buf, 11) == 11);
+    g_assert (memcmp (buf, "hello world", 11) == 0);
+    gsk_buffer_destruct (&gskbuffer);
+  }
+
+  /* Test fragment recycling:  a few fragments live in the thread cache,
+     the overflow goes to the depot, and the rest goes back to malloc. */
+  {
+    GskBufferRecyclingStats stats;
+    guint max_per_thread, max_in_depot;
+    gsk_buffer_cleanup_recycling_bin ();
+    gsk_buffer_set_recycling_limits (4, 8);
+    gsk_buffer_get_recycling_limits (&max_per_thread, &max_in_depot);
+    g_assert (max_per_thread == 4);
+    g_assert (max_in_depot == 8);
+
+    gsk_buffer_construct (&gskbuffer);
+    count (&gskbuffer, 1, 100000);      /* about 600k: many fragments */
+    gsk_buffer_destruct (&gskbuffer);
+    gsk_buffer_get_recycling_stats (&stats);
+    g_assert (stats.n_depot_fragments <= 8);
+    g_assert (stats.n_freed > 0);
+
+    gsk_buffer_construct (&gskbuffer);
+    count (&gskbuffer, 1, 100000);
+    decount (&gskbuffer, 1, 100000);
+    g_assert (gskbuffer.size == 0);
+    gsk_buffer_destruct (&gskbuffer);
+    gsk_buffer_get_recycling_stats (&stats);
+    g_assert (stats.n_thread_hits > 0);
+    g_assert (stats.n_depot_hits > 0);
+
+    gsk_buffer_cleanup_recycling_bin ();
+    gsk_buffer_get_recycling_stats (&stats);
+    g_assert (stats.n_depot_fragments == 0);
+  }
+
   return 0;
 }
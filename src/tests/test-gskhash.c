@@ -28,10 +28,180 @@ static HashSumTest tests[] =
 };
 #define TEST_COUNT		G_N_ELEMENTS(tests)
 
+/* FIPS 180-2 and RFC 1321 vectors:  str, repeated n_repeats times */
+typedef struct _HexSumTest HexSumTest;
+struct _HexSumTest
+{
+  const char *str;
+  guint n_repeats;
+  const char *md5;
+  const char *sha1;
+  const char *sha256;
+};
+
+static HexSumTest hex_tests[] =
+{
+  {
+    "abc", 1,
+    "900150983cd24fb0d6963f7d28e17f72",
+    "a9993e364706816aba3e25717850c26c9cd0d89d",
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+  },
+  {
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+    "8215ef0796a20bcaaae116d3876c664a",
+    "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+  },
+  {
+    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 10000,
+    "7707d6ae4e027c70eea2a935c2296f21",
+    "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+  }
+};
+
+typedef GskHash *(*HashNewFunc) (void);
+
+static GskHash *
+crc32_new (void)
+{
+  return gsk_hash_new_crc32 (FALSE);
+}
+
+static HashNewFunc hash_new_funcs[] =
+{
+  gsk_hash_new_md5,
+  gsk_hash_new_sha1,
+  gsk_hash_new_sha256,
+  crc32_new
+};
+
+static void
+test_hex_vectors (void)
+{
+  guint i, j;
+  for (i = 0; i < G_N_ELEMENTS (hex_tests); i++)
+    {
+      const char *expected[3];
+      char hex[65];
+      expected[0] = hex_tests[i].md5;
+      expected[1] = hex_tests[i].sha1;
+      expected[2] = hex_tests[i].sha256;
+      for (j = 0; j < 3; j++)
+        {
+          GskHash *h = (*hash_new_funcs[j]) ();
+          guint r;
+          for (r = 0; r < hex_tests[i].n_repeats; r++)
+            gsk_hash_feed_str (h, hex_tests[i].str);
+          gsk_hash_done (h);
+          gsk_hash_get_hex (h, hex);
+          g_assert (strcmp (hex, expected[j]) == 0);
+          gsk_hash_destroy (h);
+        }
+    }
+}
+
+/* hash data in pieces of 1..max_piece bytes */
+static void
+hash_in_pieces (HashNewFunc   func,
+                const guint8 *data,
+                guint         len,
+                guint         max_piece,
+                GRand        *rand,
+                guint8       *out)
+{
+  GskHash *h = (*func) ();
+  memset (out, 0, 32);
+  while (len > 0)
+    {
+      guint piece = g_rand_int_range (rand, 1, max_piece + 1);
+      if (piece > len)
+        piece = len;
+      gsk_hash_feed (h, data, piece);
+      data += piece;
+      len -= piece;
+    }
+  gsk_hash_done (h);
+  gsk_hash_get (h, out);
+  gsk_hash_destroy (h);
+}
+
+/* the cpu-specific code must agree with the portable code */
+static void
+test_cpu_features (const guint8 *data,
+                   guint         max_len,
+                   GRand        *rand)
+{
+  guint f, len;
+  for (f = 0; f < G_N_ELEMENTS (hash_new_funcs); f++)
+    for (len = 0; len <= max_len; len += (len < 300) ? 1 : 997)
+      {
+        guint8 portable[32], fast[32];
+        guint max_piece = (len % 3 == 0) ? len + 1 : g_rand_int_range (rand, 1, 200);
+        _gsk_hash_set_use_cpu_features (FALSE);
+        hash_in_pieces (hash_new_funcs[f], data, len, len + 1, rand, portable);
+        _gsk_hash_set_use_cpu_features (TRUE);
+        hash_in_pieces (hash_new_funcs[f], data, len, max_piece, rand, fast);
+        g_assert (memcmp (portable, fast, 32) == 0);
+      }
+}
+
+/* gsk_hash_feed_multi() must agree with gsk_hash_feed() */
+#define N_MULTI         21
+static void
+test_feed_multi (const guint8 *data,
+                 guint         max_len,
+                 GRand        *rand)
+{
+  guint iter;
+  for (iter = 0; iter < 200; iter++)
+    {
+      GskHash *multi[N_MULTI];
+      GskHash *single[N_MULTI];
+      gconstpointer multi_data[N_MULTI];
+      guint lengths[N_MULTI];
+      guint i, round;
+      for (i = 0; i < N_MULTI; i++)
+        {
+          guint f = g_rand_int_range (rand, 0, G_N_ELEMENTS (hash_new_funcs));
+          multi[i] = (*hash_new_funcs[f]) ();
+          single[i] = (*hash_new_funcs[f]) ();
+        }
+      for (round = 0; round < 3; round++)
+        {
+          /* similar lengths, sometimes all the same */
+          guint base = g_rand_int_range (rand, 0, max_len / 2);
+          gboolean same = g_rand_boolean (rand);
+          for (i = 0; i < N_MULTI; i++)
+            {
+              guint off = g_rand_int_range (rand, 0, max_len / 2);
+              lengths[i] = same ? base : g_rand_int_range (rand, base / 2, base + 1);
+              multi_data[i] = data + off;
+              gsk_hash_feed (single[i], multi_data[i], lengths[i]);
+            }
+          gsk_hash_feed_multi (N_MULTI, multi, multi_data, lengths);
+        }
+      for (i = 0; i < N_MULTI; i++)
+        {
+          guint8 a[32], b[32];
+          gsk_hash_done (multi[i]);
+          gsk_hash_done (single[i]);
+          gsk_hash_get (multi[i], a);
+          gsk_hash_get (single[i], b);
+          g_assert (memcmp (a, b, gsk_hash_get_size (multi[i])) == 0);
+          gsk_hash_destroy (multi[i]);
+          gsk_hash_destroy (single[i]);
+        }
+    }
+}
+
 int main ()
 {
   GskHash *h;
   guint i;
+  GRand *rand = g_rand_new_with_seed (42);
+  guint8 *data = g_malloc (20000);
   for (i = 0; i < TEST_COUNT; i++)
     {
       guint8 buf[32];
@@ -57,6 +227,19 @@ int main ()
       g_assert (memcmp (buf, tests[i].sha256, 32) == 0);
       gsk_hash_destroy (h);
     }
+
+  test_hex_vectors ();
+
+  for (i = 0; i < 20000; i++)
+    data[i] = g_rand_int (rand);
+  test_cpu_features (data, 20000, rand);
+  test_feed_multi (data, 20000, rand);
+  _gsk_hash_set_use_cpu_features (FALSE);
+  test_feed_multi (data, 20000, rand);
+  _gsk_hash_set_use_cpu_features (TRUE);
+
+  g_free (data);
+  g_rand_free (rand);
   return 0;
 }
 
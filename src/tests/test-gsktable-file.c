@@ -3,12 +3,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "gskinit.h"
 #include "gsktable.h"
 #include "gsktable-file.h"
+#include "gsktable-helpers.h"
 
 static void gen_kv_0 (guint   index,
                       GByteArray *key,
@@ -26,6 +28,15 @@ static void gen_kv_0 (guint   index,
   memcpy (value->data, value_buf, value->len);
 }
 
+/* keys that sort between those of gen_kv_0, but never match them */
+static void gen_kv_0_absent (guint   index,
+                             GByteArray *key,
+                             GByteArray *value)
+{
+  gen_kv_0 (index, key, value);
+  g_byte_array_append (key, (const guint8 *) "Z", 1);
+}
+
 typedef void (*GenKeyValue) (guint index,
                              GByteArray *key_out,
                              GByteArray *value_out);
@@ -128,6 +139,40 @@ query_entries (GskTableFile *file,
   gsk_table_file_query_clear (&query);
 }
 
+/* like query_entries(), but tells the file the key,
+   so it can use its bloom filter, and checks the results */
+static void
+query_entries_expect (GskTableFile *file,
+                      GenKeyValue   gen_kv,
+                      guint         start,
+                      guint         end,
+                      gboolean      expect_found)
+{
+  GByteArray *key = g_byte_array_new ();
+  GByteArray *value = g_byte_array_new ();
+  guint i;
+  GskTableFileQuery query = GSK_TABLE_FILE_QUERY_INIT;
+  GError *error = NULL;
+  query.compare = compare_by_memcmp;
+  query.compare_data = key;
+
+  for (i = start; i < end; i++)
+    {
+      gen_kv (i, key, value);
+      query.key_len = key->len;
+      query.key_data = key->data;
+      if (!gsk_table_file_query (file, &query, &error))
+        g_error ("gsk_table_file_query: %s", error->message);
+      g_assert (query.found == expect_found);
+      if (expect_found)
+        g_assert (query.value.len == value->len
+               && memcmp (query.value.data, value->data, value->len) == 0);
+    }
+  g_byte_array_free (key, TRUE);
+  g_byte_array_free (value, TRUE);
+  gsk_table_file_query_clear (&query);
+}
+
 static void
 finish_file (GskTableFile *file)
 {
@@ -236,6 +281,245 @@ run_test_big (GskTableFileFactory *factory,
     g_error ("gsk_table_file_destroy: %s", error->message);
 }
 
+static void
+run_test_bloom (GskTableFileFactory *factory,
+                const char          *dir,
+                guint64              id)
+{
+  GskTableFile *file;
+  GskTableFileHints hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GError *error = NULL;
+  guint state_len;
+  guint8 *state_data;
+  guint end;
+
+  hints.max_entries = 20000;
+  file = gsk_table_file_factory_create_file (factory, dir, id, &hints, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_create_file: %s", error->message);
+  inject_entries (file, gen_kv_0, 0, 10000);
+  inject_entries_til_success (file, gen_kv_0, 10000, &end);
+  query_entries_expect (file, gen_kv_0_absent, 0, end, FALSE);
+
+  /* the bloom filter must survive restarting the build */
+  if (!gsk_table_file_get_build_state (file, &state_len, &state_data, &error))
+    g_error ("gsk_table_file_get_build_state: %s", error->message);
+  if (!gsk_table_file_destroy (file, dir, FALSE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  file = gsk_table_file_factory_open_building_file (factory, dir, id, state_len, state_data, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_open_building_file: %s", error->message);
+  g_free (state_data);
+  inject_entries (file, gen_kv_0, end, 20000);
+  finish_file (file);
+  query_entries_expect (file, gen_kv_0, 0, 20000, TRUE);
+
+  if (!gsk_table_file_destroy (file, dir, FALSE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  file = gsk_table_file_factory_open_file (factory, dir, id, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_open_file: %s", error->message);
+  file->n_entries = 20000;
+  query_entries_expect (file, gen_kv_0, 0, 20000, TRUE);
+  query_entries_expect (file, gen_kv_0_absent, 0, 20000, FALSE);
+  query_entries_expect (file, gen_kv_0, 20000, 21000, FALSE);
+
+  /* a filter with a bad number of hash functions is ignored */
+  if (!gsk_table_file_destroy (file, dir, FALSE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  {
+    char fname[GSK_TABLE_MAX_PATH];
+    guint32 zero = 0;
+    int fd;
+    gsk_table_mk_fname (fname, dir, id, "bloom");
+    fd = open (fname, O_WRONLY);
+    g_assert (fd >= 0);
+    g_assert (pwrite (fd, &zero, 4, 4) == 4);
+    close (fd);
+  }
+  file = gsk_table_file_factory_open_file (factory, dir, id, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_open_file: %s", error->message);
+  file->n_entries = 20000;
+  query_entries_expect (file, gen_kv_0, 0, 20000, TRUE);
+  query_entries_expect (file, gen_kv_0_absent, 0, 20000, FALSE);
+
+  if (!gsk_table_file_destroy (file, dir, TRUE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+}
+
+/* write with one factory's codec; continue, read and query with the default
+   factory, which must use the codec recorded in the file */
+static void
+run_test_codec (GskTableCompression  compression,
+                gint                 level,
+                GskTableFileFactory *default_factory,
+                const char          *dir,
+                guint64              id)
+{
+  GskTableFileFactory *factory;
+  GskTableFile *file;
+  GskTableFileHints hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GError *error = NULL;
+  guint state_len;
+  guint8 *state_data;
+  guint end;
+  GskTableReader *reader;
+  GByteArray *key = g_byte_array_new ();
+  GByteArray *value = g_byte_array_new ();
+  guint i;
+
+  factory = gsk_table_file_factory_new_flat_full (compression, level, 0, &error);
+  if (factory == NULL)
+    g_error ("gsk_table_file_factory_new_flat_full: %s", error->message);
+  file = gsk_table_file_factory_create_file (factory, dir, id, &hints, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_create_file: %s", error->message);
+  inject_entries (file, gen_kv_0, 0, 20000);
+  inject_entries_til_success (file, gen_kv_0, 20000, &end);
+  if (!gsk_table_file_get_build_state (file, &state_len, &state_data, &error))
+    g_error ("gsk_table_file_get_build_state: %s", error->message);
+  if (!gsk_table_file_destroy (file, dir, FALSE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  gsk_table_file_factory_destroy (factory);
+
+  file = gsk_table_file_factory_open_building_file (default_factory, dir, id,
+                                                    state_len, state_data, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_open_building_file: %s", error->message);
+  g_free (state_data);
+  inject_entries (file, gen_kv_0, end, 40000);
+  finish_file (file);
+  if (!gsk_table_file_destroy (file, dir, FALSE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+
+  file = gsk_table_file_factory_open_file (default_factory, dir, id, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_open_file: %s", error->message);
+  g_assert (file->n_entries == 40000);
+  query_entries_expect (file, gen_kv_0, 0, 40000, TRUE);
+  query_entries_expect (file, gen_kv_0_absent, 0, 1000, FALSE);
+
+  reader = gsk_table_file_create_reader (file, dir, &error);
+  if (reader == NULL)
+    g_error ("gsk_table_file_create_reader: %s", error->message);
+  for (i = 0; i < 40000; i++)
+    {
+      g_assert (!reader->eof && reader->error == NULL);
+      gen_kv_0 (i, key, value);
+      g_assert (reader->key_len == key->len
+             && memcmp (reader->key_data, key->data, key->len) == 0);
+      g_assert (reader->value_len == value->len
+             && memcmp (reader->value_data, value->data, value->len) == 0);
+      gsk_table_reader_advance (reader);
+    }
+  g_assert (reader->eof);
+  gsk_table_reader_destroy (reader);
+
+  if (!gsk_table_file_destroy (file, dir, TRUE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  g_byte_array_free (key, TRUE);
+  g_byte_array_free (value, TRUE);
+}
+
+/* a factory with its own small block cache */
+static void
+run_test_cache (const char *dir,
+                guint64     id)
+{
+  GskTableFileFactory *factory;
+  GskTableFile *file;
+  GskTableFileHints hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GskTableCacheStats stats;
+  GError *error = NULL;
+
+  factory = gsk_table_file_factory_new_flat_full (GSK_TABLE_COMPRESSION_LZ, -1,
+                                                  256*1024, &error);
+  if (factory == NULL)
+    g_error ("gsk_table_file_factory_new_flat_full: %s", error->message);
+  file = gsk_table_file_factory_create_file (factory, dir, id, &hints, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_create_file: %s", error->message);
+  inject_entries (file, gen_kv_0, 0, 100000);
+  finish_file (file);
+
+  /* every query of a present key looks in the cache exactly once */
+  query_entries_expect (file, gen_kv_0, 0, 100000, TRUE);
+  query_entries_expect (file, gen_kv_0, 0, 1000, TRUE);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  g_assert (stats.n_hits + stats.n_misses == 101000);
+  g_assert (stats.n_hits > stats.n_misses);
+  g_assert (stats.n_evictions > 0);
+  g_assert (stats.max_bytes == 256*1024);
+  g_assert (stats.n_bytes <= stats.max_bytes);
+
+  /* destroying the file drops its blocks */
+  if (!gsk_table_file_destroy (file, dir, TRUE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  g_assert (stats.n_blocks == 0 && stats.n_bytes == 0);
+  gsk_table_file_factory_destroy (factory);
+}
+
+/* A block wanted again soon after being evicted is hot:
+   it must survive a full scan, which only churns the FIFO. */
+static void
+run_test_cache_scan (const char *dir,
+                     guint64     id)
+{
+  GskTableFileFactory *factory;
+  GskTableFile *file;
+  GskTableFileHints hints = GSK_TABLE_FILE_HINTS_DEFAULTS;
+  GskTableCacheStats stats, before;
+  GError *error = NULL;
+  guint i;
+
+  factory = gsk_table_file_factory_new_flat_full (GSK_TABLE_COMPRESSION_LZ, -1,
+                                                  256*1024, &error);
+  if (factory == NULL)
+    g_error ("gsk_table_file_factory_new_flat_full: %s", error->message);
+  file = gsk_table_file_factory_create_file (factory, dir, id, &hints, &error);
+  if (file == NULL)
+    g_error ("gsk_table_file_factory_create_file: %s", error->message);
+  inject_entries (file, gen_kv_0, 0, 100000);
+  finish_file (file);
+
+  /* query the first block, then scan until it is the first to go */
+  query_entries_expect (file, gen_kv_0, 0, 1, TRUE);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  for (i = 1; stats.n_evictions == 0; i++)
+    {
+      g_assert (i < 100000);
+      query_entries_expect (file, gen_kv_0, i, i + 1, TRUE);
+      gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+    }
+  g_assert (stats.n_hot_bytes == 0);
+
+  /* wanting it again makes it hot */
+  before = stats;
+  query_entries_expect (file, gen_kv_0, 0, 1, TRUE);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  g_assert (stats.n_misses == before.n_misses + 1);
+  g_assert (stats.n_hot_bytes > 0);
+
+  /* a full scan evicts plenty, but not the hot block */
+  before = stats;
+  query_entries_expect (file, gen_kv_0, 0, 100000, TRUE);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  g_assert (stats.n_evictions > before.n_evictions + 10);
+  g_assert (stats.n_hot_bytes == before.n_hot_bytes);
+  g_assert (stats.n_bytes <= stats.max_bytes);
+  before = stats;
+  query_entries_expect (file, gen_kv_0, 0, 1, TRUE);
+  gsk_table_file_factory_flat_get_cache_stats (factory, &stats);
+  g_assert (stats.n_hits == before.n_hits + 1);
+  g_assert (stats.n_misses == before.n_misses);
+
+  if (!gsk_table_file_destroy (file, dir, TRUE, &error))
+    g_error ("gsk_table_file_destroy: %s", error->message);
+  gsk_table_file_factory_destroy (factory);
+}
+
 int
 main(int    argc,
      char **argv)
@@ -256,6 +540,21 @@ main(int    argc,
   run_test_big (factory, dir, 1001);
   g_printerr ("done.\n");
 
+  g_printerr ("running bloom-filter test... ");
+  run_test_bloom (factory, dir, 1002);
+  g_printerr ("done.\n");
+
+  g_printerr ("running codec tests... ");
+  run_test_codec (GSK_TABLE_COMPRESSION_NONE, -1, factory, dir, 1003);
+  run_test_codec (GSK_TABLE_COMPRESSION_LZ, -1, factory, dir, 1004);
+  run_test_codec (GSK_TABLE_COMPRESSION_ZLIB, 9, factory, dir, 1005);
+  g_printerr ("done.\n");
+
+  g_printerr ("running block-cache test... ");
+  run_test_cache (dir, 1006);
+  run_test_cache_scan (dir, 1007);
+  g_printerr ("done.\n");
+
   if (rmdir (dir) < 0)
     g_error ("rmdir(%s) failed: %s", dir, g_strerror (errno));
   g_free (dir);
@@ -13,6 +13,11 @@ static const char *input = NULL;
 static gboolean create = FALSE;
 static gboolean existing = FALSE;
 static gboolean no_close = FALSE;
+static gint n_merge_threads = 0;
+static gboolean batch = FALSE;
+static gint max_in_memory_entries = 0;
+static const char *journal_mode = "default";
+static gboolean force_sorted = FALSE;
 
 static gboolean
 print_op_modes_handler (const gchar    *option_name,
@@ -22,7 +27,11 @@ print_op_modes_handler (const gchar    *option_name,
 {
   g_printerr ("operation modes:\n");
   g_printerr ("  replacement         Setting a key's value twice\n"
-              "                      overrides the old value.\n");
+              "                      overrides the old value.\n"
+              "  edit                An empty value leaves the old value;\n"
+              "                      00 deletes it;  a value starting with\n"
+              "                      2b ('+') is appended to it;\n"
+              "                      any other value replaces it.\n");
   exit (1);
 }
 static gboolean
@@ -39,7 +48,9 @@ print_io_modes_handler (const gchar    *option_name,
               "        Q [KEY]           Find the value for a key\n"
               "        A [KEY] [VALUE]   Insert the value for a key\n"
               "        !+ [KEY] [VALUE]  Assert db's entry for KEY is VALUE\n"
-              "        !- [KEY]          Assert that there is no value for KEY\n");
+              "        !- [KEY]          Assert that there is no value for KEY\n"
+              "        !x                Assert that the preceding run of 'A' lines\n"
+              "                          was rejected as unsorted (--batch --force-sorted)\n");
   exit (1);
 }
 
@@ -60,6 +71,16 @@ static GOptionEntry op_entries[] =
     "open an existing table; abort if it does not exist", NULL },
   { "no-close", 0, 0, G_OPTION_ARG_NONE, &no_close,
     "do not cleanup when done", NULL },
+  { "merge-threads", 0, 0, G_OPTION_ARG_INT, &n_merge_threads,
+    "run merges in N background threads", "N" },
+  { "batch", 0, 0, G_OPTION_ARG_NONE, &batch,
+    "add runs of 'A' lines with gsk_table_add_batch()", NULL },
+  { "max-in-memory-entries", 0, 0, G_OPTION_ARG_INT, &max_in_memory_entries,
+    "flush the in-memory tree after N entries", "N" },
+  { "journal-mode", 0, 0, G_OPTION_ARG_STRING, &journal_mode,
+    "none, occasionally, default or sync", "MODE" },
+  { "force-sorted", 0, 0, G_OPTION_ARG_NONE, &force_sorted,
+    "pass GSK_TABLE_BATCH_SORTED even for unsorted batches", NULL },
   { "help-op-modes", 0, G_OPTION_FLAG_NO_ARG,
     G_OPTION_ARG_CALLBACK, print_op_modes_handler,
     "print the operation modes and exit", NULL },
@@ -74,6 +95,72 @@ typedef struct {
   guint8 *data;
 } Data;
 
+/* the merge function for --op-mode=edit */
+static GskTableMergeResult
+merge_edit (guint         key_len,
+            const guint8 *key_data,
+            guint         a_len,
+            const guint8 *a_data,
+            guint         b_len,
+            const guint8 *b_data,
+            GskTableBuffer *output,
+            gpointer      user_data)
+{
+  if (b_len == 0)
+    return GSK_TABLE_MERGE_RETURN_A;
+  if (a_len == 0)
+    return GSK_TABLE_MERGE_RETURN_B;
+  if (b_len == 1 && b_data[0] == 0)
+    return GSK_TABLE_MERGE_DROP;
+  if (b_data[0] == '+')
+    {
+      gsk_table_buffer_set_len (output, a_len + b_len - 1);
+      memcpy (output->data, a_data, a_len);
+      memcpy (output->data + a_len, b_data + 1, b_len - 1);
+      return GSK_TABLE_MERGE_SUCCESS;
+    }
+  return GSK_TABLE_MERGE_RETURN_B;
+}
+
+/* the 'A' lines collected for --batch */
+static GArray *pending_adds = NULL;
+
+/* Returns FALSE if the batch was rejected as unsorted
+   (which only happens with --force-sorted). */
+static gboolean
+flush_pending_adds (GskTable *table)
+{
+  GskTableBatchEntry *entries = (GskTableBatchEntry *) pending_adds->data;
+  GskTableBatchFlags flags = GSK_TABLE_BATCH_SORTED;
+  GError *error = NULL;
+  gboolean rv = TRUE;
+  guint i;
+  if (!force_sorted)
+    for (i = 1; i < pending_adds->len; i++)
+      {
+        guint min_len = MIN (entries[i-1].key_len, entries[i].key_len);
+        int cmp = memcmp (entries[i-1].key_data, entries[i].key_data, min_len);
+        if (cmp > 0 || (cmp == 0 && entries[i-1].key_len > entries[i].key_len))
+          flags = 0;
+      }
+  if (!gsk_table_add_batch (table, pending_adds->len, entries, flags, &error))
+    {
+      if (!force_sorted
+       || error->domain != GSK_G_ERROR_DOMAIN
+       || error->code != GSK_ERROR_INVALID_ARGUMENT)
+        g_error ("gsk_table_add_batch failed: %s", error->message);
+      g_error_free (error);
+      rv = FALSE;
+    }
+  for (i = 0; i < pending_adds->len; i++)
+    {
+      g_free ((guint8 *) entries[i].key_data);
+      g_free ((guint8 *) entries[i].value_data);
+    }
+  g_array_set_size (pending_adds, 0);
+  return rv;
+}
+
 static gboolean
 parse_hex (const char *line,
            guint       n_data,
@@ -150,7 +237,11 @@ int main(int argc, char **argv)
   GError *error = NULL;
   GskTable *table = NULL;
   FILE *input_fp;
+  gboolean batch_rejected = FALSE;
 
+  /* needed for --merge-threads */
+  if (!g_thread_supported ())
+    g_thread_init (NULL);
   gsk_init_without_threads (&argc,&argv);
 
   context = g_option_context_new ("test-gsktable-prog");
@@ -169,13 +260,31 @@ int main(int argc, char **argv)
 
   options = gsk_table_options_new ();
   if (strcmp (op_mode, "replacement") == 0)
-    {
-      gsk_table_options_set_replacement_semantics (options);
-      if (strcmp (io_mode, "default") == 0)
-        io_mode = "cmd_prefixed_hex";
-    }
+    gsk_table_options_set_replacement_semantics (options);
+  else if (strcmp (op_mode, "edit") == 0)
+    options->merge = merge_edit;
   else
     g_error ("unknown operations mode '%s'", op_mode);
+  if (strcmp (io_mode, "default") == 0)
+    io_mode = "cmd_prefixed_hex";
+  if (strcmp (journal_mode, "none") == 0)
+    options->journal_mode = GSK_TABLE_JOURNAL_NONE;
+  else if (strcmp (journal_mode, "occasionally") == 0)
+    options->journal_mode = GSK_TABLE_JOURNAL_OCCASIONALLY;
+  else if (strcmp (journal_mode, "default") == 0)
+    options->journal_mode = GSK_TABLE_JOURNAL_DEFAULT;
+  else if (strcmp (journal_mode, "sync") == 0)
+    options->journal_mode = GSK_TABLE_JOURNAL_SYNC;
+  else
+    g_error ("unknown journal mode '%s'", journal_mode);
+  if (n_merge_threads < 0)
+    g_error ("--merge-threads must be nonnegative");
+  options->n_merge_threads = n_merge_threads;
+  if (max_in_memory_entries < 0)
+    g_error ("--max-in-memory-entries must be nonnegative");
+  if (max_in_memory_entries > 0)
+    options->max_in_memory_entries = max_in_memory_entries;
+  pending_adds = g_array_new (FALSE, FALSE, sizeof (GskTableBatchEntry));
 
   table = gsk_table_new (dir, options, new_flags, &error);
   if (table == NULL)
@@ -197,6 +306,12 @@ int main(int argc, char **argv)
       while ((line=gsk_stdio_readline (input_fp)) != NULL)
         {
           Data data[2];
+          if (line[0] != 'A' && pending_adds->len > 0)
+            {
+              batch_rejected = !flush_pending_adds (table);
+              if (batch_rejected && strncmp (line, "!x", 2) != 0)
+                g_error ("batch before line %u was rejected", lineno);
+            }
           switch (line[0])
             {
             case '#':
@@ -230,6 +345,16 @@ int main(int argc, char **argv)
               if (!parse_hex (line+1, 2, data, &error))
                 g_error ("error line %u parsing add binary data: %s",
                          lineno, error->message);
+              if (batch)
+                {
+                  GskTableBatchEntry entry;
+                  entry.key_len = data[0].len;
+                  entry.key_data = data[0].data;
+                  entry.value_len = data[1].len;
+                  entry.value_data = data[1].data;
+                  g_array_append_val (pending_adds, entry);
+                  break;
+                }
               if (!gsk_table_add (table, data[0].len, data[0].data,
                                   data[1].len, data[1].data, &error))
                 g_error ("gsk_table_add failed: %s", error->message);
@@ -242,6 +367,14 @@ int main(int argc, char **argv)
                 guint value_len;
                 guint8 *value_data;
                 gboolean should_exist;
+                if (line[1] == 'x')
+                  {
+                    if (!batch_rejected)
+                      g_error ("assert: batch should have been rejected (line %u)",
+                               lineno);
+                    batch_rejected = FALSE;
+                    break;
+                  }
                 if (line[1] == '+')
                   should_exist = TRUE;
                 else if (line[1] == '-')
@@ -281,11 +414,14 @@ int main(int argc, char **argv)
               g_error ("unexpected command '%c' in input", line[0]);
             }
           g_free (line);
+          lineno++;
         }
-      lineno++;
     }
   else
     g_error ("unknown io_mode %s", io_mode);
+  if (pending_adds->len > 0 && !flush_pending_adds (table))
+    g_error ("final batch was rejected");
+  g_array_free (pending_adds, TRUE);
 
   if (!no_close)
     gsk_table_destroy (table);
@@ -1,5 +1,6 @@
 #include "../http/gskhttprequest.h"
 #include "../http/gskhttpresponse.h"
+#include "../http/gskhttpresponsetemplate.h"
 #include "../gskinit.h"
 #include <string.h>
 
@@ -192,6 +193,101 @@ test_cgi_parsing (const char *query_string,
 }
 
 
+/* --- the perfect hash-table of header-line parsers --- */
+
+/* a lookup must find nothing, or a parser with exactly this name */
+static void
+check_lookup_is_exact (gboolean is_request, const char *name, guint len)
+{
+  const GskHttpHeaderLineParser *parser;
+  parser = gsk_http_header_lookup_line_parser (is_request, name, len);
+  if (parser != NULL)
+    g_assert (strlen (parser->name) == len
+           && g_ascii_strncasecmp (parser->name, name, len) == 0);
+}
+
+static void
+check_known_header (gpointer key, gpointer value, gpointer data)
+{
+  const char *name = key;
+  const GskHttpHeaderLineParser *parser = value;
+  gboolean is_request = GPOINTER_TO_UINT (data);
+  GHashTable *other_table = gsk_http_header_get_parser_table (!is_request);
+  guint len = strlen (name);
+  char *mixed = g_strdup (name);
+  char *miss = g_malloc (len + 2);
+  guint i;
+
+  /* every known header, in any case */
+  for (i = 0; i < len; i += 2)
+    mixed[i] = g_ascii_toupper (mixed[i]);
+  g_assert (gsk_http_header_lookup_line_parser (is_request, name, len) == parser);
+  g_assert (gsk_http_header_lookup_line_parser (is_request, mixed, len) == parser);
+  for (i = 0; i < len; i++)
+    mixed[i] = g_ascii_toupper (mixed[i]);
+  g_assert (gsk_http_header_lookup_line_parser (is_request, mixed, len) == parser);
+
+  /* the other kind of header only has it if its table does */
+  g_assert (gsk_http_header_lookup_line_parser (!is_request, name, len)
+            == g_hash_table_lookup (other_table, name));
+
+  /* near misses:  one byte off, a byte short, a byte long,
+     or with a NUL in place of a byte */
+  for (i = 0; i < len; i++)
+    {
+      memcpy (miss, name, len);
+      miss[i] = name[i] == 'z' ? 'a' : name[i] + 1;
+      check_lookup_is_exact (is_request, miss, len);
+      miss[i] = '\0';
+      g_assert (gsk_http_header_lookup_line_parser (is_request, miss, len) == NULL);
+    }
+  check_lookup_is_exact (is_request, name, len - 1);
+  memcpy (miss, name, len);
+  miss[len] = 's';
+  check_lookup_is_exact (is_request, miss, len + 1);
+  miss[len] = '\0';
+  g_assert (gsk_http_header_lookup_line_parser (is_request, miss, len + 1) == NULL);
+
+  g_free (mixed);
+  g_free (miss);
+}
+
+static void
+test_lookup_line_parser (void)
+{
+  const GskHttpHeaderLineParser *request_parser, *response_parser;
+  g_hash_table_foreach (gsk_http_header_get_parser_table (TRUE),
+                        check_known_header, GUINT_TO_POINTER (TRUE));
+  g_hash_table_foreach (gsk_http_header_get_parser_table (FALSE),
+                        check_known_header, GUINT_TO_POINTER (FALSE));
+
+  /* unknown headers */
+  g_assert (gsk_http_header_lookup_line_parser (TRUE, "X-Unknown", 9) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (FALSE, "X-Unknown", 9) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (TRUE, "", 0) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (FALSE, "Agf", 3) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (FALSE, "Age\0x", 5) == NULL);
+
+  /* request-only and response-only headers */
+  g_assert (gsk_http_header_lookup_line_parser (TRUE, "User-Agent", 10) != NULL);
+  g_assert (gsk_http_header_lookup_line_parser (FALSE, "User-Agent", 10) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (TRUE, "Server", 6) == NULL);
+  g_assert (gsk_http_header_lookup_line_parser (FALSE, "Server", 6) != NULL);
+
+  /* a common header has one parser;  Cache-Control has one of each */
+  request_parser = gsk_http_header_lookup_line_parser (TRUE, "CONTENT-TYPE", 12);
+  response_parser = gsk_http_header_lookup_line_parser (FALSE, "content-Type", 12);
+  g_assert (request_parser != NULL && request_parser == response_parser);
+  request_parser = gsk_http_header_lookup_line_parser (TRUE, "Cache-Control", 13);
+  response_parser = gsk_http_header_lookup_line_parser (FALSE, "Cache-Control", 13);
+  g_assert (request_parser != NULL && response_parser != NULL);
+  g_assert (request_parser->func != response_parser->func);
+
+  /* the name need not be NUL-terminated */
+  g_assert (gsk_http_header_lookup_line_parser (TRUE, "Hostname", 4)
+            == gsk_http_header_lookup_line_parser (TRUE, "host", 4));
+}
+
 int main(int argc, char **argv)
 {
   GskHttpHeader *header0, *header1;
@@ -199,6 +295,8 @@ int main(int argc, char **argv)
 
   gsk_init_without_threads (&argc, &argv);
 
+  test_lookup_line_parser ();
+
   header0 = header_from_string (TRUE,
 				"GET / HTTP/1.0\r\n"
 				"User-Agent: foo\r\n"
@@ -732,6 +830,103 @@ int main(int argc, char **argv)
     g_object_unref (header1);
   }
 
+  /* zero-copy parsing, with the header split between fragments */
+  {
+    static const char text[] = "GET /index.html HTTP/1.1\r\n"
+                               "Host: www.example.com\r\n"
+                               "User-Agent: foo\r\n"
+                               "X-Forwarded-For: 10.0.0.1\r\n"
+                               "\r\n"
+                               "rest";
+    guint split;
+    for (split = 0; split < sizeof (text) - 1; split += 7)
+      {
+        GskBuffer buffer = GSK_BUFFER_STATIC_INIT;
+        GskBuffer out = GSK_BUFFER_STATIC_INIT;
+        GskHttpRequest *request;
+        GError *error = NULL;
+        char *str;
+
+        /* incomplete: the buffer must be left as it was */
+        gsk_buffer_append (&buffer, text, sizeof (text) - 12);
+        header0 = gsk_http_header_from_buffer (&buffer, TRUE, GSK_HTTP_PARSE_ZERO_COPY, &error);
+        g_assert (header0 == NULL && error == NULL);
+        str = g_malloc (buffer.size);
+        gsk_buffer_peek (&buffer, str, buffer.size);
+        g_assert (memcmp (str, text, buffer.size) == 0);
+        g_free (str);
+        gsk_buffer_destruct (&buffer);
+
+        gsk_buffer_append (&buffer, text, split);
+        gsk_buffer_append_foreign (&buffer, text + split, sizeof (text) - 1 - split, NULL, NULL);
+        header0 = gsk_http_header_from_buffer (&buffer, TRUE, GSK_HTTP_PARSE_ZERO_COPY, &error);
+        g_assert (header0 != NULL);
+        g_assert (buffer.size == 4);
+        request = GSK_HTTP_REQUEST (header0);
+        g_assert (strcmp (request->path, "/index.html") == 0);
+        g_assert (strcmp (request->host, "www.example.com") == 0);
+        g_assert (strcmp (request->user_agent, "foo") == 0);
+        g_assert (strcmp (gsk_http_header_lookup_misc (header0, "x-forwarded-for"), "10.0.0.1") == 0);
+        g_assert (strcmp (gsk_http_header_lookup_misc (header0, "X-FORWARDED-FOR"), "10.0.0.1") == 0);
+        g_object_set (header0, "user-agent", "bar", NULL);
+        g_assert (strcmp (request->user_agent, "bar") == 0);
+
+        gsk_http_header_to_buffer (header0, &out);
+        g_assert (gsk_buffer_str_index_of (&out, "x-forwarded-for: 10.0.0.1") >= 0);
+        gsk_http_header_add_misc (header0, "X-Other", "1");
+        g_assert (strcmp (gsk_http_header_lookup_misc (header0, "x-forwarded-for"), "10.0.0.1") == 0);
+        g_assert (strcmp (gsk_http_header_lookup_misc (header0, "x-other"), "1") == 0);
+        g_object_unref (header0);
+        gsk_buffer_destruct (&buffer);
+        gsk_buffer_destruct (&out);
+      }
+  }
+
+  /* pre-rendered response headers */
+  {
+    GskHttpResponse *response = gsk_http_response_new_blank ();
+    GskHttpResponseTemplate *templ;
+    GskBuffer buffer = GSK_BUFFER_STATIC_INIT;
+    guint iter;
+
+    response->status_code = GSK_HTTP_STATUS_OK;
+    gsk_http_header_set_content_type (response, "text");
+    gsk_http_header_set_content_subtype (response, "plain");
+    gsk_http_header_set_date (response, 1000000000);
+    gsk_http_header_set_content_length (response, 99);
+    g_object_set (response, "e-tag", "old", "server", "gsk", NULL);
+    templ = gsk_http_response_template_new (response);
+    g_object_unref (response);
+
+    for (iter = 0; iter < 2; iter++)
+      {
+        GskHttpResponse *parsed;
+        gsk_http_response_template_write (templ, iter ? -1 : 42,
+                                          iter ? NULL : "\"abc\"", &buffer);
+        header0 = gsk_http_header_from_buffer (&buffer, FALSE, GSK_HTTP_PARSE_STRICT, NULL);
+        g_assert (header0 != NULL);
+        g_assert (buffer.size == 0);
+        parsed = GSK_HTTP_RESPONSE (header0);
+        g_assert (parsed->status_code == GSK_HTTP_STATUS_OK);
+        g_assert (strcmp (header0->content_type, "text") == 0);
+        g_assert (strcmp (header0->content_subtype, "plain") == 0);
+        g_assert (strcmp (parsed->server, "gsk") == 0);
+        g_assert (header0->date > 1000000000);
+        if (iter == 0)
+          {
+            g_assert (header0->content_length == 42);
+            g_assert (strcmp (parsed->etag, "\"abc\"") == 0);
+          }
+        else
+          {
+            g_assert (header0->content_length == -1);
+            g_assert (strcmp (parsed->etag, "old") == 0);
+          }
+        g_object_unref (header0);
+      }
+    gsk_http_response_template_unref (templ);
+  }
+
   test_cgi_parsing ("/whaever?a=1&b=42", FALSE,
                     "a", "1",
                     "b", "42",
@@ -0,0 +1,199 @@
+#include "../http/gskhttpserver.h"
+#include "../gskbufferstream.h"
+#include "../gskmemory.h"
+#include "../gskstreamfd.h"
+#include "../gskinit.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FILE_SIZE	(300 * 1000 + 7)
+
+static const char request_text[] =
+  "GET /file HTTP/1.1\r\n"
+  "Host: localhost\r\n"
+  "\r\n";
+
+static char *contents;
+
+static GskStream *
+make_file (void)
+{
+  char filename[] = "/tmp/test-http-server-sendfile-XXXXXX";
+  GError *error = NULL;
+  GskStream *file;
+  int fd = mkstemp (filename);
+  g_assert (fd >= 0);
+  g_assert (write (fd, contents, FILE_SIZE) == FILE_SIZE);
+  close (fd);
+  file = gsk_stream_fd_new_read_file (filename, &error);
+  g_assert (file != NULL);
+  unlink (filename);
+  return file;
+}
+
+/* Feed the server a request, and answer it with 'content'. */
+static void
+request_and_respond (GskHttpServer *server,
+                     GskStream     *content,
+                     gint64         content_length)
+{
+  GskHttpRequest *request;
+  GskHttpResponse *response;
+  GskStream *post_data;
+  GError *error = NULL;
+  gsk_stream_write (GSK_STREAM (server), request_text, strlen (request_text), &error);
+  g_assert (error == NULL);
+  g_assert (gsk_http_server_get_request (server, &request, &post_data));
+  g_assert (post_data == NULL);
+  response = gsk_http_response_from_request (request, GSK_HTTP_STATUS_OK, content_length);
+  gsk_http_response_set_content_type (response, "text");
+  gsk_http_response_set_content_subtype (response, "plain");
+  gsk_http_server_respond (server, request, response, content);
+  g_object_unref (response);
+  g_object_unref (request);
+}
+
+/* Read until the end of the response header,
+   one byte at a time so that none of the content is taken. */
+static void
+read_header (GskHttpServer *server,
+             GskBuffer     *header)
+{
+  GError *error = NULL;
+  while (gsk_buffer_str_index_of (header, "\r\n\r\n") < 0)
+    {
+      char c;
+      g_assert (gsk_stream_read (GSK_STREAM (server), &c, 1, &error) == 1);
+      g_assert (error == NULL);
+      gsk_buffer_append_char (header, c);
+    }
+}
+
+/* A file answered by a server attached to a socket
+   goes through gsk_stream_sendfile(). */
+static void
+test_sendfile_response (void)
+{
+  GskHttpServer *server = gsk_http_server_new ();
+  GskStream *file = make_file ();
+  GskStream *sock_a, *sock_b;
+  GskStream *hello;
+  GskBufferStream *memory_output;
+  GskBuffer *output_buffer;
+  GskBuffer header;
+  GError *error = NULL;
+  GskMainLoop *loop = gsk_main_loop_default ();
+  guint n_written;
+  gboolean use_sendfile;
+  char *got;
+
+  if (!gsk_stream_fd_duplex_pipe (&sock_a, &sock_b, &error))
+    g_error ("error creating socketpair: %s", error->message);
+  use_sendfile = gsk_stream_fd_get_transfer_mode (file, sock_a)
+              == GSK_STREAM_FD_TRANSFER_SENDFILE;
+  if (!use_sendfile)
+    g_message ("note: sendfile not available; testing buffered transfer");
+
+  request_and_respond (server, file, FILE_SIZE);
+  gsk_buffer_construct (&header);
+  read_header (server, &header);
+  g_assert (gsk_buffer_str_index_of (&header, "Content-Length: 300007\r\n") >= 0);
+  gsk_buffer_destruct (&header);
+
+  /* the body is offered as a file, and asking moves nothing */
+  g_assert (gsk_stream_sendfile (GSK_STREAM (server), sock_a, 0, &n_written, &error) == use_sendfile);
+  g_assert (error == NULL);
+  g_assert (n_written == 0);
+
+  /* but only to file-descriptors */
+  memory_output = gsk_buffer_stream_new ();
+  g_assert (!gsk_stream_sendfile (GSK_STREAM (server), GSK_STREAM (memory_output),
+                                  0, &n_written, &error));
+
+  gsk_stream_attach (GSK_STREAM (server), sock_a, &error);
+  g_assert (error == NULL);
+  gsk_stream_attach (sock_b, GSK_STREAM (memory_output), &error);
+  g_assert (error == NULL);
+
+  output_buffer = gsk_buffer_stream_peek_write_buffer (memory_output);
+  while (output_buffer->size < FILE_SIZE)
+    gsk_main_loop_run (loop, -1, NULL);
+  g_assert (output_buffer->size == FILE_SIZE);
+  got = g_malloc (FILE_SIZE);
+  gsk_buffer_read (output_buffer, got, FILE_SIZE);
+  g_assert (memcmp (got, contents, FILE_SIZE) == 0);
+  g_free (got);
+
+  /* the connection is kept alive, and goes back to buffering
+     for a response which isn't a file */
+  hello = gsk_memory_source_static_string ("hello");
+  request_and_respond (server, hello, 5);
+  g_object_unref (hello);
+  while (gsk_buffer_str_index_of (output_buffer, "\r\n\r\nhello") < 0)
+    gsk_main_loop_run (loop, -1, NULL);
+
+  gsk_io_read_shutdown (GSK_IO (server), NULL);
+  while (gsk_io_get_is_writable (memory_output))
+    gsk_main_loop_run (loop, -1, NULL);
+
+  g_object_unref (file);
+  g_object_unref (sock_a);
+  g_object_unref (sock_b);
+  g_object_unref (memory_output);
+  g_object_unref (server);
+}
+
+/* A reader which does not use gsk_stream_sendfile()
+   gets the file with gsk_stream_read(). */
+static void
+test_buffered_response (void)
+{
+  GskHttpServer *server = gsk_http_server_new ();
+  GskStream *file = make_file ();
+  GskBuffer buffer;
+  GError *error = NULL;
+  char *got;
+  int header_len;
+
+  request_and_respond (server, file, FILE_SIZE);
+  gsk_buffer_construct (&buffer);
+  while ((header_len = gsk_buffer_str_index_of (&buffer, "\r\n\r\n")) < 0
+      || buffer.size < header_len + 4 + FILE_SIZE)
+    {
+      g_assert (gsk_stream_read_buffer (GSK_STREAM (server), &buffer, &error) > 0);
+      g_assert (error == NULL);
+    }
+  g_assert (buffer.size == header_len + 4 + FILE_SIZE);
+  gsk_buffer_discard (&buffer, header_len + 4);
+  got = g_malloc (FILE_SIZE);
+  gsk_buffer_read (&buffer, got, FILE_SIZE);
+  g_assert (memcmp (got, contents, FILE_SIZE) == 0);
+  g_free (got);
+
+  /* nothing more until the next request */
+  g_assert (gsk_stream_read_buffer (GSK_STREAM (server), &buffer, &error) == 0);
+  g_assert (error == NULL);
+
+  gsk_buffer_destruct (&buffer);
+  g_object_unref (file);
+  g_object_unref (server);
+}
+
+int main (int argc, char **argv)
+{
+  guint i;
+
+  gsk_init_without_threads (&argc, &argv);
+
+  contents = g_malloc (FILE_SIZE);
+  for (i = 0; i < FILE_SIZE; i++)
+    contents[i] = 'a' + (i * 7 + i / 251) % 26;
+
+  test_sendfile_response ();
+  test_buffered_response ();
+
+  g_free (contents);
+  return 0;
+}
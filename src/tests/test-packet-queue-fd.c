@@ -0,0 +1,177 @@
+/* Send more than one batch of packets over loopback UDP
+   to a batched GskPacketQueueFd, which echoes them back
+   from its read-hook. */
+#include "../gskpacketqueuefd.h"
+#include "../gskmainloop.h"
+#include "../gskinit.h"
+#include <string.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define BATCH_SIZE      4
+#define N_PACKETS       (BATCH_SIZE * 5 + 1)
+
+static GskPacketQueue *server;
+static GskPacketQueue *client;
+static GskSocketAddress *server_address;
+static GskSocketAddress *client_address;
+
+static guint n_received = 0;
+static guint n_echoed = 0;
+
+/* the first packet is kept until the end,
+   so its buffer must not be reused. */
+static GskPacket *kept_packet = NULL;
+
+/* buffers received into, other than kept_packet's */
+static gconstpointer buffers[N_PACKETS];
+static guint n_buffers = 0;
+
+static GskPacketQueue *
+make_bound_queue (GskSocketAddress **address_out)
+{
+  GError *error = NULL;
+  GskSocketAddress *address = gsk_socket_address_ipv4_localhost (0);
+  GskPacketQueue *queue = gsk_packet_queue_fd_new_bound (address, &error);
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  if (queue == NULL)
+    g_error ("error binding packet-queue: %s", error->message);
+  g_object_unref (address);
+
+  /* find the port the kernel chose */
+  if (getsockname (GSK_PACKET_QUEUE_FD (queue)->fd,
+                   (struct sockaddr *) &addr, &addr_len) < 0)
+    g_error ("getsockname failed");
+  *address_out = gsk_socket_address_from_native (&addr, addr_len);
+  g_assert (*address_out != NULL);
+  return queue;
+}
+
+static GskPacket *
+make_packet (guint index)
+{
+  char buf[64];
+  g_snprintf (buf, sizeof (buf), "packet %u", index);
+  return gsk_packet_new_copy (buf, strlen (buf));
+}
+
+static void
+check_packet (GskPacket *packet, guint index)
+{
+  char buf[64];
+  g_snprintf (buf, sizeof (buf), "packet %u", index);
+  g_assert (packet->len == strlen (buf));
+  g_assert (memcmp (packet->data, buf, packet->len) == 0);
+}
+
+static gboolean
+handle_server_readable (GskIO *io, gpointer data)
+{
+  GError *error = NULL;
+  GskPacket *packet = gsk_packet_queue_read (server, TRUE, &error);
+  GskPacket *echo;
+  guint i;
+  if (packet == NULL)
+    {
+      if (error)
+        g_error ("error reading packet: %s", error->message);
+      return TRUE;
+    }
+  check_packet (packet, n_received);
+  g_assert (gsk_socket_address_equals (packet->src_address, client_address));
+
+  echo = gsk_packet_new_copy (packet->data, packet->len);
+  gsk_packet_set_dst_address (echo, packet->src_address);
+  if (!gsk_packet_queue_write (server, echo, &error))
+    g_error ("error echoing packet %u: %s",
+             n_received, error ? error->message : "would block");
+  gsk_packet_unref (echo);
+
+  if (n_received == 0)
+    kept_packet = packet;
+  else
+    {
+      /* the buffer must not be shared with a live packet */
+      g_assert (packet->data != kept_packet->data);
+      for (i = 0; i < n_buffers; i++)
+        if (buffers[i] == packet->data)
+          break;
+      if (i == n_buffers)
+        buffers[n_buffers++] = packet->data;
+      gsk_packet_unref (packet);
+    }
+  n_received++;
+  return TRUE;
+}
+
+static gboolean
+handle_client_readable (GskIO *io, gpointer data)
+{
+  GError *error = NULL;
+  GskPacket *packet = gsk_packet_queue_read (client, TRUE, &error);
+  if (packet == NULL)
+    {
+      if (error)
+        g_error ("error reading echo: %s", error->message);
+      return TRUE;
+    }
+  check_packet (packet, n_echoed);
+  g_assert (gsk_socket_address_equals (packet->src_address, server_address));
+  gsk_packet_unref (packet);
+  n_echoed++;
+  return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+  GskMainLoop *loop;
+  GError *error = NULL;
+  guint i;
+
+  gsk_init_without_threads (&argc, &argv);
+  loop = gsk_main_loop_default ();
+
+  server = make_bound_queue (&server_address);
+  client = make_bound_queue (&client_address);
+  if (!gsk_packet_queue_fd_set_batch_size (GSK_PACKET_QUEUE_FD (server),
+                                           BATCH_SIZE, 64))
+    {
+      fprintf (stderr, "recvmmsg/sendmmsg not available: skipping test\n");
+      return 0;
+    }
+  gsk_io_trap_readable (server, handle_server_readable, NULL, NULL, NULL);
+  gsk_io_trap_readable (client, handle_client_readable, NULL, NULL, NULL);
+
+  /* queue every packet before the server runs,
+     so that it receives full batches */
+  for (i = 0; i < N_PACKETS; i++)
+    {
+      GskPacket *packet = make_packet (i);
+      gsk_packet_set_dst_address (packet, server_address);
+      if (!gsk_packet_queue_write (client, packet, &error))
+        g_error ("error writing packet %u: %s",
+                 i, error ? error->message : "would block");
+      gsk_packet_unref (packet);
+    }
+
+  while (n_echoed < N_PACKETS)
+    gsk_main_loop_run (loop, -1, NULL);
+  g_assert (n_received == N_PACKETS);
+
+  /* the released buffers were reused:  a batch only needs
+     a new buffer in place of kept_packet's */
+  g_assert (n_buffers <= BATCH_SIZE + 1);
+
+  /* a received packet may outlive its queue */
+  gsk_io_untrap_readable (server);
+  g_object_unref (server);
+  check_packet (kept_packet, 0);
+  gsk_packet_unref (kept_packet);
+
+  gsk_io_untrap_readable (client);
+  g_object_unref (client);
+  g_object_unref (server_address);
+  g_object_unref (client_address);
+  return 0;
+}
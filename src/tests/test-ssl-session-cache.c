@@ -0,0 +1,162 @@
+/* Test the sharded session cache used by the SSL streams. */
+#include <string.h>
+#include <time.h>
+#include "../ssl/gsksslsessioncache.h"
+
+#define N_SHARDS        16      /* as in gsksslsessioncache.c */
+
+static void
+store (GskSslSessionCache *cache,
+       const char         *key,
+       const char         *data,
+       gulong              expire_time)
+{
+  gsk_ssl_session_cache_store (cache, strlen (key), (const guint8 *) key,
+                               strlen (data), (const guint8 *) data,
+                               expire_time);
+}
+
+/* whether the key is cached, with the given data if non-NULL */
+static gboolean
+has (GskSslSessionCache *cache,
+     const char         *key,
+     const char         *data)
+{
+  guint len;
+  guint8 *found = gsk_ssl_session_cache_lookup (cache, strlen (key),
+                                                (const guint8 *) key, &len);
+  gboolean rv;
+  if (found == NULL)
+    return FALSE;
+  rv = data == NULL
+    || (len == strlen (data) && memcmp (found, data, len) == 0);
+  g_free (found);
+  return rv;
+}
+
+/* Whether two keys are kept in the same shard:
+   with room for one session per shard,
+   storing one evicts the other. */
+static gboolean
+same_shard (const char *a, const char *b)
+{
+  static GskSslSessionCache *probe = NULL;
+  gulong later = time (NULL) + 3600;
+  if (probe == NULL)
+    probe = gsk_ssl_session_cache_new (N_SHARDS);
+  gsk_ssl_session_cache_remove (probe, strlen (a), (const guint8 *) a);
+  store (probe, a, "a", later);
+  store (probe, b, "b", later);
+  return !has (probe, a, NULL);
+}
+
+/* Find n keys, including first, which share a shard. */
+static char **
+find_keys_in_shard (const char *first, guint n)
+{
+  char **rv = g_new (char *, n + 1);
+  guint found = 1;
+  guint i;
+  rv[0] = g_strdup (first);
+  for (i = 0; found < n; i++)
+    {
+      char *key = g_strdup_printf ("key-%u", i);
+      if (same_shard (first, key))
+        rv[found++] = key;
+      else
+        g_free (key);
+    }
+  rv[n] = NULL;
+  return rv;
+}
+
+int main (int argc, char **argv)
+{
+  GskSslSessionCache *cache;
+  gulong now = time (NULL);
+  gulong later = now + 3600;
+  char **keys;
+  guint i, n_found;
+
+  /* store, lookup, replace, remove */
+  cache = gsk_ssl_session_cache_new (1000);
+  g_assert (!has (cache, "a", NULL));
+  store (cache, "a", "session a", later);
+  store (cache, "b", "session b", later);
+  g_assert (has (cache, "a", "session a"));
+  g_assert (has (cache, "b", "session b"));
+  store (cache, "a", "new session a", later);
+  g_assert (has (cache, "a", "new session a"));
+  gsk_ssl_session_cache_remove (cache, 1, (const guint8 *) "a");
+  g_assert (!has (cache, "a", NULL));
+  g_assert (has (cache, "b", "session b"));
+
+  /* keys are binary */
+  gsk_ssl_session_cache_store (cache, 3, (const guint8 *) "x\0y",
+                               1, (const guint8 *) "1", later);
+  gsk_ssl_session_cache_store (cache, 3, (const guint8 *) "x\0z",
+                               1, (const guint8 *) "2", later);
+  g_assert (has (cache, "x", NULL) == FALSE);
+  {
+    guint len;
+    guint8 *data = gsk_ssl_session_cache_lookup (cache, 3, (const guint8 *) "x\0y", &len);
+    g_assert (data != NULL && len == 1 && data[0] == '1');
+    g_free (data);
+  }
+
+  /* expiry */
+  store (cache, "expired", "old", now - 1);
+  g_assert (!has (cache, "expired", NULL));
+  store (cache, "expired", "new", later);
+  g_assert (has (cache, "expired", "new"));
+
+  /* each shard keeps at most max_sessions/16 sessions:
+     the cache as a whole keeps at most max_sessions */
+  cache = gsk_ssl_session_cache_new (N_SHARDS * 3);
+  for (i = 0; i < 1000; i++)
+    {
+      char *key = g_strdup_printf ("many-%u", i);
+      store (cache, key, key, later);
+      g_free (key);
+    }
+  n_found = 0;
+  for (i = 0; i < 1000; i++)
+    {
+      char *key = g_strdup_printf ("many-%u", i);
+      if (has (cache, key, key))
+        n_found++;
+      g_free (key);
+    }
+  g_assert (n_found == N_SHARDS * 3);
+  g_assert (has (cache, "many-999", "many-999"));
+
+  /* the least recently used session of a shard is evicted */
+  keys = find_keys_in_shard ("lru", 4);
+  cache = gsk_ssl_session_cache_new (N_SHARDS * 3);
+  store (cache, keys[0], "0", later);
+  store (cache, keys[1], "1", later);
+  store (cache, keys[2], "2", later);
+  g_assert (has (cache, keys[0], "0"));         /* now the most recent */
+  store (cache, keys[3], "3", later);
+  g_assert (has (cache, keys[0], "0"));
+  g_assert (!has (cache, keys[1], NULL));
+  g_assert (has (cache, keys[2], "2"));
+  g_assert (has (cache, keys[3], "3"));
+
+  /* replacing a session does not evict another */
+  store (cache, keys[2], "2 again", later);
+  g_assert (has (cache, keys[0], "0"));
+  g_assert (has (cache, keys[2], "2 again"));
+  g_assert (has (cache, keys[3], "3"));
+
+  /* shrinking takes effect as sessions are stored */
+  gsk_ssl_session_cache_set_max_sessions (cache, N_SHARDS);
+  store (cache, keys[1], "1", later);
+  g_assert (has (cache, keys[1], "1"));
+  g_assert (!has (cache, keys[0], NULL));
+  g_assert (!has (cache, keys[2], NULL));
+  g_assert (!has (cache, keys[3], NULL));
+  g_strfreev (keys);
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include "../gskmainloop.h"
 #include <string.h>
 #include <stdlib.h>
+#include <openssl/ssl.h>
 
 static void
 usage()
@@ -24,15 +25,104 @@ usage()
 #define CLIENT_PASSWORD		NULL
 #endif
 
+/* connections made at once, to wait for the handshake pool */
+#define N_CONCURRENT		8
+
+static const char *client_cert_file = NULL;
+static const char *server_cert_file = NULL;
+static const char *client_key_file = NULL;
+static const char *server_key_file = NULL;
+
+/* A client and server talking through SSL streams,
+   with buffer-streams for their plaintext ends. */
+typedef struct _Connection Connection;
+struct _Connection
+{
+  GskBufferStream *client, *server;
+  GskStreamSsl *client_ssl, *server_ssl;
+};
+
+/* Connect, and send "hi mom" to the server and "hi dad" to the client. */
+static void
+connection_start (Connection *conn,
+                  const char *session_key)
+{
+  GError *error = NULL;
+  conn->server = gsk_buffer_stream_new ();
+  conn->client = gsk_buffer_stream_new ();
+  conn->server_ssl = GSK_STREAM_SSL (gsk_stream_ssl_new_server (server_cert_file, server_key_file, SERVER_PASSWORD, NULL, &error));
+  if (conn->server_ssl == NULL)
+    g_error (error->message);
+  conn->client_ssl = GSK_STREAM_SSL (gsk_stream_ssl_new_client_with_session (client_cert_file, client_key_file, CLIENT_PASSWORD, session_key, gsk_stream_ssl_peek_backend (conn->server_ssl), &error));
+  if (conn->client_ssl == NULL)
+    g_error (error->message);
+  if (!gsk_stream_attach_pair (GSK_STREAM (conn->server), GSK_STREAM (conn->server_ssl), NULL)
+   || !gsk_stream_attach_pair (GSK_STREAM (conn->client), GSK_STREAM (conn->client_ssl), NULL))
+    {
+      g_error ("error doing internal attachments");
+    }
+
+  gsk_buffer_append_string (gsk_buffer_stream_peek_read_buffer (conn->client), "hi mom");
+  gsk_buffer_stream_read_buffer_changed (conn->client);
+  gsk_buffer_append_string (gsk_buffer_stream_peek_read_buffer (conn->server), "hi dad");
+  gsk_buffer_stream_read_buffer_changed (conn->server);
+}
+
+static gboolean
+connection_got_greetings (Connection *conn)
+{
+  return gsk_buffer_stream_peek_write_buffer (conn->server)->size >= 6
+      && gsk_buffer_stream_peek_write_buffer (conn->client)->size >= 6;
+}
+
+/* Check the greetings, and close the connection. */
+static void
+connection_finish (Connection *conn)
+{
+  char buf[256];
+  g_assert (gsk_buffer_stream_peek_write_buffer (conn->server)->size == 6);
+  gsk_buffer_read (gsk_buffer_stream_peek_write_buffer (conn->server), buf, 6);
+  g_assert (memcmp (buf, "hi mom", 6) == 0);
+  gsk_buffer_stream_write_buffer_changed (conn->server);
+  g_assert (gsk_buffer_stream_peek_write_buffer (conn->client)->size == 6);
+  gsk_buffer_read (gsk_buffer_stream_peek_write_buffer (conn->client), buf, 6);
+  g_assert (memcmp (buf, "hi dad", 6) == 0);
+  gsk_buffer_stream_write_buffer_changed (conn->client);
+
+  gsk_io_shutdown (GSK_IO (conn->client), NULL);
+  while (gsk_io_get_is_writable (conn->server) || gsk_io_get_is_readable (conn->server))
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+  g_object_unref (conn->server);
+  g_object_unref (conn->client);
+  g_object_unref (conn->server_ssl);
+  g_object_unref (conn->client_ssl);
+}
+
+/* Run one connection, returning whether its session was resumed. */
+static gboolean
+test_connection (const char *session_key)
+{
+  Connection conn;
+  gboolean reused;
+  connection_start (&conn, session_key);
+  while (!connection_got_greetings (&conn))
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+  reused = SSL_session_reused (conn.client_ssl->ssl);
+  g_assert (reused == SSL_session_reused (conn.server_ssl->ssl));
+  connection_finish (&conn);
+  return reused;
+}
+
 int main(int argc, char **argv)
 {
   int i;
-  const char *client_cert_file = NULL;
-  const char *server_cert_file = NULL;
-  const char *client_key_file = NULL;
-  const char *server_key_file = NULL;
   const char *srcdir = NULL;
-  gsk_init_without_threads (&argc, &argv);
+  gboolean reused;
+  Connection conns[N_CONCURRENT];
+  gboolean all_done;
+
+  /* threads are needed for gsk_stream_ssl_set_handshake_offload() */
+  gsk_init (&argc, &argv, NULL);
   for (i = 1; i < argc; i++)
     {
       const char *arg = argv[i];
@@ -91,41 +181,42 @@ int main(int argc, char **argv)
   if (!g_file_test (client_key_file, G_FILE_TEST_EXISTS))
     g_error ("client_key_file file %s does not exist", client_key_file);
 
-  {
-    GskBufferStream *client, *server;
-    GskStreamSsl *client_ssl, *server_ssl;
-    char buf[256];
-    GError *error = NULL;
-    server = gsk_buffer_stream_new ();
-    client = gsk_buffer_stream_new ();
-    server_ssl = GSK_STREAM_SSL (gsk_stream_ssl_new_server (server_cert_file, server_key_file, SERVER_PASSWORD, NULL, &error));
-    if (server_ssl == NULL)
-      g_error (error->message);
-    client_ssl = GSK_STREAM_SSL (gsk_stream_ssl_new_client (client_cert_file, client_key_file, CLIENT_PASSWORD, gsk_stream_ssl_peek_backend (server_ssl), &error));
-    if (client_ssl == NULL)
-      g_error (error->message);
-    if (!gsk_stream_attach_pair (GSK_STREAM (server), GSK_STREAM (server_ssl), NULL)
-     || !gsk_stream_attach_pair (GSK_STREAM (client), GSK_STREAM (client_ssl), NULL))
-      {
-	g_error ("error doing internal attachments");
-      }
-
-    gsk_buffer_append_string (gsk_buffer_stream_peek_read_buffer (client), "hi mom");
-    gsk_buffer_stream_read_buffer_changed (client);
-    while (gsk_buffer_stream_peek_write_buffer (server)->size < 6)
-      gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
-    g_assert (gsk_buffer_stream_peek_write_buffer (server)->size == 6);
-    gsk_buffer_read (gsk_buffer_stream_peek_write_buffer (server), buf, 6);
-    g_assert (memcmp (buf, "hi mom", 6) == 0);
-    gsk_buffer_stream_write_buffer_changed (server);
-    gsk_io_shutdown (GSK_IO (client), NULL);
-    while (gsk_io_get_is_writable (server) || gsk_io_get_is_readable (server))
+  /* no session key:  never resumed */
+  reused = test_connection (NULL);
+  g_assert (!reused);
+  reused = test_connection (NULL);
+  g_assert (!reused);
+
+  /* later connections with a session key resume
+     the session of the first */
+  reused = test_connection ("test-ssl:resume");
+  g_assert (!reused);
+  reused = test_connection ("test-ssl:resume");
+  g_assert (reused);
+  reused = test_connection ("test-ssl:resume");
+  g_assert (reused);
+
+  /* handshakes in a thread-pool, one step at a time:
+     concurrent connections queue for it, and must all finish */
+  gsk_stream_ssl_set_handshake_offload (2, 1);
+  for (i = 0; i < N_CONCURRENT; i++)
+    connection_start (conns + i, NULL);
+  do
+    {
       gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
-    g_object_unref (server);
-    g_object_unref (client);
-    g_object_unref (server_ssl);
-    g_object_unref (client_ssl);
-  }
+      all_done = TRUE;
+      for (i = 0; i < N_CONCURRENT; i++)
+        if (!connection_got_greetings (conns + i))
+          all_done = FALSE;
+    }
+  while (!all_done);
+  for (i = 0; i < N_CONCURRENT; i++)
+    connection_finish (conns + i);
+
+  /* resumption works with offloading too */
+  reused = test_connection ("test-ssl:resume");
+  g_assert (reused);
+  gsk_stream_ssl_set_handshake_offload (0, 0);
 
   return 0;
 }
@@ -0,0 +1,82 @@
+#include "../gskbufferstream.h"
+#include "../gskstreamfd.h"
+#include "../gskinit.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FILE_SIZE	(300 * 1000 + 7)
+
+/* file --[sendfile]--> socket --[splice]--> pipe --[buffered]--> memory */
+int main (int argc, char **argv)
+{
+  char filename[] = "/tmp/test-stream-fd-sendfile-XXXXXX";
+  int fd;
+  guint i;
+  char *contents;
+  GskStream *file;
+  GskStream *sock_a, *sock_b;
+  GskStream *pipe_read, *pipe_write;
+  GskBufferStream *memory_output;
+  GskBuffer *output_buffer;
+  GError *error = NULL;
+  GskMainLoop *loop;
+  char *got;
+
+  gsk_init_without_threads (&argc, &argv);
+  loop = gsk_main_loop_default ();
+
+  contents = g_malloc (FILE_SIZE);
+  for (i = 0; i < FILE_SIZE; i++)
+    contents[i] = 'a' + (i * 7 + i / 251) % 26;
+  fd = mkstemp (filename);
+  g_assert (fd >= 0);
+  g_assert (write (fd, contents, FILE_SIZE) == FILE_SIZE);
+  close (fd);
+
+  file = gsk_stream_fd_new_read_file (filename, &error);
+  g_assert (file != NULL);
+  unlink (filename);
+  if (!gsk_stream_fd_duplex_pipe (&sock_a, &sock_b, &error))
+    g_error ("error creating socketpair: %s", error->message);
+  if (!gsk_stream_fd_pipe (&pipe_read, &pipe_write, &error))
+    g_error ("error creating pipe: %s", error->message);
+  memory_output = gsk_buffer_stream_new ();
+
+  /* zlib, ssl and the like would have to go through the buffer */
+  g_assert (gsk_stream_fd_get_transfer_mode (pipe_read, GSK_STREAM (memory_output))
+            == GSK_STREAM_FD_TRANSFER_BUFFERED);
+  if (gsk_stream_fd_get_transfer_mode (file, sock_a) == GSK_STREAM_FD_TRANSFER_BUFFERED)
+    g_message ("note: sendfile not available; testing buffered transfer");
+
+  gsk_stream_attach (file, sock_a, &error);
+  g_assert (error == NULL);
+  gsk_stream_attach (sock_b, pipe_write, &error);
+  g_assert (error == NULL);
+  gsk_stream_attach (pipe_read, GSK_STREAM (memory_output), &error);
+  g_assert (error == NULL);
+  g_object_unref (file);
+  g_object_unref (sock_a);
+  g_object_unref (sock_b);
+  g_object_unref (pipe_write);
+  g_object_unref (pipe_read);
+
+  output_buffer = gsk_buffer_stream_peek_write_buffer (memory_output);
+  while (output_buffer->size < FILE_SIZE)
+    gsk_main_loop_run (loop, -1, NULL);
+  g_assert (output_buffer->size == FILE_SIZE);
+
+  got = g_malloc (FILE_SIZE);
+  gsk_buffer_read (output_buffer, got, FILE_SIZE);
+  g_assert (memcmp (got, contents, FILE_SIZE) == 0);
+
+  /* the end-of-file should propagate all the way through */
+  while (gsk_io_get_is_writable (memory_output))
+    gsk_main_loop_run (loop, -1, NULL);
+
+  g_free (got);
+  g_free (contents);
+  g_object_unref (memory_output);
+  return 0;
+}
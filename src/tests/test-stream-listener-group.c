@@ -0,0 +1,141 @@
+/* Start a listener group with several workers, connect clients to it,
+   and check that they are all served and that the group stops cleanly. */
+#include "../gskstreamlistenergroup.h"
+#include "../gskstreamclient.h"
+#include "../gskmemory.h"
+#include "../gskinit.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define N_WORKERS       3
+#define N_CLIENTS       30
+
+static gint n_served[N_WORKERS];
+static guint n_replies;
+
+/* in a worker:  reply with the worker's index, and hang up */
+static gboolean
+handle_accept (GskStream    *stream,
+               gpointer      data,
+               GError      **error)
+{
+  guint index = GPOINTER_TO_UINT (data);
+  guint8 c8 = index;
+  guint8 *d = g_memdup (&c8, 1);
+  GskStream *source = gsk_memory_slab_source_new (d, 1, g_free, d);
+  gsk_stream_attach (source, stream, NULL);
+  gsk_io_read_shutdown (stream, NULL);
+  g_object_unref (source);
+  g_object_unref (stream);
+  g_atomic_int_inc (n_served + index);
+  return TRUE;
+}
+
+static void
+handle_listener_error (GError       *err,
+                       gpointer      data)
+{
+  g_error ("listener group: error accepting: %s", err->message);
+}
+
+static void
+setup_worker (GskStreamListener *listener,
+              guint              worker_index,
+              gpointer           setup_data)
+{
+  g_assert (setup_data == n_served);
+  g_assert (gsk_main_loop_default () != NULL);
+  gsk_stream_listener_handle_accept (listener, handle_accept,
+                                     handle_listener_error,
+                                     GUINT_TO_POINTER (worker_index), NULL);
+}
+
+static gboolean
+handle_client_readable (GskStream *stream, gpointer data)
+{
+  guint8 c;
+  GError *error = NULL;
+  guint n = gsk_stream_read (stream, &c, 1, &error);
+  if (error)
+    g_error ("error reading from worker: %s", error->message);
+  if (n == 1)
+    {
+      g_assert (c < N_WORKERS);
+      n_replies++;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Find a free TCP port on the loopback interface. */
+static guint
+find_free_port (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof (addr);
+  int fd = socket (PF_INET, SOCK_STREAM, 0);
+  g_assert (fd >= 0);
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+   || getsockname (fd, (struct sockaddr *) &addr, &addr_len) < 0)
+    g_error ("error finding a free port");
+  close (fd);
+  return ntohs (addr.sin_port);
+}
+
+static void
+test_group (GskStreamListenerGroupFlags flags)
+{
+  GskSocketAddress *address = gsk_socket_address_ipv4_localhost (find_free_port ());
+  GskStreamListenerGroup *group;
+  GError *error = NULL;
+  guint i, total;
+
+  memset (n_served, 0, sizeof (n_served));
+  n_replies = 0;
+  group = gsk_stream_listener_group_new (address, N_WORKERS, flags,
+                                         setup_worker, n_served, &error);
+  if (group == NULL)
+    g_error ("error creating listener group: %s", error->message);
+  g_assert (gsk_stream_listener_group_get_n_workers (group) == N_WORKERS);
+  for (i = 0; i < N_WORKERS; i++)
+    g_assert (gsk_stream_listener_group_peek_main_loop (group, i)
+              != gsk_main_loop_default ());
+
+  /* connect all the clients at once */
+  for (i = 0; i < N_CLIENTS; i++)
+    {
+      GskStream *client = gsk_stream_new_connecting (address, &error);
+      if (client == NULL)
+        g_error ("error connecting: %s", error->message);
+      gsk_io_trap_readable (client, handle_client_readable, NULL,
+                            client, g_object_unref);
+      gsk_io_write_shutdown (client, NULL);
+    }
+  while (n_replies < N_CLIENTS)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+
+  gsk_stream_listener_group_destroy (group);
+  total = 0;
+  for (i = 0; i < N_WORKERS; i++)
+    total += g_atomic_int_get (n_served + i);
+  g_assert (total == N_CLIENTS);
+  g_object_unref (address);
+}
+
+int main (int argc, char **argv)
+{
+  gsk_init (&argc, &argv, NULL);
+
+  /* one shared socket */
+  test_group (0);
+
+  /* a socket per worker, where SO_REUSEPORT is available */
+  test_group (GSK_STREAM_LISTENER_GROUP_REUSE_PORT);
+
+  return 0;
+}
@@ -26,6 +26,13 @@ confirm_squared_input_and_inc_count (gpointer run_data, gpointer result_data)
   count++;
 }
 
+static guint n_destroyed = 0;
+static void
+inc_destroyed (gpointer run_data, gpointer result_data)
+{
+  n_destroyed++;
+}
+
 static void
 set_count_to_user_data (gpointer user_data)
 {
@@ -58,11 +65,36 @@ int main (int argc, char **argv)
   while (count < 100)
     gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
 
+  /* many tiny tasks:  completions arrive in batches */
+  count = 0;
+  for (i = 0; i < 10000; i++)
+    gsk_thread_pool_push (pool,
+			  (i % 100 == 0) ? square_input_and_sleep : square_input,
+			  confirm_squared_input_and_inc_count,
+			  GUINT_TO_POINTER (i), NULL);
+  while (count < 10000)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+
   count = 0;
   gsk_thread_pool_destroy (pool, set_count_to_user_data,
 			   GUINT_TO_POINTER (31415));
   while (count != 31415)
     gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
 
+  /* destroying a busy pool:  every task is destroyed,
+     whether it ran or not */
+  pool = gsk_thread_pool_new (gsk_main_loop_default (), 2);
+  count = 0;
+  for (i = 0; i < 1000; i++)
+    gsk_thread_pool_push (pool,
+			  square_input_and_sleep,
+			  confirm_squared_input_and_inc_count,
+			  GUINT_TO_POINTER (i), inc_destroyed);
+  gsk_thread_pool_destroy (pool, set_count_to_user_data,
+			   GUINT_TO_POINTER (31415));
+  while (count != 31415)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+  g_assert (n_destroyed == 1000);
+
   return 0;
 }
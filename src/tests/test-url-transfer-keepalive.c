@@ -0,0 +1,305 @@
+/* Test the reuse of connections by GskUrlTransferHttp,
+   against a local GskHttpServer which counts its connections. */
+#include "../http/gskhttpcontent.h"
+#include "../url/gskurltransferhttp.h"
+#include "../gskstreamlistenersocket.h"
+#include "../gskmemory.h"
+#include "../gskmainloop.h"
+#include "../gskinit.h"
+#include <string.h>
+#include <sys/socket.h>
+
+static GskHttpContent *content;
+static GskSocketAddress *server_address;
+static guint port;
+
+static guint n_connections = 0;
+static GskStream *latest_connection = NULL;
+
+/* if set, the next request is not answered:
+   instead its connection is closed */
+static gboolean drop_next_request = FALSE;
+
+static gboolean
+handle_new_connection (GskStream    *stream,
+                       gpointer      data,
+                       GError      **error)
+{
+  GskHttpServer *server = gsk_http_server_new ();
+  gsk_http_content_manage_server (content, server);
+  if (!gsk_stream_attach_pair (GSK_STREAM (server), stream, error))
+    {
+      g_object_unref (server);
+      return FALSE;
+    }
+  g_object_unref (server);
+  n_connections++;
+  if (latest_connection != NULL)
+    g_object_unref (latest_connection);
+  latest_connection = stream;
+  return TRUE;
+}
+
+static gboolean
+close_latest_connection (gpointer data)
+{
+  gsk_io_shutdown (GSK_IO (latest_connection), NULL);
+  return FALSE;
+}
+
+static GskHttpContentResult
+handle_request (GskHttpContent        *content,
+                GskHttpContentHandler *handler,
+                GskHttpServer         *server,
+                GskHttpRequest        *request,
+                GskStream             *post_data,
+                gpointer               data)
+{
+  GskHttpResponse *response;
+  GskStream *stream;
+  if (drop_next_request)
+    {
+      drop_next_request = FALSE;
+      gsk_main_loop_add_timer (gsk_main_loop_default (),
+                               close_latest_connection, NULL, NULL,
+                               0, -1);
+      return GSK_HTTP_CONTENT_OK;
+    }
+  if (strcmp (request->path, "/empty") == 0)
+    {
+      /* no Content-Length, but the connection is still kept alive */
+      response = gsk_http_response_from_request (request, GSK_HTTP_STATUS_NO_CONTENT, -1);
+      GSK_HTTP_HEADER (response)->connection_type = GSK_HTTP_HEADER (request)->connection_type;
+      gsk_http_server_respond (server, request, response, NULL);
+      g_object_unref (response);
+      return GSK_HTTP_CONTENT_OK;
+    }
+  response = gsk_http_response_from_request (request, GSK_HTTP_STATUS_OK, 6);
+  if (request->verb == GSK_HTTP_VERB_HEAD)
+    stream = NULL;
+  else
+    stream = gsk_memory_source_static_string ("hi mom");
+  gsk_http_server_respond (server, request, response, stream);
+  g_object_unref (response);
+  if (stream != NULL)
+    g_object_unref (stream);
+  return GSK_HTTP_CONTENT_OK;
+}
+
+static void
+set_verb (GskHttpRequest *request,
+          gpointer        data)
+{
+  gsk_http_request_set_verb (request, GPOINTER_TO_UINT (data));
+}
+
+typedef struct _TransferData TransferData;
+struct _TransferData
+{
+  gboolean transfer_done;
+  gboolean stream_done;
+  GskBuffer incoming;
+  GError *error;
+};
+
+static gboolean
+handle_content_readable (GskStream *stream, gpointer data)
+{
+  TransferData *td = data;
+  gsk_stream_read_buffer (stream, &td->incoming, &td->error);
+  return TRUE;
+}
+
+static gboolean
+handle_content_read_shutdown (GskStream *stream, gpointer data)
+{
+  g_object_unref (stream);
+  return FALSE;
+}
+
+static void
+set_stream_done (gpointer data)
+{
+  TransferData *td = data;
+  td->stream_done = TRUE;
+}
+
+static void
+handle_transfer (GskUrlTransfer *transfer,
+                 gpointer        data)
+{
+  TransferData *td = data;
+  td->transfer_done = TRUE;
+  if (transfer->error)
+    td->error = g_error_copy (transfer->error);
+  else
+    {
+      g_assert (transfer->result == GSK_URL_TRANSFER_SUCCESS);
+      g_assert (transfer->content != NULL);
+      gsk_io_trap_readable (g_object_ref (transfer->content),
+                            handle_content_readable,
+                            handle_content_read_shutdown,
+                            td, set_stream_done);
+    }
+}
+
+/* Do 'verb' on 'path', returning whether it succeeded
+   and gave the content 'expected'.
+   Returns once the connection is free for another transfer. */
+static gboolean
+transfer_full (const char  *path,
+               GskHttpVerb  verb,
+               const char  *expected)
+{
+  GskUrl *url = gsk_url_new_from_parts (GSK_URL_SCHEME_HTTP,
+                                        "localhost", port,
+                                        NULL, NULL, path, NULL, NULL);
+  GskUrlTransfer *transfer = gsk_url_transfer_new (url);
+  GskUrlTransferHttp *http = GSK_URL_TRANSFER_HTTP (transfer);
+  GError *error = NULL;
+  TransferData td;
+  gboolean rv;
+
+  memset (&td, 0, sizeof (td));
+  gsk_buffer_construct (&td.incoming);
+  gsk_url_transfer_set_address_hint (transfer, server_address);
+  gsk_url_transfer_set_handler (transfer, handle_transfer, &td, NULL);
+  if (verb != GSK_HTTP_VERB_GET)
+    gsk_url_transfer_http_add_modifier (http, set_verb,
+                                        GUINT_TO_POINTER (verb), NULL);
+  if (!gsk_url_transfer_start (transfer, &error))
+    g_error ("error starting transfer: %s", error->message);
+  while (!td.stream_done && td.error == NULL)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+  while (http->undestroyed_requests > 0)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+
+  if (td.error == NULL)
+    {
+      guint len = strlen (expected);
+      char *buf = g_alloca (len);
+      g_assert (td.incoming.size == len);
+      gsk_buffer_read (&td.incoming, buf, len);
+      g_assert (memcmp (buf, expected, len) == 0);
+      rv = TRUE;
+    }
+  else
+    {
+      g_error_free (td.error);
+      rv = FALSE;
+    }
+  gsk_buffer_destruct (&td.incoming);
+  g_object_unref (transfer);
+  g_object_unref (url);
+  return rv;
+}
+
+/* Get (or post to) /x. */
+static gboolean
+transfer (gboolean post)
+{
+  return transfer_full ("/x", post ? GSK_HTTP_VERB_POST : GSK_HTTP_VERB_GET,
+                        "hi mom");
+}
+
+static gboolean
+set_flag (gpointer data)
+{
+  * (gboolean *) data = TRUE;
+  return FALSE;
+}
+
+int main (int argc, char **argv)
+{
+  GskHttpContentId id = GSK_HTTP_CONTENT_ID_INIT;
+  GskHttpContentHandler *handler;
+  GskUrlTransferHttpKeepaliveConfig config;
+  GskStreamListener *listener;
+  GskSocketAddress *bind_address;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  GError *error = NULL;
+  gboolean timed_out = FALSE;
+
+  gsk_init_without_threads (&argc, &argv);
+
+  content = gsk_http_content_new ();
+  handler = gsk_http_content_handler_new (handle_request, NULL, NULL);
+  id.path = "/x";
+  gsk_http_content_add_handler (content, &id, handler, GSK_HTTP_CONTENT_REPLACE);
+  id.path = "/empty";
+  gsk_http_content_add_handler (content, &id, handler, GSK_HTTP_CONTENT_REPLACE);
+  gsk_http_content_handler_unref (handler);
+
+  bind_address = gsk_socket_address_ipv4_localhost (0);
+  listener = gsk_stream_listener_socket_new_bind (bind_address, &error);
+  if (listener == NULL)
+    g_error ("error binding: %s", error->message);
+  g_object_unref (bind_address);
+  if (getsockname (GSK_STREAM_LISTENER_SOCKET (listener)->fd,
+                   (struct sockaddr *) &addr, &addr_len) < 0)
+    g_error ("getsockname failed");
+  server_address = gsk_socket_address_from_native (&addr, addr_len);
+  port = GSK_SOCKET_ADDRESS_IPV4 (server_address)->ip_port;
+  gsk_stream_listener_handle_accept (listener, handle_new_connection,
+                                     NULL, NULL, NULL);
+
+  /* keepalive is off by default */
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 2);
+
+  gsk_url_transfer_http_get_keepalive_config (&config);
+  config.keepalive = TRUE;
+  config.max_idle_millis = 100;
+  gsk_url_transfer_http_set_keepalive_config (&config);
+
+  /* sequential transfers share one connection */
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 3);
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 3);
+
+  /* responses which never have a body need no Content-Length
+     (and HEAD responses' Content-Length is not a body) */
+  if (!transfer_full ("/empty", GSK_HTTP_VERB_GET, ""))
+    g_error ("transfer failed");
+  if (!transfer_full ("/x", GSK_HTTP_VERB_HEAD, ""))
+    g_error ("transfer failed");
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 3);
+
+  /* an idle connection is closed after max_idle_millis */
+  gsk_main_loop_add_timer (gsk_main_loop_default (), set_flag, &timed_out,
+                           NULL, 300, -1);
+  while (!timed_out)
+    gsk_main_loop_run (gsk_main_loop_default (), -1, NULL);
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 4);
+
+  /* if the server closes a kept-alive connection
+     instead of answering a GET, the GET is retried
+     on a new connection */
+  drop_next_request = TRUE;
+  if (!transfer (FALSE))
+    g_error ("transfer failed");
+  g_assert (n_connections == 5);
+
+  /* ... but a POST is not retried, since it may have had an effect */
+  drop_next_request = TRUE;
+  if (transfer (TRUE))
+    g_error ("POST was retried");
+  g_assert (n_connections == 5);
+
+  g_object_unref (listener);
+  g_object_unref (server_address);
+  return 0;
+}
@@ -2,6 +2,7 @@
 
 #include "gskurltransferhttp.h"
 #include "../gsknameresolver.h"
+#include "../gskmainloop.h"
 #include "../gskstreamclient.h"
 #include "../ssl/gskstreamssl.h"
 #include "../http/gskhttpclient.h"
@@ -20,18 +21,388 @@ struct _GskUrlTransferHttpModifierNode
   GskUrlTransferHttpModifierNode *next;
 };
 
+/* --- keepalive connection pool --- */
+
+/* A connection to a server, with its http-client.
+   A pooled connection belongs to a bin while it may be reused:
+   it is then either busy (some requests are queued on its client)
+   or idle (waiting in the bin to be reused or to time out). */
+struct _GskUrlTransferHttpConnection
+{
+  guint ref_count;
+  GskUrlTransferHttpPoolBin *bin;       /* NULL once no longer reusable */
+  GskStream *raw_transport;
+  GskHttpClient *http_client;
+  guint n_active;                       /* requests queued on http_client */
+  guint n_requests;                     /* requests ever issued */
+  guint pooled : 1;
+  guint reusable : 1;
+  GskSource *idle_timeout;
+};
+
+/* All the connections to one server.  A bin is freed
+   once it has no connections and no waiting transfers
+   (see bin_free_if_unused()), or with its main-loop. */
+struct _GskUrlTransferHttpPoolBin
+{
+  char *key;
+  GHashTable *bins;                     /* the pool, containing this */
+  guint n_users;                        /* functions using the bin now */
+  guint n_connections;                  /* busy and idle */
+  GQueue idle;                          /* most recently used first */
+  GQueue busy;
+  GQueue waiting;                       /* GskUrlTransferHttps, referenced */
+};
+
+/* The pool is per-main-loop, so it needs no locking;
+   only the configuration is shared between threads. */
+G_LOCK_DEFINE_STATIC (keepalive_config);
+static GskUrlTransferHttpKeepaliveConfig keepalive_config =
+{
+  FALSE,        /* keepalive: off until the application enables it */
+  8,            /* max_keepalive_clients */
+  5000,         /* max_idle_millis */
+  0,            /* max_connections */
+  1             /* max_pipelined */
+};
+
+static GQuark pool_quark = 0;
+
+/* Information about one request, passed to the GskHttpClient */
+typedef struct _RequestInfo RequestInfo;
+struct _RequestInfo
+{
+  GskUrlTransferHttp *http;
+  GskUrlTransferHttpConnection *connection;
+  gboolean got_response;
+
+  /* if the request was not the first on its connection,
+     the server may have closed the connection before seeing it,
+     so it may be retried once on a new connection,
+     if sending it twice is harmless (RFC 2616, 8.1.4)
+     and it has no upload, which cannot be replayed */
+  gboolean retryable;
+};
+
+static void
+get_keepalive_config (GskUrlTransferHttpKeepaliveConfig *config)
+{
+  G_LOCK (keepalive_config);
+  *config = keepalive_config;
+  G_UNLOCK (keepalive_config);
+}
+
+static inline GskUrlTransferHttpConnection *
+connection_ref (GskUrlTransferHttpConnection *connection)
+{
+  ++(connection->ref_count);
+  return connection;
+}
+
+static void
+connection_unref (GskUrlTransferHttpConnection *connection)
+{
+  g_assert (connection->ref_count > 0);
+  if (--(connection->ref_count) == 0)
+    {
+      g_assert (connection->bin == NULL);
+      g_assert (connection->idle_timeout == NULL);
+      g_object_unref (connection->http_client);
+      g_object_unref (connection->raw_transport);
+      g_free (connection);
+    }
+}
+
+/* Remove a connection from its bin, so that it will not be reused. */
+static void
+connection_detach (GskUrlTransferHttpConnection *connection)
+{
+  GskUrlTransferHttpPoolBin *bin = connection->bin;
+  connection->reusable = FALSE;
+  if (bin == NULL)
+    return;
+  if (connection->idle_timeout != NULL)
+    {
+      gsk_source_remove (connection->idle_timeout);
+      connection->idle_timeout = NULL;
+    }
+  g_queue_remove (&bin->idle, connection);
+  g_queue_remove (&bin->busy, connection);
+  --(bin->n_connections);
+  connection->bin = NULL;
+  connection_unref (connection);        /* the bin's reference */
+}
+
+/* Stop reusing a connection, and close it once
+   its queued requests are done. */
+static void
+connection_close (GskUrlTransferHttpConnection *connection)
+{
+  GskHttpClient *http_client = connection->http_client;
+  g_object_ref (http_client);
+  connection_detach (connection);
+  if ((GSK_HTTP_CLIENT_HOOK (http_client)->user_flags & GSK_HTTP_CLIENT_DEFERRED_SHUTDOWN) == 0)
+    gsk_http_client_shutdown_when_done (http_client);
+  g_object_unref (http_client);
+}
+
+static gboolean
+connection_is_alive (GskUrlTransferHttpConnection *connection)
+{
+  return gsk_io_get_is_readable (connection->http_client)
+      && gsk_io_get_is_writable (connection->http_client)
+      && gsk_io_get_is_readable (connection->raw_transport)
+      && gsk_io_get_is_writable (connection->raw_transport);
+}
+
+static void bin_dispatch_waiting (GskUrlTransferHttpPoolBin *bin);
+
+/* Free a bin which is no longer needed,
+   so that the pool does not keep one for every server ever used. */
+static void
+bin_free_if_unused (GskUrlTransferHttpPoolBin *bin)
+{
+  if (bin->n_connections > 0
+   || bin->waiting.length > 0
+   || bin->n_users > 0)
+    return;
+  g_hash_table_remove (bin->bins, bin->key);
+  g_free (bin->key);
+  g_free (bin);
+}
+
+static gboolean
+handle_idle_timeout (gpointer data)
+{
+  GskUrlTransferHttpConnection *connection = data;
+  GskUrlTransferHttpPoolBin *bin = connection->bin;
+  connection->idle_timeout = NULL;
+  connection_close (connection);
+  bin_dispatch_waiting (bin);
+  return FALSE;
+}
+
+/* Called when the last request queued on a reusable connection is done. */
+static void
+connection_make_idle (GskUrlTransferHttpConnection *connection)
+{
+  GskUrlTransferHttpPoolBin *bin = connection->bin;
+  GskUrlTransferHttpKeepaliveConfig config;
+  get_keepalive_config (&config);
+
+  if (!connection_is_alive (connection))
+    {
+      connection_detach (connection);
+      return;
+    }
+  g_queue_remove (&bin->busy, connection);
+  g_queue_push_head (&bin->idle, connection);
+  connection->idle_timeout = gsk_main_loop_add_timer (gsk_main_loop_default (),
+                                                      handle_idle_timeout,
+                                                      connection,
+                                                      NULL,
+                                                      config.max_idle_millis,
+                                                      -1);
+
+  /* max_keepalive_clients is at least 1, so this
+     never closes the connection we just added. */
+  while (bin->idle.length > config.max_keepalive_clients)
+    connection_close (g_queue_peek_tail (&bin->idle));
+}
+
+/* Find a connection in the bin to use for a new request.
+   Returns FALSE if the request must wait for one;
+   otherwise *connection_out is the connection to use,
+   or NULL if a new connection should be made.
+   If fresh is set, a new connection is always made. */
+static gboolean
+bin_checkout (GskUrlTransferHttpPoolBin          *bin,
+              GskUrlTransferHttpKeepaliveConfig  *config,
+              gboolean                            fresh,
+              GskUrlTransferHttpConnection      **connection_out)
+{
+  GskUrlTransferHttpConnection *connection;
+  GList *at;
+
+  *connection_out = NULL;
+  if (fresh)
+    return TRUE;
+
+  /* reuse the most recently used idle connection */
+  while ((connection = g_queue_peek_head (&bin->idle)) != NULL)
+    {
+      if (!connection_is_alive (connection))
+        {
+          /* the server closed it */
+          connection_close (connection);
+          continue;
+        }
+      gsk_source_remove (connection->idle_timeout);
+      connection->idle_timeout = NULL;
+      g_queue_pop_head (&bin->idle);
+      g_queue_push_tail (&bin->busy, connection);
+      *connection_out = connection;
+      return TRUE;
+    }
+
+  if (config->max_connections == 0
+   || bin->n_connections < config->max_connections)
+    return TRUE;
+
+  /* pipeline onto the least busy connection */
+  if (config->max_pipelined > 1)
+    {
+      GskUrlTransferHttpConnection *best = NULL;
+      for (at = bin->busy.head; at != NULL; at = at->next)
+        {
+          connection = at->data;
+          if (connection->reusable
+           && connection->n_active < config->max_pipelined
+           && (best == NULL || connection->n_active < best->n_active))
+            best = connection;
+        }
+      if (best != NULL)
+        {
+          *connection_out = best;
+          return TRUE;
+        }
+    }
+  return FALSE;
+}
+
+static char *
+make_bin_key (GskUrlTransferHttp *http,
+              GskUrl             *url,
+              GskSocketAddress   *address)
+{
+  char *addr_str = gsk_socket_address_to_string (address);
+  char *rv;
+  if (url->scheme == GSK_URL_SCHEME_HTTPS)
+    rv = g_strdup_printf ("https:%s@%s:%s", url->host, addr_str,
+                          http->ssl_cert ? http->ssl_cert : "");
+  else
+    rv = g_strdup_printf ("http:%s", addr_str);
+  g_free (addr_str);
+  return rv;
+}
+
+static void
+pool_destroy_bin (gpointer key,
+                  gpointer value,
+                  gpointer data)
+{
+  GskUrlTransferHttpPoolBin *bin = value;
+  GskUrlTransferHttpConnection *connection;
+  GskUrlTransferHttp *http;
+
+  /* The main-loop is being destroyed, so its sources are gone:
+     just forget the connections. */
+  while ((connection = g_queue_pop_head (&bin->idle)) != NULL
+      || (connection = g_queue_pop_head (&bin->busy)) != NULL)
+    {
+      connection->idle_timeout = NULL;
+      connection->bin = NULL;
+      connection->reusable = FALSE;
+      connection_unref (connection);
+    }
+  while ((http = g_queue_pop_head (&bin->waiting)) != NULL)
+    {
+      http->waiting_bin = NULL;
+      g_object_unref (http);
+    }
+  g_free (bin->key);
+  g_free (bin);
+}
+
+static void
+pool_destroy (gpointer data)
+{
+  GHashTable *bins = data;
+  g_hash_table_foreach (bins, pool_destroy_bin, NULL);
+  g_hash_table_destroy (bins);
+}
+
+static GskUrlTransferHttpPoolBin *
+get_pool_bin (GskUrlTransferHttp *http,
+              GskUrl             *url,
+              GskSocketAddress   *address)
+{
+  GskMainLoop *loop = gsk_main_loop_default ();
+  GHashTable *bins;
+  GskUrlTransferHttpPoolBin *bin;
+  char *key;
+
+  if (pool_quark == 0)
+    pool_quark = g_quark_from_static_string ("gsk-url-transfer-http-pool");
+  bins = g_object_get_qdata (G_OBJECT (loop), pool_quark);
+  if (bins == NULL)
+    {
+      bins = g_hash_table_new (g_str_hash, g_str_equal);
+      g_object_set_qdata_full (G_OBJECT (loop), pool_quark, bins, pool_destroy);
+    }
+
+  key = make_bin_key (http, url, address);
+  bin = g_hash_table_lookup (bins, key);
+  if (bin == NULL)
+    {
+      bin = g_new0 (GskUrlTransferHttpPoolBin, 1);
+      bin->key = key;
+      bin->bins = bins;
+      g_hash_table_insert (bins, bin->key, bin);
+    }
+  else
+    g_free (key);
+  return bin;
+}
+
+static gboolean
+response_allows_keepalive (GskHttpRequest  *request,
+                           GskHttpResponse *response)
+{
+  GskHttpHeader *header = GSK_HTTP_HEADER (response);
+  if (gsk_http_header_get_connection_type (header) == GSK_HTTP_CONNECTION_CLOSE)
+    return FALSE;
+
+  /* these never have a body, so they need no length (RFC 2616, 4.4) */
+  if (request->verb == GSK_HTTP_VERB_HEAD
+   || response->status_code == GSK_HTTP_STATUS_NO_CONTENT
+   || response->status_code == GSK_HTTP_STATUS_NOT_MODIFIED)
+    return TRUE;
+
+  return header->transfer_encoding_type == GSK_HTTP_TRANSFER_ENCODING_CHUNKED
+      || header->content_length >= 0;
+}
+
+static void connect_and_request (GskUrlTransferHttp *http,
+                                 gboolean            fresh);
+
 static void
 handle_http_response (GskHttpRequest  *request,
                       GskHttpResponse *response,
                       GskStream       *input,
                       gpointer         hook_data)
 {
-  GskUrlTransfer *transfer = GSK_URL_TRANSFER (hook_data);
-  GskUrlTransferHttp *http = GSK_URL_TRANSFER_HTTP (hook_data);
+  RequestInfo *info = hook_data;
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (info->http);
+  GskUrlTransferHttp *http = info->http;
+
+  info->got_response = TRUE;
+  if (info->connection->bin != NULL
+   && !response_allows_keepalive (request, response))
+    {
+      GskUrlTransferHttpPoolBin *bin = info->connection->bin;
+      connection_close (info->connection);
+      bin_free_if_unused (bin);
+    }
 
   ++(http->response_count);
   if (gsk_url_transfer_is_done (transfer))
-    return;
+    {
+      /* discard the content (a pooled connection remains usable) */
+      if (input)
+        gsk_io_read_shutdown (input, NULL);
+      return;
+    }
 
   /* For exposition we retain copy
      the entire list of GskHttpStatusCodes.
@@ -183,8 +554,21 @@ handle_http_response (GskHttpRequest  *request,
 static void
 http_client_request_destroyed (gpointer data)
 {
-  GskUrlTransfer *transfer = GSK_URL_TRANSFER (data);
-  GskUrlTransferHttp *http = GSK_URL_TRANSFER_HTTP (data);
+  RequestInfo *info = data;
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (info->http);
+  GskUrlTransferHttp *http = info->http;
+  GskUrlTransferHttpConnection *connection = info->connection;
+  GskUrlTransferHttpPoolBin *bin = connection->bin;
+
+  g_assert (connection->n_active > 0);
+  --(connection->n_active);
+  if (bin != NULL)
+    {
+      if (!info->got_response || !connection->reusable)
+        connection_detach (connection);
+      else if (connection->n_active == 0)
+        connection_make_idle (connection);
+    }
 
   /* http invariant */
   g_assert (http->response_count <= http->request_count);
@@ -197,81 +581,158 @@ http_client_request_destroyed (gpointer data)
    && http->undestroyed_requests == 0
    && http->response_count < http->request_count)
     {
-      /* transfer has been aborted for mysterious reasons */
-      gsk_url_transfer_take_error (transfer,
-                                   g_error_new (GSK_G_ERROR_DOMAIN, 
-                                                GSK_ERROR_BAD_FORMAT,
-                                                "unable to get HTTP response from server"));
-      gsk_url_transfer_notify_done (transfer, GSK_URL_TRANSFER_ERROR_SERVER_ERROR);
+      if (info->retryable && !http->retried)
+        {
+          /* the server probably closed a kept-alive connection */
+          http->retried = TRUE;
+          connect_and_request (http, TRUE);
+        }
+      else
+        {
+          /* transfer has been aborted for mysterious reasons */
+          gsk_url_transfer_take_error (transfer,
+                                       g_error_new (GSK_G_ERROR_DOMAIN, 
+                                                    GSK_ERROR_BAD_FORMAT,
+                                                    "unable to get HTTP response from server"));
+          gsk_url_transfer_notify_done (transfer, GSK_URL_TRANSFER_ERROR_SERVER_ERROR);
+        }
     }
+
+  if (bin != NULL)
+    bin_dispatch_waiting (bin);
+
+  connection_unref (connection);
   g_object_unref (transfer);
+  g_free (info);
 }
 
-static void
-handle_name_resolution_succeeded (GskSocketAddress *address,
-                                  gpointer          data)
+/* Connect to transfer->address, and attach an http-client. */
+static GskUrlTransferHttpConnection *
+connection_new (GskUrlTransferHttp   *http,
+                GskUrl               *url,
+                GskUrlTransferResult *result_out,
+                GError              **error)
 {
-  GskUrlTransfer *transfer = GSK_URL_TRANSFER (data);
-  GskUrlTransferHttp *http = GSK_URL_TRANSFER_HTTP (data);
-  GError *error = NULL;
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (http);
+  GskUrlTransferHttpConnection *connection;
+  GskStream *raw_transport;
   GskStream *transport;
-  GskHttpClient *http_client;
-  GskHttpRequest *http_request;
-  GskStream *upload_stream;
-  GskUrlTransferHttpModifierNode *modifier;
-  GskUrl *url = transfer->redirect_url ? transfer->redirect_url : transfer->url;
+  GError *attach_error = NULL;
 
-  if (gsk_url_transfer_is_done (transfer))
-    return;
-
-  /* Create actual address (with correct port) */
-  {
-    GskSocketAddressIpv4 *found = GSK_SOCKET_ADDRESS_IPV4 (address);
-    GskSocketAddress *addr;
-    guint url_port = gsk_url_get_port (url);
-    if (http->is_proxy || found->ip_port == url_port)
-      addr = g_object_ref (address);
-    else
-      addr = gsk_socket_address_ipv4_new (found->ip_address, url_port);
-    gsk_url_transfer_set_address (transfer, addr);
-
-    /* Create a TCP connection to that address. */
-    if (http->raw_transport != NULL)
-      {
-        /* from a redirect */
-        g_object_unref (http->raw_transport);
-      }
-    http->raw_transport = gsk_stream_new_connecting (addr, &error);
-    if (http->raw_transport == NULL)
-      {
-        gsk_url_transfer_take_error (transfer, error);
-        gsk_url_transfer_notify_done (transfer, GSK_URL_TRANSFER_ERROR_NO_SERVER);
-        return;
-      }
-    g_object_unref (addr);
-    addr = NULL;
-  }
+  /* Create a TCP connection to that address. */
+  raw_transport = gsk_stream_new_connecting (transfer->address, error);
+  if (raw_transport == NULL)
+    {
+      *result_out = GSK_URL_TRANSFER_ERROR_NO_SERVER;
+      return NULL;
+    }
 
   /* For SSL streams, create the ssl-transport */
   if (url->scheme == GSK_URL_SCHEME_HTTPS)
     {
-      transport = gsk_stream_ssl_new_client (http->ssl_cert,
-                                             http->ssl_key,
-                                             http->ssl_password,
-                                             http->raw_transport,
-                                             &error);
+      /* resume the last session with this server, if possible;
+         only with the same client certificate, since a session
+         carries the authentication it was negotiated with */
+      char *session_key = g_strdup_printf ("%s:%u|%s|%s", url->host,
+                                           gsk_url_get_port (url),
+                                           http->ssl_cert ? http->ssl_cert : "",
+                                           http->ssl_key ? http->ssl_key : "");
+      transport = gsk_stream_ssl_new_client_with_session (http->ssl_cert,
+                                                          http->ssl_key,
+                                                          http->ssl_password,
+                                                          session_key,
+                                                          raw_transport,
+                                                          error);
+      g_free (session_key);
       if (transport == NULL)
         {
-          gsk_url_transfer_take_error (transfer, error);
-          gsk_url_transfer_notify_done (transfer, GSK_URL_TRANSFER_ERROR_BAD_REQUEST);
-          return;
+          g_object_unref (raw_transport);
+          *result_out = GSK_URL_TRANSFER_ERROR_BAD_REQUEST;
+          return NULL;
         }
     }
   else
     {
       /* otherwise, use the raw_transport directly. */
-      transport = g_object_ref (http->raw_transport);
+      transport = g_object_ref (raw_transport);
+    }
+
+  connection = g_new0 (GskUrlTransferHttpConnection, 1);
+  connection->ref_count = 1;
+  connection->raw_transport = raw_transport;
+  connection->http_client = gsk_http_client_new ();
+  if (!gsk_stream_attach_pair (transport, GSK_STREAM (connection->http_client), &attach_error))
+    {
+      g_warning ("gsk_stream_attach_pair: transport/http-client: %s", attach_error->message);
+      g_clear_error (&attach_error);
     }
+  g_object_unref (transport);
+  return connection;
+}
+
+/* Whether repeating a request has the same effect
+   as making it once (RFC 2616, 9.1.2). */
+static gboolean
+verb_is_idempotent (GskHttpVerb verb)
+{
+  switch (verb)
+    {
+    case GSK_HTTP_VERB_GET:
+    case GSK_HTTP_VERB_HEAD:
+    case GSK_HTTP_VERB_OPTIONS:
+    case GSK_HTTP_VERB_PUT:
+    case GSK_HTTP_VERB_DELETE:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+}
+
+/* Issue the transfer's request on a connection,
+   or on a new one if connection is NULL. */
+static void
+start_on_connection (GskUrlTransferHttp           *http,
+                     GskUrlTransferHttpPoolBin    *bin,
+                     GskUrlTransferHttpConnection *connection)
+{
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (http);
+  GError *error = NULL;
+  GskHttpRequest *http_request;
+  GskStream *upload_stream;
+  GskUrlTransferHttpModifierNode *modifier;
+  RequestInfo *info;
+  GskUrl *url = transfer->redirect_url ? transfer->redirect_url : transfer->url;
+
+  if (connection != NULL)
+    connection_ref (connection);
+  else
+    {
+      GskUrlTransferResult result;
+      connection = connection_new (http, url, &result, &error);
+      if (connection == NULL)
+        {
+          gsk_url_transfer_take_error (transfer, error);
+          gsk_url_transfer_notify_done (transfer, result);
+          return;
+        }
+      if (bin != NULL)
+        {
+          connection->bin = bin;
+          connection->pooled = connection->reusable = TRUE;
+          ++(bin->n_connections);
+          g_queue_push_tail (&bin->busy, connection_ref (connection));
+        }
+      else
+        gsk_http_client_propagate_content_read_shutdown (connection->http_client);
+    }
+
+  /* from a redirect or retry */
+  if (http->connection != NULL)
+    connection_unref (http->connection);
+  http->connection = connection;
+  if (http->raw_transport != NULL)
+    g_object_unref (http->raw_transport);
+  http->raw_transport = g_object_ref (connection->raw_transport);
 
   /* setup path */
   {
@@ -322,7 +783,8 @@ handle_name_resolution_succeeded (GskSocketAddress *address,
       upload_stream = gsk_url_transfer_create_upload (transfer, &size, &error);
       if (upload_stream == NULL)
         {
-          g_object_unref (transport);
+          /* uploads never use pooled connections */
+          gsk_http_client_shutdown_when_done (connection->http_client);
           g_object_unref (http_request);
           gsk_url_transfer_take_error (transfer, error);
           gsk_url_transfer_notify_done (transfer, GSK_URL_TRANSFER_ERROR_BAD_REQUEST);
@@ -336,25 +798,121 @@ handle_name_resolution_succeeded (GskSocketAddress *address,
       upload_stream = NULL;
     }
 
-  http_client = gsk_http_client_new ();
+  info = g_new (RequestInfo, 1);
+  info->http = g_object_ref (http);
+  info->connection = connection_ref (connection);
+  info->got_response = FALSE;
+  info->retryable = connection->n_requests > 0
+                  && upload_stream == NULL
+                  && verb_is_idempotent (http_request->verb);
+  ++(connection->n_requests);
+  ++(connection->n_active);
   ++(http->request_count);
   ++(http->undestroyed_requests);
-  gsk_http_client_propagate_content_read_shutdown (http_client);
-  gsk_http_client_request (http_client, http_request, upload_stream,
+  gsk_http_client_request (connection->http_client, http_request, upload_stream,
                            handle_http_response,
-                           g_object_ref (transfer),
+                           info,
                            http_client_request_destroyed);
-  gsk_http_client_shutdown_when_done (http_client);
-  if (!gsk_stream_attach_pair (transport, GSK_STREAM (http_client), &error))
-    {
-      g_warning ("gsk_stream_attach_pair: transport/http-client: %s", error->message);
-      g_clear_error (&error);
-    }
+  if (!connection->pooled)
+    gsk_http_client_shutdown_when_done (connection->http_client);
   if (upload_stream)
     g_object_unref (upload_stream);
-  g_object_unref (transport);
   g_object_unref (http_request);
-  g_object_unref (http_client);
+}
+
+/* Start waiting transfers, while the bin has connections for them. */
+static void
+bin_dispatch_waiting (GskUrlTransferHttpPoolBin *bin)
+{
+  GskUrlTransferHttpKeepaliveConfig config;
+  GskUrlTransferHttpConnection *connection;
+  GskUrlTransferHttp *http;
+  get_keepalive_config (&config);
+
+  /* starting a transfer may run user code, which may use the bin too */
+  ++(bin->n_users);
+  while ((http = g_queue_peek_head (&bin->waiting)) != NULL)
+    {
+      if (!gsk_url_transfer_is_done (GSK_URL_TRANSFER (http)))
+        {
+          if (!bin_checkout (bin, &config, FALSE, &connection))
+            break;
+          g_queue_pop_head (&bin->waiting);
+          http->waiting_bin = NULL;
+          start_on_connection (http, bin, connection);
+        }
+      else
+        {
+          g_queue_pop_head (&bin->waiting);
+          http->waiting_bin = NULL;
+        }
+      g_object_unref (http);
+    }
+  --(bin->n_users);
+  bin_free_if_unused (bin);
+}
+
+/* Issue the transfer's request, to transfer->address,
+   reusing a kept-alive connection if possible. */
+static void
+connect_and_request (GskUrlTransferHttp *http,
+                     gboolean            fresh)
+{
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (http);
+  GskUrl *url = transfer->redirect_url ? transfer->redirect_url : transfer->url;
+  GskUrlTransferHttpKeepaliveConfig config;
+  GskUrlTransferHttpConnection *connection;
+  GskUrlTransferHttpPoolBin *bin;
+
+  get_keepalive_config (&config);
+  if (!config.keepalive
+   || http->no_keepalive
+   || gsk_url_transfer_has_upload (transfer))
+    {
+      start_on_connection (http, NULL, NULL);
+      return;
+    }
+
+  bin = get_pool_bin (http, url, transfer->address);
+  if (!bin_checkout (bin, &config, fresh, &connection))
+    {
+      http->waiting_bin = bin;
+      g_queue_push_tail (&bin->waiting, g_object_ref (http));
+      return;
+    }
+  ++(bin->n_users);
+  start_on_connection (http, bin, connection);
+  --(bin->n_users);
+
+  /* if connecting failed, the bin may be empty */
+  bin_free_if_unused (bin);
+}
+
+static void
+handle_name_resolution_succeeded (GskSocketAddress *address,
+                                  gpointer          data)
+{
+  GskUrlTransfer *transfer = GSK_URL_TRANSFER (data);
+  GskUrlTransferHttp *http = GSK_URL_TRANSFER_HTTP (data);
+  GskUrl *url = transfer->redirect_url ? transfer->redirect_url : transfer->url;
+
+  if (gsk_url_transfer_is_done (transfer))
+    return;
+
+  /* Create actual address (with correct port) */
+  {
+    GskSocketAddressIpv4 *found = GSK_SOCKET_ADDRESS_IPV4 (address);
+    GskSocketAddress *addr;
+    guint url_port = gsk_url_get_port (url);
+    if (http->is_proxy || found->ip_port == url_port)
+      addr = g_object_ref (address);
+    else
+      addr = gsk_socket_address_ipv4_new (found->ip_address, url_port);
+    gsk_url_transfer_set_address (transfer, addr);
+    g_object_unref (addr);
+  }
+
+  connect_and_request (http, FALSE);
 }
 
 static void
@@ -415,15 +973,46 @@ gsk_url_transfer_http_start (GskUrlTransfer *transfer,
 static void
 cancel_internal (GskUrlTransferHttp *http)
 {
+  GskUrlTransferHttpConnection *connection = http->connection;
   if (http->name_lookup)
     {
       /* we were doing name resolution */
       gsk_name_resolver_task_cancel (http->name_lookup);
     }
+  else if (http->waiting_bin)
+    {
+      /* we were waiting for a connection */
+      GskUrlTransferHttpPoolBin *bin = http->waiting_bin;
+      g_queue_remove (&bin->waiting, http);
+      http->waiting_bin = NULL;
+      g_object_unref (http);
+      bin_free_if_unused (bin);
+    }
+  else if (connection != NULL
+        && connection->pooled
+        && (http->undestroyed_requests == 0 || connection->n_active > 1))
+    {
+      /* don't abort other transfers' requests:
+         just stop reusing the connection, if we have a request on it. */
+      if (http->undestroyed_requests > 0)
+        {
+          GskUrlTransferHttpPoolBin *bin = connection->bin;
+          connection_close (connection);
+          if (bin != NULL)
+            bin_dispatch_waiting (bin);
+        }
+    }
   else if (http->raw_transport)
     {
       /* who knows where we are... just cancel now. */
       GError *error = NULL;
+      if (connection != NULL)
+        {
+          GskUrlTransferHttpPoolBin *bin = connection->bin;
+          connection_detach (connection);
+          if (bin != NULL)
+            bin_free_if_unused (bin);
+        }
       gsk_io_shutdown (GSK_IO (http->raw_transport), &error);
       if (error)
         {
@@ -466,6 +1055,8 @@ gsk_url_transfer_http_get_running_state (GskUrlTransfer *transfer)
 
   if (http->name_lookup)
     g_string_append (str, ": doing name lookup");
+  else if (http->waiting_bin)
+    g_string_append (str, ": waiting for a connection");
   else if (http->raw_transport == NULL)
     g_string_append (str, ": no raw transport");
   else if (gsk_io_get_is_connecting (http->raw_transport))
@@ -484,6 +1075,9 @@ gsk_url_transfer_http_finalize (GObject *object)
   g_free (http->ssl_password);
 
   g_assert (http->name_lookup == NULL);
+  g_assert (http->waiting_bin == NULL);
+  if (http->connection)
+    connection_unref (http->connection);
   if (http->raw_transport)
     g_object_unref (http->raw_transport);
 
@@ -652,3 +1246,61 @@ gsk_url_transfer_http_add_modifier (GskUrlTransferHttp *http,
     http->last_modifier->next = node;
   http->last_modifier = node;
 }
+
+/**
+ * gsk_url_transfer_http_set_keepalive:
+ * @http: the transfer to affect.
+ * @keepalive: whether the transfer may use a kept-alive connection.
+ *
+ * Set whether this transfer may reuse a connection
+ * from an earlier transfer, and leave its connection open
+ * for later transfers.  This is only possible if
+ * keepalive is enabled by gsk_url_transfer_http_set_keepalive_config(),
+ * which it is not by default.
+ */
+void
+gsk_url_transfer_http_set_keepalive   (GskUrlTransferHttp *http,
+                                       gboolean            keepalive)
+{
+  http->no_keepalive = !keepalive;
+}
+
+/**
+ * gsk_url_transfer_http_get_keepalive_config:
+ * @config_out: place to store the configuration.
+ *
+ * Get the configuration of connection reuse by http transfers.
+ */
+void
+gsk_url_transfer_http_get_keepalive_config (GskUrlTransferHttpKeepaliveConfig *config_out)
+{
+  get_keepalive_config (config_out);
+}
+
+/**
+ * gsk_url_transfer_http_set_keepalive_config:
+ * @config: the new configuration.
+ *
+ * Configure the reuse of connections by http transfers,
+ * in all threads.  Connections which are already open
+ * are not affected until they are next used.
+ *
+ * Keepalive is off by default, so that every transfer
+ * uses its own connection, closed when it is done.
+ * To enable it, get the configuration,
+ * set its keepalive member to TRUE, and set it back.
+ */
+void
+gsk_url_transfer_http_set_keepalive_config (const GskUrlTransferHttpKeepaliveConfig *config)
+{
+  G_LOCK (keepalive_config);
+  keepalive_config = *config;
+  if (keepalive_config.max_keepalive_clients == 0)
+    {
+      keepalive_config.keepalive = FALSE;
+      keepalive_config.max_keepalive_clients = 1;
+    }
+  if (keepalive_config.max_pipelined == 0)
+    keepalive_config.max_pipelined = 1;
+  G_UNLOCK (keepalive_config);
+}
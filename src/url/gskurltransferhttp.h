@@ -13,6 +13,9 @@ G_BEGIN_DECLS
 /* --- typedefs --- */
 typedef struct _GskUrlTransferHttp GskUrlTransferHttp;
 typedef struct _GskUrlTransferHttpModifierNode GskUrlTransferHttpModifierNode;
+typedef struct _GskUrlTransferHttpConnection GskUrlTransferHttpConnection;
+typedef struct _GskUrlTransferHttpPoolBin GskUrlTransferHttpPoolBin;
+typedef struct _GskUrlTransferHttpKeepaliveConfig GskUrlTransferHttpKeepaliveConfig;
 typedef struct _GskUrlTransferHttpClass GskUrlTransferHttpClass;
 /* --- type macros --- */
 GType gsk_url_transfer_http_get_type(void) G_GNUC_CONST;
@@ -43,7 +46,39 @@ struct _GskUrlTransferHttp
   guint response_count;
   guint undestroyed_requests;
 
+  /* keepalive state: the connection of the latest request,
+     or the bin we are waiting in for a connection */
+  GskUrlTransferHttpConnection *connection;
+  GskUrlTransferHttpPoolBin *waiting_bin;
+
   gboolean is_proxy;
+  gboolean no_keepalive;
+  gboolean retried;
+};
+
+/* If keepalive is enabled (it is off by default),
+   connections to a server are kept open and reused
+   by later transfers run by the same thread, unless the
+   transfer has an upload or the server says "Connection: close".
+   The pool of each thread is divided by server address
+   (and for https, by hostname and certificate). */
+struct _GskUrlTransferHttpKeepaliveConfig
+{
+  gboolean keepalive;
+
+  /* number of idle connections to keep per server */
+  guint max_keepalive_clients;
+
+  /* how long an idle connection is kept */
+  guint max_idle_millis;
+
+  /* maximum number of connections per server (0 for unlimited);
+     further transfers wait for a connection to become available */
+  guint max_connections;
+
+  /* maximum number of requests to queue on one connection,
+     once there are max_connections;  1 disables pipelining */
+  guint max_pipelined;
 };
 /* --- prototypes --- */
 
@@ -77,6 +112,12 @@ void gsk_url_transfer_http_add_modifier (GskUrlTransferHttp *http,
 void gsk_url_transfer_http_set_proxy_address  (GskUrlTransferHttp *http,
                                                GskSocketAddress   *proxy_address);
 
+/* keepalive configuration */
+void gsk_url_transfer_http_set_keepalive      (GskUrlTransferHttp *http,
+                                               gboolean            keepalive);
+void gsk_url_transfer_http_get_keepalive_config (GskUrlTransferHttpKeepaliveConfig *config_out);
+void gsk_url_transfer_http_set_keepalive_config (const GskUrlTransferHttpKeepaliveConfig *config);
+
 G_END_DECLS
 
 #endif